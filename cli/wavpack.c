@@ -116,8 +116,10 @@ static const char *help =
 "                              n = 2.0 to 23.9 bits/sample, or\n"
 "                              n = 24-9600 kbits/second (kbps)\n"
 "                              add -c to create correction file (.wpsc)\n"
-"    --block-samples=n       specify block size in samples (100 to 8000)\n"
-"    --block-bytes=n         specify max block size in bytes (256 to 16384)\n"
+"    --block-samples=n       specify block size in samples (100 to 8000, or\n"
+"                             up to 1048576 with --large-blocks)\n"
+"    --block-bytes=n         specify max block size in bytes (256 to 16384, or\n"
+"                             up to 16777216 with --large-blocks)\n"
 "    -c                      hybrid lossless mode (use with -b to create\n"
 "                             correction file (.wpsc) in hybrid mode)\n"
 "    -cc                     maximum hybrid lossless compression (but degrades\n"
@@ -129,11 +131,16 @@ static const char *help =
 "                             assigned to specific speakers, or terminate list\n"
 "                             with '...' to indicate that any channels beyond\n"
 "                             those specified are unassigned\n"
+"    --constant-blocks       send blocks of digital silence (or any constant\n"
+"                             value) in just a few bytes (needs a recent decoder)\n"
 "    --cross-decorr          use cross-channel correlation in hybrid mode (on by\n"
 "                             default in lossless mode and with -cc option)\n"
 "    -d                      delete source file if successful (use with caution!)\n"
 "    -f                      fast mode (faster encode and decode, but some\n"
 "                             compromise in compression ratio)\n"
+"    --governor=n            step the mode down (and back up) between blocks to\n"
+"                             keep encoding within n percent of real time (the\n"
+"                             specified mode is the highest used)\n"
 "    -h                      high quality (better compression ratio, but slower\n"
 "                             encode and decode than default mode)\n"
 "    -hh                     very high quality (best compression, but slowest\n"
@@ -141,6 +148,9 @@ static const char *help =
 "    --help                  this extended help display\n"
 "    -i                      ignore length in file header (no pipe output allowed)\n"
 "    -jn                     joint-stereo override (0 = left/right, 1 = mid/side)\n"
+"    --large-blocks          use the large-block format with 8x longer default\n"
+"                             blocks (better compression but higher latency;\n"
+"                             needs a recent decoder)\n"
 #if defined (_WIN32) || defined (__OS2__)
 "    -l                      run at lower priority for smoother multitasking\n"
 #endif
@@ -148,6 +158,9 @@ static const char *help =
 "    -n                      calculate average and peak quantization noise\n"
 "                             (for hybrid mode only, reference fullscale sine)\n"
 "    --pair-unassigned-chans encode unassigned channels into stereo pairs\n"
+"    --pipeline              analyze each block on a second thread while the\n"
+"                             previous one is coded (lossless PCM only; the\n"
+"                             output is identical to normal encoding)\n"
 #ifdef _WIN32
 "    --pause                 pause before exiting (if console window disappears)\n"
 #endif
@@ -155,6 +168,10 @@ static const char *help =
 "                             (common use would be --pre-quantize=20 for 24-bit or\n"
 "                             float material recorded with typical converters)\n"
 "    -q                      quiet (keep console output to a minimum)\n"
+"    --rate-cap=kbps[,bytes] adjust the hybrid bitrate of each block so that the\n"
+"                             output never overflows a buffer of <bytes> (default\n"
+"                             is one second) that drains at <kbps> (hybrid only,\n"
+"                             and at least 2.22 bits/sample for each channel)\n"
 "    -r                      remove file headers (file-appropriate headers\n"
 "                             will be regenerated during unpacking)\n"
 "    --raw-pcm               input data is raw pcm (default is 44100 Hz, 16-bit\n"
@@ -172,9 +189,16 @@ static const char *help =
 "                             lower in freq, positive values move noise higher\n"
 "                             in freq, use '0' for no shaping (white noise)\n"
 "    -t                      copy input file's time stamp to output file(s)\n"
+"    --transrate             when re-encoding a WavPack file into hybrid, reuse the\n"
+"                             source's decorrelation for each block instead of\n"
+"                             searching again (keeps most of the benefit of a\n"
+"                             source made with -x, at the speed of no -x)\n"
 "    --use-dns               force use of dynamic noise shaping (hybrid mode only)\n"
 "    -v                      verify output file integrity after write (no pipes)\n"
 "    --version               write the version to stdout\n"
+"    --warm-search           start the extra mode search for each block from the\n"
+"                             results of the previous block (much faster with\n"
+"                             -x3 and higher, with very little loss)\n"
 "    -x[n]                   extra encode processing (optional n = 1 to 6, 1=default)\n"
 "                             -x1 to -x3 to choose best of predefined filters\n"
 "                             -x4 to -x6 to generate custom filters (very slow!)\n"
@@ -222,8 +246,8 @@ static struct {
 int debug_logging_mode;
 
 static int overwrite_all, num_files, file_index, copy_time, quiet_mode, verify_mode, delete_source,
-    set_console_title, quantize_bits, quantize_round,
-    raw_pcm_skip_bytes_begin, raw_pcm_skip_bytes_end;
+    set_console_title, quantize_bits, quantize_round, pipeline_encode, governor_percent,
+    rate_cap_kbps, rate_cap_bytes, transrate_mode, raw_pcm_skip_bytes_begin, raw_pcm_skip_bytes_end;
 
 static int num_channels_order;
 static unsigned char channel_order [18];
@@ -242,6 +266,8 @@ static int repack_file (char *infilename, char *outfilename, char *out2filename,
 static int repack_audio (WavpackContext *wpc, WavpackContext *infile, unsigned char *md5_digest_source);
 static int verify_audio (char *infilename, unsigned char *md5_digest_source);
 static void display_progress (double file_progress);
+static void display_encoder_stats (WavpackContext *wpc);
+static int check_rate_overflows (WavpackContext *wpc);
 
 #ifdef _WIN32
 static void TextToUTF8 (void *string, int len);
@@ -334,6 +360,37 @@ int main (int argc, char **argv)
                 config.flags |= CONFIG_CROSS_DECORR;
             else if (!strcmp (long_option, "pair-unassigned-chans"))    // --pair-unassigned-chans
                 config.flags |= CONFIG_PAIR_UNDEF_CHANS;
+            else if (!strcmp (long_option, "pipeline"))                 // --pipeline
+                pipeline_encode = 1;
+            else if (!strcmp (long_option, "transrate"))                // --transrate
+                transrate_mode = 1;
+            else if (!strcmp (long_option, "warm-search"))              // --warm-search
+                config.flags |= CONFIG_WARM_SEARCH;
+            else if (!strcmp (long_option, "large-blocks"))             // --large-blocks
+                config.flags |= CONFIG_LARGE_BLOCKS;
+            else if (!strcmp (long_option, "constant-blocks"))          // --constant-blocks
+                config.flags |= CONFIG_CONSTANT_BLOCKS;
+            else if (!strncmp (long_option, "rate-cap", 8)) {           // --rate-cap=
+                rate_cap_kbps = strtol (long_param, &long_param, 10);
+
+                if (*long_param == ',')
+                    rate_cap_bytes = strtol (++long_param, &long_param, 10);
+                else
+                    rate_cap_bytes = rate_cap_kbps * 125;
+
+                if (*long_param || rate_cap_kbps < 1 || rate_cap_bytes < 1) {
+                    error_line ("invalid rate-cap!");
+                    ++error_count;
+                }
+            }
+            else if (!strncmp (long_option, "governor", 8)) {           // --governor=
+                governor_percent = strtol (long_param, NULL, 10);
+
+                if (governor_percent < 1 || governor_percent > 1000) {
+                    error_line ("invalid governor target percentage!");
+                    ++error_count;
+                }
+            }
             else if (!strncmp (long_option, "raw-pcm-skip", 12)) {      // --raw-pcm-skip
                 raw_pcm_skip_bytes_begin = strtol (long_param, &long_param, 10);
 
@@ -424,7 +481,7 @@ int main (int argc, char **argv)
             else if (!strncmp (long_option, "block-samples", 13)) {     // --block-samples
                 config.block_samples = strtol (long_param, NULL, 10);
 
-                if (config.block_samples < 50 || config.block_samples > 8000) {
+                if (config.block_samples < 50 || config.block_samples > 1048576) {
                     error_line ("invalid block-samples!");
                     ++error_count;
                 }
@@ -432,7 +489,7 @@ int main (int argc, char **argv)
             else if (!strncmp (long_option, "block-bytes", 11)) {       // --block-bytes
                 config.block_bytes = strtol (long_param, NULL, 10);
 
-                if (config.block_bytes < 256 || config.block_bytes > 16384) {
+                if (config.block_bytes < 256 || config.block_bytes > 16777216) {
                     error_line ("invalid block-bytes!");
                     ++error_count;
                 }
@@ -737,6 +794,11 @@ int main (int argc, char **argv)
         ++error_count;
     }
 
+    if (!(config.flags & CONFIG_LARGE_BLOCKS) && (config.block_samples > 8000 || config.block_bytes > 16384)) {
+        error_line ("block-samples over 8000 or block-bytes over 16384 require --large-blocks!");
+        ++error_count;
+    }
+
     if ((config.qmode & QMODE_IGNORE_LENGTH) && outfilename && *outfilename == '-') {
         error_line ("can't ignore length in header when using stdout!");
         ++error_count;
@@ -764,6 +826,11 @@ int main (int argc, char **argv)
         }
     }
 
+    // blocks that are transrated skip the search, so -x only affects the ones that can't be
+
+    if (transrate_mode && (config.flags & CONFIG_EXTRA_MODE) && !quiet_mode)
+        error_line ("warning: -x is ignored for blocks that are transrated!");
+
     if (strcmp (WavpackStreamGetLibraryVersionString (), PACKAGE_VERSION)) {
         fprintf (stderr, version_warning, WavpackStreamGetLibraryVersionString (), PACKAGE_VERSION);
         fflush (stderr);
@@ -1648,7 +1715,7 @@ static int pack_file (char *infilename, char *outfilename, char *out2filename, c
 
             if (block_buff && !DoSetFilePositionAbsolute (wv_file.file, 0) &&
                 DoReadFile (wv_file.file, block_buff, wv_file.first_block_size, &bcount) &&
-                bcount == wv_file.first_block_size && !strncmp (block_buff, "wpsb", 4)) {
+                bcount == wv_file.first_block_size && (!strncmp (block_buff, "wpsb", 4) || !strncmp (block_buff, "wpsl", 4))) {
 
                     // this call will take care of the initial WavPack header and any RIFF header the library made
 
@@ -1674,7 +1741,7 @@ static int pack_file (char *infilename, char *outfilename, char *out2filename, c
 
                 if (block_buff && !DoSetFilePositionAbsolute (wvc_file.file, 0) &&
                     DoReadFile (wvc_file.file, block_buff, wvc_file.first_block_size, &bcount) &&
-                    bcount == wvc_file.first_block_size && !strncmp (block_buff, "wpsb", 4)) {
+                    bcount == wvc_file.first_block_size && (!strncmp (block_buff, "wpsb", 4) || !strncmp (block_buff, "wpsl", 4))) {
 
                         WavpackStreamUpdateNumSamples (wpc, block_buff);
 
@@ -1888,7 +1955,7 @@ static int pack_audio (WavpackContext *wpc, FILE *infile, int qmode, unsigned ch
 {
     int64_t samples_remaining, input_samples = INPUT_SAMPLES;
     double progress = -1.0;
-    int bytes_per_sample;
+    int bytes_per_sample, rate_warning = FALSE;
     int32_t *sample_buffer;
     unsigned char *input_buffer;
     MD5_CTX md5_context;
@@ -1904,6 +1971,20 @@ static int pack_audio (WavpackContext *wpc, FILE *infile, int qmode, unsigned ch
         MD5_Init (&md5_context);
 
     WavpackStreamPackInit (wpc);
+
+    if (pipeline_encode && !WavpackStreamSetEncodeThreads (wpc, 2) && !quiet_mode)
+        error_line ("warning: %s", WavpackStreamGetErrorMessage (wpc));
+
+    if (governor_percent && !WavpackStreamSetSpeedGovernor (wpc, governor_percent) && !quiet_mode)
+        error_line ("warning: %s", WavpackStreamGetErrorMessage (wpc));
+
+    // unlike the options above, the rate cap is a hard limit, so don't encode without it
+
+    if (rate_cap_kbps && !WavpackStreamSetRateControl (wpc, rate_cap_kbps, rate_cap_bytes)) {
+        error_line ("%s", WavpackStreamGetErrorMessage (wpc));
+        return WAVPACK_SOFT_ERROR;
+    }
+
     bytes_per_sample = WavpackStreamGetBytesPerSample (wpc) * WavpackStreamGetNumChannels (wpc);
     input_buffer = malloc ((uint32_t) input_samples * bytes_per_sample);
     sample_buffer = malloc ((uint32_t) input_samples * sizeof (int32_t) * WavpackStreamGetNumChannels (wpc));
@@ -1994,6 +2075,9 @@ static int pack_audio (WavpackContext *wpc, FILE *infile, int qmode, unsigned ch
             return WAVPACK_HARD_ERROR;
         }
 
+        if (rate_cap_kbps && !rate_warning && !quiet_mode)
+            rate_warning = check_rate_overflows (wpc);
+
         if (check_break ()) {
 #if defined(_WIN32)
             fprintf (stderr, "^C\n");
@@ -2029,6 +2113,9 @@ static int pack_audio (WavpackContext *wpc, FILE *infile, int qmode, unsigned ch
         return WAVPACK_HARD_ERROR;
     }
 
+    if ((governor_percent || rate_cap_kbps) && !quiet_mode)
+        display_encoder_stats (wpc);
+
     if (md5_digest_source)
         MD5_Final (md5_digest_source, &md5_context);
 
@@ -2735,6 +2822,7 @@ static int repack_audio (WavpackContext *outfile, WavpackContext *infile, unsign
     int qmode = WavpackStreamGetQualifyMode (infile);
     unsigned char *new_channel_order = NULL;
     uint32_t input_samples = INPUT_SAMPLES;
+    int rate_warning = FALSE;
     unsigned char *format_buffer;
     int32_t *sample_buffer;
     double progress = -1.0;
@@ -2769,6 +2857,27 @@ static int repack_audio (WavpackContext *outfile, WavpackContext *infile, unsign
     }
 
     WavpackStreamPackInit (outfile);
+
+    if (pipeline_encode && !WavpackStreamSetEncodeThreads (outfile, 2) && !quiet_mode)
+        error_line ("warning: %s", WavpackStreamGetErrorMessage (outfile));
+
+    if (governor_percent && !WavpackStreamSetSpeedGovernor (outfile, governor_percent) && !quiet_mode)
+        error_line ("warning: %s", WavpackStreamGetErrorMessage (outfile));
+
+    // unlike the options above, the rate cap is a hard limit, so don't encode without it
+
+    if (rate_cap_kbps && !WavpackStreamSetRateControl (outfile, rate_cap_kbps, rate_cap_bytes)) {
+        error_line ("%s", WavpackStreamGetErrorMessage (outfile));
+
+        if (md5_digest_source)
+            free (format_buffer);
+
+        if (new_channel_order)
+            free (new_channel_order);
+
+        return WAVPACK_SOFT_ERROR;
+    }
+
     sample_buffer = malloc (input_samples * sizeof (int32_t) * WavpackStreamGetNumChannels (outfile));
 
     if (quantize_bits && quantize_bits < bps*8) {
@@ -2781,7 +2890,18 @@ static int repack_audio (WavpackContext *outfile, WavpackContext *infile, unsign
     }
 
     while (1) {
-        int32_t sample_count = WavpackStreamUnpackSamples (infile, sample_buffer, input_samples);
+        int32_t sample_count, transrate_samples = 0;
+
+        // when transrating, we decode (and then encode) one block at a time if it will fit
+
+        if (transrate_mode) {
+            transrate_samples = WavpackStreamGetBlockSamplesLeft (infile);
+
+            if (transrate_samples > (int32_t) input_samples)
+                transrate_samples = 0;
+        }
+
+        sample_count = WavpackStreamUnpackSamples (infile, sample_buffer, transrate_samples ? transrate_samples : input_samples);
 
         if (!sample_count)
             break;
@@ -2808,12 +2928,16 @@ static int repack_audio (WavpackContext *outfile, WavpackContext *infile, unsign
             }
         }
 
-        if (!WavpackStreamPackSamples (outfile, sample_buffer, sample_count)) {
-            error_line ("%s", WavpackStreamGetErrorMessage (outfile));
-            free (sample_buffer);
-            return WAVPACK_HARD_ERROR;
+        if (transrate_samples ? !WavpackStreamTransrateBlock (outfile, infile, sample_buffer, sample_count) :
+            !WavpackStreamPackSamples (outfile, sample_buffer, sample_count)) {
+                error_line ("%s", WavpackStreamGetErrorMessage (outfile));
+                free (sample_buffer);
+                return WAVPACK_HARD_ERROR;
         }
 
+        if (rate_cap_kbps && !rate_warning && !quiet_mode)
+            rate_warning = check_rate_overflows (outfile);
+
         if (md5_digest_source) {
             if (new_channel_order)
                 unreorder_channels (sample_buffer, new_channel_order, num_channels, sample_count);
@@ -2888,6 +3012,9 @@ static int repack_audio (WavpackContext *outfile, WavpackContext *infile, unsign
         return WAVPACK_HARD_ERROR;
     }
 
+    if ((governor_percent || rate_cap_kbps) && !quiet_mode)
+        display_encoder_stats (outfile);
+
     if (md5_digest_source) {
         MD5_Final (md5_digest_source, &md5_context);
         free (format_buffer);
@@ -3590,6 +3717,44 @@ static void TextToUTF8 (void *string, int len)
 // account the total number of files to generate a batch progress number.   //
 //////////////////////////////////////////////////////////////////////////////
 
+// Display a summary of the mode changes made by the speed governor and of the rate
+// controller's buffer (for whichever are enabled).
+
+static void display_encoder_stats (WavpackContext *wpc)
+{
+    WavpackGovernorStats governor_stats;
+    WavpackRateStats rate_stats;
+
+    if (WavpackStreamGetGovernorStats (wpc, &governor_stats))
+        error_line ("governor: %u steps down, %u up, %u of %u blocks at top level",
+            governor_stats.step_downs, governor_stats.step_ups,
+            governor_stats.level_blocks [governor_stats.max_level], governor_stats.blocks);
+
+    if (WavpackStreamGetRateStats (wpc, &rate_stats))
+        error_line ("rate cap: peak buffer %u of %u bytes, %u blocks retried, %u overflowed",
+            rate_stats.peak_fullness, rate_stats.buffer_bytes, rate_stats.retries, rate_stats.overflows);
+}
+
+// Warn (once per file) when most of the blocks encoded so far have overflowed the rate
+// controller's buffer even at the lowest hybrid bitrate, which means that the rate cap
+// is too low for this audio. Returns TRUE if the warning was displayed.
+
+#define RATE_OVERFLOW_BLOCKS 16     // don't judge on fewer overflowed blocks than this
+
+static int check_rate_overflows (WavpackContext *wpc)
+{
+    WavpackRateStats rate_stats;
+
+    if (!WavpackStreamGetRateStats (wpc, &rate_stats) || rate_stats.overflows < RATE_OVERFLOW_BLOCKS ||
+        rate_stats.overflows * 2 <= rate_stats.blocks)
+            return FALSE;
+
+    error_line ("warning: rate cap too low, %u of %u blocks have overflowed the buffer!",
+        rate_stats.overflows, rate_stats.blocks);
+
+    return TRUE;
+}
+
 static void display_progress (double file_progress)
 {
     char title [40];
@@ -43,22 +43,28 @@ typedef int32_t (*read_stream)(void *, int32_t);
 
 ////////////////////////////// WavPack Header /////////////////////////////////
 
-// Note that this is the ONLY structure that is written to (or read from)
-// wavpack-stream files, and is the preamble to every block in both the .wps
-// and .wpsc files.
+// This is the preamble to every block in both the .wps and .wpsc files. It's
+// stored in one of two forms: standard blocks ("wpsb") have 16-bit ckSize and
+// block_samples fields (and ckSize is 2 less than here), while large blocks
+// ("wpsl") are stored exactly like this structure. In memory we always use this
+// form (with ckSize as for large blocks), and keep the block data as stored.
 
 typedef struct {
     char ckID [4];
-    uint16_t ckSize, block_samples;
+    uint32_t ckSize, block_samples;
     uint32_t flags;
 } WavpackHeader;
 
-#define WavpackHeaderFormat "4SSL"
+#define WavpackHeaderFormat "4LLL"
 
 #define FOURCC "wpsb"
-#define CHUNK_SIZE_OFFSET 6
+#define FOURCC_LARGE "wpsl"
+#define CHUNK_SIZE_OFFSET 8
 #define CHUNK_SIZE_REMAINDER (sizeof (WavpackHeader) - CHUNK_SIZE_OFFSET)
 
+#define STANDARD_HEADER_SIZE 12
+#define STANDARD_CKSIZE_ADJUST 2
+
 // or-values for "flags"
 
 #define BYTES_STORED	3	// 1-4 bytes/sample
@@ -121,7 +127,7 @@ typedef struct {
 
 static const char *metadata_names [] = {
     "DUMMY", "ENCODER_INFO", "DECORR_TERMS", "DECORR_WEIGHTS", "DECORR_SAMPLES", "ENTROPY_VARS", "HYBRID_PROFILE", "SHAPING_WEIGHTS",
-    "FLOAT_INFO", "INT32_INFO", "WV_BITSTREAM", "WVC_BITSTREAM", "WVX_BITSTREAM", "CHANNEL_INFO", "DSD_BLOCK", "UNASSIGNED",
+    "FLOAT_INFO", "INT32_INFO", "WV_BITSTREAM", "WVC_BITSTREAM", "WVX_BITSTREAM", "CHANNEL_INFO", "DSD_BLOCK", "CONSTANT_SAMPLES",
     "DECORR_COMBINED", "ENTROPY_COMBINED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED",
     "UNASSIGNED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED", "UNASSIGNED",
     "UNASSIGNED", "RIFF_HEADER", "RIFF_TRAILER", "ALT_HEADER", "ALT_TRAILER", "CONFIG_BLOCK", "MD5_CHECKSUM", "SAMPLE_RATE",
@@ -131,11 +137,10 @@ static const char *metadata_names [] = {
 };
 
 static int32_t read_bytes (void *buff, int32_t bcount);
-static uint32_t read_next_header (read_stream infile, WavpackHeader *wphdr);
+static uint32_t read_next_header (read_stream infile, WavpackHeader *wphdr, unsigned char *stored_header, int *header_bytes);
 static void little_endian_to_native (void *data, char *format);
-static void native_to_little_endian (void *data, char *format);
-static void parse_wavpack_block (unsigned char *block_data);
-static int verify_wavpack_block (unsigned char *buffer);
+static void parse_wavpack_block (unsigned char *block_data, uint32_t block_size, int header_bytes);
+static int verify_wavpack_block (unsigned char *buffer, uint32_t block_size, int header_bytes);
 
 static const char *sign_on = "\n"
 " WVPARSER  WavPack Streaming Audio File Parser / Filter  Version 1.00\n"
@@ -146,8 +151,10 @@ int main ()
     uint32_t bcount, total_bytes, sample_rate, first_sample, last_sample = -1L;
     int channel_count, block_count;
     char flags_list [256];
+    unsigned char stored_header [sizeof (WavpackHeader)];
     WavpackHeader wphdr;
-    uint32_t block_index = 0;
+    uint32_t block_index = 0, block_size;
+    int header_bytes;
 
 #ifdef _WIN32
     setmode (fileno (stdin), O_BINARY);
@@ -158,7 +165,7 @@ int main ()
 
 	// read next WavPack header
 
-	bcount = read_next_header (read_bytes, &wphdr);
+	bcount = read_next_header (read_bytes, &wphdr, stored_header, &header_bytes);
 
 	if (bcount == (uint32_t) -1) {
 	    printf ("\nend of file\n\n");
@@ -168,6 +175,8 @@ int main ()
 	if (bcount)
 	    printf ("\nunknown data skipped, %d bytes\n", bcount);
 
+        block_size = wphdr.ckSize + CHUNK_SIZE_OFFSET - (sizeof (WavpackHeader) - header_bytes);
+
         if (((wphdr.flags & SRATE_MASK) >> SRATE_LSB) == 15) {
             if (sample_rate != 44100)
                 printf ("\nwarning: unknown sample rate...using 44100 default\n");
@@ -183,7 +192,7 @@ int main ()
 
 	if (wphdr.block_samples) {
 	    printf ("%s audio block, %d samples in %d bytes, time = %.2f-%.2f\n",
-                (wphdr.flags & MONO_FLAG) ? "mono" : "stereo", wphdr.block_samples, wphdr.ckSize + CHUNK_SIZE_OFFSET,
+                (wphdr.flags & MONO_FLAG) ? "mono" : "stereo", wphdr.block_samples, block_size,
                 (double) block_index / sample_rate, (double) (block_index + wphdr.block_samples - 1) / sample_rate);
 
             // now show information from the "flags" field of the header
@@ -197,6 +206,7 @@ int main ()
             flags_list [0] = 0;
 
             if (wphdr.flags) {
+                if (header_bytes != STANDARD_HEADER_SIZE) strcat (flags_list, "LARGE ");
                 if (wphdr.flags & INITIAL_BLOCK) strcat (flags_list, "INITIAL ");
                 if (wphdr.flags & MONO_FLAG) strcat (flags_list, "MONO ");
                 if (wphdr.flags & DSD_FLAG) strcat (flags_list, "DSD ");
@@ -220,17 +230,18 @@ int main ()
             block_index += wphdr.block_samples;
         }
         else
-            printf ("non-audio block of %d bytes\n", wphdr.ckSize + CHUNK_SIZE_OFFSET);
+            printf ("non-audio block of %d bytes\n", block_size);
 
 	// read and parse the actual block data (which is entirely composed of "meta" blocks)
 
 	if (wphdr.ckSize > CHUNK_SIZE_REMAINDER) {
-	    uint32_t block_size = wphdr.ckSize + CHUNK_SIZE_OFFSET;
-	    char *block_buff = malloc (block_size);
+	    unsigned char *block_buff = malloc (block_size);
+
+            // the block is kept in its stored form (so that the checksum can be verified)
 
-            memcpy (block_buff, &wphdr, sizeof (WavpackHeader));
-	    read_bytes (block_buff + sizeof (WavpackHeader), block_size - sizeof (WavpackHeader));
-            parse_wavpack_block (block_buff);
+            memcpy (block_buff, stored_header, header_bytes);
+	    read_bytes (block_buff + header_bytes, block_size - header_bytes);
+            parse_wavpack_block (block_buff, block_size, header_bytes);
 	    free (block_buff);
 	}
     }
@@ -240,11 +251,8 @@ int main ()
 
 // read the next metadata block, or return 0 if there aren't any more (or an error occurs)
 
-static int read_metadata_buff (WavpackMetadata *wpmd, unsigned char *blockbuff, unsigned char **buffptr)
+static int read_metadata_buff (WavpackMetadata *wpmd, unsigned char *buffend, unsigned char **buffptr)
 {
-    WavpackHeader *wphdr = (WavpackHeader *) blockbuff;
-    unsigned char *buffend = blockbuff + wphdr->ckSize + CHUNK_SIZE_OFFSET;
-
     if (buffend - *buffptr < 2)
         return 0;
 
@@ -283,16 +291,15 @@ static int read_metadata_buff (WavpackMetadata *wpmd, unsigned char *blockbuff,
     return 1;
 }
 
-// given a pointer to a WavPack block, parse all the "meta" blocks and display something about them
+// given a pointer to a stored WavPack block, parse all the "meta" blocks and display something about them
 
-static void parse_wavpack_block (unsigned char *block_data)
+static void parse_wavpack_block (unsigned char *block_data, uint32_t block_size, int header_bytes)
 {
-    unsigned char *blockptr = block_data + sizeof (WavpackHeader), *blockprev = blockptr;
-    int metadata_count = 0, overhead = sizeof (WavpackHeader), realdata = 0;
-    WavpackHeader *wphdr = (WavpackHeader *) block_data;
+    unsigned char *blockptr = block_data + header_bytes, *blockprev = blockptr;
+    int metadata_count = 0, overhead = header_bytes, realdata = 0;
     WavpackMetadata wpmd;
 
-    while (read_metadata_buff (&wpmd, block_data, &blockptr)) {
+    while (read_metadata_buff (&wpmd, block_data + block_size, &blockptr)) {
         metadata_count++;
         printf ("  metadata: ID = 0x%02x (%s), size = %d bytes\n", wpmd.id, metadata_names [wpmd.id & 0x3F], wpmd.byte_length);
 
@@ -304,35 +311,34 @@ static void parse_wavpack_block (unsigned char *block_data)
         blockprev = blockptr;
     }
 
-    if (blockptr != block_data + wphdr->ckSize + CHUNK_SIZE_OFFSET)
+    if (blockptr != block_data + block_size)
         printf ("error: garbage at end of WavPack block\n");
 
-    if (!verify_wavpack_block (block_data))
+    if (!verify_wavpack_block (block_data, block_size, header_bytes))
         printf ("error: checksum failure on WavPack block\n");
 
     printf ("block overhead = %d / %d (%.2f%%)\n", overhead, overhead + realdata, overhead * 100.0 / (overhead + realdata));
 }
 
-// Quickly verify the referenced block. It is assumed that the WavPack header has been converted
-// to native endian format. If a block checksum is performed, that is done in little-endian
-// (file) format. It is also assumed that the caller has made sure that the block length
-// indicated in the header is correct (we won't overflow the buffer). If a checksum is present,
-// then it is checked, otherwise we just check that all the metadata blocks are formatted
-// correctly (without looking at their contents). Returns FALSE for bad block.
+// Quickly verify the referenced block, which is in its stored (little-endian) form with
+// the specified total size and header size. If a checksum is present, then it is checked,
+// otherwise we just check that all the metadata blocks are formatted correctly (without
+// looking at their contents). Returns FALSE for bad block.
 
 #define ID_BLOCK_CHECKSUM       (ID_OPTIONAL_DATA | 0xf)
 
-static int verify_wavpack_block (unsigned char *buffer)
+static int verify_wavpack_block (unsigned char *buffer, uint32_t block_size, int header_bytes)
 {
-    WavpackHeader *wphdr = (WavpackHeader *) buffer;
-    uint32_t checksum_passed = 0, bcount, meta_bc;
+    uint32_t checksum_passed = 0, bcount, meta_bc, flags;
     unsigned char *dp, meta_id, c1, c2;
 
-    if (strncmp (wphdr->ckID, FOURCC, 4) || wphdr->ckSize + CHUNK_SIZE_OFFSET < sizeof (WavpackHeader))
+    if ((strncmp ((char *) buffer, FOURCC, 4) && strncmp ((char *) buffer, FOURCC_LARGE, 4)) || block_size < (uint32_t) header_bytes)
         return 0;
 
-    bcount = wphdr->ckSize - CHUNK_SIZE_REMAINDER;
-    dp = (unsigned char *)(wphdr + 1);
+    flags = buffer [header_bytes - 4] + (buffer [header_bytes - 3] << 8) +
+        ((uint32_t) buffer [header_bytes - 2] << 16) + ((uint32_t) buffer [header_bytes - 1] << 24);
+    bcount = block_size - header_bytes;
+    dp = buffer + header_bytes;
 
     while (bcount >= 2) {
         meta_id = *dp++;
@@ -363,15 +369,11 @@ static int verify_wavpack_block (unsigned char *buffer)
             if ((meta_id & ID_ODD_SIZE) || meta_bc < 2 || meta_bc > 4)
                 return 0;
 
-            native_to_little_endian ((WavpackHeader *) buffer, WavpackHeaderFormat);
-
             while (wcount--) {
                 csum = (csum * 3) + csptr [0] + (csptr [1] << 8);
                 csptr += 2;
             }
 
-            little_endian_to_native ((WavpackHeader *) buffer, WavpackHeaderFormat);
-
             if (meta_bc == 4) {
                 if (*dp++ != (csum & 0xff) || *dp++ != ((csum >> 8) & 0xff) || *dp++ != ((csum >> 16) & 0xff) || *dp++ != ((csum >> 24) & 0xff))
                     return 0;
@@ -390,7 +392,7 @@ static int verify_wavpack_block (unsigned char *buffer)
         dp += meta_bc;
     }
 
-    return (bcount == 0) && (!(wphdr->flags & HAS_CHECKSUM) || checksum_passed);
+    return (bcount == 0) && (!(flags & HAS_CHECKSUM) || checksum_passed);
 }
 
 static int32_t read_bytes (void *buff, int32_t bcount)
@@ -398,15 +400,15 @@ static int32_t read_bytes (void *buff, int32_t bcount)
     return fread (buff, 1, bcount, stdin);
 }
 
-// Read from current file position until a valid 32-byte WavPack 4.0 header is
-// found and read into the specified pointer. The number of bytes skipped is
-// returned. If no WavPack header is found within 1 meg, then a -1 is returned
-// to indicate the error. No additional bytes are read past the header and it
-// is returned in the processor's native endian mode. Seeking is not required.
+// Read from current file position until a valid WavPack header (standard or large) is
+// found. The header is returned in the processor's native endian mode, along with a copy
+// of the stored header and its size. The number of bytes skipped is returned. If no WavPack
+// header is found within 10k, then a -1 is returned to indicate the error. No additional
+// bytes are read past the header. Seeking is not required.
 
-static uint32_t read_next_header (read_stream infile, WavpackHeader *wphdr)
+static uint32_t read_next_header (read_stream infile, WavpackHeader *wphdr, unsigned char *stored_header, int *header_bytes)
 {
-    unsigned char buffer [sizeof (*wphdr)], *sp = buffer + sizeof (*wphdr), *ep = sp;
+    unsigned char buffer [STANDARD_HEADER_SIZE], *sp = buffer + STANDARD_HEADER_SIZE, *ep = sp;
     uint32_t bytes_skipped = 0;
     int bleft;
 
@@ -418,17 +420,37 @@ static uint32_t read_next_header (read_stream infile, WavpackHeader *wphdr)
 	else
 	    bleft = 0;
 
-	if (infile (buffer + bleft, sizeof (*wphdr) - bleft) != (int32_t) sizeof (*wphdr) - bleft)
+	if (infile (buffer + bleft, STANDARD_HEADER_SIZE - bleft) != STANDARD_HEADER_SIZE - bleft)
 	    return -1;
 
 	sp = buffer;
 
-        if (*sp++ == FOURCC [0] && *sp == FOURCC [1] && *++sp == FOURCC [2] && *++sp == FOURCC [3] &&
-            !(*++sp & 1) && sp [1] < 64 && sp [3] < 32) {
-                memcpy (wphdr, buffer, sizeof (*wphdr));
+        if (sp [0] == FOURCC [0] && sp [1] == FOURCC [1] && sp [2] == FOURCC [2] && !(sp [4] & 1)) {
+            if (sp [3] == FOURCC [3] && sp [5] < 64 && sp [7] < 32) {
+                memcpy (stored_header, buffer, STANDARD_HEADER_SIZE);
+                memcpy (wphdr->ckID, buffer, 4);
+                wphdr->ckSize = buffer [4] + (buffer [5] << 8) + STANDARD_CKSIZE_ADJUST;
+                wphdr->block_samples = buffer [6] + (buffer [7] << 8);
+                wphdr->flags = buffer [8] + (buffer [9] << 8) + ((uint32_t) buffer [10] << 16) + ((uint32_t) buffer [11] << 24);
+                *header_bytes = STANDARD_HEADER_SIZE;
+                return bytes_skipped;
+            }
+
+            if (sp [3] == FOURCC_LARGE [3] && !sp [7] && !sp [11] && (sp [10] < 0x10 || (sp [10] == 0x10 && !sp [9] && !sp [8]))) {
+                memcpy (stored_header, buffer, STANDARD_HEADER_SIZE);
+
+                if (infile (stored_header + STANDARD_HEADER_SIZE, sizeof (WavpackHeader) - STANDARD_HEADER_SIZE) !=
+                    (int32_t) (sizeof (WavpackHeader) - STANDARD_HEADER_SIZE))
+                        return -1;
+
+                memcpy (wphdr, stored_header, sizeof (WavpackHeader));
                 little_endian_to_native (wphdr, WavpackHeaderFormat);
+                *header_bytes = sizeof (WavpackHeader);
                 return bytes_skipped;
             }
+        }
+
+	sp++;
 
 	while (sp < ep && *sp != FOURCC [0])
 	    sp++;
@@ -469,35 +491,3 @@ static void little_endian_to_native (void *data, char *format)
 	format++;
     }
 }
-
-static void native_to_little_endian (void *data, char *format)
-{
-    unsigned char *cp = (unsigned char *) data;
-    int32_t temp;
-
-    while (*format) {
-        switch (*format) {
-            case 'L':
-                temp = * (int32_t *) cp;
-                *cp++ = (unsigned char) temp;
-                *cp++ = (unsigned char) (temp >> 8);
-                *cp++ = (unsigned char) (temp >> 16);
-                *cp++ = (unsigned char) (temp >> 24);
-                break;
-
-            case 'S':
-                temp = * (int16_t *) cp;
-                *cp++ = (unsigned char) temp;
-                *cp++ = (unsigned char) (temp >> 8);
-                break;
-
-            default:
-                if (isdigit (*format))
-                    cp += *format - '0';
-
-                break;
-        }
-
-        format++;
-    }
-}
@@ -13,9 +13,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <math.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "wavpack-stream.h"
 #include "utils.h"                  // for PACKAGE_VERSION, etc.
@@ -48,7 +50,26 @@ static const char *usage =
 "          --no-floats         = skip the float modes\n"
 "          --no-lossy          = skip the lossy modes\n"
 "          --no-speeds         = skip the speed modes (fast, high, etc.)\n"
+"          --no-dsd            = skip the DSD modes\n"
+"          --no-large          = skip the short large-block pass (run at the end\n"
+"                                unless --large-blocks is used for all tests)\n"
+"          --no-api            = skip the API tests (push decoder, etc.)\n"
+"          --api-only          = perform only the API tests\n"
+"          --perf-bound=n      = fail any test where a decode call takes more than\n"
+"                                n times the test's average (decode CPU time)\n"
+"          --timing            = show encode and decode speeds (CPU time, as a\n"
+"                                multiple of realtime) for each test and overall\n"
 "          --help              = display this message\n"
+"          -j n | --jobs=n     = run up to n tests at once (output is still\n"
+"                                displayed in order)\n"
+"          --jitter-trace=file = run jitter buffer test using network trace file\n"
+"                                (lines of \"seq arrival_ms [offset_ms]\", any\n"
+"                                 order, may repeat or omit frames to simulate\n"
+"                                 dups/loss; the API tests generate a trace)\n"
+"          --recovery          = run damaged stream recovery benchmark (default\n"
+"                                skip limit vs. OPEN_NO_SKIP_LIMIT and\n"
+"                                OPEN_VERIFY_RESYNC, seekable and not)\n"
+"          --large-blocks      = use the large-block format for all tests\n"
 "          --version           = write the version to stdout\n"
 "          --write=n[-n][,...] = write specific test(s) (or range(s)) to disk\n\n"
 " Web:     Visit www.wavpack.com for latest version and info\n";
@@ -68,16 +89,37 @@ static const char *usage =
 #define TEST_FLAG_STORE_INT32_AS_FLOAT  0x2000
 #define TEST_FLAG_IGNORE_WVC            0x4000
 #define TEST_FLAG_NO_DECODE             0x8000
+#define TEST_FLAG_DSD_DATA              0x10000
+#define TEST_FLAG_NO_DSD                0x20000
+#define TEST_FLAG_NO_API                0x40000
+#define TEST_FLAG_API_ONLY              0x80000
+#define TEST_FLAG_NO_LARGE              0x100000
 
 static int run_test_size_modes (int wpconfig_flags, int test_flags, int base_minutes, int fuzz_period);
+static int run_test_large_blocks (int wpconfig_flags, int test_flags, int base_minutes, int fuzz_period);
 static int run_test_speed_modes (int wpconfig_flags, int test_flags, int bits, int num_chans, int num_seconds, int fuzz_period);
 static int run_test_extra_modes (int wpconfig_flags, int test_flags, int bits, int num_chans, int num_seconds, int fuzz_period);
 static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans, int num_seconds, int fuzz_period);
+static int run_jitter_test (char *trace_filename, int wpconfig_flags);
+static int run_recovery_test (int wpconfig_flags);
+static int run_api_tests (int wpconfig_flags);
+static void print_heading (const char *heading);
+static int run_queued_tests (void);
 
 #define NUM_WRITE_RANGES 10
 static struct { int start, stop; } write_ranges [NUM_WRITE_RANGES];
 int number_of_ranges;
 
+static double perf_bound, perf_worst;
+static int perf_worst_test;
+
+static int timing;
+static int64_t timing_encode_time, timing_decode_time;
+static double timing_encode_seconds, timing_decode_seconds;
+
+#define MAX_JOBS 64
+static int num_jobs = 1;
+
 enum generator_type { noise, tone };
 
 struct audio_generator {
@@ -104,10 +146,13 @@ static void mix_samples_with_gain (float *destin, float *source, int num_samples
 static void truncate_float_samples (float *samples, int num_samples, int bits);
 static void float_to_integer_samples (float *samples, int num_samples, int bits);
 static void float_to_32bit_integer_samples (float *samples, int num_samples);
+static void float_to_dsd_samples (float *samples, int32_t *dsd_samples, int num_samples, int num_chans, double *dsd_state);
 static void *store_samples (void *dst, int32_t *src, int qmode, int bps, int count);
 static void frandom_set_seed (uint64_t seed);
 static uint64_t frandom_get_seed (void);
 static double frandom (void);
+#define RANDOM_SEED 0x3141592653589793ULL
+static int64_t thread_cpu_time_ns (void);
 
 typedef struct {
     uint32_t buffer_size, bytes_written, bytes_read, first_block_size;
@@ -121,10 +166,30 @@ typedef struct {
 typedef struct {
     StreamingFile *wv_stream, *wvc_stream;
     unsigned char md5_decoded [16];
-    uint32_t sample_count;
+    uint32_t sample_count, decode_calls;
+    int64_t decode_time, worst_time;
     int num_errors;
 } WavpackDecoder;
 
+// When tests are run in parallel each one is queued as a job and executed by a worker thread,
+// with its output saved until it can be displayed in order. The section headings are queued
+// as jobs with no test so that they stay in the right place.
+
+typedef struct {
+    int wpconfig_flags, test_flags, bits, num_chans, num_seconds, fuzz_period, test_number;
+    int buffered, done, result;
+    char *output;
+    size_t output_length, output_size;
+} TestJob;
+
+static TestJob *jobs;
+static int jobs_queued, jobs_allocated, next_job, abort_jobs;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static void job_printf (TestJob *job, const char *format, ...);
+static int execute_test (TestJob *job);
+
 static void initialize_stream (StreamingFile *ws, int buffer_size, int fuzz_period);
 static int write_block (void *id, void *data, int32_t length);
 static void flush_stream (StreamingFile *ws);
@@ -137,7 +202,8 @@ static WavpackReader freader;
 int main (argc, argv) int argc; char **argv;
 {
     int wpconfig_flags = CONFIG_MD5_CHECKSUM | CONFIG_OPTIMIZE_MONO, test_flags = 0, base_minutes = 2, res;
-    int fuzz_period = 0;
+    char *jitter_trace = NULL;
+    int fuzz_period = 0, recovery = 0;
 
     // loop through command-line arguments
 
@@ -185,9 +251,28 @@ int main (argc, argv) int argc; char **argv;
             else if (!strcmp (long_option, "no-floats")) {              // --no-floats
                 test_flags |= TEST_FLAG_NO_FLOATS;
             }
+            else if (!strcmp (long_option, "no-dsd")) {                 // --no-dsd
+                test_flags |= TEST_FLAG_NO_DSD;
+            }
+            else if (!strcmp (long_option, "no-large")) {               // --no-large
+                test_flags |= TEST_FLAG_NO_LARGE;
+            }
+            else if (!strcmp (long_option, "no-api")) {                 // --no-api
+                test_flags |= TEST_FLAG_NO_API;
+            }
+            else if (!strcmp (long_option, "api-only")) {               // --api-only
+                test_flags |= TEST_FLAG_API_ONLY;
+            }
+            else if (!strcmp (long_option, "recovery"))                 // --recovery
+                recovery = 1;
+            else if (!strcmp (long_option, "timing"))                   // --timing
+                timing = 1;
             else if (!strcmp (long_option, "no-decode")) {              // --no-decode
                 test_flags |= TEST_FLAG_NO_DECODE;
             }
+            else if (!strcmp (long_option, "large-blocks")) {           // --large-blocks
+                wpconfig_flags |= CONFIG_LARGE_BLOCKS;
+            }
             else if (!strncmp (long_option, "fuzz-period", 11)) {       // --fuzz-period
                 fuzz_period = strtol (long_param, NULL, 10);
 
@@ -196,6 +281,30 @@ int main (argc, argv) int argc; char **argv;
                     return 1;
                 }
             }
+            else if (!strncmp (long_option, "jobs", 4)) {               // --jobs
+                num_jobs = strtol (long_param, NULL, 10);
+
+                if (num_jobs < 1 || num_jobs > MAX_JOBS) {
+                    printf ("invalid number of jobs, must be 1 - %d!\n", MAX_JOBS);
+                    return 1;
+                }
+            }
+            else if (!strncmp (long_option, "perf-bound", 10)) {        // --perf-bound
+                perf_bound = strtod (long_param, NULL);
+
+                if (perf_bound < 2.0 || perf_bound > 10000.0) {
+                    printf ("invalid performance bound, must be 2 - 10000!\n");
+                    return 1;
+                }
+            }
+            else if (!strncmp (long_option, "jitter-trace", 12)) {     // --jitter-trace
+                if (!*long_param) {
+                    printf ("jitter trace filename required!\n");
+                    return 1;
+                }
+
+                jitter_trace = long_param;
+            }
             else if (!strncmp (long_option, "write", 5)) {              // --write
                 for (number_of_ranges = 0; *long_param && isdigit (*long_param) && number_of_ranges < NUM_WRITE_RANGES;) {
                     write_ranges [number_of_ranges].start = strtol (long_param, &long_param, 10);
@@ -230,6 +339,16 @@ int main (argc, argv) int argc; char **argv;
                 return 1;
             }
         }
+        else if (**argv == '-' && (*argv)[1] == 'j') {                  // -j n
+            char *param = (*argv)[2] ? *argv + 2 : (argc > 1 ? (--argc, *++argv) : "");
+
+            num_jobs = strtol (param, NULL, 10);
+
+            if (num_jobs < 1 || num_jobs > MAX_JOBS) {
+                printf ("invalid number of jobs, must be 1 - %d!\n", MAX_JOBS);
+                return 1;
+            }
+        }
         else {
             printf ("unknown option: %s !\n", *argv);
             return 1;
@@ -241,35 +360,68 @@ int main (argc, argv) int argc; char **argv;
     else
         printf (sign_on, VERSION_OS, WavpackStreamGetLibraryVersionString ());
 
-    if (!(test_flags & (TEST_FLAG_DEFAULT | TEST_FLAG_EXHAUSTIVE))) {
+    if (jitter_trace) {
+        res = run_jitter_test (jitter_trace, wpconfig_flags & CONFIG_LARGE_BLOCKS);
+        goto done;
+    }
+
+    if (recovery) {
+        res = run_recovery_test (wpconfig_flags & CONFIG_LARGE_BLOCKS);
+        goto done;
+    }
+
+    if (!(test_flags & (TEST_FLAG_DEFAULT | TEST_FLAG_EXHAUSTIVE | TEST_FLAG_API_ONLY))) {
         puts (usage);
         return 1;
     }
 
-    printf ("\n\n                          ****** pure lossless ******\n");
+    if (!(test_flags & TEST_FLAG_NO_API)) {
+        res = run_api_tests (wpconfig_flags);
+        if (res || (test_flags & TEST_FLAG_API_ONLY)) goto done;
+    }
+
+    print_heading ("\n\n                          ****** pure lossless ******\n");
     res = run_test_size_modes (wpconfig_flags, test_flags, base_minutes, fuzz_period);
     if (res) goto done;
 
     if (!(test_flags & TEST_FLAG_NO_HYBRID)) {
         if (!fuzz_period) {
-            printf ("\n\n                         ****** hybrid lossless ******\n");
+            print_heading ("\n\n                         ****** hybrid lossless ******\n");
             res = run_test_size_modes (wpconfig_flags | CONFIG_HYBRID_FLAG | CONFIG_CREATE_WVC, test_flags, base_minutes, fuzz_period);
             if (res) goto done;
         }
 
         if (!(test_flags & TEST_FLAG_NO_LOSSY)) {
-            printf ("\n\n                          ****** hybrid lossy ******\n");
+            print_heading ("\n\n                          ****** hybrid lossy ******\n");
             res = run_test_size_modes (wpconfig_flags | CONFIG_HYBRID_FLAG, test_flags, base_minutes, fuzz_period);
             if (res) goto done;
 
-            printf ("\n\n            ****** hybrid lossless (but ignore wpsc on decode) ******\n");
+            print_heading ("\n\n            ****** hybrid lossless (but ignore wpsc on decode) ******\n");
             res = run_test_size_modes (wpconfig_flags | CONFIG_HYBRID_FLAG | CONFIG_CREATE_WVC,
                 test_flags | TEST_FLAG_IGNORE_WVC, base_minutes, fuzz_period);
             if (res) goto done;
         }
     }
 
+    if (!(wpconfig_flags & CONFIG_LARGE_BLOCKS) && !(test_flags & TEST_FLAG_NO_LARGE)) {
+        print_heading ("\n\n                          ****** large blocks ******\n");
+        res = run_test_large_blocks (wpconfig_flags | CONFIG_LARGE_BLOCKS, test_flags, base_minutes, fuzz_period);
+        if (res) goto done;
+    }
+
+    if (num_jobs > 1)
+        res = run_queued_tests ();
+
 done:
+    if (perf_bound && perf_worst_test)
+        printf ("\nworst decode call: %.1fx test average (test %04d)\n", perf_worst, perf_worst_test);
+
+    if (timing && timing_encode_time)
+        printf ("\noverall encode speed: %.1fx realtime\n", timing_encode_seconds * 1.0e9 / timing_encode_time);
+
+    if (timing && timing_decode_time)
+        printf ("overall decode speed: %.1fx realtime\n", timing_decode_seconds * 1.0e9 / timing_decode_time);
+
     if (res)
         printf ("\ntest failed!\n\n");
     else
@@ -285,48 +437,48 @@ static int run_test_size_modes (int wpconfig_flags, int test_flags, int base_min
 {
     int res;
 
-    printf ("\n   *** 8-bit, mono ***\n");
+    print_heading ("\n   *** 8-bit, mono ***\n");
     res = run_test_speed_modes (wpconfig_flags, test_flags, 8, 1, base_minutes*5*60, fuzz_period);
     if (res) return res;
 
     if (test_flags & TEST_FLAG_EXHAUSTIVE) {
-        printf ("\n   *** 16-bit, mono ***\n");
+        print_heading ("\n   *** 16-bit, mono ***\n");
         res = run_test_speed_modes (wpconfig_flags, test_flags, 16, 1, base_minutes*5*60, fuzz_period);
         if (res) return res;
     }
 
-    printf ("\n   *** 16-bit, stereo ***\n");
+    print_heading ("\n   *** 16-bit, stereo ***\n");
     res = run_test_speed_modes (wpconfig_flags, test_flags, 16, 2, base_minutes*3*60, fuzz_period);
     if (res) return res;
 
     if ((test_flags & TEST_FLAG_EXHAUSTIVE) && !(test_flags & TEST_FLAG_NO_FLOATS)) {
-        printf ("\n   *** 16-bit (converted to float), stereo ***\n");
+        print_heading ("\n   *** 16-bit (converted to float), stereo ***\n");
         res = run_test_speed_modes (wpconfig_flags, test_flags | TEST_FLAG_FLOAT_DATA, 16, 2, base_minutes*3*60, fuzz_period);
         if (res) return res;
     }
 
-    printf ("\n   *** 24-bit, 5.1 channels ***\n");
+    print_heading ("\n   *** 24-bit, 5.1 channels ***\n");
     res = run_test_speed_modes (wpconfig_flags, test_flags, 24, 6, base_minutes*60, fuzz_period);
     if (res) return res;
 
     if (test_flags & TEST_FLAG_EXHAUSTIVE) {
         if (!(test_flags & TEST_FLAG_NO_FLOATS)) {
-            printf ("\n   *** 24-bit (converted to float), 5.1 channels ***\n");
+            print_heading ("\n   *** 24-bit (converted to float), 5.1 channels ***\n");
             res = run_test_speed_modes (wpconfig_flags, test_flags | TEST_FLAG_FLOAT_DATA, 24, 6, base_minutes*60, fuzz_period);
             if (res) return res;
         }
  
-        printf ("\n   *** 32-bit integer, 5.1 channels ***\n");
+        print_heading ("\n   *** 32-bit integer, 5.1 channels ***\n");
         res = run_test_speed_modes (wpconfig_flags, test_flags, 32, 6, base_minutes*60, fuzz_period);
         if (res) return res;
 
         if (!(test_flags & TEST_FLAG_NO_FLOATS)) {
-            printf ("\n   *** 32-bit float stored as integer (pathological), 5.1 channels ***\n");
+            print_heading ("\n   *** 32-bit float stored as integer (pathological), 5.1 channels ***\n");
             res = run_test_speed_modes (wpconfig_flags, test_flags | TEST_FLAG_STORE_FLOAT_AS_INT32, 32, 6, base_minutes*60, fuzz_period);
             if (res) return res;
         
             if (!(wpconfig_flags & CONFIG_HYBRID_FLAG)) {
-                printf ("\n   *** 32-bit integer stored as float (pathological), 5.1 channels ***\n");
+                print_heading ("\n   *** 32-bit integer stored as float (pathological), 5.1 channels ***\n");
                 res = run_test_speed_modes (wpconfig_flags, test_flags | TEST_FLAG_STORE_INT32_AS_FLOAT, 32, 6, base_minutes*60, fuzz_period);
                 if (res) return res;
             }
@@ -334,11 +486,81 @@ static int run_test_size_modes (int wpconfig_flags, int test_flags, int base_min
     }
 
     if (!(test_flags & TEST_FLAG_NO_FLOATS)) {
-        printf ("\n   *** 32-bit float, 5.1 channels ***\n");
+        print_heading ("\n   *** 32-bit float, 5.1 channels ***\n");
         res = run_test_speed_modes (wpconfig_flags, test_flags | TEST_FLAG_FLOAT_DATA, 32, 6, base_minutes*60, fuzz_period);
         if (res) return res;
     }
 
+#ifdef ENABLE_DSD
+    // DSD is lossless only, has no extra modes, and just the default (fast) and high speed modes
+
+    if (!(wpconfig_flags & CONFIG_HYBRID_FLAG) && !(test_flags & TEST_FLAG_NO_DSD)) {
+        if (test_flags & TEST_FLAG_EXHAUSTIVE) {
+            print_heading ("\n   *** 1-bit DSD (DSD64), mono ***\n");
+            res = run_test (wpconfig_flags, test_flags | TEST_FLAG_DSD_DATA, 1, 1, base_minutes*60, fuzz_period);
+            if (res) return res;
+
+            if (!(test_flags & TEST_FLAG_NO_SPEEDS)) {
+                res = run_test (wpconfig_flags | CONFIG_HIGH_FLAG, test_flags | TEST_FLAG_DSD_DATA, 1, 1, base_minutes*60, fuzz_period);
+                if (res) return res;
+            }
+        }
+
+        print_heading ("\n   *** 1-bit DSD (DSD64), stereo ***\n");
+        res = run_test (wpconfig_flags, test_flags | TEST_FLAG_DSD_DATA, 1, 2, base_minutes*60, fuzz_period);
+        if (res) return res;
+
+        if (!(test_flags & TEST_FLAG_NO_SPEEDS)) {
+            res = run_test (wpconfig_flags | CONFIG_HIGH_FLAG, test_flags | TEST_FLAG_DSD_DATA, 1, 2, base_minutes*60, fuzz_period);
+            if (res) return res;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+// Run a short pass with the large-block format (which also makes the default blocks 8 times
+// longer) when the rest of the tests are using standard blocks. Only the default speed mode
+// is done, but in each of the lossless, hybrid lossless and hybrid lossy modes that the other
+// tests are doing. A return value of FALSE indicates an error.
+
+static int run_test_large_blocks (int wpconfig_flags, int test_flags, int base_minutes, int fuzz_period)
+{
+    static const struct { const char *heading; int bits, num_chans; } formats [] = {
+        { "\n   *** 16-bit, stereo ***\n", 16, 2 },
+        { "\n   *** 24-bit, 5.1 channels ***\n", 24, 6 }
+    };
+    int res, i;
+
+    for (i = 0; i < (int) (sizeof (formats) / sizeof (formats [0])); ++i) {
+        print_heading (formats [i].heading);
+        res = run_test (wpconfig_flags, test_flags, formats [i].bits, formats [i].num_chans, base_minutes*60, fuzz_period);
+        if (res) return res;
+
+        if (test_flags & TEST_FLAG_NO_HYBRID)
+            continue;
+
+        if (!fuzz_period) {
+            res = run_test (wpconfig_flags | CONFIG_HYBRID_FLAG | CONFIG_CREATE_WVC, test_flags,
+                formats [i].bits, formats [i].num_chans, base_minutes*60, fuzz_period);
+            if (res) return res;
+        }
+
+        if (!(test_flags & TEST_FLAG_NO_LOSSY)) {
+            res = run_test (wpconfig_flags | CONFIG_HYBRID_FLAG, test_flags, formats [i].bits, formats [i].num_chans, base_minutes*60, fuzz_period);
+            if (res) return res;
+        }
+    }
+
+#ifdef ENABLE_DSD
+    if (!(test_flags & TEST_FLAG_NO_DSD)) {
+        print_heading ("\n   *** 1-bit DSD (DSD64), stereo ***\n");
+        res = run_test (wpconfig_flags, test_flags | TEST_FLAG_DSD_DATA, 1, 2, base_minutes*60, fuzz_period);
+        if (res) return res;
+    }
+#endif
+
     return 0;
 }
 
@@ -418,6 +640,188 @@ static int run_test_extra_modes (int wpconfig_flags, int test_flags, int bits, i
     return 0;
 }
 
+// Add a job (with buffered output) to the end of the queue.
+
+static TestJob *queue_job (void)
+{
+    TestJob *job;
+
+    if (jobs_queued == jobs_allocated) {
+        jobs_allocated = jobs_allocated ? jobs_allocated * 2 : 256;
+        jobs = realloc (jobs, jobs_allocated * sizeof (TestJob));
+
+        if (!jobs) {
+            printf ("queue_job(): can't allocate memory!\n");
+            exit (-1);
+        }
+    }
+
+    job = jobs + jobs_queued++;
+    CLEAR (*job);
+    job->buffered = 1;
+    return job;
+}
+
+// Run the specified test, either right now or (when running tests in parallel) by queuing it
+// for the worker threads, in which case any failure is reported by run_queued_tests() instead.
+
+static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans, int num_seconds, int fuzz_period)
+{
+    static int test_number;
+    TestJob local_job, *job = &local_job;
+
+    if (num_jobs > 1)
+        job = queue_job ();
+    else
+        CLEAR (local_job);
+
+    job->wpconfig_flags = wpconfig_flags;
+    job->test_flags = test_flags;
+    job->bits = bits;
+    job->num_chans = num_chans;
+    job->num_seconds = num_seconds;
+    job->fuzz_period = fuzz_period;
+    job->test_number = ++test_number;
+
+    return job->buffered ? 0 : execute_test (job);
+}
+
+// Display a section heading now, or queue it to be displayed in order with the test results.
+
+static void print_heading (const char *heading)
+{
+    TestJob *job;
+
+    if (num_jobs == 1) {
+        printf ("%s", heading);
+        return;
+    }
+
+    job = queue_job ();
+    job->done = 1;
+    job_printf (job, "%s", heading);
+}
+
+// Either display the specified text immediately or append it to the job's saved output.
+
+static void job_printf (TestJob *job, const char *format, ...)
+{
+    va_list args;
+    int length;
+
+    va_start (args, format);
+
+    if (!job->buffered) {
+        vprintf (format, args);
+        va_end (args);
+        fflush (stdout);
+        return;
+    }
+
+    length = vsnprintf (NULL, 0, format, args);
+    va_end (args);
+
+    if (length <= 0)
+        return;
+
+    if (job->output_length + length + 1 > job->output_size) {
+        job->output_size = (job->output_length + length + 1) * 2;
+        job->output = realloc (job->output, job->output_size);
+
+        if (!job->output) {
+            printf ("job_printf(): can't allocate memory!\n");
+            exit (-1);
+        }
+    }
+
+    va_start (args, format);
+    vsnprintf (job->output + job->output_length, length + 1, format, args);
+    job->output_length += length;
+    va_end (args);
+}
+
+// Worker thread that runs queued tests (in order) until there are none left or a test fails.
+
+static void *test_worker_thread (void *unused)
+{
+    pthread_mutex_lock (&jobs_mutex);
+
+    while (!abort_jobs) {
+        TestJob *job;
+
+        while (next_job < jobs_queued && jobs [next_job].done)
+            next_job++;
+
+        if (next_job == jobs_queued)
+            break;
+
+        job = jobs + next_job++;
+        pthread_mutex_unlock (&jobs_mutex);
+
+        job->result = execute_test (job);
+
+        pthread_mutex_lock (&jobs_mutex);
+        job->done = 1;
+        pthread_cond_broadcast (&jobs_cond);
+    }
+
+    pthread_mutex_unlock (&jobs_mutex);
+    return NULL;
+}
+
+// Run all the queued tests with a pool of worker threads, displaying the output of each test
+// (and the headings) in the order they were queued, and stop at the first failure just like
+// running them one at a time. The tests are deterministic, so the output is identical.
+
+static int run_queued_tests (void)
+{
+    pthread_t workers [MAX_JOBS];
+    int num_workers, res = 0, i;
+
+    for (num_workers = 0; num_workers < num_jobs; ++num_workers)
+        if (pthread_create (workers + num_workers, NULL, test_worker_thread, NULL)) {
+            if (!num_workers) {
+                printf ("run_queued_tests(): can't create worker threads!\n");
+                exit (-1);
+            }
+
+            break;
+        }
+
+    for (i = 0; i < jobs_queued; ++i) {
+        pthread_mutex_lock (&jobs_mutex);
+
+        while (!jobs [i].done)
+            pthread_cond_wait (&jobs_cond, &jobs_mutex);
+
+        if (jobs [i].result && !res) {
+            res = jobs [i].result;
+            abort_jobs = 1;
+        }
+
+        pthread_mutex_unlock (&jobs_mutex);
+
+        if (jobs [i].output)
+            fputs (jobs [i].output, stdout);
+
+        fflush (stdout);
+
+        if (res)
+            break;
+    }
+
+    for (i = 0; i < num_workers; ++i)
+        pthread_join (workers [i], NULL);
+
+    for (i = 0; i < jobs_queued; ++i)
+        free (jobs [i].output);
+
+    free (jobs);
+    jobs = NULL;
+    jobs_queued = jobs_allocated = next_job = 0;
+    return res;
+}
+
 // Given a WavPack configuration and test flags, actually run the specified test. This entails
 // generating the actual audio test data, creating the "virtual" WavPack file and writing to it,
 // and spawning the thread that will read the "virtual" file and do the decoding (which is obviously
@@ -435,14 +839,21 @@ struct audio_channel {
 
 #define SAMPLE_RATE 44100
 #define ENCODE_SAMPLES 128
+#define DSD_BYTES_PER_SAMPLE 8      // DSD bytes generated per PCM sample (i.e., DSD64)
 #define NOISE_GAIN 0.6667
 #define TONE_GAIN 0.3333
 
-static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans, int num_seconds, int fuzz_period)
+static int execute_test (TestJob *job)
 {
-    static int test_number;
-
+    int wpconfig_flags = job->wpconfig_flags, test_flags = job->test_flags, bits = job->bits;
+    int num_chans = job->num_chans, num_seconds = job->num_seconds, fuzz_period = job->fuzz_period;
+    int test_number = job->test_number;
     float sequencing_angle = 0.0, speed = 60.0, width = 200.0, *source, *destin, ratio, bps;
+    int sample_multiplier = (test_flags & TEST_FLAG_DSD_DATA) ? DSD_BYTES_PER_SAMPLE : 1;
+    int32_t *pack_buffer, *dsd_samples = NULL;
+    double perf_ratio = 0.0, audio_seconds, *dsd_state = NULL;
+    int64_t encode_time = 0, start_time;
+    char perf_string [64] = "";
     int lossless = !(wpconfig_flags & CONFIG_HYBRID_FLAG) || ((wpconfig_flags & CONFIG_CREATE_WVC) && !(test_flags & TEST_FLAG_IGNORE_WVC));
     char md5_string1 [] = "????????????????????????????????";
     char md5_string2 [] = "????????????????????????????????";
@@ -468,7 +879,8 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
     else if (wpconfig_flags & CONFIG_VERY_HIGH_FLAG)
         strcat (mode_string, "hh");
 
-    printf ("test %04d...", ++test_number); fflush (stdout);
+    job_printf (job, "test %04d...", test_number);
+    frandom_set_seed (RANDOM_SEED ^ (test_number * 0x9e3779b97f4a7c15ULL));
     MD5_Init (&md5_context);
 
     noise_generator_init (&generators [0], 128.0);
@@ -487,7 +899,15 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
     source = malloc (ENCODE_SAMPLES * sizeof (*source));
     destin = malloc (ENCODE_SAMPLES * num_chans * sizeof (*destin));
 
-    if (!channels || !source || !destin) {
+    if (test_flags & TEST_FLAG_DSD_DATA) {
+        dsd_samples = malloc (ENCODE_SAMPLES * DSD_BYTES_PER_SAMPLE * num_chans * sizeof (*dsd_samples));
+        dsd_state = calloc (num_chans * 2, sizeof (*dsd_state));
+        pack_buffer = dsd_samples;
+    }
+    else
+        pack_buffer = (int32_t *) destin;
+
+    if (!channels || !source || !destin || !pack_buffer || ((test_flags & TEST_FLAG_DSD_DATA) && !dsd_state)) {
         printf ("run_test(): can't allocate memory!\n");
         exit (-1);
     }
@@ -550,7 +970,7 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
                 sprintf (filename, "testfile-%04d.wps", test_number);
 
                 if (((wv_stream.file = fopen (filename, "w+b")) == NULL)) {
-                    printf ("can't create file %s!\n", filename);
+                    job_printf (job, "can't create file %s!\n", filename);
                     free_stream (&wv_stream);
                     return 1;
                 }
@@ -574,7 +994,7 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
             strcat (filename_c, "c");
 
             if ((wvc_stream.file = fopen (filename_c, "w+b")) == NULL) {
-                printf ("can't create file %s!\n", filename_c);
+                job_printf (job, "can't create file %s!\n", filename_c);
                 free_stream (&wv_stream);
                 free_stream (&wvc_stream);
                 return 1;
@@ -594,6 +1014,11 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
         wpconfig.bytes_per_sample = 4;
         wpconfig.bits_per_sample = 32;
     }
+    else if (test_flags & TEST_FLAG_DSD_DATA) {
+        wpconfig.qmode = QMODE_DSD_MSB_FIRST;
+        wpconfig.bytes_per_sample = 1;
+        wpconfig.bits_per_sample = 8;
+    }
     else {
         wpconfig.bytes_per_sample = (bits + 7) >> 3;
         wpconfig.bits_per_sample = bits;
@@ -605,7 +1030,7 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
         wpconfig_flags |= CONFIG_EXTRA_MODE;
     }
 
-    wpconfig.sample_rate = SAMPLE_RATE;
+    wpconfig.sample_rate = SAMPLE_RATE * sample_multiplier;
     wpconfig.num_channels = num_chans;
     wpconfig.channel_mask = chan_mask;
     wpconfig.flags = wpconfig_flags;
@@ -665,6 +1090,8 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
                 exit (-1);
             }
         }
+        else if (test_flags & TEST_FLAG_DSD_DATA)
+            float_to_dsd_samples (destin, dsd_samples, ENCODE_SAMPLES, num_chans, dsd_state);
         else if (!(test_flags & TEST_FLAG_STORE_FLOAT_AS_INT32)) {
             if (bits < 32)
                 float_to_integer_samples (destin, ENCODE_SAMPLES * num_chans, bits);
@@ -676,11 +1103,16 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
             }
         }
 
-        if (!WavpackStreamPackSamples (out_wpc, (int32_t *) destin, ENCODE_SAMPLES))
-            printf ("...PackSamples() returned FALSE\n");
+        start_time = timing ? thread_cpu_time_ns () : 0;
+
+        if (!WavpackStreamPackSamples (out_wpc, pack_buffer, ENCODE_SAMPLES * sample_multiplier))
+            job_printf (job, "...PackSamples() returned FALSE\n");
 
-        store_samples (destin, (int32_t *) destin, 0, wpconfig.bytes_per_sample, ENCODE_SAMPLES * num_chans);
-        MD5_Update (&md5_context, (unsigned char *) destin, wpconfig.bytes_per_sample * ENCODE_SAMPLES * num_chans);
+        if (timing)
+            encode_time += thread_cpu_time_ns () - start_time;
+
+        store_samples (pack_buffer, pack_buffer, 0, wpconfig.bytes_per_sample, ENCODE_SAMPLES * sample_multiplier * num_chans);
+        MD5_Update (&md5_context, (unsigned char *) pack_buffer, wpconfig.bytes_per_sample * ENCODE_SAMPLES * sample_multiplier * num_chans);
 
         sequencing_angle += 2.0 * M_PI / SAMPLE_RATE / speed * ENCODE_SAMPLES;
         if (sequencing_angle > M_PI) sequencing_angle -= M_PI * 2.0;
@@ -705,7 +1137,12 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
         }
     }
 
+    start_time = timing ? thread_cpu_time_ns () : 0;
     WavpackStreamFlushSamples (out_wpc);
+
+    if (timing)
+        encode_time += thread_cpu_time_ns () - start_time;
+
     MD5_Final (md5_encoded, &md5_context);
 
     if (wpconfig.flags & CONFIG_MD5_CHECKSUM) {
@@ -718,13 +1155,15 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
     free (channels);
     free (source);
     free (destin);
+    free (dsd_samples);
+    free (dsd_state);
 
     if ((wpconfig_flags & CONFIG_CREATE_WVC) && !(test_flags & TEST_FLAG_IGNORE_WVC))
         total_encoded_bytes = wv_stream.bytes_written + wvc_stream.bytes_written;
     else
         total_encoded_bytes = wv_stream.bytes_written;
 
-    total_encoded_samples = seconds * SAMPLE_RATE + samples;
+    total_encoded_samples = (seconds * SAMPLE_RATE + samples) * sample_multiplier;
     ratio = total_encoded_bytes / ((float) total_encoded_samples * wpconfig.bytes_per_sample * num_chans);
     bps = total_encoded_bytes * 8 / ((float) total_encoded_samples * num_chans);
 
@@ -735,9 +1174,39 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
         pthread_join (pthread, &term_value);
 
         if (term_value) {
-            printf ("decode_thread() returned error %d\n", (int) (long) term_value);
+            job_printf (job, "decode_thread() returned error %d\n", (int) (long) term_value);
             return 1;
         }
+
+        // The decode CPU time check is done before the error check so that it also covers
+        // the fuzzed tests, where the point is that damaged data must not be much slower to
+        // decode than good data. Each call decodes the same number of samples (except the
+        // last), so the worst one is compared to the average for the same test, which is
+        // portable where absolute times are not.
+
+        if (perf_bound && wv_decoder.decode_calls) {
+            double average = (double) wv_decoder.decode_time / wv_decoder.decode_calls;
+
+            perf_ratio = average > 0.0 ? wv_decoder.worst_time / average : 0.0;
+
+            pthread_mutex_lock (&jobs_mutex);
+
+            if (perf_ratio > perf_worst) {
+                perf_worst = perf_ratio;
+                perf_worst_test = test_number;
+            }
+
+            pthread_mutex_unlock (&jobs_mutex);
+
+            if (perf_ratio > perf_bound) {
+                job_printf (job, "\n---------------------------------------------\n");
+                job_printf (job, "decode calls: %u, average %.1f us, worst %.1f us\n", wv_decoder.decode_calls,
+                    average / 1000.0, wv_decoder.worst_time / 1000.0);
+                job_printf (job, "worst decode call is %.1fx average, bound is %.1fx\n", perf_ratio, perf_bound);
+                job_printf (job, "---------------------------------------------\n");
+                return 1;
+            }
+        }
     }
 
     free_stream (&wv_stream);
@@ -751,105 +1220,2006 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
 
         if (wv_decoder.num_errors || wv_decoder.sample_count != total_encoded_samples ||
             (lossless && memcmp (md5_encoded, wv_decoder.md5_decoded, sizeof (md5_encoded)))) {
-                printf ("\n---------------------------------------------\n");
-                printf ("enc/dec sample count: %u / %u\n", total_encoded_samples, wv_decoder.sample_count);
-                printf ("encoded md5: %s\n", md5_string1);
-                printf ("decoded md5: %s\n", md5_string2);
-                printf ("reported decode errors: %d\n", wv_decoder.num_errors);
-                printf ("---------------------------------------------\n");
+                job_printf (job, "\n---------------------------------------------\n");
+                job_printf (job, "enc/dec sample count: %u / %u\n", total_encoded_samples, wv_decoder.sample_count);
+                job_printf (job, "encoded md5: %s\n", md5_string1);
+                job_printf (job, "decoded md5: %s\n", md5_string2);
+                job_printf (job, "reported decode errors: %d\n", wv_decoder.num_errors);
+                job_printf (job, "---------------------------------------------\n");
                 return fuzz_period ? 0 : wv_decoder.num_errors + 1;
         }
     }
 
-    printf ("pass (%8s, %.2f%%, %.2f bps, %s)\n", mode_string, 100.0 - ratio * 100.0, bps, md5_string2);
-
-    return 0;
-}
+    if (perf_bound)
+        sprintf (perf_string, ", %.1fx", perf_ratio);
 
-// Thread / function that opens a virtual WavPack file, decodes it and calculates the MD5 hash of the
-// decoded audio data.
+    // speeds are CPU time (so not affected by other jobs) expressed as a multiple of realtime
 
-#define DECODE_SAMPLES 1000
+    if (timing) {
+        audio_seconds = (double) total_encoded_samples / SAMPLE_RATE / sample_multiplier;
 
-static void *decode_thread (void *threadid)
-{
-    WavpackDecoder *wd = (WavpackDecoder *) threadid;
-    char error [80];
-    WavpackContext *wpc;
-    int32_t *decoded_samples, num_chans, bps;
-    MD5_CTX md5_context;
+        if (encode_time)
+            sprintf (perf_string + strlen (perf_string), ", enc %.0fx", audio_seconds * 1.0e9 / encode_time);
 
-    while (1) {
-        wpc = WavpackStreamOpenFileInputEx (&freader, wd->wv_stream, wd->wvc_stream, error, 0, 0);
+        if (wv_decoder.decode_time)
+            sprintf (perf_string + strlen (perf_string), ", dec %.0fx", audio_seconds * 1.0e9 / wv_decoder.decode_time);
 
-        if (wpc)
-            break;
+        pthread_mutex_lock (&jobs_mutex);
+        timing_encode_time += encode_time;
+        timing_encode_seconds += audio_seconds;
 
-        wd->num_errors++;
+        if (wv_decoder.decode_time) {
+            timing_decode_time += wv_decoder.decode_time;
+            timing_decode_seconds += audio_seconds;
+        }
 
-        if (wd->wv_stream->done || (wd->wvc_stream && wd->wvc_stream->done))
-            break;
+        pthread_mutex_unlock (&jobs_mutex);
     }
 
-    if (!wpc)
-        pthread_exit (NULL);
+    job_printf (job, "pass (%8s, %.2f%%, %.2f bps, %s%s)\n", mode_string, 100.0 - ratio * 100.0, bps, md5_string2, perf_string);
 
-    MD5_Init (&md5_context);
-    num_chans = WavpackStreamGetNumChannels (wpc);
-    bps = WavpackStreamGetBytesPerSample (wpc);
+    return 0;
+}
 
-    decoded_samples = malloc (sizeof (int32_t) * DECODE_SAMPLES * num_chans);
+// Jitter buffer test. Ten seconds of stereo test audio is encoded into 20 ms frames (which are
+// single blocks for stereo) and these are then "received" in the order and at the times given in
+// the trace file and played out through the jitter buffer in 10 ms periods. Each line of the trace
+// file contains a frame sequence number and an arrival time in milliseconds, so frames may be
+// reordered, duplicated or lost simply by editing the file. An optional third value offsets the
+// frame's timestamp (in milliseconds) to simulate a bad sender, and the jitter buffer must reject
+// such a frame if it overlaps one already held. All the audio played out (except the silence
+// inserted for missing frames) must match the source audio exactly. The same test is run as one
+// of the API tests with a generated trace.
+
+#define JITTER_SECONDS 10
+#define JITTER_FRAME_SAMPLES (SAMPLE_RATE / 50)
+#define JITTER_PERIOD_SAMPLES (SAMPLE_RATE / 100)
+#define JITTER_CHANS 2
 
-    if (!decoded_samples) {
-        printf ("decode_thread(): can't allocate memory!\n");
+typedef struct {
+    unsigned char *data;
+    int32_t bytes, alloc, num_frames, frames_alloc, *frame_offsets;
+    int64_t *frame_timestamps, total_samples;
+} EncodedFrames;
+
+typedef struct {
+    int sequence, line_number;
+    int64_t arrival_time, offset;
+} TraceEntry;
+
+static int play_jitter_trace (TraceEntry *entries, int num_entries, int wpconfig_flags, WavpackJitterStats *stats, char *info);
+
+static int store_frame (void *id, void *data, int32_t length)
+{
+    EncodedFrames *ef = (EncodedFrames *) id;
+    unsigned char *bp = data;
+    int block_samples = bp [3] == 'l' ?         // "wpsl" blocks have 32-bit fields
+        bp [8] + (bp [9] << 8) + (bp [10] << 16) : bp [6] + (bp [7] << 8);
+
+    if (!block_samples)         // skip metadata-only blocks (e.g., the MD5 sum)
+        return 1;
+
+    if (ef->bytes + length > ef->alloc && !(ef->data = realloc (ef->data, ef->alloc = (ef->bytes + length) * 2))) {
+        printf ("store_frame(): can't allocate memory!\n");
         exit (-1);
     }
 
-    while (1) {
-        int samples = WavpackStreamUnpackSamples (wpc, decoded_samples, DECODE_SAMPLES);
+    if (ef->num_frames + 1 >= ef->frames_alloc) {
+        ef->frame_offsets = realloc (ef->frame_offsets, (ef->frames_alloc += 1024) * sizeof (*ef->frame_offsets));
+        ef->frame_timestamps = realloc (ef->frame_timestamps, ef->frames_alloc * sizeof (*ef->frame_timestamps));
 
-        if (samples) {
-            store_samples (decoded_samples, decoded_samples, 0, bps, samples * num_chans);
-            MD5_Update (&md5_context, (unsigned char *) decoded_samples, bps * samples * num_chans);
-            wd->sample_count += samples;
+        if (!ef->frame_offsets || !ef->frame_timestamps) {
+            printf ("store_frame(): can't allocate memory!\n");
+            exit (-1);
         }
-        else if (wd->wv_stream->done || (wd->wvc_stream && wd->wvc_stream->done))
-            break;
-        else
-            wd->num_errors++;
     }
 
-    MD5_Final (wd->md5_decoded, &md5_context);
-    wd->num_errors = WavpackStreamGetNumErrors (wpc);
-    free (decoded_samples);
-    WavpackStreamCloseFile (wpc);
-    pthread_exit (NULL);
-    return NULL;
+    memcpy (ef->data + ef->bytes, data, length);
+    ef->frame_offsets [ef->num_frames] = ef->bytes;
+    ef->frame_timestamps [ef->num_frames++] = ef->total_samples;
+    ef->frame_offsets [ef->num_frames] = ef->bytes += length;
+    ef->total_samples += block_samples;
+    return 1;
 }
 
-// Given a desired average period of corruptions and the length of the input data,
-// calculate the probability that the specified number of hits will occur.
-
-static double hit_probability (int period, int length, int num_hits)
+static int compare_trace_entries (const void *a, const void *b)
 {
-    double probability = pow ((period - 1.0) / period, length - num_hits);
-    int hits;
+    const TraceEntry *ta = a, *tb = b;
 
-    for (hits = 0; hits < num_hits; ++hits)
-        probability *= (double)(length - hits) / (period * (hits + 1));
+    if (ta->arrival_time != tb->arrival_time)
+        return ta->arrival_time < tb->arrival_time ? -1 : 1;
 
-    return probability;
+    return ta->line_number - tb->line_number;
 }
 
-// Fuzzing code. The fuzz "period" is the average distance in bytes between corrupted samples
-// (but of course they are randomly distributed). For each byte selected for corruption, we
-// randomly choose between 1 and 8 bits to toggle. We don't check for duplicate bits or bytes.
-// So that the underlying file is identical regardless of fuzzing, we load and restore the
-// random number generator seed value.
-
-static void fuzz_buffer (void *data, int32_t length, int fuzz_period)
+static int run_jitter_test (char *trace_filename, int wpconfig_flags)
 {
-    uint64_t saved_seed = frandom_get_seed();
+    int num_entries = 0, alloc_entries = 0, res;
+    TraceEntry *entries = NULL;
+    WavpackJitterStats stats;
+    char info [128], line [80];
+    FILE *file;
+
+    if (!(file = fopen (trace_filename, "r"))) {
+        printf ("can't open trace file %s!\n", trace_filename);
+        return 1;
+    }
+
+    while (fgets (line, sizeof (line), file)) {
+        double arrival_ms, offset_ms = 0.0;
+        int sequence;
+
+        if (*line == '#' || sscanf (line, "%d %lf %lf", &sequence, &arrival_ms, &offset_ms) < 2)
+            continue;
+
+        if (num_entries == alloc_entries && !(entries = realloc (entries, (alloc_entries += 1024) * sizeof (*entries)))) {
+            printf ("run_jitter_test(): can't allocate memory!\n");
+            exit (-1);
+        }
+
+        entries [num_entries].line_number = num_entries;
+        entries [num_entries].sequence = sequence;
+        entries [num_entries].offset = floor (offset_ms * SAMPLE_RATE / 1000.0 + 0.5);
+        entries [num_entries++].arrival_time = floor (arrival_ms * SAMPLE_RATE / 1000.0 + 0.5);
+    }
+
+    fclose (file);
+
+    if (!num_entries) {
+        printf ("no frames found in trace file %s!\n", trace_filename);
+        return 1;
+    }
+
+    printf ("jitter test: %d arrivals in trace...", num_entries);
+    fflush (stdout);
+
+    res = play_jitter_trace (entries, num_entries, wpconfig_flags, &stats, info);
+    free (entries);
+
+    printf ("%s\n\n", res ? "fail" : "pass");
+    printf ("%s\n", info);
+    printf ("frames: %u received, %u duplicate, %u late, %u damaged, %u overlapping\n", stats.frames_received,
+        stats.frames_duplicate, stats.frames_late, stats.frames_damaged, stats.frames_overlapping);
+    printf ("periods: %u total, %u underruns, %u stalls, %u skips\n", stats.periods, stats.underruns, stats.stalls, stats.skips);
+    printf ("jitter: %.1f ms, target delay: %.1f ms, current delay: %.1f ms\n", stats.jitter * 1000.0 / SAMPLE_RATE,
+        stats.target_delay * 1000.0 / SAMPLE_RATE, stats.current_delay * 1000.0 / SAMPLE_RATE);
+
+    return res;
+}
+
+// Encode the test audio and play the given trace (which is sorted here) through a jitter buffer,
+// checking every period played. Returns non-zero on failure, and the jitter buffer statistics
+// and a summary of the periods played are returned in "stats" and "info".
+
+static int play_jitter_trace (TraceEntry *entries, int num_entries, int wpconfig_flags, WavpackJitterStats *stats, char *info)
+{
+    int next_entry = 0, complete_periods = 0, partial_periods = 0, errors = 0;
+    int32_t *source, *destin, i, j;
+    struct audio_generator generators [2];
+    WavpackContext *out_wpc, *jitter_wpc;
+    WavpackStreamConfig wpconfig;
+    EncodedFrames frames;
+    char error [80];
+    float *buffer;
+    int64_t now;
+
+    CLEAR (*stats);
+    qsort (entries, num_entries, sizeof (*entries), compare_trace_entries);
+
+    // generate and encode the test audio, keeping a copy of the source for verification
+
+    source = malloc (SAMPLE_RATE * JITTER_SECONDS * JITTER_CHANS * sizeof (*source));
+    destin = malloc (JITTER_PERIOD_SAMPLES * JITTER_CHANS * sizeof (*destin));
+    buffer = malloc (ENCODE_SAMPLES * (JITTER_CHANS + 1) * sizeof (*buffer));
+
+    if (!source || !destin || !buffer) {
+        printf ("run_jitter_test(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    tone_generator_init (&generators [0], SAMPLE_RATE, 200, 2000);
+    noise_generator_init (&generators [1], 12.0);
+
+    CLEAR (wpconfig);
+    CLEAR (frames);
+    wpconfig.bytes_per_sample = 2;
+    wpconfig.bits_per_sample = 16;
+    wpconfig.sample_rate = SAMPLE_RATE;
+    wpconfig.num_channels = JITTER_CHANS;
+    wpconfig.channel_mask = 0x3;
+    wpconfig.block_samples = JITTER_FRAME_SAMPLES;
+    wpconfig.flags = wpconfig_flags;
+
+    out_wpc = WavpackStreamOpenFileOutput (store_frame, &frames, NULL);
+    WavpackStreamSetConfiguration64 (out_wpc, &wpconfig, -1, NULL);
+    WavpackStreamPackInit (out_wpc);
+
+    for (i = 0; i < SAMPLE_RATE * JITTER_SECONDS; i += ENCODE_SAMPLES) {
+        float *mixed = buffer + ENCODE_SAMPLES;
+        int samples = SAMPLE_RATE * JITTER_SECONDS - i < ENCODE_SAMPLES ? SAMPLE_RATE * JITTER_SECONDS - i : ENCODE_SAMPLES;
+
+        memset (mixed, 0, samples * JITTER_CHANS * sizeof (*mixed));
+
+        for (j = 0; j < 2; ++j) {
+            audio_generator_run (&generators [j], buffer, samples);
+            mix_samples_with_gain (mixed, buffer, samples, JITTER_CHANS, j ? 0.05 : 0.3, j ? 0.05 : 0.3);
+            mix_samples_with_gain (mixed + 1, buffer, samples, JITTER_CHANS, j ? 0.08 : 0.2, j ? 0.08 : 0.2);
+        }
+
+        float_to_integer_samples (mixed, samples * JITTER_CHANS, 16);
+        memcpy (source + i * JITTER_CHANS, mixed, samples * JITTER_CHANS * sizeof (*source));
+
+        if (!WavpackStreamPackSamples (out_wpc, (int32_t *) mixed, samples))
+            printf ("...PackSamples() returned FALSE\n");
+    }
+
+    WavpackStreamFlushSamples (out_wpc);
+    WavpackStreamCloseFile (out_wpc);
+    free (buffer);
+
+    // now simulate the network and playout, with one period played per iteration
+
+    jitter_wpc = WavpackStreamOpenJitterBuffer (error, 0, 0, JITTER_PERIOD_SAMPLES, JITTER_PERIOD_SAMPLES * 2, SAMPLE_RATE / 2);
+
+    if (!jitter_wpc) {
+        sprintf (info, "can't open jitter buffer: %s", error);
+        return 1;
+    }
+
+    for (now = 0; now <= entries [num_entries - 1].arrival_time + SAMPLE_RATE; now += JITTER_PERIOD_SAMPLES) {
+        int64_t sample_index;
+        uint32_t samples;
+
+        while (next_entry < num_entries && entries [next_entry].arrival_time <= now) {
+            int sequence = entries [next_entry].sequence;
+
+            if (sequence >= 0 && sequence < frames.num_frames)
+                WavpackStreamJitterPutFrame (jitter_wpc, frames.data + frames.frame_offsets [sequence],
+                    frames.frame_offsets [sequence + 1] - frames.frame_offsets [sequence],
+                    frames.frame_timestamps [sequence] + entries [next_entry].offset, entries [next_entry].arrival_time);
+
+            next_entry++;
+        }
+
+        if (!WavpackStreamGetNumChannels (jitter_wpc))
+            continue;
+
+        samples = WavpackStreamJitterGetPeriod (jitter_wpc, destin, now);
+        sample_index = WavpackStreamGetSampleIndex64 (jitter_wpc) - JITTER_PERIOD_SAMPLES;
+
+        if (samples == JITTER_PERIOD_SAMPLES)
+            complete_periods++;
+        else if (samples)
+            partial_periods++;
+        else
+            continue;
+
+        // every sample must either match the source or be silence (for missing audio)
+
+        for (i = 0; i < JITTER_PERIOD_SAMPLES; ++i) {
+            int32_t *sp = source + (sample_index + i) * JITTER_CHANS, *dp = destin + i * JITTER_CHANS;
+
+            if (sample_index + i >= frames.total_samples || (memcmp (sp, dp, JITTER_CHANS * sizeof (*dp)) && (dp [0] || dp [1]))) {
+                errors++;
+                break;
+            }
+        }
+
+        if (next_entry == num_entries && sample_index + JITTER_PERIOD_SAMPLES >= frames.total_samples)
+            break;
+    }
+
+    WavpackStreamGetJitterStats (jitter_wpc, stats);
+    WavpackStreamCloseFile (jitter_wpc);
+    free (frames.frame_timestamps);
+    free (frames.frame_offsets);
+    free (frames.data);
+    free (source);
+    free (destin);
+
+    sprintf (info, "%d frames, periods played: %d complete, %d partial, %d mismatched",
+        frames.num_frames, complete_periods, partial_periods, errors);
+
+    return errors || !complete_periods;
+}
+
+// Thread / function that opens a virtual WavPack file, decodes it and calculates the MD5 hash of the
+// decoded audio data.
+
+#define DECODE_SAMPLES 1000
+
+static void *decode_thread (void *threadid)
+{
+    WavpackDecoder *wd = (WavpackDecoder *) threadid;
+    char error [80];
+    WavpackContext *wpc;
+    int32_t *decoded_samples, num_chans, bps;
+    MD5_CTX md5_context;
+
+    while (1) {
+        wpc = WavpackStreamOpenFileInputEx (&freader, wd->wv_stream, wd->wvc_stream, error, OPEN_DSD_NATIVE, 0);
+
+        if (wpc)
+            break;
+
+        wd->num_errors++;
+
+        if (wd->wv_stream->done || (wd->wvc_stream && wd->wvc_stream->done))
+            break;
+    }
+
+    if (!wpc)
+        pthread_exit (NULL);
+
+    MD5_Init (&md5_context);
+    num_chans = WavpackStreamGetNumChannels (wpc);
+    bps = WavpackStreamGetBytesPerSample (wpc);
+
+    decoded_samples = malloc (sizeof (int32_t) * DECODE_SAMPLES * num_chans);
+
+    if (!decoded_samples) {
+        printf ("decode_thread(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    while (1) {
+        int64_t start_time = (perf_bound || timing) ? thread_cpu_time_ns () : 0;
+        int samples = WavpackStreamUnpackSamples (wpc, decoded_samples, DECODE_SAMPLES);
+
+        if (perf_bound || timing) {
+            int64_t call_time = thread_cpu_time_ns () - start_time;
+
+            if (call_time > wd->worst_time)
+                wd->worst_time = call_time;
+
+            wd->decode_time += call_time;
+            wd->decode_calls++;
+        }
+
+        if (samples) {
+            store_samples (decoded_samples, decoded_samples, 0, bps, samples * num_chans);
+            MD5_Update (&md5_context, (unsigned char *) decoded_samples, bps * samples * num_chans);
+            wd->sample_count += samples;
+        }
+        else if (wd->wv_stream->done || (wd->wvc_stream && wd->wvc_stream->done))
+            break;
+        else
+            wd->num_errors++;
+    }
+
+    MD5_Final (wd->md5_decoded, &md5_context);
+    wd->num_errors = WavpackStreamGetNumErrors (wpc);
+    free (decoded_samples);
+    WavpackStreamCloseFile (wpc);
+    pthread_exit (NULL);
+    return NULL;
+}
+
+// API tests. These exercise the parts of the library that the main test suite doesn't reach
+// (because it only uses the basic encode and decode calls) with short streams that are encoded
+// completely into memory before being decoded. Each test returns zero for pass and can put a
+// short note (e.g., a timing) in "info", which is displayed with the result.
+
+#define API_TEST_SECONDS 10
+
+typedef struct {
+    unsigned char *data;
+    int32_t bytes, alloc, position, push_back;
+    int seekable;
+} MemoryFile;
+
+static int api_test_push_decoder (int wpconfig_flags, char *info);
+static int api_test_jitter_buffer (int wpconfig_flags, char *info);
+static int api_test_shared_pool (int wpconfig_flags, char *info);
+static int api_test_pool_destroyed_early (int wpconfig_flags, char *info);
+static int api_test_executor_pool (int wpconfig_flags, char *info);
+static int api_test_batch_lossless (int wpconfig_flags, char *info);
+static int api_test_batch_hybrid (int wpconfig_flags, char *info);
+static int api_test_compact_lossless (int wpconfig_flags, char *info);
+static int api_test_compact_wvc (int wpconfig_flags, char *info);
+static int api_test_state_lossless (int wpconfig_flags, char *info);
+static int api_test_state_wvc (int wpconfig_flags, char *info);
+static int api_test_speed_governor (int wpconfig_flags, char *info);
+static int api_test_simulcast (int wpconfig_flags, char *info);
+static int api_test_rate_floor (int wpconfig_flags, char *info);
+static int api_test_rate_control (int wpconfig_flags, char *info);
+static int api_test_transrate (int wpconfig_flags, char *info);
+static int api_test_decode_speed (int wpconfig_flags, char *info);
+
+static const struct {
+    const char *name;
+    int (*function) (int wpconfig_flags, char *info);
+} api_tests [] = {
+    { "push decoder, random chunks", api_test_push_decoder },
+    { "jitter buffer, generated trace", api_test_jitter_buffer },
+    { "thread pool shared by 4 decoders", api_test_shared_pool },
+    { "thread pool destroyed before decoders closed", api_test_pool_destroyed_early },
+    { "executor pool shared by 4 decoders", api_test_executor_pool },
+    { "batch decode of 16 mono streams, lossless", api_test_batch_lossless },
+    { "batch decode of 16 mono streams, hybrid lossy", api_test_batch_hybrid },
+    { "compact decoding, 5.1 lossless", api_test_compact_lossless },
+    { "compact decoding, 5.1 hybrid with correction", api_test_compact_wvc },
+    { "encoder state save/restore/clone, lossless", api_test_state_lossless },
+    { "encoder state save/restore/clone, hybrid with correction", api_test_state_wvc },
+    { "speed governor, lossless -hx3", api_test_speed_governor },
+    { "simulcast, leader and 2 renditions", api_test_simulcast },
+    { "rate cap minimum, stereo and 4 channels", api_test_rate_floor },
+    { "rate control, stereo hybrid with correction", api_test_rate_control },
+    { "transrate lossless -hx2 to hybrid with correction", api_test_transrate },
+    { "decode speed, lossless vs hybrid", api_test_decode_speed },
+};
+
+static int run_api_tests (int wpconfig_flags)
+{
+    int failures = 0, i;
+
+    printf ("\n\n                             ****** API tests ******\n\n");
+
+    for (i = 0; i < (int) (sizeof (api_tests) / sizeof (api_tests [0])); ++i) {
+        char info [128] = "";
+        int res;
+
+        printf ("%s...", api_tests [i].name);
+        fflush (stdout);
+        frandom_set_seed (RANDOM_SEED ^ ((i + 1) * 0x9e3779b97f4a7c15ULL));
+        res = api_tests [i].function (wpconfig_flags, info);
+
+        if (res)
+            failures++;
+
+        printf ("%s%s%s%s\n", res ? "fail" : "pass", *info ? " (" : "", info, *info ? ")" : "");
+    }
+
+    return failures;
+}
+
+static int write_memory (void *id, void *data, int32_t length)
+{
+    MemoryFile *mf = (MemoryFile *) id;
+
+    if (mf->bytes + length > mf->alloc && !(mf->data = realloc (mf->data, mf->alloc = (mf->bytes + length) * 2))) {
+        printf ("write_memory(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    memcpy (mf->data + mf->bytes, data, length);
+    mf->bytes += length;
+    return 1;
+}
+
+static int32_t mem_read_bytes (void *id, void *data, int32_t bcount)
+{
+    MemoryFile *mf = (MemoryFile *) id;
+    unsigned char *data_ptr = data;
+
+    if (bcount && mf->push_back) {
+        *data_ptr++ = mf->push_back;
+        mf->push_back = 0;
+        bcount--;
+    }
+
+    if (bcount > mf->bytes - mf->position)
+        bcount = mf->bytes - mf->position;
+
+    memcpy (data_ptr, mf->data + mf->position, bcount);
+    mf->position += bcount;
+    return data_ptr + bcount - (unsigned char *) data;
+}
+
+static uint32_t mem_get_pos (void *id)
+{
+    MemoryFile *mf = (MemoryFile *) id;
+
+    return mf->seekable ? (uint32_t) (mf->position - (mf->push_back ? 1 : 0)) : (uint32_t) -1;
+}
+
+static int mem_set_pos_abs (void *id, uint32_t pos)
+{
+    MemoryFile *mf = (MemoryFile *) id;
+
+    if (!mf->seekable || pos > (uint32_t) mf->bytes)
+        return -1;
+
+    mf->position = pos;
+    mf->push_back = 0;
+    return 0;
+}
+
+static int mem_set_pos_rel (void *id, int32_t delta, int mode)
+{
+    MemoryFile *mf = (MemoryFile *) id;
+    int64_t pos = mode == SEEK_SET ? 0 : mode == SEEK_END ? mf->bytes : mf->position - (mf->push_back ? 1 : 0);
+
+    if (!mf->seekable || pos + delta < 0 || pos + delta > mf->bytes)
+        return -1;
+
+    mf->position = (int32_t) (pos + delta);
+    mf->push_back = 0;
+    return 0;
+}
+
+static int mem_push_back_byte (void *id, int c)
+{
+    MemoryFile *mf = (MemoryFile *) id;
+
+    if (!mf->push_back)
+        return mf->push_back = c;
+    else
+        return EOF;
+}
+
+static uint32_t mem_get_length (void *id)
+{
+    MemoryFile *mf = (MemoryFile *) id;
+
+    return mf->seekable ? (uint32_t) mf->bytes : 0;
+}
+
+static int mem_can_seek (void *id)
+{
+    MemoryFile *mf = (MemoryFile *) id;
+
+    return mf->seekable;
+}
+
+static WavpackReader mreader = {
+    mem_read_bytes, mem_get_pos, mem_set_pos_abs, mem_set_pos_rel, mem_push_back_byte, mem_get_length, mem_can_seek,
+};
+
+// Generate the specified number of samples of integer test audio (a tone and noise mixed with
+// different gains in each channel). The returned buffer must be freed by the caller.
+
+static int32_t *generate_test_audio (int num_samples, int num_chans, int bits)
+{
+    float *buffer = malloc (ENCODE_SAMPLES * (num_chans + 1) * sizeof (*buffer));
+    int32_t *samples = malloc (num_samples * num_chans * sizeof (*samples));
+    struct audio_generator generators [2];
+    int i, j, k;
+
+    if (!buffer || !samples) {
+        printf ("generate_test_audio(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    tone_generator_init (&generators [0], SAMPLE_RATE, 200, 2000);
+    noise_generator_init (&generators [1], 12.0);
+
+    for (i = 0; i < num_samples; i += ENCODE_SAMPLES) {
+        float *mixed = buffer + ENCODE_SAMPLES;
+        int count = num_samples - i < ENCODE_SAMPLES ? num_samples - i : ENCODE_SAMPLES;
+
+        memset (mixed, 0, count * num_chans * sizeof (*mixed));
+
+        for (j = 0; j < 2; ++j) {
+            audio_generator_run (&generators [j], buffer, count);
+
+            for (k = 0; k < num_chans; ++k) {
+                float gain = j ? 0.04 + k * 0.01 : 0.3 - k * 0.02;
+
+                mix_samples_with_gain (mixed + k, buffer, count, num_chans, gain, gain);
+            }
+        }
+
+        float_to_integer_samples (mixed, count * num_chans, bits);
+        memcpy (samples + i * num_chans, mixed, count * num_chans * sizeof (*samples));
+    }
+
+    free (buffer);
+    return samples;
+}
+
+// Open an encoder writing to the specified memory file(s) and initialize it for the given
+// configuration. The caller packs the audio (with pack_test_audio() or otherwise) and closes it.
+
+static WavpackContext *open_test_encoder (WavpackStreamConfig *config, int64_t num_samples, MemoryFile *wv, MemoryFile *wvc)
+{
+    WavpackContext *wpc = WavpackStreamOpenFileOutput (write_memory, wv, wvc);
+
+    if (!WavpackStreamSetConfiguration64 (wpc, config, num_samples, NULL) || !WavpackStreamPackInit (wpc)) {
+        printf ("open_test_encoder(): %s\n", WavpackStreamGetErrorMessage (wpc));
+        WavpackStreamCloseFile (wpc);
+        return NULL;
+    }
+
+    return wpc;
+}
+
+// Pack the specified audio (in ENCODE_SAMPLES pieces, like an application would) and flush.
+
+static int pack_test_audio (WavpackContext *wpc, int32_t *samples, int num_samples, int num_chans)
+{
+    int i;
+
+    for (i = 0; i < num_samples; i += ENCODE_SAMPLES) {
+        int count = num_samples - i < ENCODE_SAMPLES ? num_samples - i : ENCODE_SAMPLES;
+
+        if (!WavpackStreamPackSamples (wpc, samples + i * num_chans, count))
+            return FALSE;
+    }
+
+    return WavpackStreamFlushSamples (wpc);
+}
+
+// Decode everything remaining in the specified context and compare it with the source audio.
+// If "lossless" is false the audio is not compared, but the decode must still be clean and
+// return the right number of samples. Returns the number of problems found.
+
+static int verify_test_decode (WavpackContext *wpc, int32_t *source, int num_samples, int num_chans, int lossless)
+{
+    int32_t *decoded = malloc (DECODE_SAMPLES * num_chans * sizeof (*decoded));
+    int total_samples = 0, mismatches = 0;
+    uint32_t samples;
+
+    if (!decoded) {
+        printf ("verify_test_decode(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    while ((samples = WavpackStreamUnpackSamples (wpc, decoded, DECODE_SAMPLES))) {
+        if (total_samples + (int) samples > num_samples) {
+            mismatches++;
+            break;
+        }
+
+        if (lossless && memcmp (decoded, source + total_samples * num_chans, samples * num_chans * sizeof (*decoded)))
+            mismatches++;
+
+        total_samples += samples;
+    }
+
+    free (decoded);
+    return mismatches + WavpackStreamGetNumErrors (wpc) + (total_samples != num_samples);
+}
+
+// Test the push decoder by feeding it a stream in random-sized pieces (from a single byte to
+// several blocks, so headers are split everywhere) and unpacking at random points in between.
+// Ten channels with no channel mask are used so that there are more than 8 streams per frame,
+// which the decoder does not know until it has the first complete frame.
+
+#define PUSH_TEST_CHANS 10
+
+static int api_test_push_decoder (int wpconfig_flags, char *info)
+{
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, samples_unpacked = 0, pushes = 0, mismatches = 0;
+    int32_t *source = generate_test_audio (num_samples, PUSH_TEST_CHANS, 16), *decoded, offset = 0;
+    WavpackContext *wpc;
+    WavpackStreamConfig config;
+    MemoryFile wv;
+    char error [80];
+
+    CLEAR (config);
+    CLEAR (wv);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = PUSH_TEST_CHANS;
+    config.flags = wpconfig_flags;
+
+    if (!(wpc = open_test_encoder (&config, num_samples, &wv, NULL)) || !pack_test_audio (wpc, source, num_samples, PUSH_TEST_CHANS)) {
+        free (source);
+        return 1;
+    }
+
+    WavpackStreamCloseFile (wpc);
+
+    if (!(wpc = WavpackStreamOpenPushDecoder (error, 0, 0))) {
+        printf ("can't open push decoder: %s\n", error);
+        free (source);
+        free (wv.data);
+        return 1;
+    }
+
+    decoded = malloc (DECODE_SAMPLES * PUSH_TEST_CHANS * sizeof (*decoded));
+
+    while (1) {
+        int32_t bcount = (int32_t) (pow (frandom (), 4.0) * 20000.0) + 1;
+        uint32_t samples;
+
+        if (bcount > wv.bytes - offset)
+            bcount = wv.bytes - offset;
+
+        if (bcount && !WavpackStreamPushData (wpc, wv.data + offset, bcount)) {
+            mismatches++;
+            break;
+        }
+
+        offset += bcount;
+        pushes++;
+
+        if (offset < wv.bytes && frandom () < 0.5)
+            continue;
+
+        while ((samples = WavpackStreamUnpackSamples (wpc, decoded, DECODE_SAMPLES))) {
+            if (samples_unpacked + (int) samples > num_samples ||
+                memcmp (decoded, source + samples_unpacked * PUSH_TEST_CHANS, samples * PUSH_TEST_CHANS * sizeof (*decoded)))
+                    mismatches++;
+
+            samples_unpacked += samples;
+
+            if (offset < wv.bytes && frandom () < 0.5)
+                break;
+        }
+
+        if (offset == wv.bytes && !samples)
+            break;
+    }
+
+    mismatches += WavpackStreamGetNumErrors (wpc) + (samples_unpacked != num_samples);
+    sprintf (info, "%d pushes, %d samples", pushes, samples_unpacked);
+    WavpackStreamCloseFile (wpc);
+    free (decoded);
+    free (source);
+    free (wv.data);
+    return mismatches;
+}
+
+// Run the jitter buffer test with a generated trace. The frames are sent every 20 ms and arrive
+// after a random delay (mostly small, with occasional spikes that reorder them), and some are
+// lost or duplicated. Some are also resent with their timestamp moved back 10 ms (after the
+// real frame has arrived) and these must all be rejected because they overlap.
+
+static int api_test_jitter_buffer (int wpconfig_flags, char *info)
+{
+    int num_frames = JITTER_SECONDS * SAMPLE_RATE / JITTER_FRAME_SAMPLES, num_entries = 0, overlapping = 0, res, i;
+    TraceEntry *entries = malloc (num_frames * 3 * sizeof (*entries));
+    WavpackJitterStats stats;
+
+    if (!entries) {
+        printf ("api_test_jitter_buffer(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    for (i = 0; i < num_frames; ++i) {
+        double delay_ms = 30.0 + pow (frandom (), 3.0) * 40.0 + (frandom () < 0.02 ? 150.0 : 0.0);
+        int64_t arrival_time = floor ((i * 20.0 + delay_ms) * SAMPLE_RATE / 1000.0);
+
+        if (frandom () < 0.02)                  // lost
+            continue;
+
+        entries [num_entries].sequence = i;
+        entries [num_entries].offset = 0;
+        entries [num_entries].line_number = num_entries;
+        entries [num_entries++].arrival_time = arrival_time;
+
+        if (frandom () < 0.03) {                // duplicate
+            entries [num_entries] = entries [num_entries - 1];
+            entries [num_entries].line_number = num_entries;
+            entries [num_entries++].arrival_time += floor (frandom () * 60.0 * SAMPLE_RATE / 1000.0);
+        }
+
+        if (i && frandom () < 0.03) {           // overlapping
+            entries [num_entries] = entries [num_entries - 1];
+            entries [num_entries].line_number = num_entries;
+            entries [num_entries].offset = -JITTER_FRAME_SAMPLES / 2;
+            entries [num_entries++].arrival_time += SAMPLE_RATE / 200;
+            overlapping++;
+        }
+    }
+
+    res = play_jitter_trace (entries, num_entries, wpconfig_flags, &stats, info);
+    free (entries);
+
+    // a resent frame is either overlapping or late (if the real one has already been played)
+
+    if (!res && stats.frames_overlapping + stats.frames_late < (uint32_t) overlapping)
+        res = 1;
+
+    sprintf (info + strlen (info), ", %u overlapping", stats.frames_overlapping);
+    return res;
+}
+
+// Decode several streams at once (a DECODE_SAMPLES piece of each in turn) through a thread pool
+// attached to all of them, checking all the audio. If "destroy_early" is set, the pool is destroyed
+// halfway through, which must be deferred until the last of the decoders is closed.
+
+#define POOL_TEST_STREAMS 4
+
+static int decode_with_pool (WavpackThreadPool *pool, int wpconfig_flags, int destroy_early, char *info)
+{
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, samples_done [POOL_TEST_STREAMS], mismatches = 0, active, i;
+    int32_t *source [POOL_TEST_STREAMS], *decoded = malloc (DECODE_SAMPLES * 2 * sizeof (*decoded));
+    WavpackContext *wpcs [POOL_TEST_STREAMS];
+    MemoryFile wv [POOL_TEST_STREAMS];
+    WavpackStreamConfig config;
+    char error [80];
+
+    if (!pool) {
+        strcpy (info, "can't create pool, threads not configured?");
+        free (decoded);
+        return 1;
+    }
+
+    CLEAR (config);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = 2;
+    config.channel_mask = 0x3;
+    config.block_samples = SAMPLE_RATE / 50;
+    config.flags = wpconfig_flags;
+
+    for (i = 0; i < POOL_TEST_STREAMS; ++i) {
+        WavpackContext *wpc;
+
+        CLEAR (wv [i]);
+        source [i] = generate_test_audio (num_samples, 2, 16);
+
+        if (!(wpc = open_test_encoder (&config, num_samples, &wv [i], NULL)) || !pack_test_audio (wpc, source [i], num_samples, 2))
+            mismatches++;
+
+        WavpackStreamCloseFile (wpc);
+        wpcs [i] = WavpackStreamOpenFileInputEx (&mreader, &wv [i], NULL, error, 0, 0);
+        samples_done [i] = 0;
+
+        if (!wpcs [i] || !WavpackStreamAttachThreadPool (wpcs [i], pool, 0)) {
+            strcpy (info, wpcs [i] ? WavpackStreamGetErrorMessage (wpcs [i]) : error);
+            mismatches++;
+        }
+    }
+
+    for (active = mismatches ? 0 : POOL_TEST_STREAMS; active;) {
+        for (active = i = 0; i < POOL_TEST_STREAMS; ++i) {
+            uint32_t samples = WavpackStreamUnpackSamples (wpcs [i], decoded, DECODE_SAMPLES);
+
+            if (samples_done [i] + (int) samples > num_samples ||
+                memcmp (decoded, source [i] + samples_done [i] * 2, samples * 2 * sizeof (*decoded)))
+                    mismatches++;
+            else if (samples) {
+                samples_done [i] += samples;
+                active++;
+            }
+        }
+
+        if (destroy_early && samples_done [0] >= num_samples / 2) {
+            WavpackStreamDestroyThreadPool (pool);
+            destroy_early = 0;
+        }
+    }
+
+    for (i = 0; i < POOL_TEST_STREAMS; ++i) {
+        if (wpcs [i]) {
+            mismatches += WavpackStreamGetNumErrors (wpcs [i]) + (samples_done [i] != num_samples);
+            WavpackStreamCloseFile (wpcs [i]);
+        }
+
+        free (source [i]);
+        free (wv [i].data);
+    }
+
+    if (destroy_early)
+        WavpackStreamDestroyThreadPool (pool);
+
+    if (!*info)
+        sprintf (info, "%d streams, %d samples each", POOL_TEST_STREAMS, samples_done [0]);
+
+    free (decoded);
+    return mismatches;
+}
+
+static int api_test_shared_pool (int wpconfig_flags, char *info)
+{
+    WavpackThreadPool *pool = WavpackStreamCreateThreadPool (3);
+    int res = decode_with_pool (pool, wpconfig_flags, 0, info);
+
+    WavpackStreamDestroyThreadPool (pool);
+    return res;
+}
+
+static int api_test_pool_destroyed_early (int wpconfig_flags, char *info)
+{
+    return decode_with_pool (WavpackStreamCreateThreadPool (3), wpconfig_flags, 1, info);
+}
+
+// A minimal executor for the executor pool test, which simply runs each task on a new detached
+// thread (like an application handing tasks to its own runtime). If a thread can't be created,
+// the task is rejected and the library runs it directly.
+
+typedef struct {
+    WavpackTaskFunction function;
+    void *arg;
+} ExecutorTask;
+
+static void *executor_thread (void *arg)
+{
+    ExecutorTask task = * (ExecutorTask *) arg;
+
+    free (arg);
+    task.function (task.arg);
+    return NULL;
+}
+
+static int test_executor (void *executor_id, WavpackTaskFunction function, void *arg)
+{
+    ExecutorTask *task = malloc (sizeof (ExecutorTask));
+    pthread_attr_t attr;
+    pthread_t thread;
+    int res;
+
+    if (!task)
+        return 0;
+
+    task->function = function;
+    task->arg = arg;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    res = pthread_create (&thread, &attr, executor_thread, task);
+    pthread_attr_destroy (&attr);
+
+    if (res) {
+        free (task);
+        return 0;
+    }
+
+    (* (int *) executor_id)++;
+    return 1;
+}
+
+static int api_test_executor_pool (int wpconfig_flags, char *info)
+{
+    int tasks_executed = 0, res;
+    WavpackThreadPool *pool = WavpackStreamCreateExecutorPool (test_executor, &tasks_executed, 3);
+
+    res = decode_with_pool (pool, wpconfig_flags, 1, info);
+
+    if (!res)
+        sprintf (info + strlen (info), ", %d tasks executed", tasks_executed);
+
+    return res || !tasks_executed;
+}
+
+// Decode a set of mono streams both with WavpackStreamUnpackSamplesBatch() and with a separate
+// WavpackStreamUnpackSamples() call for each one, which must give identical results (and, for
+// lossless, the source audio). Most calls are for a whole block so the streams are batched, but
+// every few calls one and a half blocks are requested, so that they must fall back (and then the
+// rest of the block is requested). The CPU time of each method is returned as the speed of the
+// batch relative to the separate calls.
+
+#define BATCH_TEST_STREAMS 16
+#define BATCH_TEST_BLOCK (SAMPLE_RATE / 50)
+
+static int batch_test (int wpconfig_flags, char *info)
+{
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, samples_done = 0, calls = 0, batch_calls = 0, batched = 0, mismatches = 0, i;
+    WavpackContext *batch_wpcs [BATCH_TEST_STREAMS], *single_wpcs [BATCH_TEST_STREAMS];
+    int32_t *source [BATCH_TEST_STREAMS], *batch_buffers [BATCH_TEST_STREAMS], *single_buffer;
+    uint32_t samples_unpacked [BATCH_TEST_STREAMS];
+    int64_t batch_time = 0, single_time = 0;
+    MemoryFile wv [BATCH_TEST_STREAMS], copies [BATCH_TEST_STREAMS];
+    WavpackStreamConfig config;
+    char error [80];
+
+    CLEAR (config);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = 1;
+    config.block_samples = BATCH_TEST_BLOCK;
+    config.bitrate = 3.0;
+    config.flags = wpconfig_flags;
+    single_buffer = malloc (BATCH_TEST_BLOCK * 2 * sizeof (int32_t));
+
+    for (i = 0; i < BATCH_TEST_STREAMS; ++i) {
+        WavpackContext *wpc;
+
+        CLEAR (wv [i]);
+        source [i] = generate_test_audio (num_samples, 1, 16);
+        batch_buffers [i] = malloc (BATCH_TEST_BLOCK * 2 * sizeof (int32_t));
+
+        if (!(wpc = open_test_encoder (&config, num_samples, &wv [i], NULL)) || !pack_test_audio (wpc, source [i], num_samples, 1))
+            mismatches++;
+
+        WavpackStreamCloseFile (wpc);
+        copies [i] = wv [i];        // the other decoder reads the same data with its own position
+        batch_wpcs [i] = WavpackStreamOpenFileInputEx (&mreader, &wv [i], NULL, error, 0, 0);
+        single_wpcs [i] = WavpackStreamOpenFileInputEx (&mreader, &copies [i], NULL, error, 0, 0);
+
+        if (!batch_wpcs [i] || !single_wpcs [i])
+            mismatches++;
+    }
+
+    while (!mismatches && samples_done < num_samples) {
+        int offset = samples_done % BATCH_TEST_BLOCK;
+        uint32_t samples = offset ? BATCH_TEST_BLOCK - offset : ++calls % 7 ? BATCH_TEST_BLOCK : BATCH_TEST_BLOCK * 3 / 2 + calls % 5;
+        int64_t start_time = thread_cpu_time_ns ();
+
+        batched += WavpackStreamUnpackSamplesBatch (batch_wpcs, batch_buffers, samples_unpacked, BATCH_TEST_STREAMS, samples);
+        batch_calls++;
+        batch_time += thread_cpu_time_ns () - start_time;
+
+        for (i = 0; i < BATCH_TEST_STREAMS; ++i) {
+            uint32_t single_samples;
+
+            start_time = thread_cpu_time_ns ();
+            single_samples = WavpackStreamUnpackSamples (single_wpcs [i], single_buffer, samples);
+            single_time += thread_cpu_time_ns () - start_time;
+
+            if (single_samples != samples_unpacked [i] || memcmp (single_buffer, batch_buffers [i], single_samples * sizeof (int32_t)) ||
+                (!(wpconfig_flags & CONFIG_HYBRID_FLAG) && memcmp (single_buffer, source [i] + samples_done, single_samples * sizeof (int32_t))))
+                    mismatches++;
+        }
+
+        if (!samples_unpacked [0])
+            break;
+
+        samples_done += samples_unpacked [0];
+    }
+
+    for (i = 0; i < BATCH_TEST_STREAMS; ++i) {
+        if (batch_wpcs [i]) {
+            mismatches += WavpackStreamGetNumErrors (batch_wpcs [i]);
+            WavpackStreamCloseFile (batch_wpcs [i]);
+        }
+
+        if (single_wpcs [i]) {
+            mismatches += WavpackStreamGetNumErrors (single_wpcs [i]);
+            WavpackStreamCloseFile (single_wpcs [i]);
+        }
+
+        free (batch_buffers [i]);
+        free (source [i]);
+        free (wv [i].data);
+    }
+
+    free (single_buffer);
+    sprintf (info, "%d of %d calls batched, batch speed %.2fx", batched / BATCH_TEST_STREAMS, batch_calls,
+        batch_time ? (double) single_time / batch_time : 0.0);
+
+    return mismatches + (samples_done != num_samples);
+}
+
+static int api_test_batch_lossless (int wpconfig_flags, char *info)
+{
+    return batch_test (wpconfig_flags, info);
+}
+
+static int api_test_batch_hybrid (int wpconfig_flags, char *info)
+{
+    return batch_test (wpconfig_flags | CONFIG_HYBRID_FLAG, info);
+}
+
+// Decode a 24-bit 5.1 stream with a regular context and an OPEN_COMPACT context in lockstep,
+// checking the audio from both and comparing WavpackStreamGetMemoryUsage() for each between
+// calls (i.e., while they are idle, which is where a compact context should save the most).
+
+#define COMPACT_TEST_CHANS 6
+
+static int compact_test (int wpconfig_flags, char *info)
+{
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, samples_done = 0, mismatches = 0, open_flags = 0;
+    int32_t *source = generate_test_audio (num_samples, COMPACT_TEST_CHANS, 24), *decoded [2];
+    int64_t usage [2], max_usage [2] = { 0, 0 };
+    MemoryFile wv [2], wvc [2];
+    WavpackContext *wpcs [2];
+    WavpackStreamConfig config;
+    char error [80];
+    int i;
+
+    CLEAR (config);
+    CLEAR (wv [0]);
+    CLEAR (wvc [0]);
+    config.bytes_per_sample = 3;
+    config.bits_per_sample = 24;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = COMPACT_TEST_CHANS;
+    config.channel_mask = 0x3F;
+    config.bitrate = 3.0;
+    config.flags = wpconfig_flags;
+
+    if (!(wpcs [0] = open_test_encoder (&config, num_samples, &wv [0], (wpconfig_flags & CONFIG_CREATE_WVC) ? &wvc [0] : NULL)) ||
+        !pack_test_audio (wpcs [0], source, num_samples, COMPACT_TEST_CHANS)) {
+            free (source);
+            return 1;
+    }
+
+    WavpackStreamCloseFile (wpcs [0]);
+
+    if (wpconfig_flags & CONFIG_CREATE_WVC)
+        open_flags |= OPEN_WVC;
+
+    wv [1] = wv [0];            // the two decoders read the same data with their own positions
+    wvc [1] = wvc [0];
+
+    for (i = 0; i < 2; ++i) {
+        decoded [i] = malloc (DECODE_SAMPLES * COMPACT_TEST_CHANS * sizeof (int32_t));
+        wpcs [i] = WavpackStreamOpenFileInputEx (&mreader, &wv [i], (open_flags & OPEN_WVC) ? &wvc [i] : NULL, error,
+            open_flags | (i ? OPEN_COMPACT : 0), 0);
+
+        if (!wpcs [i]) {
+            strcpy (info, error);
+            mismatches++;
+        }
+    }
+
+    while (!mismatches && samples_done < num_samples) {
+        uint32_t samples [2];
+
+        for (i = 0; i < 2; ++i) {
+            samples [i] = WavpackStreamUnpackSamples (wpcs [i], decoded [i], DECODE_SAMPLES);
+
+            if ((usage [i] = WavpackStreamGetMemoryUsage (wpcs [i])) > max_usage [i])
+                max_usage [i] = usage [i];
+        }
+
+        if (!samples [0])
+            break;
+
+        if (samples [0] != samples [1] || samples_done + samples [0] > (uint32_t) num_samples ||
+            memcmp (decoded [0], source + samples_done * COMPACT_TEST_CHANS, samples [0] * COMPACT_TEST_CHANS * sizeof (int32_t)) ||
+            memcmp (decoded [1], decoded [0], samples [0] * COMPACT_TEST_CHANS * sizeof (int32_t)) || usage [1] <= 0 || usage [1] >= usage [0])
+                mismatches++;
+
+        samples_done += samples [0];
+    }
+
+    for (i = 0; i < 2; ++i) {
+        if (wpcs [i]) {
+            mismatches += WavpackStreamGetNumErrors (wpcs [i]);
+            WavpackStreamCloseFile (wpcs [i]);
+        }
+
+        free (decoded [i]);
+    }
+
+    if (!*info)
+        sprintf (info, "peak memory usage %.1f KB regular, %.1f KB compact", max_usage [0] / 1024.0, max_usage [1] / 1024.0);
+
+    free (source);
+    free (wv [0].data);
+    free (wvc [0].data);
+    return mismatches + (samples_done != num_samples);
+}
+
+static int api_test_compact_lossless (int wpconfig_flags, char *info)
+{
+    return compact_test (wpconfig_flags, info);
+}
+
+static int api_test_compact_wvc (int wpconfig_flags, char *info)
+{
+    return compact_test (wpconfig_flags | CONFIG_HYBRID_FLAG | CONFIG_CREATE_WVC, info);
+}
+
+// Test encoder snapshots. After encoding the first few seconds of a stream we save the state and
+// encode the next few seconds. Then the same audio is encoded again three ways, and each must
+// produce exactly the same blocks: by the original context after restoring the snapshot, by a
+// fresh context after restoring the snapshot, and by a clone made at the same point. Finally the
+// original finishes the stream, which must decode correctly. The snapshot is also saved twice
+// into buffers with different contents, which must come out identical.
+
+#define STATE_TEST_CHANS 2
+#define STATE_SAVE_SECONDS 3
+
+static int segment_matches (MemoryFile *mf, int32_t start, unsigned char *segment, int32_t length)
+{
+    return mf->bytes - start == length && !memcmp (mf->data + start, segment, length);
+}
+
+static int state_test (int wpconfig_flags, char *info)
+{
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, save_point = SAMPLE_RATE * STATE_SAVE_SECONDS, mismatches = 0, i;
+    int32_t *source = generate_test_audio (num_samples, STATE_TEST_CHANS, 16), wv_start, wvc_start, wv_length, wvc_length;
+    int wvc = wpconfig_flags & CONFIG_CREATE_WVC;
+    unsigned char *state [2] = { NULL, NULL }, *wv_segment, *wvc_segment;
+    MemoryFile wv, wvc_file, other_wv, other_wvc;
+    WavpackContext *wpc, *other_wpc;
+    WavpackStreamConfig config;
+    uint32_t state_bytes;
+    char error [80];
+
+    CLEAR (config);
+    CLEAR (wv);
+    CLEAR (wvc_file);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = STATE_TEST_CHANS;
+    config.channel_mask = 0x3;
+    config.bitrate = 3.0;
+    config.xmode = 2;
+    config.flags = wpconfig_flags | CONFIG_HIGH_FLAG | CONFIG_EXTRA_MODE;
+
+    if (!(wpc = open_test_encoder (&config, num_samples, &wv, wvc ? &wvc_file : NULL)) ||
+        !WavpackStreamPackSamples (wpc, source, save_point) || !(state_bytes = WavpackStreamSaveState (wpc, NULL, 0))) {
+            free (source);
+            return 1;
+    }
+
+    for (i = 0; i < 2; ++i) {
+        state [i] = malloc (state_bytes);
+        memset (state [i], i ? 0xff : 0, state_bytes);
+
+        if (WavpackStreamSaveState (wpc, state [i], state_bytes) != state_bytes)
+            mismatches++;
+    }
+
+    if (memcmp (state [0], state [1], state_bytes))
+        mismatches++;
+
+    // encode the next few seconds (the blocks will not include the last partial block)
+
+    wv_start = wv.bytes;
+    wvc_start = wvc_file.bytes;
+
+    if (!WavpackStreamPackSamples (wpc, source + save_point * STATE_TEST_CHANS, save_point))
+        mismatches++;
+
+    wv_length = wv.bytes - wv_start;
+    wvc_length = wvc_file.bytes - wvc_start;
+    wv_segment = malloc (wv_length);
+    wvc_segment = malloc (wvc_length + 1);
+    memcpy (wv_segment, wv.data + wv_start, wv_length);
+
+    if (wvc)
+        memcpy (wvc_segment, wvc_file.data + wvc_start, wvc_length);
+
+    // restore a fresh context (after encoding something else with it, to make it dirty) and a clone
+
+    for (i = 0; i < 2; ++i) {
+        CLEAR (other_wv);
+        CLEAR (other_wvc);
+
+        if (i) {
+            other_wpc = open_test_encoder (&config, num_samples, &other_wv, wvc ? &other_wvc : NULL);
+
+            if (!other_wpc || !WavpackStreamPackSamples (other_wpc, source + save_point * STATE_TEST_CHANS * 2, SAMPLE_RATE / 3) ||
+                !WavpackStreamRestoreState (other_wpc, state [0], state_bytes)) {
+                    strcpy (error, other_wpc ? WavpackStreamGetErrorMessage (other_wpc) : "can't open encoder");
+                    mismatches++;
+            }
+        }
+        else {
+            WavpackStreamRestoreState (wpc, state [0], state_bytes);
+            other_wpc = WavpackStreamCloneEncoder (wpc, write_memory, &other_wv, wvc ? &other_wvc : NULL);
+        }
+
+        if (!other_wpc) {
+            mismatches++;
+            continue;
+        }
+
+        other_wv.bytes = other_wvc.bytes = 0;
+
+        if (!WavpackStreamPackSamples (other_wpc, source + save_point * STATE_TEST_CHANS, save_point) ||
+            !segment_matches (&other_wv, 0, wv_segment, wv_length) || (wvc && !segment_matches (&other_wvc, 0, wvc_segment, wvc_length)))
+                mismatches++;
+
+        WavpackStreamCloseFile (other_wpc);
+        free (other_wv.data);
+        free (other_wvc.data);
+    }
+
+    // the original has been restored, so re-encode the segment over what it wrote before
+
+    wv.bytes = wv_start;
+    wvc_file.bytes = wvc_start;
+
+    if (!WavpackStreamPackSamples (wpc, source + save_point * STATE_TEST_CHANS, save_point) ||
+        !segment_matches (&wv, wv_start, wv_segment, wv_length) || (wvc && !segment_matches (&wvc_file, wvc_start, wvc_segment, wvc_length)))
+            mismatches++;
+
+    if (!WavpackStreamPackSamples (wpc, source + save_point * 2 * STATE_TEST_CHANS, num_samples - save_point * 2) ||
+        !WavpackStreamFlushSamples (wpc))
+            mismatches++;
+
+    WavpackStreamCloseFile (wpc);
+    wpc = WavpackStreamOpenFileInputEx (&mreader, &wv, wvc ? &wvc_file : NULL, error, wvc ? OPEN_WVC : 0, 0);
+
+    if (wpc) {
+        mismatches += verify_test_decode (wpc, source, num_samples, STATE_TEST_CHANS, TRUE);
+        WavpackStreamCloseFile (wpc);
+    }
+    else
+        mismatches++;
+
+    sprintf (info, "%u byte snapshot, %d bytes re-encoded 3 ways", state_bytes, wv_length + wvc_length);
+    free (wv_segment);
+    free (wvc_segment);
+    free (state [0]);
+    free (state [1]);
+    free (source);
+    free (wv.data);
+    free (wvc_file.data);
+    return mismatches;
+}
+
+static int api_test_state_lossless (int wpconfig_flags, char *info)
+{
+    return state_test (wpconfig_flags, info);
+}
+
+static int api_test_state_wvc (int wpconfig_flags, char *info)
+{
+    return state_test (wpconfig_flags | CONFIG_HYBRID_FLAG | CONFIG_CREATE_WVC, info);
+}
+
+// Test the speed governor with a lossless -hx3 encode, first for a few blocks with a target
+// that the configured mode can't meet (so it must step down) and then with one that's easily
+// met (so it must step back up to the configured mode). How far down it goes depends on the
+// host, so that's just reported. The mode changes between blocks must not affect the audio,
+// so the result must still decode losslessly.
+
+#define GOVERNOR_TEST_CHANS 2
+#define GOVERNOR_BLOCK_SAMPLES 1024
+#define GOVERNOR_SLOW_BLOCKS 8
+
+static int api_test_speed_governor (int wpconfig_flags, char *info)
+{
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, slow_samples = GOVERNOR_BLOCK_SAMPLES * GOVERNOR_SLOW_BLOCKS;
+    int problems = 0, levels_used = 0, i;
+    int32_t *source = generate_test_audio (num_samples, GOVERNOR_TEST_CHANS, 16);
+    WavpackGovernorStats stats;
+    WavpackStreamConfig config;
+    WavpackContext *wpc;
+    uint32_t blocks = 0;
+    char error [80];
+    MemoryFile wv;
+
+    CLEAR (config);
+    CLEAR (wv);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = GOVERNOR_TEST_CHANS;
+    config.channel_mask = 0x3;
+    config.block_samples = GOVERNOR_BLOCK_SAMPLES;
+    config.xmode = 3;
+    config.flags = wpconfig_flags | CONFIG_HIGH_FLAG | CONFIG_EXTRA_MODE;
+
+    if (!(wpc = open_test_encoder (&config, num_samples, &wv, NULL))) {
+        free (source);
+        return 1;
+    }
+
+    if (!WavpackStreamSetSpeedGovernor (wpc, 1)) {
+        printf ("api_test_speed_governor(): %s\n", WavpackStreamGetErrorMessage (wpc));
+        problems++;
+    }
+
+    // at 1% of real time the governor must have stepped down from -hx3 (and not yet back up)
+
+    if (!WavpackStreamPackSamples (wpc, source, slow_samples) || !WavpackStreamGetGovernorStats (wpc, &stats) ||
+        !stats.step_downs || stats.step_ups || stats.current_level == stats.max_level)
+            problems++;
+
+    // and at 1000 times real time it must climb all the way back up in the rest of the audio
+
+    if (!WavpackStreamSetSpeedGovernor (wpc, 100000) ||
+        !WavpackStreamPackSamples (wpc, source + slow_samples * GOVERNOR_TEST_CHANS, num_samples - slow_samples) ||
+        !WavpackStreamFlushSamples (wpc) || !WavpackStreamGetGovernorStats (wpc, &stats) ||
+        !stats.step_ups || stats.current_level != stats.max_level)
+            problems++;
+
+    for (i = 0; i <= stats.max_level; ++i) {
+        blocks += stats.level_blocks [i];
+        levels_used += stats.level_blocks [i] != 0;
+    }
+
+    if (blocks != stats.blocks)
+        problems++;
+
+    WavpackStreamCloseFile (wpc);
+    wpc = WavpackStreamOpenFileInputEx (&mreader, &wv, NULL, error, 0, 0);
+
+    if (wpc) {
+        problems += verify_test_decode (wpc, source, num_samples, GOVERNOR_TEST_CHANS, TRUE);
+        WavpackStreamCloseFile (wpc);
+    }
+    else
+        problems++;
+
+    sprintf (info, "%u blocks, %u step downs, %u step ups, %d of %d levels used",
+        stats.blocks, stats.step_downs, stats.step_ups, levels_used, stats.max_level + 1);
+
+    free (source);
+    free (wv.data);
+    return problems;
+}
+
+// Test simulcast with a leader at 4.0 bits/sample and renditions at 3.0 and 2.5 bits/sample
+// (hybrid -x2 with dynamic noise shaping, so the block lengths vary). The leader and the first
+// rendition have correction files, so they must both decode losslessly, and the second
+// rendition must decode cleanly and be within 5% of the size of a separate encode at its
+// bitrate (it uses the leader's decorrelation, which was chosen for a higher bitrate). The
+// second rendition is closed before the leader and the first one after it.
+
+#define SIMULCAST_TEST_CHANS 2
+#define SIMULCAST_RENDITIONS 3
+
+static int api_test_simulcast (int wpconfig_flags, char *info)
+{
+    static const float bitrates [SIMULCAST_RENDITIONS] = { 4.0, 3.0, 2.5 };
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, problems = 0, i;
+    int32_t *source = generate_test_audio (num_samples, SIMULCAST_TEST_CHANS, 16);
+    MemoryFile wv [SIMULCAST_RENDITIONS + 1], wvc [SIMULCAST_RENDITIONS];
+    WavpackContext *wpc [SIMULCAST_RENDITIONS + 1];
+    WavpackStreamConfig config;
+    char error [80];
+
+    CLEAR (config);
+    CLEAR (wv);
+    CLEAR (wvc);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = SIMULCAST_TEST_CHANS;
+    config.channel_mask = 0x3;
+    config.xmode = 2;
+    config.flags = wpconfig_flags | CONFIG_HYBRID_FLAG | CONFIG_HYBRID_SHAPE | CONFIG_DYNAMIC_SHAPING | CONFIG_EXTRA_MODE;
+
+    // the last context is a separate encoder at the lowest bitrate, for comparison
+
+    for (i = 0; i <= SIMULCAST_RENDITIONS; ++i) {
+        int rendition = i < SIMULCAST_RENDITIONS ? i : SIMULCAST_RENDITIONS - 1;
+
+        config.bitrate = bitrates [rendition];
+
+        if (i < 2)
+            config.flags |= CONFIG_CREATE_WVC;
+        else
+            config.flags &= ~CONFIG_CREATE_WVC;
+
+        if (!(wpc [i] = open_test_encoder (&config, num_samples, wv + i, i < 2 ? wvc + i : NULL))) {
+            while (i--)
+                WavpackStreamCloseFile (wpc [i]);
+
+            free (source);
+            return 1;
+        }
+
+        if (i && i < SIMULCAST_RENDITIONS && !WavpackStreamAddSimulcast (wpc [0], wpc [i])) {
+            printf ("api_test_simulcast(): %s\n", WavpackStreamGetErrorMessage (wpc [0]));
+            problems++;
+        }
+    }
+
+    if (!pack_test_audio (wpc [0], source, num_samples, SIMULCAST_TEST_CHANS) ||
+        !pack_test_audio (wpc [SIMULCAST_RENDITIONS], source, num_samples, SIMULCAST_TEST_CHANS))
+            problems++;
+
+    WavpackStreamCloseFile (wpc [2]);
+    WavpackStreamCloseFile (wpc [0]);
+    WavpackStreamCloseFile (wpc [1]);
+    WavpackStreamCloseFile (wpc [3]);
+
+    for (i = 0; i < SIMULCAST_RENDITIONS; ++i) {
+        WavpackContext *dec = WavpackStreamOpenFileInputEx (&mreader, wv + i, i < 2 ? wvc + i : NULL, error, i < 2 ? OPEN_WVC : 0, 0);
+
+        if (dec) {
+            problems += verify_test_decode (dec, source, num_samples, SIMULCAST_TEST_CHANS, i < 2);
+            WavpackStreamCloseFile (dec);
+        }
+        else
+            problems++;
+
+        if (i && wv [i].bytes >= wv [i - 1].bytes)
+            problems++;
+    }
+
+    if (abs (wv [2].bytes - wv [3].bytes) * 20 > wv [3].bytes)
+        problems++;
+
+    sprintf (info, "%d, %d and %d bytes at 4.0, 3.0 and 2.5 bps, separate 2.5 bps encode %d bytes",
+        wv [0].bytes, wv [1].bytes, wv [2].bytes, wv [3].bytes);
+
+    for (i = 0; i <= SIMULCAST_RENDITIONS; ++i)
+        free (wv [i].data);
+
+    for (i = 0; i < SIMULCAST_RENDITIONS; ++i)
+        free (wvc [i].data);
+
+    free (source);
+    return problems;
+}
+
+// Test that rate caps below the lowest hybrid bitrate for the format (about 2.2 bits/sample
+// for each channel, so 196 kbps for stereo and 392 kbps for 4 channels at 44.1 kHz) are
+// rejected, and that caps at those minimums are accepted.
+
+static int api_test_rate_floor (int wpconfig_flags, char *info)
+{
+    static const int chans [2] = { 2, 4 }, low_kbps [2] = { 128, 256 }, min_kbps [2] = { 196, 392 };
+    WavpackStreamConfig config;
+    int problems = 0, i;
+
+    for (i = 0; i < 2; ++i) {
+        WavpackContext *wpc;
+        MemoryFile wv;
+
+        CLEAR (config);
+        CLEAR (wv);
+        config.bytes_per_sample = 2;
+        config.bits_per_sample = 16;
+        config.sample_rate = SAMPLE_RATE;
+        config.num_channels = chans [i];
+        config.channel_mask = (1 << chans [i]) - 1;
+        config.bitrate = 3.0;
+        config.flags = wpconfig_flags | CONFIG_HYBRID_FLAG;
+
+        if (!(wpc = open_test_encoder (&config, SAMPLE_RATE, &wv, NULL)))
+            return 1;
+
+        if (WavpackStreamSetRateControl (wpc, low_kbps [i], low_kbps [i] * 125) ||
+            WavpackStreamSetRateControl (wpc, min_kbps [i] - 1, min_kbps [i] * 125) ||
+            !WavpackStreamSetRateControl (wpc, min_kbps [i], min_kbps [i] * 125))
+                problems++;
+
+        WavpackStreamCloseFile (wpc);
+        free (wv.data);
+    }
+
+    sprintf (info, "minimums %d and %d kbps", min_kbps [0], min_kbps [1]);
+    return problems;
+}
+
+// Test the rate controller with a stereo hybrid encode configured at 6.0 bits/sample (about
+// 530 kbps) but capped at 256 kbps with a 16000 byte buffer (a bit less than half a second).
+// The controller must have lowered the bitrate and the buffer must never overflow, so the
+// total size can't exceed what the link drains in the duration plus the buffer, and the
+// statistics must agree with the output. Because the
+// bitrate only affects the split between the .wv and the .wvc data, the decode with the
+// correction file must still be lossless.
+
+#define RATE_TEST_CHANS 2
+#define RATE_TEST_KBPS 256
+#define RATE_TEST_BUFFER 16000
+
+static int api_test_rate_control (int wpconfig_flags, char *info)
+{
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, problems = 0;
+    int32_t *source = generate_test_audio (num_samples, RATE_TEST_CHANS, 16);
+    WavpackStreamConfig config;
+    WavpackRateStats stats;
+    MemoryFile wv, wvc;
+    WavpackContext *wpc;
+    char error [80];
+
+    CLEAR (config);
+    CLEAR (stats);
+    CLEAR (wv);
+    CLEAR (wvc);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = RATE_TEST_CHANS;
+    config.channel_mask = 0x3;
+    config.bitrate = 6.0;
+    config.flags = wpconfig_flags | CONFIG_HYBRID_FLAG | CONFIG_CREATE_WVC;
+
+    if (!(wpc = open_test_encoder (&config, num_samples, &wv, &wvc))) {
+        free (source);
+        return 1;
+    }
+
+    if (!WavpackStreamSetRateControl (wpc, RATE_TEST_KBPS, RATE_TEST_BUFFER)) {
+        printf ("api_test_rate_control(): %s\n", WavpackStreamGetErrorMessage (wpc));
+        problems++;
+    }
+
+    if (!pack_test_audio (wpc, source, num_samples, RATE_TEST_CHANS) || !WavpackStreamGetRateStats (wpc, &stats) ||
+        stats.overflows || !stats.blocks || stats.peak_fullness > stats.buffer_bytes || stats.buffer_bytes != RATE_TEST_BUFFER ||
+        stats.current_bits >= (uint32_t) (config.bitrate * 256.0))
+            problems++;
+
+    WavpackStreamCloseFile (wpc);
+
+    if (wv.bytes != stats.total_bytes || wv.bytes > RATE_TEST_KBPS * 125 * API_TEST_SECONDS + RATE_TEST_BUFFER)
+        problems++;
+
+    wpc = WavpackStreamOpenFileInputEx (&mreader, &wv, &wvc, error, OPEN_WVC, 0);
+
+    if (wpc) {
+        problems += verify_test_decode (wpc, source, num_samples, RATE_TEST_CHANS, TRUE);
+        WavpackStreamCloseFile (wpc);
+    }
+    else
+        problems++;
+
+    sprintf (info, "%u blocks, %u retried, peak buffer %u of %u bytes, last block at %.2f bps",
+        stats.blocks, stats.retries, stats.peak_fullness, stats.buffer_bytes, stats.current_bits / 256.0);
+
+    free (wv.data);
+    free (wvc.data);
+    free (source);
+    return problems;
+}
+
+// Test transrating by encoding lossless -hx2 and then transrating it block by block into
+// 3.0 bits/sample hybrid with a correction file (in the default mode), the way the command-
+// line program does it. The result must decode losslessly with the correction file, and
+// it must differ from a normal encode of the same audio in the same mode (otherwise the
+// source's decorrelation wasn't used).
+
+#define TRANSRATE_TEST_CHANS 2
+
+static int api_test_transrate (int wpconfig_flags, char *info)
+{
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, problems = 0, transrated = 0;
+    int32_t *source = generate_test_audio (num_samples, TRANSRATE_TEST_CHANS, 16), *buffer;
+    MemoryFile lossless, wv, wvc, normal, normal_wvc;
+    WavpackContext *dec, *wpc, *cmp;
+    WavpackStreamConfig config;
+    uint32_t samples;
+    char error [80];
+
+    CLEAR (config);
+    CLEAR (lossless);
+    CLEAR (wv);
+    CLEAR (wvc);
+    CLEAR (normal);
+    CLEAR (normal_wvc);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = TRANSRATE_TEST_CHANS;
+    config.channel_mask = 0x3;
+    config.xmode = 2;
+    config.flags = wpconfig_flags | CONFIG_HIGH_FLAG | CONFIG_EXTRA_MODE;
+
+    if (!(wpc = open_test_encoder (&config, num_samples, &lossless, NULL))) {
+        free (source);
+        return 1;
+    }
+
+    if (!pack_test_audio (wpc, source, num_samples, TRANSRATE_TEST_CHANS))
+        problems++;
+
+    WavpackStreamCloseFile (wpc);
+
+    config.xmode = 0;
+    config.bitrate = 3.0;
+    config.flags = wpconfig_flags | CONFIG_HYBRID_FLAG | CONFIG_CREATE_WVC;
+
+    if (!(dec = WavpackStreamOpenFileInputEx (&mreader, &lossless, NULL, error, 0, 0))) {
+        printf ("api_test_transrate(): %s\n", error);
+        free (lossless.data);
+        free (source);
+        return 1;
+    }
+
+    if (!(wpc = open_test_encoder (&config, num_samples, &wv, &wvc)) ||
+        !(cmp = open_test_encoder (&config, num_samples, &normal, &normal_wvc))) {
+            if (wpc)
+                WavpackStreamCloseFile (wpc);
+
+            WavpackStreamCloseFile (dec);
+            free (lossless.data);
+            free (wv.data);
+            free (wvc.data);
+            free (source);
+            return 1;
+    }
+
+    if (!(buffer = malloc (SAMPLE_RATE * TRANSRATE_TEST_CHANS * sizeof (*buffer)))) {
+        printf ("api_test_transrate(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    // decode a block at a time and hand each one to the encoder with its source
+
+    while ((samples = WavpackStreamGetBlockSamplesLeft (dec))) {
+        if (samples > SAMPLE_RATE || WavpackStreamUnpackSamples (dec, buffer, samples) != samples ||
+            !WavpackStreamTransrateBlock (wpc, dec, buffer, samples)) {
+                problems++;
+                break;
+        }
+
+        transrated++;
+    }
+
+    WavpackStreamCloseFile (dec);
+    WavpackStreamCloseFile (wpc);
+
+    if (!pack_test_audio (cmp, source, num_samples, TRANSRATE_TEST_CHANS))
+        problems++;
+
+    WavpackStreamCloseFile (cmp);
+
+    if (wv.bytes == normal.bytes && !memcmp (wv.data, normal.data, wv.bytes))
+        problems++;
+
+    if ((dec = WavpackStreamOpenFileInputEx (&mreader, &wv, &wvc, error, OPEN_WVC, 0))) {
+        problems += verify_test_decode (dec, source, num_samples, TRANSRATE_TEST_CHANS, TRUE);
+        WavpackStreamCloseFile (dec);
+    }
+    else
+        problems++;
+
+    sprintf (info, "%d blocks, %d + %d bytes, normal encode %d + %d bytes",
+        transrated, wv.bytes, wvc.bytes, normal.bytes, normal_wvc.bytes);
+
+    free (buffer);
+    free (lossless.data);
+    free (wv.data);
+    free (wvc.data);
+    free (normal.data);
+    free (normal_wvc.data);
+    free (source);
+    return problems;
+}
+
+// Benchmark decoding the same stereo audio encoded lossless, hybrid lossless (3.0 bits/sample
+// with a correction file) and hybrid lossy (the same file decoded without the correction file),
+// reporting the best CPU time of several passes of each as a multiple of realtime. The hybrid
+// decodes are mostly in get_words_hybrid(). The lossless decodes must match the source.
+
+#define DECODE_SPEED_CHANS 2
+#define DECODE_SPEED_PASSES 5
+
+static int api_test_decode_speed (int wpconfig_flags, char *info)
+{
+    static const char *names [3] = { "lossless", "hybrid lossless", "hybrid lossy" };
+    int num_samples = SAMPLE_RATE * API_TEST_SECONDS, problems = 0, i, j;
+    int32_t *source = generate_test_audio (num_samples, DECODE_SPEED_CHANS, 16);
+    MemoryFile wv [2], wvc;
+    WavpackStreamConfig config;
+    int64_t best_time [3];
+    char error [80];
+
+    CLEAR (config);
+    CLEAR (wv);
+    CLEAR (wvc);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = DECODE_SPEED_CHANS;
+    config.channel_mask = 0x3;
+    config.bitrate = 3.0;
+
+    for (i = 0; i < 2; ++i) {
+        WavpackContext *wpc;
+
+        config.flags = wpconfig_flags | (i ? CONFIG_HYBRID_FLAG | CONFIG_CREATE_WVC : 0);
+
+        if (!(wpc = open_test_encoder (&config, num_samples, wv + i, i ? &wvc : NULL)) ||
+            !pack_test_audio (wpc, source, num_samples, DECODE_SPEED_CHANS))
+                problems++;
+
+        if (wpc)
+            WavpackStreamCloseFile (wpc);
+    }
+
+    for (i = 0; i < 3 && !problems; ++i)
+        for (best_time [i] = 0, j = 0; j < DECODE_SPEED_PASSES; ++j) {
+            MemoryFile wv_copy = wv [i ? 1 : 0], wvc_copy = wvc;
+            WavpackContext *wpc = WavpackStreamOpenFileInputEx (&mreader, &wv_copy, i == 1 ? &wvc_copy : NULL,
+                error, i == 1 ? OPEN_WVC : 0, 0);
+            int64_t start_time = thread_cpu_time_ns (), time;
+
+            if (!wpc) {
+                problems++;
+                break;
+            }
+
+            problems += verify_test_decode (wpc, source, num_samples, DECODE_SPEED_CHANS, i < 2);
+            time = thread_cpu_time_ns () - start_time;
+            WavpackStreamCloseFile (wpc);
+
+            if (!best_time [i] || time < best_time [i])
+                best_time [i] = time;
+        }
+
+    if (!problems) {
+        char *cptr = info;
+
+        for (i = 0; i < 3; ++i)
+            cptr += sprintf (cptr, "%s%s %.0fx", i ? ", " : "", names [i],
+                best_time [i] ? API_TEST_SECONDS * 1.0e9 / best_time [i] : 0.0);
+
+        strcpy (cptr, " realtime");
+    }
+
+    free (wv [0].data);
+    free (wv [1].data);
+    free (wvc.data);
+    free (source);
+    return problems;
+}
+
+// Damaged stream recovery benchmark. A minute of stereo test audio is encoded (lossless) and
+// then damaged in several ways, and each damaged stream is decoded with the default skip limit
+// and with OPEN_NO_SKIP_LIMIT | OPEN_VERIFY_RESYNC, from both seekable and non-seekable input.
+// The samples lost (not decoded) and the CPU time to open and decode are shown for each.
+// This fails if resyncing doesn't decode an undamaged stream (or one with garbage only in front)
+// exactly, if resyncing with seekable input (where the blocks found are verified) loses more than
+// the default, or if any decode returns more samples than were encoded.
+
+#define RECOVERY_SECONDS 60
+#define RECOVERY_CHANS 2
+#define RECOVERY_FAKE_HEADER_BYTES 32
+
+static const struct {
+    const char *name;
+    int32_t prefix, offset, length, period, fake_header_period;
+} recovery_tests [] = {
+    { "no damage",                          0,          0,          0,          0,          0 },
+    { "40K of garbage every 300K",          0,          300 << 10,  40 << 10,   300 << 10,  0 },
+    { "400K of garbage",                    0,          1 << 20,    400 << 10,  0,          0 },
+    { "64M of garbage in front",            64 << 20,   0,          0,          0,          0 },
+    { "200K of garbage with fake headers",  0,          1 << 20,    200 << 10,  0,          1 << 10 },
+};
+
+// Make a damaged copy of the encoded stream for the specified recovery test. The garbage is
+// random, and the fake headers are copies of the first block's header.
+
+static void damage_test_stream (MemoryFile *damaged, MemoryFile *wv, int test)
+{
+    int32_t prefix = recovery_tests [test].prefix, offset = recovery_tests [test].offset, i;
+
+    CLEAR (*damaged);
+    damaged->bytes = damaged->alloc = prefix + wv->bytes;
+    damaged->seekable = 1;
+
+    if (!(damaged->data = malloc (damaged->bytes))) {
+        printf ("damage_test_stream(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    for (i = 0; i < prefix; ++i)
+        damaged->data [i] = (unsigned char) (frandom () * 256.0);
+
+    memcpy (damaged->data + prefix, wv->data, wv->bytes);
+
+    while (recovery_tests [test].length && offset + recovery_tests [test].length <= wv->bytes) {
+        for (i = 0; i < recovery_tests [test].length; ++i)
+            if (recovery_tests [test].fake_header_period && !(i % recovery_tests [test].fake_header_period) &&
+                i + RECOVERY_FAKE_HEADER_BYTES <= recovery_tests [test].length) {
+                    memcpy (damaged->data + prefix + offset + i, wv->data, RECOVERY_FAKE_HEADER_BYTES);
+                    i += RECOVERY_FAKE_HEADER_BYTES - 1;
+            }
+            else
+                damaged->data [prefix + offset + i] = (unsigned char) (frandom () * 256.0);
+
+        if (!recovery_tests [test].period)
+            break;
+
+        offset += recovery_tests [test].period;
+    }
+}
+
+// Decode the damaged stream with the specified open flags and return the number of samples lost
+// (not decoded), or -1 if too many are decoded. Blocks found after a damaged region are decoded
+// right after the ones before it (the gap is not filled), so the decoded audio can only be
+// compared with the source when nothing is lost, and "exact" is set if it matches. The CPU
+// time taken to open and decode the stream is also returned.
+
+static int decode_damaged_stream (MemoryFile *damaged, int seekable, int open_flags, int32_t *source, int num_samples,
+    int *exact, int64_t *time)
+{
+    int32_t *decoded = malloc (DECODE_SAMPLES * RECOVERY_CHANS * sizeof (*decoded));
+    int64_t start_time = thread_cpu_time_ns ();
+    MemoryFile wv_copy = *damaged;
+    int total_samples = 0;
+    WavpackContext *wpc;
+    uint32_t samples;
+    char error [80];
+
+    if (!decoded) {
+        printf ("decode_damaged_stream(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    wv_copy.seekable = seekable;
+    *exact = TRUE;
+
+    if ((wpc = WavpackStreamOpenFileInputEx (&mreader, &wv_copy, NULL, error, open_flags, 0))) {
+        while ((samples = WavpackStreamUnpackSamples (wpc, decoded, DECODE_SAMPLES))) {
+            if (total_samples + (int) samples > num_samples) {
+                total_samples = -1;
+                break;
+            }
+
+            if (memcmp (decoded, source + total_samples * RECOVERY_CHANS, samples * RECOVERY_CHANS * sizeof (*decoded)))
+                *exact = FALSE;
+
+            total_samples += samples;
+        }
+
+        WavpackStreamCloseFile (wpc);
+    }
+
+    *time = thread_cpu_time_ns () - start_time;
+    free (decoded);
+    return total_samples < 0 ? -1 : num_samples - total_samples;
+}
+
+static int run_recovery_test (int wpconfig_flags)
+{
+    static const char *modes [2] = { "default", "resync" };
+    int num_samples = SAMPLE_RATE * RECOVERY_SECONDS, failures = 0, lost [2] [2], exact [2] [2], i, j, k;
+    int32_t *source = generate_test_audio (num_samples, RECOVERY_CHANS, 16);
+    WavpackStreamConfig config;
+    WavpackContext *wpc;
+    MemoryFile wv;
+    int64_t time;
+
+    CLEAR (config);
+    CLEAR (wv);
+    config.bytes_per_sample = 2;
+    config.bits_per_sample = 16;
+    config.sample_rate = SAMPLE_RATE;
+    config.num_channels = RECOVERY_CHANS;
+    config.channel_mask = 0x3;
+    config.flags = wpconfig_flags;
+
+    if (!(wpc = open_test_encoder (&config, num_samples, &wv, NULL)) ||
+        !pack_test_audio (wpc, source, num_samples, RECOVERY_CHANS)) {
+            printf ("recovery test: can't encode test audio!\n");
+
+            if (wpc)
+                WavpackStreamCloseFile (wpc);
+
+            free (wv.data);
+            free (source);
+            return 1;
+    }
+
+    WavpackStreamCloseFile (wpc);
+
+    printf ("recovery test: %d seconds of stereo audio, %d bytes (lossless)\n\n", RECOVERY_SECONDS, wv.bytes);
+    printf ("%-34s %-7s %28s %28s\n\n", "damage", "mode", "seekable input", "non-seekable input");
+
+    for (i = 0; i < (int) (sizeof (recovery_tests) / sizeof (recovery_tests [0])); ++i) {
+        MemoryFile damaged;
+
+        damage_test_stream (&damaged, &wv, i);
+
+        for (j = 0; j < 2; ++j) {
+            printf ("%-34s %-7s", j ? "" : recovery_tests [i].name, modes [j]);
+
+            for (k = 0; k < 2; ++k) {
+                lost [j] [k] = decode_damaged_stream (&damaged, !k, j ? OPEN_NO_SKIP_LIMIT | OPEN_VERIFY_RESYNC : 0,
+                    source, num_samples, &exact [j] [k], &time);
+
+                if (lost [j] [k] < 0)
+                    printf (" %28s", "too many samples!");
+                else
+                    printf (" %9d lost, %9.1f ms", lost [j] [k], time / 1.0e6);
+
+                fflush (stdout);
+            }
+
+            printf ("\n");
+        }
+
+        if (lost [0] [0] < 0 || lost [0] [1] < 0 || lost [1] [0] < 0 || lost [1] [1] < 0 || lost [1] [0] > lost [0] [0] ||
+            (!recovery_tests [i].length && (lost [1] [0] || lost [1] [1] || !exact [1] [0] || !exact [1] [1]))) {
+                printf ("%-34s *** fail ***\n", "");
+                failures++;
+        }
+
+        printf ("\n");
+        free (damaged.data);
+    }
+
+    printf ("recovery test...%s\n", failures ? "fail" : "pass");
+    free (wv.data);
+    free (source);
+    return failures;
+}
+
+// Given a desired average period of corruptions and the length of the input data,
+// calculate the probability that the specified number of hits will occur.
+
+static double hit_probability (int period, int length, int num_hits)
+{
+    double probability = pow ((period - 1.0) / period, length - num_hits);
+    int hits;
+
+    for (hits = 0; hits < num_hits; ++hits)
+        probability *= (double)(length - hits) / (period * (hits + 1));
+
+    return probability;
+}
+
+// Fuzzing code. The fuzz "period" is the average distance in bytes between corrupted samples
+// (but of course they are randomly distributed). For each byte selected for corruption, we
+// randomly choose between 1 and 8 bits to toggle. We don't check for duplicate bits or bytes.
+// So that the underlying file is identical regardless of fuzzing, we load and restore the
+// random number generator seed value.
+
+static void fuzz_buffer (void *data, int32_t length, int fuzz_period)
+{
+    uint64_t saved_seed = frandom_get_seed();
     double fuzz_factor = frandom (), probability_accum = 0.0;
     unsigned char *data_ptr = data;
     int num_hits = 0;
@@ -1070,11 +3440,24 @@ static void free_stream (StreamingFile *ws)
     }
 }
 
+// Return the CPU time used by the calling thread in nanoseconds, which (unlike wall time)
+// does not include the time the decoder spends waiting for the encoder.
+
+static int64_t thread_cpu_time_ns (void)
+{
+    struct timespec ts;
+
+    if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts))
+        return 0;
+
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 // Helper utilities for generating the audio used for testing.
 
 // Return a random value in the range: 0.0 <= n < 1.0
 
-static uint64_t random_seed = 0x3141592653589793;
+static __thread uint64_t random_seed = RANDOM_SEED;
 
 static double frandom (void)
 {
@@ -1242,6 +3625,37 @@ static void float_to_32bit_integer_samples (float *samples, int num_samples)
     } 
 }
 
+// Convert float samples to DSD64 (returned as bytes, MSB first, in int32_t) with a simple
+// second-order sigma-delta modulator, holding each float sample for DSD_BYTES_PER_SAMPLE bytes.
+// The modulator state (two integrators per channel) is kept in "dsd_state" between calls.
+
+static void float_to_dsd_samples (float *samples, int32_t *dsd_samples, int num_samples, int num_chans, double *dsd_state)
+{
+    int i, j, k;
+
+    while (num_samples--) {
+        for (k = 0; k < num_chans; ++k) {
+            double input = *samples++ * 0.5, *integrators = dsd_state + k * 2;
+
+            for (i = 0; i < DSD_BYTES_PER_SAMPLE; ++i) {
+                int32_t byte = 0;
+
+                for (j = 0; j < 8; ++j) {
+                    double feedback = integrators [1] >= 0.0 ? 1.0 : -1.0;
+
+                    byte = (byte << 1) | (feedback > 0.0);
+                    integrators [0] += input - feedback;
+                    integrators [1] += integrators [0] - feedback;
+                }
+
+                dsd_samples [i * num_chans + k] = byte;
+            }
+        }
+
+        dsd_samples += DSD_BYTES_PER_SAMPLE * num_chans;
+    }
+}
+
 // Code to store samples. Source is an array of int32_t data (which is what WavPack uses
 // internally), but the destination can have from 1 to 4 bytes per sample. Also, the destination
 // data is assumed to be little-endian and signed, except for byte data which is unsigned (these
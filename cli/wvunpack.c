@@ -103,6 +103,7 @@ static const char *usage =
 "                (optional \"n\" = 1-10 for specific item, otherwise all)\n"
 "          --help = this help display\n"
 "          -i  = ignore .wpsc file (forces hybrid lossy decompression)\n"
+"          -j[n] = decode frames in parallel using n threads (default 2)\n"
 #if defined (_WIN32) || defined (__OS2__)
 "          -l  = run at low priority (for smoother multitasking)\n"
 #endif
@@ -115,6 +116,8 @@ static const char *usage =
 #endif
 "          -q  = quiet (keep console output to a minimum)\n"
 "          -r or --raw  = force raw audio decode (results in .raw extension)\n"
+"          --resync = skip any amount of damaged data to find the next block\n"
+"              (and check that block first if the input file is seekable)\n"
 "          -s  = display summary information only to stdout (no audio decode)\n"
 "          -ss = display super summary to stdout (no decode)\n"
 "          --skip=[-][sample|hh:mm:ss.ss] = start decoding at specified sample/time\n"
@@ -161,9 +164,10 @@ static struct {
 int debug_logging_mode;
 
 static int overwrite_all, delete_source, raw_decode, no_utf8_convert, no_audio_decode, file_info,
-    summary, ignore_wvc, quiet_mode, calc_md5, copy_time, blind_decode, decode_format, format_specified, caf_be, set_console_title;
+    summary, ignore_wvc, quiet_mode, calc_md5, copy_time, blind_decode, decode_format, format_specified, caf_be, set_console_title,
+    resync_mode;
 
-static int num_files, file_index, outbuf_k;
+static int num_files, file_index, outbuf_k, decode_threads;
 
 static struct sample_time_index {
     int value_is_time, value_is_relative, value_is_valid;
@@ -299,6 +303,8 @@ int main(int argc, char **argv)
             }
             else if (!strcmp (long_option, "raw"))                      // --raw
                 raw_decode = 1;
+            else if (!strcmp (long_option, "resync"))                   // --resync
+                resync_mode = 1;
             else {
                 error_line ("unknown option: %s !", long_option);
                 ++error_count;
@@ -377,6 +383,22 @@ int main(int argc, char **argv)
                         calc_md5 = 1;
                         break;
 
+                    case 'J': case 'j':
+                        if (isdigit ((*argv) [1]) || (*argv) [1] == '-') {
+                            decode_threads = strtol (++*argv, argv, 10);
+
+                            if (decode_threads < 1 || decode_threads > 64) {
+                                error_line ("-j option must be 1-64, or omit for 2 threads!");
+                                ++error_count;
+                            }
+
+                            --*argv;
+                        }
+                        else
+                            decode_threads = 2;
+
+                        break;
+
                     case 'B': case 'b':
                         blind_decode = 1;
                         break;
@@ -934,6 +956,7 @@ static void *store_samples (void *dst, int32_t *src, int qmode, int bps, int cou
 static void dump_summary (WavpackContext *wpc, char *name, FILE *dst);
 static void dump_file_info (WavpackContext *wpc, char *name, FILE *dst, int parameter);
 static void unreorder_channels (int32_t *data, unsigned char *order, int num_chans, int num_samples);
+static void unreorder_dsd_bytes (unsigned char *data, unsigned char *order, int num_chans, int num_samples, int in_blocks);
 
 static int unpack_file (char *infilename, char *outfilename, int add_extension)
 {
@@ -970,6 +993,9 @@ static int unpack_file (char *infilename, char *outfilename, int add_extension)
     if (blind_decode)
         open_flags |= OPEN_NO_CHECKSUM;
 
+    if (resync_mode)
+        open_flags |= OPEN_NO_SKIP_LIMIT | OPEN_VERIFY_RESYNC;
+
     if (!ignore_wvc)
         open_flags |= OPEN_WVC;
 
@@ -1134,6 +1160,12 @@ static int unpack_file (char *infilename, char *outfilename, int add_extension)
         return WAVPACK_NO_ERROR;
     }
 
+    if (decode_threads > 1 && !WavpackStreamSetDecodeThreads (wpc, decode_threads, 0)) {
+        error_line ("%s", WavpackStreamGetErrorMessage (wpc));
+        WavpackStreamCloseFile (wpc);
+        return WAVPACK_SOFT_ERROR;
+    }
+
     if (outfilename) {
         if (*outfilename != '-' && add_extension) {
             strcat (outfilename, ".");
@@ -1559,25 +1591,6 @@ static int unpack_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsigned
     return result;
 }
 
-static const unsigned char bit_reverse_table [] = {
-    0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
-    0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
-    0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
-    0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
-    0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
-    0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
-    0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
-    0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
-    0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
-    0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
-    0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
-    0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
-    0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
-    0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
-    0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
-    0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff
-};
-
 #define DSD_BLOCKSIZE 4096
 
 static int unpack_dsd_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsigned char *md5_digest, int64_t *sample_count)
@@ -1587,7 +1600,7 @@ static int unpack_dsd_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsi
     int64_t until_samples_total = *sample_count, total_unpacked_samples = 0;
     uint32_t output_buffer_size = 0, bcount;
     double progress = -1.0;
-    int32_t *temp_buffer;
+    int format = 0;
     MD5_CTX md5_context;
 
     if (md5_digest)
@@ -1615,7 +1628,10 @@ static int unpack_dsd_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsi
         }
     }
 
-    temp_buffer = malloc (DSD_BLOCKSIZE * num_channels * sizeof (temp_buffer [0]));
+    // the library packs the DSD bytes for us, in blocks (and LSB first) for DSF files
+
+    if (qmode & QMODE_DSD_IN_BLOCKS)
+        format = (qmode & QMODE_DSD_LSB_FIRST) ? DSD_BYTES_IN_BLOCKS | DSD_BYTES_LSB_FIRST : DSD_BYTES_IN_BLOCKS;
 
     while (result == WAVPACK_NO_ERROR) {
         uint32_t samples_to_unpack = DSD_BLOCKSIZE, samples_unpacked;
@@ -1623,39 +1639,27 @@ static int unpack_dsd_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsi
         if (until_samples_total && samples_to_unpack > until_samples_total - total_unpacked_samples)
             samples_to_unpack = (uint32_t) (until_samples_total - total_unpacked_samples);
 
-        samples_unpacked = WavpackStreamUnpackSamples (wpc, temp_buffer, samples_to_unpack);
+        samples_unpacked = WavpackStreamUnpackDSDBytes (wpc, output_buffer, samples_to_unpack, format);
         total_unpacked_samples += samples_unpacked;
 
-        if (new_channel_order)
-            unreorder_channels (temp_buffer, new_channel_order, num_channels, samples_unpacked);
-
         if (samples_unpacked) {
-            unsigned char *dptr = output_buffer;
-            int32_t *sptr = temp_buffer;
-
             if (qmode & QMODE_DSD_IN_BLOCKS) {
                 int cc = num_channels;
 
-                while (cc--) {
-                    uint32_t si;
+                // spread a short (last) group of blocks out to full size, padding with zeros (last channel
+                // first because they only move up)
 
-                    for (si = 0; si < DSD_BLOCKSIZE; si++, sptr += num_channels)
-                        if (si < samples_unpacked)
-                            *dptr++ = (qmode & QMODE_DSD_LSB_FIRST) ? bit_reverse_table [*sptr & 0xff] : *sptr;
-                        else
-                            *dptr++ = 0;
-
-                    sptr -= (DSD_BLOCKSIZE * num_channels) - 1;
-                }
+                if (samples_to_unpack < DSD_BLOCKSIZE)
+                    while (cc--) {
+                        memmove (output_buffer + cc * DSD_BLOCKSIZE, output_buffer + cc * samples_to_unpack, samples_to_unpack);
+                        memset (output_buffer + cc * DSD_BLOCKSIZE + samples_to_unpack, 0, DSD_BLOCKSIZE - samples_to_unpack);
+                    }
 
                 samples_unpacked = DSD_BLOCKSIZE;   // make sure we MD5 and write the whole block even if partial (last)
             }
-            else {
-                int scount = samples_unpacked * num_channels;
 
-                while (scount--)
-                    *dptr++ = *sptr++;
-            }
+            if (new_channel_order)
+                unreorder_dsd_bytes (output_buffer, new_channel_order, num_channels, samples_unpacked, format & DSD_BYTES_IN_BLOCKS);
 
             if (md5_digest)
                 MD5_Update (&md5_context, output_buffer, samples_unpacked * num_channels);
@@ -1705,8 +1709,6 @@ static int unpack_dsd_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsi
     if (md5_digest)
         MD5_Final (md5_digest, &md5_context);
 
-    free (temp_buffer);
-
     if (output_buffer)
         free (output_buffer);
 
@@ -1936,6 +1938,42 @@ static void unreorder_channels (int32_t *data, unsigned char *order, int num_cha
         free (temp);
 }
 
+// Same as unreorder_channels(), but for packed DSD bytes (either interleaved, or with all the
+// bytes of each channel together when "in_blocks" is set)
+
+static void unreorder_dsd_bytes (unsigned char *data, unsigned char *order, int num_chans, int num_samples, int in_blocks)
+{
+    unsigned char reorder_buffer [16], *temp = reorder_buffer;
+    int chan;
+
+    if (in_blocks) {
+        if (!(temp = malloc (num_chans * num_samples)))
+            return;
+
+        memcpy (temp, data, num_chans * num_samples);
+
+        for (chan = 0; chan < num_chans; ++chan)
+            memcpy (data + chan * num_samples, temp + order [chan] * num_samples, num_samples);
+
+        free (temp);
+        return;
+    }
+
+    if (num_chans > 16)
+        temp = malloc (num_chans);
+
+    while (num_samples--) {
+        for (chan = 0; chan < num_chans; ++chan)
+            temp [chan] = data [order[chan]];
+
+        memcpy (data, temp, num_chans);
+        data += num_chans;
+    }
+
+    if (num_chans > 16)
+        free (temp);
+}
+
 static const char *speakers [] = {
     "FL", "FR", "FC", "LFE", "BL", "BR", "FLC", "FRC", "BC",
     "SL", "SR", "TC", "TFL", "TFC", "TFR", "TBL", "TBC", "TBR"
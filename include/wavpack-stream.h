@@ -59,13 +59,16 @@ typedef struct {
 #define CONFIG_CREATE_EXE       0x40000 // create executable
 #define CONFIG_CREATE_WVC       0x80000 // create correction file
 #define CONFIG_OPTIMIZE_WVC     0x100000 // maximize bybrid compression
+#define CONFIG_WARM_SEARCH      0x200000 // start extra mode search from previous block
 #define CONFIG_COMPATIBLE_WRITE 0x400000 // write files for decoders < 4.3
 #define CONFIG_CALC_NOISE       0x800000 // calc noise in hybrid mode
+#define CONFIG_CONSTANT_BLOCKS  0x1000000 // code silent or constant blocks compactly (new decoders only)
 #define CONFIG_EXTRA_MODE       0x2000000 // extra processing mode
 #define CONFIG_SKIP_WVX         0x4000000 // no wvx stream w/ floats & big ints
 #define CONFIG_MD5_CHECKSUM     0x8000000 // store MD5 signature
 #define CONFIG_MERGE_BLOCKS     0x10000000 // merge blocks of equal redundancy (for lossyWAV)
 #define CONFIG_PAIR_UNDEF_CHANS 0x20000000 // encode undefined channels in stereo pairs
+#define CONFIG_LARGE_BLOCKS     0x40000000 // large blocks with 32-bit size fields (new decoders only)
 #define CONFIG_OPTIMIZE_MONO    0x80000000 // optimize for mono streams posing as stereo
 
 // The lower 8 bits of qmode indicate the use of new features in version 5 that (presently)
@@ -127,6 +130,61 @@ typedef struct {
 
 typedef int (*WavpackBlockOutput)(void *id, void *data, int32_t bcount);
 
+// Thread pools for parallel operation (may be shared among contexts). An executor
+// callback can be supplied to run the pool's tasks on the application's own runtime.
+
+typedef struct WavpackThreadPool WavpackThreadPool;
+typedef void (*WavpackTaskFunction)(void *arg);
+typedef int (*WavpackTaskExecutor)(void *executor_id, WavpackTaskFunction function, void *arg);
+
+// Statistics returned by WavpackStreamGetJitterStats() (all times in samples)
+
+typedef struct {
+    uint32_t frames_received;   // total frames passed to WavpackStreamJitterPutFrame()
+    uint32_t frames_duplicate;  // frames discarded because they were already held
+    uint32_t frames_late;       // frames discarded because they arrived after playout
+    uint32_t frames_damaged;    // frames discarded because they could not be decoded
+    uint32_t frames_overlapping;// frames discarded because they overlapped held frames
+    uint32_t periods;           // total periods returned by WavpackStreamJitterGetPeriod()
+    uint32_t underruns;         // periods (after playout started) with missing audio
+    uint32_t stalls;            // periods of silence inserted to increase the delay
+    uint32_t skips;             // periods of audio dropped to decrease the delay
+    uint32_t jitter;            // current interarrival jitter estimate
+    uint32_t target_delay;      // current target delay (above minimum transit time)
+    int32_t current_delay;      // current delay (above minimum transit time)
+} WavpackJitterStats;
+
+// Statistics returned by WavpackStreamGetGovernorStats(). The levels go from 0 (fast
+// mode) up to the mode the encoder was configured with (see pack_governor.c).
+
+#define WAVPACK_GOVERNOR_MAX_LEVELS 10
+
+typedef struct {
+    uint32_t blocks;            // total blocks encoded with the governor enabled
+    uint32_t step_downs;        // transitions to a faster level
+    uint32_t step_ups;          // transitions to a slower (better) level
+    uint32_t last_transition;   // block number of the most recent transition
+    uint32_t load_percent;      // recent encode time as a percentage of real time
+    uint32_t target_percent;    // encode time target as a percentage of real time
+    int current_level, max_level;
+    int current_flags;          // CONFIG_FAST_FLAG, CONFIG_HIGH_FLAG, etc. for current level
+    int current_xmode;          // extra mode for current level (0 = none)
+    uint32_t level_blocks [WAVPACK_GOVERNOR_MAX_LEVELS];    // blocks encoded at each level
+} WavpackGovernorStats;
+
+// Statistics returned by WavpackStreamGetRateStats() (correction blocks are not counted)
+
+typedef struct {
+    uint32_t blocks;            // total blocks encoded with rate control enabled
+    uint32_t retries;           // times a block was encoded again at a lower bitrate
+    uint32_t overflows;         // blocks that overflowed the buffer even at the lowest bitrate
+    uint32_t buffer_bytes;      // size of the buffer model
+    uint32_t fullness;          // current buffer fullness in bytes
+    uint32_t peak_fullness;     // highest buffer fullness in bytes (just after adding a block)
+    uint32_t current_bits;      // hybrid bits/sample * 256 used for the last block
+    int64_t total_bytes;        // total bytes in all blocks
+} WavpackRateStats;
+
 //////////////////////////// function prototypes /////////////////////////////
 
 typedef struct WavpackContext WavpackContext;
@@ -160,6 +218,11 @@ WavpackContext *WavpackStreamOpenFileInput (const char *infilename, char *error,
 #define OPEN_ALT_TYPES  0x400   // application is aware of alternate file types & qmode
                                 // (just affects retrieving wrappers & MD5 checksums)
 #define OPEN_NO_CHECKSUM 0x800  // don't verify block checksums before decoding
+#define OPEN_COMPACT    0x1000  // minimize memory used by decoding context (PCM only)
+#define OPEN_NO_SKIP_LIMIT 0x2000   // no limit on garbage skipped to find the next block
+#define OPEN_VERIFY_RESYNC 0x4000   // verify block found after skipping (seekable input only;
+                                    // this is ignored for non-seekable input, which is also
+                                    // scanned for headers more slowly, without read-ahead)
 
 int WavpackStreamGetMode (WavpackContext *wpc);
 
@@ -177,12 +240,33 @@ int WavpackStreamGetMode (WavpackContext *wpc);
 #define MODE_DNS        0x8000
 
 int WavpackStreamVerifySingleBlock (unsigned char *buffer, int verify_checksum);
+void WavpackStreamSetResyncLimit (WavpackContext *wpc, uint32_t max_bytes);
 int WavpackStreamGetQualifyMode (WavpackContext *wpc);
 char *WavpackStreamGetErrorMessage (WavpackContext *wpc);
 int WavpackStreamGetVersion (WavpackContext *wpc);
 char *WavpackStreamGetFileExtension (WavpackContext *wpc);
 unsigned char WavpackStreamGetFileFormat (WavpackContext *wpc);
 uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint32_t samples);
+uint32_t WavpackStreamGetBlockSamplesLeft (WavpackContext *wpc);
+int WavpackStreamUnpackSamplesBatch (WavpackContext **wpcs, int32_t **buffers, uint32_t *samples_unpacked, int num_contexts, uint32_t samples);
+uint32_t WavpackStreamUnpackDSDBytes (WavpackContext *wpc, unsigned char *buffer, uint32_t samples, int format);
+
+#define DSD_BYTES_LSB_FIRST 0x1     // reverse the bits in each byte (as in DSF files)
+#define DSD_BYTES_IN_BLOCKS 0x2     // all bytes for each channel together (DSF block layout)
+#define DSD_BYTES_DOP       0x4     // DoP (DSD over PCM) as packed 24-bit little-endian words
+
+int WavpackStreamSetDecodeThreads (WavpackContext *wpc, int num_threads, int max_frames);
+WavpackThreadPool *WavpackStreamCreateThreadPool (int num_workers);
+WavpackThreadPool *WavpackStreamCreateExecutorPool (WavpackTaskExecutor executor, void *executor_id, int concurrency);
+void WavpackStreamDestroyThreadPool (WavpackThreadPool *pool);
+int WavpackStreamAttachThreadPool (WavpackContext *wpc, WavpackThreadPool *pool, int max_frames);
+WavpackContext *WavpackStreamOpenPushDecoder (char *error, int flags, int norm_offset);
+int WavpackStreamPushData (WavpackContext *wpc, void *data, int32_t bcount);
+WavpackContext *WavpackStreamOpenJitterBuffer (char *error, int flags, int norm_offset,
+    uint32_t period_samples, uint32_t min_delay, uint32_t max_delay);
+int WavpackStreamJitterPutFrame (WavpackContext *wpc, void *data, int32_t bcount, int64_t timestamp, int64_t arrival_time);
+uint32_t WavpackStreamJitterGetPeriod (WavpackContext *wpc, int32_t *buffer, int64_t now);
+int WavpackStreamGetJitterStats (WavpackContext *wpc, WavpackJitterStats *stats);
 uint32_t WavpackStreamGetNumSamples (WavpackContext *wpc);
 int64_t WavpackStreamGetNumSamples64 (WavpackContext *wpc);
 uint32_t WavpackStreamGetNumSamplesInFrame (WavpackContext *wpc);
@@ -214,6 +298,7 @@ int64_t WavpackStreamGetFileSize64 (WavpackContext *wpc);
 double WavpackStreamGetRatio (WavpackContext *wpc);
 double WavpackStreamGetAverageBitrate (WavpackContext *wpc, int count_wvc);
 double WavpackStreamGetInstantBitrate (WavpackContext *wpc);
+int64_t WavpackStreamGetMemoryUsage (WavpackContext *wpc);
 
 WavpackContext *WavpackStreamOpenFileOutput (WavpackBlockOutput blockout, void *wv_id, void *wvc_id);
 void WavpackStreamSetFileInformation (WavpackContext *wpc, char *file_extension, unsigned char file_format);
@@ -232,10 +317,20 @@ int WavpackStreamStoreMD5Sum (WavpackContext *wpc, unsigned char data [16]);
 int WavpackStreamPackInit (WavpackContext *wpc);
 int WavpackStreamPackSamples (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sample_count);
 int WavpackStreamFlushSamples (WavpackContext *wpc);
+int WavpackStreamSetEncodeThreads (WavpackContext *wpc, int num_threads);
+int WavpackStreamSetSpeedGovernor (WavpackContext *wpc, int target_percent);
+int WavpackStreamGetGovernorStats (WavpackContext *wpc, WavpackGovernorStats *stats);
+int WavpackStreamSetRateControl (WavpackContext *wpc, uint32_t kbps, uint32_t buffer_bytes);
+int WavpackStreamGetRateStats (WavpackContext *wpc, WavpackRateStats *stats);
+int WavpackStreamAddSimulcast (WavpackContext *wpc, WavpackContext *rendition);
+int WavpackStreamTransrateBlock (WavpackContext *wpc, WavpackContext *source, int32_t *sample_buffer, uint32_t sample_count);
 void WavpackStreamDiscardSamples (WavpackContext *wpc);
 void WavpackStreamUpdateNumSamples (WavpackContext *wpc, void *first_block);
 void *WavpackStreamGetWrapperLocation (void *first_block, uint32_t *size);
 double WavpackStreamGetEncodedNoise (WavpackContext *wpc, double *peak);
+uint32_t WavpackStreamSaveState (WavpackContext *wpc, void *buffer, uint32_t buffer_size);
+int WavpackStreamRestoreState (WavpackContext *wpc, void *buffer, uint32_t bcount);
+WavpackContext *WavpackStreamCloneEncoder (WavpackContext *wpc, WavpackBlockOutput blockout, void *wv_id, void *wvc_id);
 
 void WavpackStreamFloatNormalize (int32_t *values, int32_t num_values, int delta_exp);
 
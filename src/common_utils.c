@@ -344,6 +344,32 @@ WavpackContext *WavpackStreamCloseFile (WavpackContext *wpc)
     if (wpc->close_callback)
         wpc->close_callback (wpc);
 
+    if (wpc->push_decoder)
+        free_push_decoder (wpc);
+
+    if (wpc->jitter_buffer)
+        free_jitter_buffer (wpc);
+
+#ifdef ENABLE_THREADS
+    if (wpc->parallel_decoder)
+        free_parallel_decoder (wpc);
+
+    if (wpc->pack_pipeline)
+        free_pack_pipeline (wpc);
+#endif
+
+    if (wpc->speed_governor)
+        free_speed_governor (wpc);
+
+    if (wpc->rate_control)
+        free_rate_control (wpc);
+
+    if (wpc->simulcast)
+        free_simulcast (wpc);
+
+    if (wpc->transrate)
+        free_transrate (wpc);
+
     if (wpc->streams) {
         free_streams (wpc);
 
@@ -353,6 +379,11 @@ WavpackContext *WavpackStreamCloseFile (WavpackContext *wpc)
         free (wpc->streams);
     }
 
+#ifdef ENABLE_DSD
+    if (wpc->dsd_fast_tables)
+        free_dsd_fast_tables (wpc);
+#endif
+
     if (wpc->reader && wpc->reader->close && wpc->wv_in)
         wpc->reader->close (wpc->wv_in);
 
@@ -494,6 +525,62 @@ int WavpackStreamGetReducedChannels (WavpackContext *wpc)
         return 2;
 }
 
+// Return the approximate number of bytes of memory currently allocated for the
+// specified context, including its streams, the raw blocks being decoded, and
+// any wrapper, metadata, and DSD tables. This is intended for applications that
+// keep large numbers of contexts open (see OPEN_COMPACT). Not included is memory
+// belonging to the reader, or used by the parallel, push, or jitter decoders.
+
+int64_t WavpackStreamGetMemoryUsage (WavpackContext *wpc)
+{
+    int64_t bytes;
+    int si, i;
+
+    if (!wpc)
+        return 0;
+
+    bytes = sizeof (WavpackContext) + wpc->num_streams * sizeof (wpc->streams [0]) + wpc->wrapper_bytes;
+
+    for (i = 0; i < wpc->metacount; ++i)
+        bytes += sizeof (WavpackMetadata) + wpc->metadata [i].byte_length;
+
+    if (wpc->channel_reordering)
+        bytes += wpc->config.num_channels;
+
+    if (wpc->channel_identities)
+        bytes += strlen ((char *) wpc->channel_identities) + 1;
+
+    for (si = 0; si < wpc->num_streams && wpc->streams [si]; ++si) {
+        WavpackStream *wps = wpc->streams [si];
+
+        if (wpc->open_flags & OPEN_COMPACT)
+            bytes += COMPACT_STREAM_BYTES (wps->max_terms);
+        else
+            bytes += sizeof (WavpackStream);
+
+        if (wps->blockbuff)
+            bytes += ((WavpackHeader *) wps->blockbuff)->ckSize + CHUNK_SIZE_OFFSET;
+
+        if (wps->block2buff)
+            bytes += ((WavpackHeader *) wps->block2buff)->ckSize + CHUNK_SIZE_OFFSET;
+
+        if (wps->sample_buffer)
+            bytes += wpc->block_samples * ((wps->wphdr.flags & MONO_FLAG) ? 4 : 8);
+
+        if (!(wpc->open_flags & OPEN_COMPACT) && wps->ns.shaping_data)
+            bytes += wpc->block_samples * sizeof (*wps->ns.shaping_data);
+
+        if (!(wpc->open_flags & OPEN_COMPACT) && wps->dsd.ptable)
+            bytes += PTABLE_BINS * sizeof (*wps->dsd.ptable);
+    }
+
+    for (i = 0; i < wpc->num_dsd_fast_tables; ++i)
+        if (wpc->dsd_fast_tables [i])
+            bytes += sizeof (DSDFastTables);
+
+    return bytes;
+}
+
 // Free all memory allocated for raw WavPack blocks (for all allocated streams)
 // and free all additional streams. This does not free the default stream ([0])
 // which is always kept around.
@@ -518,13 +605,14 @@ void free_streams (WavpackContext *wpc)
             wpc->streams [si]->sample_buffer = NULL;
         }
 
-        if (wpc->streams [si]->dc.shaping_data) {
-            free (wpc->streams [si]->dc.shaping_data);
-            wpc->streams [si]->dc.shaping_data = NULL;
+        if (!(wpc->open_flags & OPEN_COMPACT) && wpc->streams [si]->ns.shaping_data) {
+            free (wpc->streams [si]->ns.shaping_data);
+            wpc->streams [si]->ns.shaping_data = NULL;
         }
 
 #ifdef ENABLE_DSD
-        free_dsd_tables (wpc->streams [si]);
+        if (!(wpc->open_flags & OPEN_COMPACT))
+            free_dsd_tables (wpc->streams [si]);
 #endif
 
         if (si) {
@@ -540,30 +628,46 @@ void free_streams (WavpackContext *wpc)
 #ifdef ENABLE_DSD
 void free_dsd_tables (WavpackStream *wps)
 {
-    if (wps->dsd.probabilities) {
-        free (wps->dsd.probabilities);
-        wps->dsd.probabilities = NULL;
-    }
+    wps->dsd.fast_tables = NULL;        // owned by the context (see free_dsd_fast_tables())
 
-    if (wps->dsd.summed_probabilities) {
-        free (wps->dsd.summed_probabilities);
-        wps->dsd.summed_probabilities = NULL;
+    if (wps->dsd.ptable) {
+        free (wps->dsd.ptable);
+        wps->dsd.ptable = NULL;
     }
+}
 
-    if (wps->dsd.lookup_buffer) {
-        free (wps->dsd.lookup_buffer);
-        wps->dsd.lookup_buffer = NULL;
-    }
+// Free the DSD "fast" mode decoding tables, which are kept by the context for each
+// stream index and reused for every block (see init_dsd_block_fast() in unpack_dsd.c).
 
-    if (wps->dsd.value_lookup) {
-        free (wps->dsd.value_lookup);
-        wps->dsd.value_lookup = NULL;
-    }
+void free_dsd_fast_tables (WavpackContext *wpc)
+{
+    int i;
 
-    if (wps->dsd.ptable) {
-        free (wps->dsd.ptable);
-        wps->dsd.ptable = NULL;
+    for (i = 0; i < wpc->num_dsd_fast_tables; ++i)
+        if (wpc->dsd_fast_tables [i])
+            free (wpc->dsd_fast_tables [i]);
+
+    if (wpc->dsd_fast_tables) {
+        free (wpc->dsd_fast_tables);
+        wpc->dsd_fast_tables = NULL;
     }
+
+    wpc->num_dsd_fast_tables = 0;
+}
+
+// Initialize an InvariantDivisor for the specified divisor (which must be non-zero),
+// after which divide_invariant() will return exactly the same results as division.
+
+void init_divisor (InvariantDivisor *div, uint32_t divisor)
+{
+    int log2_divisor = 0;
+
+    while (log2_divisor < 32 && (1ULL << log2_divisor) < divisor)
+        log2_divisor++;
+
+    div->multiplier = (uint32_t)((((1ULL << log2_divisor) - divisor) << 32) / divisor + 1);
+    div->shift1 = log2_divisor < 1 ? log2_divisor : 1;
+    div->shift2 = log2_divisor > 1 ? log2_divisor - 1 : 0;
 }
 #endif
 
@@ -589,6 +693,116 @@ void WavpackStreamFloatNormalize (int32_t *values, int32_t num_values, int delta
     }
 }
 
+// Blocks are handled internally with the header in the form of the WavpackHeader
+// structure (in native endian), but are stored with either the standard or the
+// large-block header (see wavpack_local.h). These functions convert between them.
+
+// Return the size of the stored header that starts at the specified location (at
+// least STANDARD_HEADER_SIZE bytes must be available), or zero if it doesn't look
+// like a valid header. These are the checks used to find blocks in a stream, so
+// the size fields are limited to what the encoder can create with each form.
+
+int stored_header_size (const unsigned char *sp)
+{
+    if (sp [0] != FOURCC [0] || sp [1] != FOURCC [1] || sp [2] != FOURCC [2] || (sp [4] & 1))
+        return 0;
+
+    if (sp [3] == FOURCC [3])
+        return ((sp [5] << 8) + sp [4] + STANDARD_CKSIZE_ADJUST >= CHUNK_SIZE_REMAINDER && sp [5] < 64 && sp [7] < 32) ?
+            STANDARD_HEADER_SIZE : 0;
+
+    if (sp [3] == FOURCC_LARGE [3]) {
+        uint32_t ckSize = sp [4] + (sp [5] << 8) + ((uint32_t) sp [6] << 16) + ((uint32_t) sp [7] << 24);
+        uint32_t block_samples = sp [8] + (sp [9] << 8) + ((uint32_t) sp [10] << 16) + ((uint32_t) sp [11] << 24);
+
+        if (ckSize >= CHUNK_SIZE_REMAINDER && ckSize < MAX_LARGE_BLOCK_BYTES && block_samples <= MAX_LARGE_BLOCK_SAMPLES)
+            return sizeof (WavpackHeader);
+    }
+
+    return 0;
+}
+
+// Convert the stored header at the specified location (which must have been checked
+// with stored_header_size() and be completely present) to the internal form, and
+// return the number of bytes it occupies.
+
+int read_stored_header (const unsigned char *sp, WavpackHeader *wphdr)
+{
+    memcpy (wphdr->ckID, sp, 4);
+
+    if (is_large_block (wphdr)) {
+        memcpy (wphdr, sp, sizeof (WavpackHeader));
+        WavpackStreamLittleEndianToNative (wphdr, WavpackHeaderFormat);
+        return sizeof (WavpackHeader);
+    }
+
+    wphdr->ckSize = sp [4] + (sp [5] << 8) + STANDARD_CKSIZE_ADJUST;
+    wphdr->block_samples = sp [6] + (sp [7] << 8);
+    wphdr->flags = sp [8] + (sp [9] << 8) + ((uint32_t) sp [10] << 16) + ((uint32_t) sp [11] << 24);
+    return STANDARD_HEADER_SIZE;
+}
+
+// Convert the internal header at the start of the specified block buffer to the stored
+// form, in place. The standard header is shorter, so it's stored at the end of the space
+// that the internal header occupied. Returns the offset of the stored block in the buffer
+// (its size is then the internal ckSize + CHUNK_SIZE_OFFSET - offset).
+
+int store_block_header (unsigned char *blockbuff)
+{
+    WavpackHeader *wphdr = (WavpackHeader *) blockbuff;
+    uint32_t ckSize, block_samples, flags;
+    unsigned char *sp;
+
+    if (is_large_block (wphdr)) {
+        WavpackStreamNativeToLittleEndian (wphdr, WavpackHeaderFormat);
+        return 0;
+    }
+
+    ckSize = wphdr->ckSize - STANDARD_CKSIZE_ADJUST;
+    block_samples = wphdr->block_samples;
+    flags = wphdr->flags;
+
+    sp = blockbuff + sizeof (WavpackHeader) - STANDARD_HEADER_SIZE;
+    memcpy (sp, blockbuff, 4);
+    sp [4] = (unsigned char) ckSize;
+    sp [5] = (unsigned char) (ckSize >> 8);
+    sp [6] = (unsigned char) block_samples;
+    sp [7] = (unsigned char) (block_samples >> 8);
+    sp [8] = (unsigned char) flags;
+    sp [9] = (unsigned char) (flags >> 8);
+    sp [10] = (unsigned char) (flags >> 16);
+    sp [11] = (unsigned char) (flags >> 24);
+
+    return sizeof (WavpackHeader) - STANDARD_HEADER_SIZE;
+}
+
+// Calculate the block checksum (which covers the stored header and the data up to the
+// checksum itself) given the internal header and the data following it, in file format.
+
+uint32_t block_checksum (WavpackHeader *wphdr, unsigned char *data, unsigned char *endptr)
+{
+    WavpackHeader header = *wphdr;
+    uint32_t csum = (uint32_t) -1;
+    unsigned char *dp = (unsigned char *) &header + store_block_header ((unsigned char *) &header);
+#ifdef BITSTREAM_SHORTS
+    uint16_t *csptr = (uint16_t*) data;
+    int wcount = (int)(endptr - data) >> 1;
+#endif
+
+    for (; dp < (unsigned char *) (&header + 1); dp += 2)
+        csum = (csum * 3) + dp [0] + (dp [1] << 8);
+
+#ifdef BITSTREAM_SHORTS
+    while (wcount--)
+        csum = (csum * 3) + *csptr++;
+#else
+    for (dp = data; dp < endptr; dp += 2)
+        csum = (csum * 3) + dp [0] + (dp [1] << 8);
+#endif
+
+    return csum;
+}
+
 void WavpackStreamLittleEndianToNative (void *data, char *format)
 {
     unsigned char *cp = (unsigned char *) data;
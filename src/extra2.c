@@ -33,6 +33,11 @@
 
 #define LOG_LIMIT 6912
 
+// With warm searching, this is how many neighboring decorrelation specs in a row
+// can fail to improve on the best one before we stop looking (see CONFIG_WARM_SEARCH).
+
+#define WARM_SEARCH_MISSES 2
+
 //#define EXTRA_DUMP        // dump generated filter data to error_line()
 
 #ifdef OPT_ASM_X86
@@ -642,7 +647,7 @@ static void analyze_stereo (WavpackContext *wpc, int32_t *samples, int do_sample
 static void stereo_add_noise (WavpackStream *wps, int32_t *lptr, int32_t *rptr)
 {
     int shaping_weight, new = wps->wphdr.flags & NEW_SHAPING;
-    short *shaping_array = wps->dc.shaping_array;
+    short *shaping_array = wps->ns.shaping_array;
     int32_t error [2], temp, cnt;
 
     scan_word (wps, rptr, wps->wphdr.block_samples, -1);
@@ -707,7 +712,7 @@ void execute_stereo (WavpackContext *wpc, int32_t *samples, int no_history, int
     int32_t num_samples = wps->wphdr.block_samples;
     int32_t buf_size = sizeof (int32_t) * num_samples * 2;
     uint32_t best_size = (uint32_t) -1, size;
-    int log_limit, force_js = 0, force_ts = 0, pi, i;
+    int log_limit, force_js = 0, force_ts = 0, warm, misses = 0, pi, i;
 
 #ifdef SKIP_DECORRELATION
     CLEAR (wps->decorr_passes);
@@ -772,7 +777,14 @@ void execute_stereo (WavpackContext *wpc, int32_t *samples, int no_history, int
         no_history = 1;
     }
 
-    if (no_history || wps->num_passes >= 7)
+    // With 7 or more passes, the search normally starts over with each block. With warm
+    // searching (and history), the search instead starts with the previous block's
+    // winner and then tries the specs that differ from it by one bit (starting with
+    // the lowest bit), stopping early when several in a row do not improve on it.
+
+    warm = !no_history && wps->num_passes >= 7 && (wpc->config.flags & CONFIG_WARM_SEARCH);
+
+    if (no_history || (wps->num_passes >= 7 && !warm))
         wps->best_decorr = wps->mask_decorr = 0;
 
     for (pi = 0; pi < wps->num_passes;) {
@@ -781,6 +793,12 @@ void execute_stereo (WavpackContext *wpc, int32_t *samples, int no_history, int
 
         if (!pi)
             c = wps->best_decorr;
+        else if (warm) {
+            if (!wps->mask_decorr || misses == WARM_SEARCH_MISSES)
+                break;
+
+            c = wps->best_decorr ^ wps->mask_decorr;
+        }
         else {
             if (wps->mask_decorr == 0)
                 c = 0;
@@ -855,9 +873,14 @@ void execute_stereo (WavpackContext *wpc, int32_t *samples, int no_history, int
             wps->num_terms = nterms;
             wps->best_decorr = c;
             best_size = size;
+            misses = 0;
         }
+        else
+            misses++;
 
-        if (pi++)
+        if (warm)
+            wps->mask_decorr = pi++ ? ((wps->mask_decorr << 1) & (wps->num_decorrs - 1)) : 1;
+        else if (pi++)
             wps->mask_decorr = wps->mask_decorr ? ((wps->mask_decorr << 1) & (wps->num_decorrs - 1)) : 1;
     }
 
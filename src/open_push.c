@@ -0,0 +1,430 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// open_push.c
+
+// This module provides a "push" decoder for event-driven applications. Rather
+// than having the library pull data through a reader callback (and treating
+// a short read as the end of the stream) the application hands the decoder
+// whatever bytes it happens to have with WavpackStreamPushData(), and these
+// can be split anywhere (even in the middle of a block header). Only complete
+// frames are decoded, so WavpackStreamUnpackSamples() never blocks and simply
+// returns 0 when more data is required. Internally we buffer only the bytes
+// of the frame currently being assembled. Correction data is not supported
+// in this mode.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+// The most input that will be buffered. Only the frame being assembled is kept
+// (garbage is discarded as soon as it's seen) so this is only reached when the
+// application pushes data without unpacking it, or if a single frame is larger
+// than this (which would require several maximum-size large blocks).
+
+#define MAX_PUSH_BYTES 0x4000000
+
+typedef struct {
+    unsigned char *data;
+    uint32_t bytes, alloc;
+    int32_t *samples;
+    uint32_t num_samples, samples_returned;
+    int format_known;
+} PushDecoder;
+
+// The context needs a reader for the functions that query the input directly (like
+// WavpackStreamGetMD5Sum() looking for information at the end of the file), but all
+// the data here arrives via WavpackStreamPushData(), so this reader is just stubs.
+
+static int32_t push_read_bytes (void *id, void *data, int32_t bcount) { return 0; }
+static int32_t push_write_bytes (void *id, void *data, int32_t bcount) { return 0; }
+static int64_t push_get_pos (void *id) { return 0; }
+static int push_set_pos_abs (void *id, int64_t pos) { return -1; }
+static int push_set_pos_rel (void *id, int64_t delta, int mode) { return -1; }
+static int push_push_back_byte (void *id, int c) { return -1; }
+static int64_t push_get_length (void *id) { return 0; }
+static int push_can_seek (void *id) { return 0; }
+
+static WavpackReader64 push_reader = {
+    push_read_bytes, push_write_bytes, push_get_pos, push_set_pos_abs, push_set_pos_rel,
+    push_push_back_byte, push_get_length, push_can_seek, NULL, NULL
+};
+
+// Open a context for push-mode decoding. The flags and norm_offset parameters
+// are the same as for WavpackStreamOpenFileInputEx64(), except that OPEN_WVC
+// is ignored. Note that the format information (channels, sample rate, etc.)
+// is not available until enough data has been pushed to complete the first
+// frame, at which point WavpackStreamGetNumChannels() will return non-zero.
+// Only the format of the first frame is used; subsequent frames that decode
+// to a different number of channels are discarded and flagged as errors.
+
+WavpackContext *WavpackStreamOpenPushDecoder (char *error, int flags, int norm_offset)
+{
+    WavpackContext *wpc = malloc (sizeof (WavpackContext));
+    PushDecoder *pd;
+
+    if (!wpc) {
+        if (error) strcpy (error, "can't allocate memory");
+        return NULL;
+    }
+
+    CLEAR (*wpc);
+    wpc->reader = &push_reader;
+    wpc->total_samples = -1;
+    wpc->norm_offset = norm_offset;
+    wpc->max_streams = OLD_MAX_STREAMS;     // use this until overwritten with actual number
+    wpc->open_flags = flags & ~OPEN_WVC;
+
+    wpc->streams = malloc ((wpc->num_streams = 1) * sizeof (wpc->streams [0]));
+    wpc->push_decoder = pd = malloc (sizeof (PushDecoder));
+
+    if (!wpc->streams || !pd) {
+        if (error) strcpy (error, "can't allocate memory");
+        return WavpackStreamCloseFile (wpc);
+    }
+
+    CLEAR (*pd);
+    wpc->streams [0] = malloc (sizeof (WavpackStream));
+
+    if (!wpc->streams [0]) {
+        if (error) strcpy (error, "can't allocate memory");
+        return WavpackStreamCloseFile (wpc);
+    }
+
+    CLEAR (*wpc->streams [0]);
+    return wpc;
+}
+
+// Append the specified bytes to the decoder's input buffer. These may be any
+// portion of the stream, and there are no alignment requirements. A return of
+// FALSE indicates that memory could not be allocated, that the data would push
+// the buffered input past MAX_PUSH_BYTES (in which case nothing is appended and
+// the application should unpack the samples available before pushing more), or
+// that the context is not a push decoder.
+
+static int decode_pushed_frame (WavpackContext *wpc);
+
+int WavpackStreamPushData (WavpackContext *wpc, void *data, int32_t bcount)
+{
+    PushDecoder *pd = wpc->push_decoder;
+
+    if (!pd || bcount < 0)
+        return FALSE;
+
+    if ((uint32_t) bcount > MAX_PUSH_BYTES - pd->bytes) {
+        strcpy (wpc->error_message, "too much data pushed without unpacking");
+        return FALSE;
+    }
+
+    if (pd->bytes + bcount > pd->alloc) {
+        uint32_t new_alloc = pd->alloc ? pd->alloc : 4096;
+        unsigned char *new_data;
+
+        while (new_alloc < pd->bytes + bcount)      // can't overflow, limited by MAX_PUSH_BYTES
+            new_alloc *= 2;
+
+        new_data = realloc (pd->data, new_alloc);
+
+        if (!new_data) {
+            strcpy (wpc->error_message, "can't allocate memory");
+            return FALSE;
+        }
+
+        pd->data = new_data;
+        pd->alloc = new_alloc;
+    }
+
+    memcpy (pd->data + pd->bytes, data, bcount);
+    pd->bytes += bcount;
+
+    // if we don't know the format yet, try to get it from the first frame now
+
+    if (!pd->format_known)
+        decode_pushed_frame (wpc);
+
+    return TRUE;
+}
+
+// This is the push-mode version of WavpackStreamUnpackSamples() and is called
+// from there for push decoders. Samples are returned only from frames that
+// have been completely received, so the return value may be less than the
+// number requested. A return of 0 means that more data must be pushed.
+
+uint32_t unpack_samples_pushed (WavpackContext *wpc, int32_t *buffer, uint32_t samples)
+{
+    int num_channels = wpc->reduced_channels ? wpc->reduced_channels : wpc->config.num_channels;
+    PushDecoder *pd = wpc->push_decoder;
+    uint32_t samples_unpacked = 0;
+    int32_t *bptr = buffer;
+
+    while (samples) {
+        uint32_t samples_to_copy;
+
+        if (pd->samples_returned == pd->num_samples && !decode_pushed_frame (wpc))
+            break;
+
+        samples_to_copy = pd->num_samples - pd->samples_returned;
+
+        if (samples_to_copy > samples)
+            samples_to_copy = samples;
+
+        memcpy (bptr, pd->samples + pd->samples_returned * num_channels, samples_to_copy * num_channels * sizeof (int32_t));
+        bptr += samples_to_copy * num_channels;
+        pd->samples_returned += samples_to_copy;
+        wpc->streams [0]->sample_index += samples_to_copy;
+        samples_unpacked += samples_to_copy;
+        samples -= samples_to_copy;
+    }
+
+#ifdef ENABLE_DSD
+    if (wpc->decimation_context)
+        decimate_dsd_run (wpc->decimation_context, buffer, samples_unpacked);
+#endif
+
+    return samples_unpacked;
+}
+
+// Look at the block starting at the specified offset in the input buffer and
+// return its total size in bytes (including the header), 0 if the block is not
+// completely in the buffer yet, or -1 if there is no valid block here. If the
+// header is valid then it's also returned (in the internal form). The header
+// check is the same one performed by read_next_header().
+
+static int32_t check_block (WavpackContext *wpc, uint32_t offset, WavpackHeader *wphdr)
+{
+    PushDecoder *pd = wpc->push_decoder;
+    unsigned char *bp = pd->data + offset;
+    int header_bytes;
+    uint32_t block_bytes;
+
+    if (pd->bytes - offset < STANDARD_HEADER_SIZE)
+        return 0;
+
+    if (!(header_bytes = stored_header_size (bp)))
+        return -1;
+
+    if (pd->bytes - offset < (uint32_t) header_bytes)
+        return 0;
+
+    read_stored_header (bp, wphdr);
+    block_bytes = wphdr->ckSize + CHUNK_SIZE_OFFSET - (sizeof (WavpackHeader) - header_bytes);
+
+    if (pd->bytes - offset < block_bytes)
+        return 0;
+
+    return verify_stored_block (bp, !(wpc->open_flags & OPEN_NO_CHECKSUM)) ? (int32_t) block_bytes : -1;
+}
+
+// Discard the specified number of bytes from the front of the input buffer.
+
+static void consume_bytes (PushDecoder *pd, uint32_t bcount)
+{
+    if (bcount < pd->bytes)
+        memmove (pd->data, pd->data + bcount, pd->bytes - bcount);
+
+    pd->bytes -= bcount;
+}
+
+// Find the first complete frame at the front of the input buffer (discarding
+// any garbage and any damaged frames encountered along the way) and return
+// its size in bytes, or 0 if more data is required. Blocks without audio are
+// processed on the main context (to pick up metadata like MD5 sums) and then
+// discarded. The header of the last block in the frame is returned. Until the
+// first frame has been decoded we don't know how many streams there can be, so
+// only the final block flag ends the frame (rather than OLD_MAX_STREAMS, which
+// would break up the first frame of a file with more than 8 streams).
+
+static uint32_t find_frame (WavpackContext *wpc, WavpackHeader *wphdr)
+{
+    PushDecoder *pd = wpc->push_decoder;
+    WavpackStream *wps = wpc->streams [0];
+    int max_streams = pd->format_known ? wpc->max_streams : NEW_MAX_STREAMS;
+    uint32_t frame_bytes;
+    int32_t block_bytes;
+
+    while (1) {
+        unsigned char *sp = pd->bytes ? memchr (pd->data, FOURCC [0], pd->bytes) : NULL;
+        int num_blocks = 0;
+
+        // discard everything up to the next possible header
+
+        consume_bytes (pd, sp ? (uint32_t)(sp - pd->data) : pd->bytes);
+        block_bytes = check_block (wpc, 0, wphdr);
+
+        if (!block_bytes)
+            return 0;
+
+        if (block_bytes < 0) {
+            consume_bytes (pd, 1);
+            continue;
+        }
+
+        // blocks with no audio are processed here and discarded
+
+        if (!wphdr->block_samples) {
+            wps->blockbuff = malloc (wphdr->ckSize + CHUNK_SIZE_OFFSET);
+
+            if (wps->blockbuff) {
+                memcpy (wps->blockbuff, wphdr, sizeof (WavpackHeader));
+                memcpy (wps->blockbuff + sizeof (WavpackHeader), pd->data + stored_header_bytes (wphdr),
+                    wphdr->ckSize - CHUNK_SIZE_REMAINDER);
+                memcpy (&wps->wphdr, wphdr, sizeof (WavpackHeader));
+                wps->init_done = FALSE;
+
+                if (!unpack_init (wpc))
+                    wpc->crc_errors++;
+
+                free_streams (wpc);
+            }
+
+            consume_bytes (pd, block_bytes);
+            continue;
+        }
+
+        // orphaned blocks (not at the start of a frame) are discarded
+
+        if (!(wphdr->flags & INITIAL_BLOCK)) {
+            consume_bytes (pd, block_bytes);
+            continue;
+        }
+
+        // now make sure the whole frame is here (the blocks must be contiguous)
+
+        for (frame_bytes = 0; 1; frame_bytes += block_bytes) {
+            WavpackHeader next_hdr;
+
+            if (frame_bytes && (block_bytes = check_block (wpc, frame_bytes, &next_hdr)) > 0) {
+                if ((next_hdr.flags & INITIAL_BLOCK) || next_hdr.block_samples != wphdr->block_samples)
+                    block_bytes = -1;
+                else
+                    memcpy (wphdr, &next_hdr, sizeof (WavpackHeader));
+            }
+
+            if (block_bytes <= 0 || (wphdr->flags & FINAL_BLOCK) || ++num_blocks == max_streams)
+                break;
+        }
+
+        if (!block_bytes)
+            return 0;
+
+        // a damaged frame is discarded (and flagged as an error)
+
+        if (block_bytes < 0) {
+            consume_bytes (pd, frame_bytes);
+            wpc->crc_errors++;
+            continue;
+        }
+
+        return frame_bytes + block_bytes;
+    }
+}
+
+// Decode the next complete frame in the input buffer into the internal sample
+// buffer. Returns TRUE if a new frame is available, or FALSE if more data is
+// required.
+
+static int decode_pushed_frame (WavpackContext *wpc)
+{
+    PushDecoder *pd = wpc->push_decoder;
+    WavpackStream *wps = wpc->streams [0];
+    uint32_t frame_bytes;
+    WavpackHeader wphdr;
+    char error [80];
+
+    while ((frame_bytes = find_frame (wpc, &wphdr))) {
+        int num_channels, open_flags = wpc->open_flags & (OPEN_2CH_MAX | OPEN_NORMALIZE | OPEN_DSD_NATIVE | OPEN_DSD_AS_PCM);
+        WavpackContext *raw_wpc;
+
+        // DSD decimation has history that spans frames, so that is done on the main context
+
+        if (open_flags & OPEN_DSD_AS_PCM)
+            open_flags = (open_flags & ~OPEN_DSD_AS_PCM) | OPEN_DSD_NATIVE;
+
+        raw_wpc = WavpackStreamOpenRawDecoder (pd->data, frame_bytes, NULL, 0, 0, error, open_flags, wpc->norm_offset);
+
+        if (!raw_wpc) {
+            strcpy (wpc->error_message, error);
+            consume_bytes (pd, frame_bytes);
+            wpc->crc_errors++;
+            continue;
+        }
+
+        // the first frame provides the format information for the context (but
+        // don't lose an MD5 sum that might have been in an earlier metadata block)
+
+        if (!pd->format_known) {
+            unsigned char md5_checksum [16], md5_read = wpc->config.md5_read;
+
+            memcpy (md5_checksum, wpc->config.md5_checksum, sizeof (md5_checksum));
+            wpc->config = raw_wpc->config;
+            wpc->config.md5_read = md5_read;
+            memcpy (wpc->config.md5_checksum, md5_checksum, sizeof (md5_checksum));
+
+            wpc->reduced_channels = raw_wpc->reduced_channels;
+            wpc->max_streams = raw_wpc->max_streams;
+            wpc->version_five = raw_wpc->version_five;
+            memcpy (&wps->wphdr, &raw_wpc->streams [0]->wphdr, sizeof (WavpackHeader));
+
+            if ((wps->wphdr.flags & DSD_FLAG) && (wpc->open_flags & OPEN_DSD_AS_PCM) && !(wpc->open_flags & OPEN_DSD_NATIVE)) {
+#ifdef ENABLE_DSD
+                wpc->decimation_context = decimate_dsd_init (wpc->reduced_channels ?
+                    wpc->reduced_channels : wpc->config.num_channels);
+#endif
+                wpc->config.bytes_per_sample = 3;
+                wpc->config.bits_per_sample = 24;
+            }
+
+            pd->format_known = TRUE;
+        }
+
+        num_channels = wpc->reduced_channels ? wpc->reduced_channels : wpc->config.num_channels;
+
+        if (pd->samples)
+            free (pd->samples);
+
+        pd->num_samples = pd->samples_returned = 0;
+        pd->samples = malloc (wphdr.block_samples * num_channels * sizeof (int32_t));
+
+        if (pd->samples && (raw_wpc->reduced_channels ? raw_wpc->reduced_channels : raw_wpc->config.num_channels) == num_channels) {
+            pd->num_samples = wphdr.block_samples;
+
+            if (WavpackStreamUnpackSamples (raw_wpc, pd->samples, pd->num_samples) != pd->num_samples)
+                wpc->crc_errors++;
+
+            wpc->crc_errors += raw_wpc->crc_errors;
+
+            if (raw_wpc->lossy_blocks)
+                wpc->lossy_blocks = TRUE;
+        }
+        else
+            wpc->crc_errors++;
+
+        WavpackStreamCloseFile (raw_wpc);
+        consume_bytes (pd, frame_bytes);
+
+        if (pd->num_samples)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Free all resources used by a push decoder (called from WavpackStreamCloseFile()).
+
+void free_push_decoder (WavpackContext *wpc)
+{
+    PushDecoder *pd = wpc->push_decoder;
+
+    if (pd) {
+        if (pd->data) free (pd->data);
+        if (pd->samples) free (pd->samples);
+        free (pd);
+        wpc->push_decoder = NULL;
+    }
+}
@@ -36,7 +36,7 @@ WavpackContext *WavpackStreamOpenFileInputEx64 (WavpackReader64 *reader, void *w
     WavpackContext *wpc = malloc (sizeof (WavpackContext));
     WavpackStream *wps;
     int num_blocks = 0;
-    uint32_t bcount;
+    int64_t bcount;
 
     if (!wpc) {
         if (error) strcpy (error, "can't allocate memory");
@@ -51,6 +51,7 @@ WavpackContext *WavpackStreamOpenFileInputEx64 (WavpackReader64 *reader, void *w
     wpc->norm_offset = norm_offset;
     wpc->max_streams = OLD_MAX_STREAMS;     // use this until overwritten with actual number
     wpc->open_flags = flags;
+    wpc->resync_limit = (flags & OPEN_NO_SKIP_LIMIT) ? 0 : DEFAULT_RESYNC_LIMIT;
 
     wpc->filelen = wpc->reader->get_length (wpc->wv_in);
 
@@ -60,19 +61,18 @@ WavpackContext *WavpackStreamOpenFileInputEx64 (WavpackReader64 *reader, void *w
         return WavpackStreamCloseFile (wpc);
     }
 
-    wpc->streams [0] = wps = malloc (sizeof (WavpackStream));
+    wpc->streams [0] = wps = alloc_stream (wpc);
     if (!wps) {
         if (error) strcpy (error, "can't allocate memory");
         return WavpackStreamCloseFile (wpc);
     }
-    CLEAR (*wps);
 
     while (!wps->wphdr.block_samples) {
 
         wpc->filepos = wpc->reader->get_pos (wpc->wv_in);
-        bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr);
+        bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr, wpc->resync_limit, flags);
 
-        if (bcount == (uint32_t) -1 ||
+        if (bcount == -1 ||
             (!wps->wphdr.block_samples && num_blocks++ > 16)) {
                 if (error) strcpy (error, "not compatible with this version of WavPack file!");
                 return WavpackStreamCloseFile (wpc);
@@ -93,7 +93,7 @@ WavpackContext *WavpackStreamOpenFileInputEx64 (WavpackReader64 *reader, void *w
         }
 
         // if block does not verify, flag error, free buffer, and continue
-        if (!WavpackStreamVerifySingleBlock (wps->blockbuff, !(flags & OPEN_NO_CHECKSUM))) {
+        if (!verify_block_buff (wps->blockbuff, !(flags & OPEN_NO_CHECKSUM))) {
             wps->wphdr.block_samples = 0;
             free (wps->blockbuff);
             wps->blockbuff = NULL;
@@ -125,6 +125,7 @@ WavpackContext *WavpackStreamOpenFileInputEx64 (WavpackReader64 *reader, void *w
             return WavpackStreamCloseFile (wpc);
         }
 
+        wps = wpc->streams [0];     // might have been reallocated (compact mode)
         wps->init_done = TRUE;
     }
 
@@ -223,9 +224,9 @@ char *WavpackStreamGetFileExtension (WavpackContext *wpc)
 // where all the metadata blocks are scanned including those that contain
 // bitstream data.
 
-static int read_metadata_buff (WavpackMetadata *wpmd, unsigned char *blockbuff, unsigned char **buffptr);
 static int process_metadata (WavpackContext *wpc, WavpackMetadata *wpmd);
 static void bs_open_read (Bitstream *bs, void *buffer_start, void *buffer_end);
+static int fit_compact_stream (WavpackContext *wpc);
 
 int unpack_init (WavpackContext *wpc)
 {
@@ -233,15 +234,36 @@ int unpack_init (WavpackContext *wpc)
     unsigned char *blockptr, *block2ptr;
     WavpackMetadata wpmd;
 
+    // compact streams have no room for DSD state, and might have to grow (and move)
+    // to accommodate the decorrelation passes of this block
+
+    if (wpc->open_flags & OPEN_COMPACT) {
+        if (wps->wphdr.flags & DSD_FLAG) {
+            strcpy (wpc->error_message, "can't decode DSD audio in compact mode!");
+            wps->mute_error = TRUE;
+            return FALSE;
+        }
+
+        if (!fit_compact_stream (wpc)) {
+            wps->mute_error = TRUE;
+            return FALSE;
+        }
+
+        wps = wpc->streams [wpc->current_stream];
+        memset (wps->decorr_passes, 0, wps->max_terms * sizeof (struct decorr_pass));
+    }
+    else {
+        wps->dsd.ready = 0;
+        CLEAR (wps->decorr_passes);
+    }
+
     wps->num_terms = 0;
     wps->mute_error = FALSE;
     wps->crc = wps->crc_x = 0xffffffff;
-    wps->crc_wv_bytes = wps->crc_wvx_bytes = 0;
-    wps->dsd.ready = 0;
+    wps->crc_wv_bytes = wps->crc_wvx_bytes = wps->constant_block = 0;
     CLEAR (wps->wvbits);
     CLEAR (wps->wvcbits);
     CLEAR (wps->wvxbits);
-    CLEAR (wps->decorr_passes);
     CLEAR (wps->dc);
     CLEAR (wps->w);
 
@@ -274,7 +296,7 @@ int unpack_init (WavpackContext *wpc)
             }
     }
 
-    if (wps->wphdr.block_samples && ((wps->wphdr.flags & DSD_FLAG) ? !wps->dsd.ready : !bs_is_open (&wps->wvbits))) {
+    if (wps->wphdr.block_samples && ((wps->wphdr.flags & DSD_FLAG) ? !wps->dsd.ready : (!bs_is_open (&wps->wvbits) && !wps->constant_block))) {
         if (bs_is_open (&wps->wvcbits))
             strcpy (wpc->error_message, "can't unpack correction files alone!");
 
@@ -296,6 +318,59 @@ int unpack_init (WavpackContext *wpc)
     return TRUE;
 }
 
+// Allocate a new stream for decoding (cleared to zeros). For compact contexts only
+// the part of the stream required for PCM decoding is allocated, initially with no
+// decorrelation passes at all (see fit_compact_stream() below).
+
+WavpackStream *alloc_stream (WavpackContext *wpc)
+{
+    size_t bytes = (wpc->open_flags & OPEN_COMPACT) ? COMPACT_STREAM_BYTES (0) : sizeof (WavpackStream);
+    WavpackStream *wps = malloc (bytes);
+
+    if (wps)
+        memset (wps, 0, bytes);
+
+    return wps;
+}
+
+// For compact contexts, make sure that the current stream has room for all the
+// decorrelation passes specified in its block (and correction block), which we
+// have to scan for before the metadata is actually processed. If the stream must
+// be enlarged it will probably move, so callers of unpack_init() must refetch their
+// stream pointers. Returns FALSE only if we run out of memory.
+
+static int fit_compact_stream (WavpackContext *wpc)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    unsigned char *buffers [2], *buffptr;
+    int max_terms = 0, i;
+    WavpackMetadata wpmd;
+
+    buffers [0] = wps->blockbuff;
+    buffers [1] = wpc->wvc_flag ? wps->block2buff : NULL;
+
+    for (i = 0; i < 2; ++i)
+        if (buffers [i])
+            for (buffptr = buffers [i] + sizeof (WavpackHeader); read_metadata_buff (&wpmd, buffers [i], &buffptr);)
+                if (wpmd.id == ID_DECORR_COMBINED && wpmd.byte_length && (*(unsigned char *) wpmd.data & 0x1f) > max_terms)
+                    max_terms = *(unsigned char *) wpmd.data & 0x1f;
+
+    if (max_terms > MAX_NTERMS)         // this will be rejected anyway
+        max_terms = MAX_NTERMS;
+
+    if (max_terms > wps->max_terms) {
+        wps = realloc (wps, COMPACT_STREAM_BYTES (max_terms));
+
+        if (!wps)
+            return FALSE;
+
+        wps->max_terms = max_terms;
+        wpc->streams [wpc->current_stream] = wps;
+    }
+
+    return TRUE;
+}
+
 //////////////////////////////// matadata handlers ///////////////////////////////
 
 // These functions handle specific metadata types and are called directly
@@ -363,6 +438,28 @@ static int read_int32_info (WavpackStream *wps, WavpackMetadata *wpmd)
     return TRUE;
 }
 
+// Read the sample value of a constant block (ID_CONSTANT_SAMPLES) into the specified
+// stream. There are 3 bytes for each channel of the stream, or none for silence.
+
+static int read_constant_samples (WavpackStream *wps, WavpackMetadata *wpmd)
+{
+    int bytecnt = wpmd->byte_length, num_values = (wps->wphdr.flags & MONO_DATA) ? 1 : 2, i;
+    unsigned char *byteptr = wpmd->data;
+
+    if ((bytecnt && bytecnt != num_values * 3) || (wps->wphdr.flags & DSD_FLAG))
+        return FALSE;
+
+    wps->constant_values [0] = wps->constant_values [1] = 0;
+
+    for (i = 0; bytecnt && i < num_values; ++i) {
+        wps->constant_values [i] = byteptr [0] | ((int32_t) byteptr [1] << 8) | ((int32_t) (signed char) byteptr [2] << 16);
+        byteptr += 3;
+    }
+
+    wps->constant_block = TRUE;
+    return TRUE;
+}
+
 static int read_float_info (WavpackStream *wps, WavpackMetadata *wpmd)
 {
     int bytecnt = wpmd->byte_length;
@@ -646,7 +743,7 @@ static int read_wrapper_data (WavpackContext *wpc, WavpackMetadata *wpmd)
     return TRUE;
 }
 
-static int read_metadata_buff (WavpackMetadata *wpmd, unsigned char *blockbuff, unsigned char **buffptr)
+int read_metadata_buff (WavpackMetadata *wpmd, unsigned char *blockbuff, unsigned char **buffptr)
 {
     WavpackHeader *wphdr = (WavpackHeader *) blockbuff;
     unsigned char *buffend = blockbuff + wphdr->ckSize + CHUNK_SIZE_OFFSET;
@@ -712,6 +809,9 @@ static int process_metadata (WavpackContext *wpc, WavpackMetadata *wpmd)
         case ID_INT32_INFO:
             return read_int32_info (wps, wpmd);
 
+        case ID_CONSTANT_SAMPLES:
+            return read_constant_samples (wps, wpmd);
+
         case ID_CHANNEL_INFO:
             return read_channel_info (wpc, wpmd);
 
@@ -745,6 +845,9 @@ static int process_metadata (WavpackContext *wpc, WavpackMetadata *wpmd)
 
         case ID_DSD_BLOCK:
 #ifdef ENABLE_DSD
+            if (wpc->open_flags & OPEN_COMPACT)     // no DSD state in compact streams
+                return FALSE;
+
             return init_dsd_block (wpc, wpmd);
 #else
             strcpy (wpc->error_message, "not configured to handle DSD WavPack files!");
@@ -868,17 +971,95 @@ int WavpackStreamGetMD5Sum (WavpackContext *wpc, unsigned char data [16])
     return FALSE;
 }
 
-// Read from current file position until a valid 32-byte WavPack 4.0 header is
-// found and read into the specified pointer. The number of bytes skipped is
-// returned. If no WavPack header is found within 1 meg, then a -1 is returned
-// to indicate the error. No additional bytes are read past the header and it
-// is returned in the processor's native endian mode. Seeking is not required.
+// Set the maximum number of bytes of garbage that will be skipped while looking for the
+// next block before the stream is considered ended (the default is 10K, and 0 means no
+// limit, as does OPEN_NO_SKIP_LIMIT on open). This should be called before unpacking
+// any samples.
 
-uint32_t read_next_header (WavpackReader64 *reader, void *id, WavpackHeader *wphdr)
+void WavpackStreamSetResyncLimit (WavpackContext *wpc, uint32_t max_bytes)
 {
-    unsigned char buffer [sizeof (*wphdr)], *sp = buffer + sizeof (*wphdr), *ep = sp;
-    uint32_t bytes_skipped = 0;
-    int bleft;
+    wpc->resync_limit = max_bytes;
+}
+
+// Used by read_next_header() with seekable input to get through a damaged region
+// quickly. The input is read a chunk at a time and searched with memchr() (which is
+// vectorized in most C libraries) for the first byte of the FOURCC, and each candidate
+// gets the same header checks as read_next_header(). We stop at the first candidate
+// that passes (or that is too close to the end of the chunk to check) and seek back so
+// that it's the next thing read. The number of bytes skipped is returned, which will be
+// more than max_bytes if the limit was reached (a negative max_bytes means no limit). At
+// EOF we also seek back to leave the last partial header (if any) for the caller to fail on.
+
+static int64_t skip_to_header (WavpackReader64 *reader, void *id, int64_t max_bytes)
+{
+    unsigned char chunk [RESYNC_CHUNK_SIZE], *sp, *ep;
+    int64_t bytes_skipped = 0;
+    int32_t bcount;
+
+    while (max_bytes < 0 || bytes_skipped <= max_bytes) {
+        if ((bcount = reader->read_bytes (id, chunk, sizeof (chunk))) < STANDARD_HEADER_SIZE) {
+            if (bcount > 0)
+                reader->set_pos_rel (id, -bcount, SEEK_CUR);
+
+            break;
+        }
+
+        for (sp = chunk, ep = chunk + bcount; (sp = memchr (sp, FOURCC [0], ep - sp)); ++sp)
+            if (ep - sp < STANDARD_HEADER_SIZE || stored_header_size (sp)) {
+                reader->set_pos_rel (id, -(int32_t)(ep - sp), SEEK_CUR);
+                return bytes_skipped + (sp - chunk);
+            }
+
+        bytes_skipped += bcount;
+    }
+
+    return bytes_skipped;
+}
+
+// Check the block whose header was just read (after skipping garbage) before accepting
+// it, by reading the whole block, verifying it, and then seeking back to just after the
+// header. This is only done with seekable input (so that a false header found in the
+// garbage doesn't swallow a real block that starts inside it). If the block can't be
+// allocated we assume it's good (and leave it to the caller's verification).
+
+static int verify_resync_block (WavpackReader64 *reader, void *id, unsigned char *header, WavpackHeader *wphdr, int verify_checksum)
+{
+    int header_bytes = stored_header_bytes (wphdr);
+    int32_t data_bytes = wphdr->ckSize + CHUNK_SIZE_OFFSET - sizeof (WavpackHeader), bcount;
+    unsigned char *block = malloc (header_bytes + data_bytes);
+    int result;
+
+    if (!block)
+        return TRUE;
+
+    memcpy (block, header, header_bytes);
+    bcount = reader->read_bytes (id, block + header_bytes, data_bytes);
+    result = bcount == data_bytes && verify_stored_block (block, verify_checksum);
+
+    if (bcount > 0)
+        reader->set_pos_rel (id, -bcount, SEEK_CUR);
+
+    free (block);
+    return result;
+}
+
+// Read from current file position until a valid WavPack header (in either the
+// standard or large-block form) is found and read into the specified pointer
+// (in the internal form). The number of bytes skipped is returned. If no WavPack
+// header is found within max_skip bytes (0 for no limit, in which case the count is
+// not limited to 32 bits either), then a -1 is returned to indicate the error. No
+// additional bytes are read past the header, and seeking is not required. But with
+// seekable input the damaged regions are scanned in chunks and, if OPEN_VERIFY_RESYNC
+// is specified in the open flags, a header found after skipping is only accepted if
+// its block verifies. Neither is possible without seeking back, so non-seekable input
+// is scanned a header's length at a time and headers that pass the field checks are
+// accepted (the block checksum, if any, is still verified before decoding).
+
+int64_t read_next_header (WavpackReader64 *reader, void *id, WavpackHeader *wphdr, uint32_t max_skip, int open_flags)
+{
+    unsigned char buffer [sizeof (*wphdr)], *sp = buffer + STANDARD_HEADER_SIZE, *ep = sp;
+    int bleft, header_bytes, seekable = -1;
+    int64_t bytes_skipped = 0;
 
     while (1) {
         if (sp < ep) {
@@ -888,23 +1069,46 @@ uint32_t read_next_header (WavpackReader64 *reader, void *id, WavpackHeader *wph
         else
             bleft = 0;
 
-        if (reader->read_bytes (id, buffer + bleft, sizeof (*wphdr) - bleft) != sizeof (*wphdr) - bleft)
+        if (reader->read_bytes (id, buffer + bleft, STANDARD_HEADER_SIZE - bleft) != STANDARD_HEADER_SIZE - bleft)
             return -1;
 
-        sp = buffer;
+        sp = buffer + 1;
+        ep = buffer + STANDARD_HEADER_SIZE;
 
-        if (*sp++ == FOURCC [0] && *sp == FOURCC [1] && *++sp == FOURCC [2] && *++sp == FOURCC [3] &&
-            !(*++sp & 1) && (sp [1] << 8) + sp [0] >= CHUNK_SIZE_REMAINDER && sp [1] < 64 && sp [3] < 32) {
-                memcpy (wphdr, buffer, sizeof (*wphdr));
-                WavpackStreamLittleEndianToNative (wphdr, WavpackHeaderFormat);
-                return bytes_skipped;
-            }
+        if ((header_bytes = stored_header_size (buffer))) {
+            if (header_bytes > STANDARD_HEADER_SIZE && reader->read_bytes (id, buffer + STANDARD_HEADER_SIZE,
+                header_bytes - STANDARD_HEADER_SIZE) != header_bytes - STANDARD_HEADER_SIZE)
+                    return -1;
+
+            read_stored_header (buffer, wphdr);
+
+            if (!bytes_skipped || !(open_flags & OPEN_VERIFY_RESYNC) || !(seekable = reader->can_seek (id)) ||
+                verify_resync_block (reader, id, buffer, wphdr, !(open_flags & OPEN_NO_CHECKSUM)))
+                    return bytes_skipped;
+
+            reader->set_pos_rel (id, 1 - header_bytes, SEEK_CUR);   // (we know we can seek here)
+            ep = sp;
+        }
 
-        while (sp < ep && *sp != FOURCC [0])
-            sp++;
+        if (!(sp = memchr (sp, FOURCC [0], ep - sp)))
+            sp = ep;
 
-        if ((bytes_skipped += (uint32_t)(sp - buffer)) > 1024 * 10)
+        bytes_skipped += sp - buffer;
+
+        if (max_skip && bytes_skipped > max_skip)
             return -1;
+
+        // when we've run out of candidates in the buffer, take the fast path if we can
+
+        if (sp == ep && seekable < 0)
+            seekable = reader->can_seek (id);
+
+        if (sp == ep && seekable) {
+            bytes_skipped += skip_to_header (reader, id, max_skip ? max_skip - bytes_skipped : -1);
+
+            if (max_skip && bytes_skipped > max_skip)
+                return -1;
+        }
     }
 }
 
@@ -960,9 +1164,9 @@ int read_wvc_block (WavpackContext *wpc)
 
     while (1) {
         file2pos = wpc->reader->get_pos (wpc->wvc_in);
-        bcount = read_next_header (wpc->reader, wpc->wvc_in, &wphdr);
+        bcount = read_next_header (wpc->reader, wpc->wvc_in, &wphdr, wpc->resync_limit, wpc->open_flags);
 
-        if (bcount == (uint32_t) -1) {
+        if (bcount == -1) {
             wps->wvc_skip = TRUE;
             wpc->crc_errors++;
             return FALSE;
@@ -993,7 +1197,7 @@ int read_wvc_block (WavpackContext *wpc)
             memcpy (wps->block2buff, &orig_wphdr, sizeof (WavpackHeader));
 
             // don't use corrupt blocks
-            if (!WavpackStreamVerifySingleBlock (wps->block2buff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
+            if (!verify_block_buff (wps->block2buff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
                 free (wps->block2buff);
                 wps->block2buff = NULL;
                 wps->wvc_skip = TRUE;
@@ -1008,7 +1212,7 @@ int read_wvc_block (WavpackContext *wpc)
         }
         else if (compare_result == -1) {
             wps->wvc_skip = TRUE;
-            wpc->reader->set_pos_rel (wpc->wvc_in, -sizeof (WavpackHeader), SEEK_CUR);
+            wpc->reader->set_pos_rel (wpc->wvc_in, -stored_header_bytes (&orig_wphdr), SEEK_CUR);
             wpc->crc_errors++;
             return TRUE;
         }
@@ -1050,7 +1254,7 @@ static int seek_eof_information (WavpackContext *wpc, int get_wrapper)
     // parsing all blocks in their entirety.
 
     while (1) {
-        uint32_t bcount = read_next_header (reader, id, &wphdr);
+        int64_t bcount = read_next_header (reader, id, &wphdr, DEFAULT_RESYNC_LIMIT, 0);
         int64_t current_pos = reader->get_pos (id);
 
         // if we just got to the same place as last time, we're stuck and need to give up
@@ -1066,7 +1270,7 @@ static int seek_eof_information (WavpackContext *wpc, int get_wrapper)
         // Since WavPack blocks are < 1 MB, that means we're in a big APE tag, or we got
         // to the end-of-file.
 
-        if (bcount == (uint32_t) -1) {
+        if (bcount == -1) {
 
             // if we have not seen any blocks at all yet, back up almost 2 MB (or to the
             // beginning of the file) and try again
@@ -1171,24 +1375,18 @@ static int seek_eof_information (WavpackContext *wpc, int get_wrapper)
     }
 }
 
-// Quickly verify the referenced block. It is assumed that the WavPack header has been converted
-// to native endian format. If a block checksum is performed, that is done in little-endian
-// (file) format. It is also assumed that the caller has made sure that the block length
-// indicated in the header is correct (we won't overflow the buffer). If a checksum is present,
-// then it is checked, otherwise we just check that all the metadata blocks are formatted
-// correctly (without looking at their contents). Returns FALSE for bad block.
+// Verify a block given its header (in the internal form) and the data that follows
+// it. This is the common part of the functions below.
 
-int WavpackStreamVerifySingleBlock (unsigned char *buffer, int verify_checksum)
+static int verify_block (WavpackHeader *wphdr, unsigned char *data, int verify_checksum)
 {
-    WavpackHeader *wphdr = (WavpackHeader *) buffer;
     uint32_t checksum_passed = 0, bcount, meta_bc;
-    unsigned char *dp, meta_id, c1, c2;
+    unsigned char *dp = data, meta_id, c1, c2;
 
-    if (strncmp (wphdr->ckID, FOURCC, 4) || wphdr->ckSize + CHUNK_SIZE_OFFSET < sizeof (WavpackHeader))
+    if (!valid_fourcc (wphdr->ckID) || wphdr->ckSize < CHUNK_SIZE_REMAINDER)
         return FALSE;
 
     bcount = wphdr->ckSize - CHUNK_SIZE_REMAINDER;
-    dp = (unsigned char *)(wphdr + 1);
 
     while (bcount >= 2) {
         meta_id = *dp++;
@@ -1211,30 +1409,12 @@ int WavpackStreamVerifySingleBlock (unsigned char *buffer, int verify_checksum)
             return FALSE;
 
         if (verify_checksum && (meta_id & ID_UNIQUE) == ID_BLOCK_CHECKSUM) {
-#ifdef BITSTREAM_SHORTS
-            uint16_t *csptr = (uint16_t*) buffer;
-#else
-            unsigned char *csptr = buffer;
-#endif
-            int wcount = (int)(dp - 2 - buffer) >> 1;
-            uint32_t csum = (uint32_t) -1;
+            uint32_t csum;
 
             if ((meta_id & ID_ODD_SIZE) || meta_bc < 2 || meta_bc > 4)
                 return FALSE;
 
-#ifdef BITSTREAM_SHORTS
-            while (wcount--)
-                csum = (csum * 3) + *csptr++;
-#else
-            WavpackStreamNativeToLittleEndian ((WavpackHeader *) buffer, WavpackHeaderFormat);
-
-            while (wcount--) {
-                csum = (csum * 3) + csptr [0] + (csptr [1] << 8);
-                csptr += 2;
-            }
-
-            WavpackStreamLittleEndianToNative ((WavpackHeader *) buffer, WavpackHeaderFormat);
-#endif
+            csum = block_checksum (wphdr, data, dp - 2);
 
             if (meta_bc == 4) {
                 if (*dp != (csum & 0xff) || dp[1] != ((csum >> 8) & 0xff) || dp[2] != ((csum >> 16) & 0xff) || dp[3] != ((csum >> 24) & 0xff))
@@ -1256,3 +1436,52 @@ int WavpackStreamVerifySingleBlock (unsigned char *buffer, int verify_checksum)
 
     return (bcount == 0) && (!verify_checksum || !(wphdr->flags & HAS_CHECKSUM) || checksum_passed);
 }
+
+// Quickly verify the referenced block, which is in the internal form (i.e., it starts
+// with the header read by read_next_header()). If a block checksum is performed, that is
+// done on the block as it is stored (with the stored header in little-endian format). It
+// is assumed that the caller has made sure that the block length indicated in the header
+// is correct (we won't overflow the buffer). If a checksum is present, then it is checked,
+// otherwise we just check that all the metadata blocks are formatted correctly (without
+// looking at their contents). Returns FALSE for bad block.
+
+int verify_block_buff (unsigned char *blockbuff, int verify_checksum)
+{
+    return verify_block ((WavpackHeader *) blockbuff, blockbuff + sizeof (WavpackHeader), verify_checksum);
+}
+
+// Verify a block exactly as it is stored (in either form), for callers that have the raw
+// stream data. The header must be valid (see stored_header_size()), and as above the whole
+// block must be present.
+
+int verify_stored_block (unsigned char *buffer, int verify_checksum)
+{
+    WavpackHeader wphdr;
+    int header_bytes = read_stored_header (buffer, &wphdr);
+
+    return verify_block (&wphdr, buffer + header_bytes, verify_checksum);
+}
+
+// Quickly verify the referenced block (in either form) as it is stored, except that the
+// header has been converted to native endian format. Otherwise this is the same as above.
+
+int WavpackStreamVerifySingleBlock (unsigned char *buffer, int verify_checksum)
+{
+    WavpackHeader wphdr;
+    uint16_t ckSize, block_samples;
+
+    memcpy (&wphdr, buffer, 4);
+
+    if (is_large_block (&wphdr)) {
+        memcpy (&wphdr, buffer, sizeof (WavpackHeader));
+        return verify_block (&wphdr, buffer + sizeof (WavpackHeader), verify_checksum);
+    }
+
+    memcpy (&ckSize, buffer + 4, sizeof (ckSize));
+    memcpy (&block_samples, buffer + 6, sizeof (block_samples));
+    memcpy (&wphdr.flags, buffer + 8, sizeof (wphdr.flags));
+    wphdr.ckSize = ckSize + STANDARD_CKSIZE_ADJUST;
+    wphdr.block_samples = block_samples;
+
+    return verify_block (&wphdr, buffer + STANDARD_HEADER_SIZE, verify_checksum);
+}
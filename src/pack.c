@@ -33,6 +33,7 @@ void pack_init (WavpackContext *wpc)
     wps->delta_decay = 2.0;
     CLEAR (wps->decorr_passes);
     CLEAR (wps->dc);
+    CLEAR (wps->ns);
 
 #ifdef SKIP_DECORRELATION
     wpc->config.xmode = 0;
@@ -64,8 +65,19 @@ void pack_init (WavpackContext *wpc)
     }
 
     if (wpc->config.flags & CONFIG_DYNAMIC_SHAPING)
-        wps->dc.shaping_data = malloc (wpc->block_samples * sizeof (*wps->dc.shaping_data));
+        wps->ns.shaping_data = malloc (wpc->block_samples * sizeof (*wps->ns.shaping_data));
 
+    set_decorr_specs (wpc, wps);
+    init_words (wps);
+}
+
+// Select the table of decorrelation specs and the number of search passes for
+// the specified stream based on the current mode (fast, high, etc.) and xmode.
+// This is done at initialization, but can also be done between blocks (e.g.,
+// by the speed governor) as long as the stream's decorrelation is reset.
+
+void set_decorr_specs (WavpackContext *wpc, WavpackStream *wps)
+{
     if (!wpc->config.xmode)
         wps->num_passes = 0;
     else if (wpc->config.xmode == 1)
@@ -91,8 +103,6 @@ void pack_init (WavpackContext *wpc)
         wps->num_decorrs = get_num_default_specs();
         wps->decorr_specs = get_default_specs();
     }
-
-    init_words (wps);
 }
 
 // Allocate room for and copy the decorrelation terms from the decorr_passes
@@ -313,6 +323,33 @@ static void write_float_info (WavpackStream *wps, WavpackMetadata *wpmd)
     wpmd->byte_length = (int32_t)(byteptr - (char *) wpmd->data);
 }
 
+// Allocate room for and copy the sample value of a constant block into the
+// specified metadata structure. This is 3 bytes for mono data or 6 bytes for
+// stereo (left first), except that digital silence is sent with no data at all.
+
+static void write_constant_samples (WavpackStream *wps, int32_t *buffer, WavpackMetadata *wpmd)
+{
+    int num_values = (wps->wphdr.flags & MONO_DATA) ? 1 : 2, i;
+    char *byteptr;
+
+    wpmd->id = ID_CONSTANT_SAMPLES;
+    wpmd->byte_length = 0;
+    wpmd->data = NULL;
+
+    if (!buffer [0] && (num_values == 1 || !buffer [1]))
+        return;
+
+    byteptr = wpmd->data = malloc (6);
+
+    for (i = 0; i < num_values; ++i) {
+        *byteptr++ = (char) (buffer [i]);
+        *byteptr++ = (char) (buffer [i] >> 8);
+        *byteptr++ = (char) (buffer [i] >> 16);
+    }
+
+    wpmd->byte_length = (int32_t)(byteptr - (char *) wpmd->data);
+}
+
 // Allocate room for and copy the multichannel information into the specified
 // metadata structure. The first byte is the total number of channels and the
 // following bytes represent the channel_mask as described for Microsoft
@@ -501,6 +538,21 @@ static void write_sample_rate (WavpackContext *wpc, WavpackMetadata *wpmd)
     wpmd->byte_length = (int32_t)(byteptr - (char *) wpmd->data);
 }
 
+// Statistics for a block of samples gathered by scan_block() in a single pass, which covers
+// everything needed from the samples before the decorrelation: whether the stereo channels
+// are identical, the redundancy in the LSBs, whether the block is constant and (in builds
+// with audio checksums) the checksum. Except for "identical", these refer to the values as
+// they will be after any fixed shift.
+
+typedef struct {
+    int32_t ordata, anddata, xordata, magdata;
+    int32_t constdata;                  // bits that change in either channel (if stereo)
+    int identical, complete, crc_valid;
+    uint32_t crc;
+} BlockScan;
+
+#define SCAN_CHUNK 32       // values per chunk (fixed so that the compiler can vectorize the loops)
+
 // Pack an entire block of samples (either mono or stereo) into a completed
 // WavPack block. This function is actually a shell for pack_samples() and
 // performs tasks like handling any shift required by the format, preprocessing
@@ -511,56 +563,126 @@ static void write_sample_rate (WavpackContext *wpc, WavpackMetadata *wpmd)
 // FALSE indicates an error.
 
 static int scan_int32_data (WavpackStream *wps, int32_t *values, int32_t num_values);
-static void scan_int32_quick (WavpackStream *wps, int32_t *values, int32_t num_values);
+static void scan_int32_quick (WavpackStream *wps, int32_t *values, int32_t num_values, BlockScan *scan);
 static void send_int32_data (WavpackStream *wps, int32_t *values, int32_t num_values);
 static int pack_samples (WavpackContext *wpc, int32_t *buffer);
+static int constant_samples (BlockScan *scan);
+static int pack_constant_samples (WavpackContext *wpc, int32_t *buffer);
+static uint32_t decorr_lossless_block (WavpackContext *wpc, int32_t *buffer, BlockScan *scan, WavpackMetadata *decorr_info);
+static int pack_lossless_block (WavpackContext *wpc, int32_t *buffer, uint32_t crc, WavpackMetadata *decorr_info);
+static int store_bitstream (unsigned char *blockbuff, uint32_t data_count, int id);
 static void bs_open_write (Bitstream *bs, void *buffer_start, void *buffer_end);
 static uint32_t bs_remain_write (Bitstream *bs);
 static uint32_t bs_close_write (Bitstream *bs);
 
-int pack_block (WavpackContext *wpc, int32_t *buffer)
+// Scan a buffer of integer samples (interleaved if stereo) for the block statistics. This is
+// done in fixed-size chunks so that the compiler can vectorize the loops, and the checksum (if
+// required) is done on each chunk while it's still in the cache. The checksum is the one used
+// in pack_samples(), which for stereo is the same as the mono version applied to the interleaved
+// values, so it's done in four independent lanes (each with a multiplier of 3^4) which are
+// combined at the end. Once the remaining samples cannot change the outcome (for most audio
+// this is after the first chunk) the scan stops, or continues with just the checksum, and
+// "complete" is cleared. The stereo channels can't be identical once they differ, the LSBs
+// can't be redundant once they're seen to be both set and clear and to differ from the next
+// bit, and the block can't be constant once any channel changes.
+
+static void scan_block (int32_t *buffer, uint32_t num_values, int stereo, int shift, int need_crc, BlockScan *scan)
 {
-    WavpackStream *wps = wpc->streams [wpc->current_stream];
-    uint32_t flags = wps->wphdr.flags, sflags = wps->wphdr.flags;
-    int32_t sample_count = wps->wphdr.block_samples, *orig_data = NULL;
-    int dynamic_shaping_done = FALSE;
+    int32_t ordata = 0, anddata = -1, xordata = 0, magdata = 0, diffdata = 0, constdata = num_values ? 0 : -1;
+    int32_t first [2], *bptr = buffer, *eptr = buffer + num_values;
+    uint32_t crc [4] = { 0, 0, 0, 0 }, crc_weight = 1;
+    int i;
+
+    first [0] = num_values ? buffer [0] : 0;
+    first [1] = stereo && num_values > 1 ? buffer [1] : first [0];
+    scan->complete = TRUE;
+
+    while (eptr - bptr >= SCAN_CHUNK) {
+        if (scan->complete)
+            for (i = 0; i < SCAN_CHUNK; i += 2) {
+                int32_t left = bptr [i], right = bptr [i + 1];
+
+                ordata |= left | right;
+                anddata &= left & right;
+                xordata |= (left ^ -((left >> shift) & 1)) | (right ^ -((right >> shift) & 1));
+                magdata |= (left ^ (left >> 31)) | (right ^ (right >> 31));
+                diffdata |= left ^ right;
+                constdata |= (left ^ first [0]) | (right ^ first [1]);
+            }
 
-    // This is done first because this code can potentially change the size of the block about to
-    // be encoded. This can happen because the dynamic noise shaping algorithm wants to send a
-    // shorter block because the desired noise-shaping profile is changing quickly. It can also
-    // be that the --merge-blocks feature wants to create a longer block because it combines areas
-    // with equal redundancy. These are not applicable for anything besides the first stream of
-    // the file and they are not applicable with float data or >24-bit data.
+        if (need_crc)
+            for (i = 0; i < SCAN_CHUNK; i += 4, crc_weight *= 81) {
+                crc [0] = crc [0] * 81 + bptr [i];
+                crc [1] = crc [1] * 81 + bptr [i + 1];
+                crc [2] = crc [2] * 81 + bptr [i + 2];
+                crc [3] = crc [3] * 81 + bptr [i + 3];
+            }
 
-    if (!wpc->current_stream && !(flags & FLOAT_DATA) && (flags & MAG_MASK) >> MAG_LSB < 24) {
-        if ((wpc->config.flags & CONFIG_DYNAMIC_SHAPING) && !wpc->config.block_samples) {
-            dynamic_noise_shaping (wpc, buffer, TRUE);
+        bptr += SCAN_CHUNK;
 
-            if (sample_count != wps->wphdr.block_samples)
-                sample_count = wps->wphdr.block_samples;
+        if (scan->complete && (diffdata || !stereo) && (constdata >> shift) &&
+            ((ordata >> shift) & 1) && !((anddata >> shift) & 1) && ((xordata >> shift) & 2)) {
+                scan->complete = FALSE;
 
-            dynamic_shaping_done = TRUE;
+                if (!need_crc)
+                    break;
         }
     }
 
-    // This code scans stereo data to check whether it can be stored as mono data
-    // (i.e., all L/R samples identical).
+    // the rest is less than a chunk (and for stereo, still whole pairs)
 
-    if (!(flags & MONO_FLAG)) {
-        int32_t lor = 0, diff = 0;
-        int32_t *sptr, *dptr, i;
+    if (scan->complete)
+        for (i = 0; bptr + i < eptr; ++i) {
+            int32_t value = bptr [i];
 
-        for (sptr = buffer, i = 0; i < (int32_t) sample_count; sptr += 2, i++) {
-            lor |= sptr [0] | sptr [1];
-            diff |= sptr [0] ^ sptr [1];
+            ordata |= value;
+            anddata &= value;
+            xordata |= value ^ -((value >> shift) & 1);
+            magdata |= value ^ (value >> 31);
+            constdata |= value ^ first [i & 1];
 
-            if (lor && diff)
-                break;
+            if (stereo)
+                diffdata |= value ^ bptr [i ^ 1];
         }
 
-        if (i == sample_count && lor && !diff) {
+    if ((scan->crc_valid = need_crc)) {
+        scan->crc = 0xffffffff * crc_weight + ((crc [0] * 3 + crc [1]) * 3 + crc [2]) * 3 + crc [3];
+
+        while (bptr < eptr)
+            scan->crc = scan->crc * 3 + *bptr++;
+    }
+
+    scan->identical = stereo && scan->complete && !diffdata && ordata;
+    scan->ordata = ordata >> shift;
+    scan->anddata = anddata >> shift;
+    scan->xordata = xordata >> shift;
+    scan->magdata = magdata >> shift;
+    scan->constdata = constdata >> shift;
+}
+
+// Prepare a block of samples for encoding. Stereo data with identical channels is
+// converted to mono (the FALSE_STEREO case) and any fixed shift is applied (for integer
+// sizes that don't fill their bytes, like 12-bit or 20-bit). The stream's header flags
+// are updated for these and also returned. The block statistics are returned in "scan"
+// (see scan_block()), and the checksum is only calculated if requested (and only valid
+// if the samples didn't have to be changed here).
+
+static uint32_t prepare_block (WavpackStream *wps, int32_t *buffer, uint32_t flags, int need_crc, BlockScan *scan)
+{
+    int32_t sample_count = wps->wphdr.block_samples;
+    int shift = (flags & SHIFT_MASK) >> SHIFT_LSB;
+
+    scan_block (buffer, (flags & MONO_FLAG) ? sample_count : sample_count * 2, !(flags & MONO_FLAG), shift, need_crc && !shift, scan);
+
+    // Stereo data can be stored as mono data if all L/R samples are identical.
+
+    if (!(flags & MONO_FLAG)) {
+        int32_t *sptr, *dptr, i;
+
+        if (scan->identical) {
             flags &= ~(JOINT_STEREO | CROSS_DECORR | HYBRID_BALANCE);
             wps->wphdr.flags = flags |= FALSE_STEREO;
+            scan->crc_valid = FALSE;
             dptr = buffer;
             sptr = buffer;
 
@@ -583,8 +705,7 @@ int pack_block (WavpackContext *wpc, int32_t *buffer)
     // This is where we handle any fixed shift which occurs when the integer size does not evenly fit
     // in bytes (like 12-bit or 20-bit) and is the same for the entire file (not based on scanning)
 
-    if (flags & SHIFT_MASK) {
-        int shift = (flags & SHIFT_MASK) >> SHIFT_LSB;
+    if (shift) {
         int mag = (flags & MAG_MASK) >> MAG_LSB;
         uint32_t cnt = sample_count;
         int32_t *ptr = buffer;
@@ -606,6 +727,101 @@ int pack_block (WavpackContext *wpc, int32_t *buffer)
         wps->wphdr.flags = flags;
     }
 
+    return flags;
+}
+
+// For integer audio of up to 24 bits, check the (prepared) block for redundancy in the LSBs
+// (see scan_int32_quick()) and if that has changed, restart the noise shaping and the entropy
+// encoder. Returns TRUE if the block is to be sent as just its constant value (see
+// pack_constant_samples()), in which case there's no decorrelation to choose for it.
+
+static int scan_int_block (WavpackContext *wpc, int32_t *buffer, uint32_t flags, BlockScan *scan)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    uint32_t sample_count = wps->wphdr.block_samples;
+
+    scan_int32_quick (wps, buffer, (flags & MONO_DATA) ? sample_count : sample_count * 2, scan);
+
+    if (wps->shift != wps->int32_zeros + wps->int32_ones + wps->int32_dups) {   // detect a change in any redundancy shifting here
+        wps->shift = wps->int32_zeros + wps->int32_ones + wps->int32_dups;
+        wps->dc.error [0] = wps->dc.error [1] = 0;                              // on a change, clear the noise-shaping error term and
+        wps->num_terms = 0;                                                     // also reset the entropy encoder (which this does)
+    }
+
+    return (wpc->config.flags & CONFIG_CONSTANT_BLOCKS) && constant_samples (scan);
+}
+
+// In some cases we need to start the decorrelation and entropy encoding from scratch. This could
+// be because we switched from stereo to mono encoding or because the magnitude of the data
+// changed, or just because this is the first block.
+
+static void start_decorr (WavpackContext *wpc, int32_t *buffer, uint32_t flags)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+
+    if (!wps->num_passes && !wps->num_terms) {
+        wps->num_passes = 1;
+
+        if (wpc->simulcast)
+            simulcast_execute (wpc, buffer, 1);
+        else if (flags & MONO_DATA)
+            execute_mono (wpc, buffer, 1, 0);
+        else
+            execute_stereo (wpc, buffer, 1, 0);
+
+        wps->num_passes = 0;
+    }
+}
+
+int pack_block (WavpackContext *wpc, int32_t *buffer)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    uint32_t flags = wps->wphdr.flags, sflags = wps->wphdr.flags;
+    int32_t sample_count = wps->wphdr.block_samples, *orig_data = NULL;
+    int dynamic_shaping_done = FALSE, num_passes = wps->num_passes, transrated = FALSE, constant = FALSE, result;
+    BlockScan scan;
+
+    // The common case of lossless integer audio up to 24 bits (without block_trigger, simulcast or
+    // dynamic noise shaping) is done in two halves, exactly as the pipelined encoder does it
+    // (see analyze_block() and pack_analyzed_block()), just without the second thread.
+
+    if (!(flags & (HYBRID_FLAG | FLOAT_DATA)) && (flags & MAG_MASK) >> MAG_LSB < 24 && !wpc->block_trigger &&
+        !wpc->simulcast && !(wpc->config.flags & CONFIG_DYNAMIC_SHAPING)) {
+            BlockAnalysis analysis;
+
+            analyze_block (wpc, buffer, &analysis);
+            result = pack_analyzed_block (wpc, buffer, &analysis);
+            free_metadata (&analysis.decorr_info);
+            return result;
+    }
+
+    // This is done first because this code can potentially change the size of the block about to
+    // be encoded. This can happen because the dynamic noise shaping algorithm wants to send a
+    // shorter block because the desired noise-shaping profile is changing quickly. It can also
+    // be that the --merge-blocks feature wants to create a longer block because it combines areas
+    // with equal redundancy. These are not applicable for anything besides the first stream of
+    // the file and they are not applicable with float data or >24-bit data.
+
+    if (!wpc->current_stream && !(flags & FLOAT_DATA) && (flags & MAG_MASK) >> MAG_LSB < 24) {
+        if ((wpc->config.flags & CONFIG_DYNAMIC_SHAPING) && !wpc->config.block_samples) {
+            if (wpc->simulcast)
+                simulcast_noise_shaping (wpc, buffer, TRUE);
+            else
+                dynamic_noise_shaping (wpc, buffer, TRUE);
+
+            if (sample_count != wps->wphdr.block_samples)
+                sample_count = wps->wphdr.block_samples;
+
+            dynamic_shaping_done = TRUE;
+        }
+    }
+
+    // The checksum is calculated with the other block statistics when it's needed, which is only
+    // for lossless integer data up to 24 bits (without block_trigger, which calculates its own).
+
+    flags = prepare_block (wps, buffer, flags, AUDIO_CHECKSUM_BYTES && !(flags & (HYBRID_FLAG | FLOAT_DATA)) &&
+        (flags & MAG_MASK) >> MAG_LSB < 24 && !wpc->block_trigger, &scan);
+
     // The regular WavPack decorrelation and entropy encoding can handle up to 24-bit integer data. If
     // we have float data or integers larger than 24-bit, then we have to potentially do extra processing.
     // For lossy encoding, we can simply convert this data in-place to 24-bit data and encode and sent
@@ -655,58 +871,65 @@ int pack_block (WavpackContext *wpc, int32_t *buffer)
         wps->num_terms = 0;
     }
     // if 24-bit integers or less we do a "quick" scan which just scans for redundancy and does NOT set the flag's "magnitude" value
-    else {
-        scan_int32_quick (wps, buffer, (flags & MONO_DATA) ? sample_count : sample_count * 2);
+    else
+        constant = scan_int_block (wpc, buffer, flags, &scan);
 
-        if (wps->shift != wps->int32_zeros + wps->int32_ones + wps->int32_dups) {   // detect a change in any redundancy shifting here
-            wps->shift = wps->int32_zeros + wps->int32_ones + wps->int32_dups;
-            wps->dc.error [0] = wps->dc.error [1] = 0;                              // on a change, clear the noise-shaping error term and
-            wps->num_terms = 0;                                                     // also reset the entropy encoder (which this does)
-        }
+    if ((wpc->config.flags & CONFIG_DYNAMIC_SHAPING) && !dynamic_shaping_done) {    // calculate dynamic noise profile
+        if (wpc->simulcast)
+            simulcast_noise_shaping (wpc, buffer, FALSE);
+        else
+            dynamic_noise_shaping (wpc, buffer, FALSE);
     }
 
-    if ((wpc->config.flags & CONFIG_DYNAMIC_SHAPING) && !dynamic_shaping_done)      // calculate dynamic noise profile
-        dynamic_noise_shaping (wpc, buffer, FALSE);
+    // When transrating, the decorrelation comes from the source block (see pack_transrate.c),
+    // so no search is done for this block.
 
-    // In some cases we need to start the decorrelation and entropy encoding from scratch. This
-    // could be because we switched from stereo to mono encoding or because the magnitude of
-    // the data changed, or just because this is the first block.
+    if (wpc->transrate && !constant && (flags & HYBRID_FLAG) && transrate_decorr (wpc)) {
+        wps->num_passes = 0;
+        transrated = TRUE;
+    }
+    else if (!constant)
+        start_decorr (wpc, buffer, flags);
 
-    if (!wps->num_passes && !wps->num_terms) {
-        wps->num_passes = 1;
+    // actually pack the block here (lossless blocks without block_trigger are decorrelated and
+    // then coded just like the common case above) and return on an error (which pretty much can
+    // only be a block buffer overrun)
 
-        if (flags & MONO_DATA)
-            execute_mono (wpc, buffer, 1, 0);
-        else
-            execute_stereo (wpc, buffer, 1, 0);
+    if (constant)
+        result = pack_constant_samples (wpc, buffer);
+    else if (!(flags & HYBRID_FLAG) && !wpc->block_trigger) {
+        WavpackMetadata decorr_info;
+        uint32_t crc = decorr_lossless_block (wpc, buffer, &scan, &decorr_info);
 
-        wps->num_passes = 0;
+        result = pack_lossless_block (wpc, buffer, crc, &decorr_info);
+        free_metadata (&decorr_info);
     }
+    else
+        result = pack_samples (wpc, buffer);
 
-    // actually pack the block here and return on an error (which pretty much can only be a block buffer overrun)
+    wps->wphdr.flags = sflags;
 
-    if (!pack_samples (wpc, buffer)) {
-        wps->wphdr.flags = sflags;
+    if (transrated)
+        wps->num_passes = num_passes;
 
+    if (!result) {
         if (orig_data)
             free (orig_data);
 
         return FALSE;
     }
-    else
-        wps->wphdr.flags = sflags;
 
     if (sample_count != wps->wphdr.block_samples)
         sample_count = wps->wphdr.block_samples;
 
     // potentially move any unused dynamic noise shaping profile data to use next time
 
-    if (wps->dc.shaping_data) {
-        if (wps->dc.shaping_samples != sample_count)
-            memmove (wps->dc.shaping_data, wps->dc.shaping_data + sample_count,
-                (wps->dc.shaping_samples - sample_count) * sizeof (*wps->dc.shaping_data));
+    if (wps->ns.shaping_data) {
+        if (wps->ns.shaping_samples != sample_count)
+            memmove (wps->ns.shaping_data, wps->ns.shaping_data + sample_count,
+                (wps->ns.shaping_samples - sample_count) * sizeof (*wps->ns.shaping_data));
 
-        wps->dc.shaping_samples -= sample_count;
+        wps->ns.shaping_samples -= sample_count;
     }
 
     // finally, if we're doing lossless float data or lossless >24-bit integers, this is where we take the
@@ -736,28 +959,7 @@ int pack_block (WavpackContext *wpc, int32_t *buffer)
 #if AUDIO_CHECKSUM_BYTES
             WavpackMetadata wpmd;
 #endif
-            if (data_count < 512) {
-                *cptr++ = ID_WVX_BITSTREAM;
-                *cptr++ = data_count >> 1;
-                memmove (cptr, cptr + 2, data_count);
-
-                if (wpc->wvc_flag)
-                    ((WavpackHeader *) wps->block2buff)->ckSize += data_count + 2;
-                else
-                    ((WavpackHeader *) wps->blockbuff)->ckSize += data_count + 2;
-            }
-            else if (data_count != (uint32_t) -1) {
-                *cptr++ = ID_WVX_BITSTREAM | ID_LARGE;
-                *cptr++ = data_count >> 1;
-                *cptr++ = data_count >> 9;
-                *cptr++ = data_count >> 17;
-
-                if (wpc->wvc_flag)
-                    ((WavpackHeader *) wps->block2buff)->ckSize += data_count + 4;
-                else
-                    ((WavpackHeader *) wps->blockbuff)->ckSize += data_count + 4;
-            }
-            else
+            if (!store_bitstream (wpc->wvc_flag ? wps->block2buff : wps->blockbuff, data_count, ID_WVX_BITSTREAM))
                 return FALSE;
 
 #if AUDIO_CHECKSUM_BYTES
@@ -776,29 +978,23 @@ int pack_block (WavpackContext *wpc, int32_t *buffer)
     return TRUE;
 }
 
-// Quickly scan a buffer of long integer data and determine whether any
-// redundancy in the LSBs can be used to reduce the data's magnitude. If yes,
-// then the INT32_DATA flag is set and the int32 parameters are set. This
-// version is designed to terminate as soon as it figures out that no
-// redundancy is available so that it can be used for all files.
+// Using the block statistics from scan_block(), quickly determine whether any
+// redundancy in the LSBs of a buffer of long integer data can be used to reduce
+// the data's magnitude. If yes, then the INT32_DATA flag is set and the int32
+// parameters are set (and the values and statistics are shifted). The scan
+// terminates as soon as it figures out that no redundancy is available, so
+// this can be used for all files.
 
-static void scan_int32_quick (WavpackStream *wps, int32_t *values, int32_t num_values)
+static void scan_int32_quick (WavpackStream *wps, int32_t *values, int32_t num_values, BlockScan *scan)
 {
-    uint32_t magdata = 0, ordata = 0, xordata = 0, anddata = ~0;
+    uint32_t magdata = scan->magdata, ordata = scan->ordata, xordata = scan->xordata, anddata = scan->anddata;
     int total_shift = 0;
     int32_t *dp, count;
 
     wps->int32_sent_bits = wps->int32_zeros = wps->int32_ones = wps->int32_dups = 0;
 
-    for (dp = values, count = num_values; count--; dp++) {
-        magdata |= (*dp < 0) ? ~*dp : *dp;
-        xordata |= *dp ^ -(*dp & 1);
-        anddata &= *dp;
-        ordata |= *dp;
-
-        if ((ordata & 1) && !(anddata & 1) && (xordata & 2))
-            return;
-    }
+    if ((ordata & 1) && !(anddata & 1) && (xordata & 2))
+        return;
 
     wps->wphdr.flags &= ~MAG_MASK;
 
@@ -837,6 +1033,9 @@ static void scan_int32_quick (WavpackStream *wps, int32_t *values, int32_t num_v
 
         for (dp = values, count = num_values; count--; dp++)
             *dp >>= total_shift;
+
+        scan->constdata >>= total_shift;
+        scan->crc_valid = FALSE;
     }
 }
 
@@ -845,26 +1044,45 @@ static void scan_int32_quick (WavpackStream *wps, int32_t *values, int32_t num_v
 // INT32_DATA flag is set and the int32 parameters are set. If bits must still
 // be transmitted literally to get down to 24 bits (which is all the integer
 // compression code can handle) then we return TRUE to indicate that a wvx
-// stream must be created in either lossless mode.
+// stream must be created in either lossless mode. The stats are gathered in
+// fixed-size chunks so that the compiler can vectorize the loops, and the wvx
+// checksum is only calculated when we are going to write it.
 
 static int scan_int32_data (WavpackStream *wps, int32_t *values, int32_t num_values)
 {
     uint32_t magdata = 0, ordata = 0, xordata = 0, anddata = ~0;
-    uint32_t crc = 0xffffffff;
     int total_shift = 0;
     int32_t *dp, count;
+    int i;
 
     wps->int32_sent_bits = wps->int32_zeros = wps->int32_ones = wps->int32_dups = 0;
 
-    for (dp = values, count = num_values; count--; dp++) {
-        crc = crc * 9 + (*dp & 0xffff) * 3 + ((*dp >> 16) & 0xffff);
-        magdata |= (*dp < 0) ? ~*dp : *dp;
+    for (dp = values, count = num_values; count >= SCAN_CHUNK; dp += SCAN_CHUNK, count -= SCAN_CHUNK)
+        for (i = 0; i < SCAN_CHUNK; ++i) {
+            magdata |= dp [i] ^ (dp [i] >> 31);
+            xordata |= dp [i] ^ -(dp [i] & 1);
+            anddata &= dp [i];
+            ordata |= dp [i];
+        }
+
+    for (; count--; dp++) {
+        magdata |= *dp ^ (*dp >> 31);
         xordata |= *dp ^ -(*dp & 1);
         anddata &= *dp;
         ordata |= *dp;
     }
 
-    wps->crc_x = crc;
+#if AUDIO_CHECKSUM_BYTES
+    {
+        uint32_t crc = 0xffffffff;
+
+        for (dp = values, count = num_values; count--; dp++)
+            crc = crc * 9 + (*dp & 0xffff) * 3 + ((*dp >> 16) & 0xffff);
+
+        wps->crc_x = crc;
+    }
+#endif
+
     wps->wphdr.flags &= ~MAG_MASK;
 
     while (magdata) {
@@ -909,29 +1127,43 @@ static int scan_int32_data (WavpackStream *wps, int32_t *values, int32_t num_val
     if (total_shift) {
         wps->wphdr.flags |= INT32_DATA;
 
-        for (dp = values, count = num_values; count--; dp++)
-            *dp >>= total_shift;
+        for (dp = values, count = num_values; count >= SCAN_CHUNK; dp += SCAN_CHUNK, count -= SCAN_CHUNK)
+            for (i = 0; i < SCAN_CHUNK; ++i)
+                dp [i] >>= total_shift;
+
+        while (count--)
+            *dp++ >>= total_shift;
     }
 
     return wps->int32_sent_bits;
 }
 
 // For the specified buffer values and the int32 parameters stored in "wps",
-// send the literal bits required to the "wvxbits" bitstream.
+// send the literal bits required to the "wvxbits" bitstream. Because the
+// bitstream is filled LSB first, several values can be packed into a single
+// putbits() call (first value in the low bits) without changing the output.
+
+#define MAX_PUTBITS 24      // most bits we pass to putbits() in one call
 
 static void send_int32_data (WavpackStream *wps, int32_t *values, int32_t num_values)
 {
-    int sent_bits = wps->int32_sent_bits, pre_shift;
+    int sent_bits = wps->int32_sent_bits, pre_shift, per_call, i;
     int32_t mask = (1 << sent_bits) - 1;
-    int32_t count, value, *dp;
+    int32_t count, *dp;
+    uint32_t value;
+
+    if (!sent_bits)
+        return;
 
     pre_shift = wps->int32_zeros + wps->int32_ones + wps->int32_dups;
+    per_call = sent_bits < MAX_PUTBITS ? MAX_PUTBITS / sent_bits : 1;
 
-    if (sent_bits)
-        for (dp = values, count = num_values; count--; dp++) {
-            value = (*dp >> pre_shift) & mask;
-            putbits (value, sent_bits, &wps->wvxbits);
-        }
+    for (dp = values, count = num_values; count; count -= i) {
+        for (value = i = 0; i < per_call && i < count; ++i)
+            value |= (uint32_t)((*dp++ >> pre_shift) & mask) << (i * sent_bits);
+
+        putbits (value, i * sent_bits, &wps->wvxbits);
+    }
 }
 
 void send_general_metadata (WavpackContext *wpc)
@@ -1030,64 +1262,136 @@ uint32_t SCAN_MAX_MAGNITUDE (int32_t *values, int32_t num_values);
 
 #define REPACK_SAFE_NUM_TERMS 5                 // 5 terms is always okay (and we truncate to this)
 
-static int pack_samples (WavpackContext *wpc, int32_t *buffer)
+// Copy the metadata that's pending in the context (added with WavpackStreamAddMetadata() and
+// the like) into the block being created, which must already have its header.
+
+static void send_pending_metadata (WavpackContext *wpc)
 {
-    WavpackStream *wps = wpc->streams [wpc->current_stream], saved_stream;
-    uint32_t flags = wps->wphdr.flags, repack_possible, data_count, crc, crc2, i;
-    uint32_t sample_count = wps->wphdr.block_samples, repack_mask;
-    int32_t *bptr, *saved_buffer = NULL;
-    struct decorr_pass *dpp;
-    WavpackMetadata wpmd;
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
 
-    crc = crc2 = 0xffffffff;
+    if (wpc->metacount) {
+        WavpackMetadata *wpmdp = wpc->metadata;
 
-    if (!(flags & HYBRID_FLAG) && (flags & MONO_DATA) && !wpc->block_trigger) {
-        int32_t *eptr = buffer + sample_count;
+        while (wpc->metacount) {
+            copy_metadata (wpmdp, wps->blockbuff, wps->blockend);
+            wpc->metabytes -= wpmdp->byte_length;
+            free_metadata (wpmdp++);
+            wpc->metacount--;
+        }
 
-        for (bptr = buffer; bptr < eptr;)
-            crc += (crc << 1) + *bptr++;
+        free (wpc->metadata);
+        wpc->metadata = NULL;
+    }
+}
 
-        if (wps->num_passes)
-            execute_mono (wpc, buffer, !wps->num_terms, 1);
+// Store a bitstream that has just been closed (with data_count from bs_close_write()) in the
+// block as a metadata item with the given id. The bitstream was opened 4 bytes past the end of
+// the block to leave room for a large item's header, so it is moved down for a small one.
+// A return of FALSE indicates that the bitstream overflowed the block.
+
+static int store_bitstream (unsigned char *blockbuff, uint32_t data_count, int id)
+{
+    unsigned char *cptr = blockbuff + ((WavpackHeader *) blockbuff)->ckSize + CHUNK_SIZE_OFFSET;
+
+    if (!data_count)
+        return TRUE;
+
+    if (data_count < 512) {
+        *cptr++ = id;
+        *cptr++ = data_count >> 1;
+        memmove (cptr, cptr + 2, data_count);
+        ((WavpackHeader *) blockbuff)->ckSize += data_count + 2;
+    }
+    else if (data_count != (uint32_t) -1) {
+        *cptr++ = id | ID_LARGE;
+        *cptr++ = data_count >> 1;
+        *cptr++ = data_count >> 9;
+        *cptr++ = data_count >> 17;
+        ((WavpackHeader *) blockbuff)->ckSize += data_count + 4;
     }
-    else if (!(flags & HYBRID_FLAG) && !(flags & MONO_DATA) && !wpc->block_trigger) {
-        int32_t *eptr = buffer + (sample_count * 2);
+    else
+        return FALSE;
+
+    return TRUE;
+}
 
-        for (bptr = buffer; bptr < eptr; bptr += 2)
-            crc += (crc << 3) + ((uint32_t)bptr [0] << 1) + bptr [0] + bptr [1];
+// After a block that's not a multiple of MAX_TERM samples, the dpp->samples_X[] values for
+// terms 1-8 are not in their "normalized" positions, so this rotates them back (m being the
+// position of the oldest sample).
 
-        if (wps->num_passes) {
-            execute_stereo (wpc, buffer, !wps->num_terms, 1);
-            flags = wps->wphdr.flags;
+static void normalize_decorr_samples (WavpackStream *wps, int m)
+{
+    struct decorr_pass *dpp;
+    int tcount;
+
+    for (tcount = wps->num_terms, dpp = wps->decorr_passes; tcount--; dpp++)
+        if (dpp->term > 0 && dpp->term <= MAX_TERM) {
+            int32_t temp_A [MAX_TERM], temp_B [MAX_TERM];
+            int k;
+
+            memcpy (temp_A, dpp->samples_A, sizeof (dpp->samples_A));
+            memcpy (temp_B, dpp->samples_B, sizeof (dpp->samples_B));
+
+            for (k = 0; k < MAX_TERM; k++) {
+                dpp->samples_A [k] = temp_A [m];
+                dpp->samples_B [k] = temp_B [m];
+                m = (m + 1) & (MAX_TERM - 1);
+            }
         }
+}
+
+// If a block was actually repacked with fewer terms, clear the terms that were dropped and
+// return to the original term count for the next block.
+
+static void restore_num_terms (WavpackStream *wps, int num_terms)
+{
+    int ti;
+
+    for (ti = wps->num_terms; ti < num_terms; ++ti) {
+        wps->decorr_passes [ti].weight_A = wps->decorr_passes [ti].weight_B = 0;
+        CLEAR (wps->decorr_passes [ti].samples_A);
+        CLEAR (wps->decorr_passes [ti].samples_B);
     }
-    else if ((flags & HYBRID_FLAG) && (flags & MONO_DATA)) {
-        if (wps->num_passes)
+
+    wps->num_terms = num_terms;
+}
+
+// Pack a block of samples with the sample-by-sample encoders, which are required for the
+// hybrid modes (where the decorrelation has to track the decoded values) and for block_trigger
+// (where the block can end early). Lossless blocks otherwise go through decorr_lossless_block()
+// and pack_lossless_block().
+
+static int pack_samples (WavpackContext *wpc, int32_t *buffer)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream], saved_stream;
+    uint32_t flags = wps->wphdr.flags, repack_possible, data_count, crc, crc2, i;
+    uint32_t sample_count = wps->wphdr.block_samples, repack_mask;
+    struct decorr_pass *dpp;
+    WavpackMetadata wpmd;
+    int32_t *bptr;
+
+    crc = crc2 = 0xffffffff;
+
+    if ((flags & HYBRID_FLAG) && (flags & MONO_DATA)) {
+        if (wps->num_passes && wpc->simulcast)
+            simulcast_execute (wpc, buffer, !wps->num_terms);
+        else if (wps->num_passes)
             execute_mono (wpc, buffer, !wps->num_terms, 0);
     }
     else if ((flags & HYBRID_FLAG) && !(flags & MONO_DATA)) {
         if (wps->num_passes) {
-            execute_stereo (wpc, buffer, !wps->num_terms, 0);
+            if (wpc->simulcast)
+                simulcast_execute (wpc, buffer, !wps->num_terms);
+            else
+                execute_stereo (wpc, buffer, !wps->num_terms, 0);
+
             flags = wps->wphdr.flags;
         }
     }
 
     wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
     memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
-
-    if (wpc->metacount) {
-        WavpackMetadata *wpmdp = wpc->metadata;
-
-        while (wpc->metacount) {
-            copy_metadata (wpmdp, wps->blockbuff, wps->blockend);
-            wpc->metabytes -= wpmdp->byte_length;
-            free_metadata (wpmdp++);
-            wpc->metacount--;
-        }
-
-        free (wpc->metadata);
-        wpc->metadata = NULL;
-    }
+    send_pending_metadata (wpc);
 
     if (!sample_count)
         return TRUE;
@@ -1097,22 +1401,18 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
     repack_mask = (flags & MAG_MASK) >> MAG_LSB >= 16 ? 0xF0000000 : 0xFFF00000;
     saved_stream = *wps;
 
-    if (repack_possible && !(flags & HYBRID_FLAG)) {
-        saved_buffer = malloc (sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
-        memcpy (saved_buffer, buffer, sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
-    }
-
     // This code is written as a loop, but in the overwhelming majority of cases it executes only once.
     // If one of the higher modes is being used and a residual exceeds a certain threshold, then the
     // block will be repacked using fewer decorrelation terms. Note that this has only been triggered
     // by pathological audio samples designed to trigger it...in practice this might never happen. Note
     // that this only applies to the "high" and "very high" modes and only when packing directly
-    // (i.e. without the "extra" modes that will have already checked magnitude).
+    // (i.e. without the "extra" modes that will have already checked magnitude). The samples are
+    // not changed by these encoders, so the same buffer is simply encoded again.
 
     do {
-        short *shaping_array = wps->dc.shaping_array;
+        short *shaping_array = wps->ns.shaping_array;
         int tcount, lossy = FALSE, m = 0;
-        double noise_acc = 0.0, noise;
+        double noise_acc = 0.0, noise_ave = wps->ns.noise_ave, noise_max = wps->ns.noise_max, noise;
         uint32_t max_magnitude = 0;
 
         write_decorr_combined (wps, &wpmd);
@@ -1153,16 +1453,7 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
 
         /////////////////////// handle lossless mono mode /////////////////////////
 
-        if (!(flags & HYBRID_FLAG) && (flags & MONO_DATA) && !wpc->block_trigger) {
-            if (!wps->num_passes) {
-                max_magnitude = DECORR_MONO_BUFFER (buffer, wps->decorr_passes, wps->num_terms, sample_count);
-                m = sample_count & (MAX_TERM - 1);
-            }
-
-            send_words_lossless (wps, buffer, sample_count);
-            i = sample_count;
-        }
-        else if (!(flags & HYBRID_FLAG) && (flags & MONO_DATA) && wpc->block_trigger) {
+        if (!(flags & HYBRID_FLAG) && (flags & MONO_DATA)) {
 
             for (bptr = buffer, i = 0; i < sample_count; ++i) {
                 int32_t code;
@@ -1201,28 +1492,7 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
 
         //////////////////// handle the lossless stereo mode //////////////////////
 
-        else if (!(flags & HYBRID_FLAG) && !(flags & MONO_DATA) && !wpc->block_trigger) {
-            if (!wps->num_passes) {
-                if (flags & JOINT_STEREO) {
-                    int32_t *eptr = buffer + (sample_count * 2);
-
-                    for (bptr = buffer; bptr < eptr; bptr += 2)
-                        bptr [1] += ((bptr [0] -= bptr [1]) >> 1);
-                }
-
-                for (tcount = wps->num_terms, dpp = wps->decorr_passes; tcount-- ; dpp++)
-                    DECORR_STEREO_PASS (dpp, buffer, sample_count);
-
-                m = sample_count & (MAX_TERM - 1);
-
-                if (repack_possible)
-                    max_magnitude = SCAN_MAX_MAGNITUDE (buffer, sample_count * 2);
-            }
-
-            send_words_lossless (wps, buffer, sample_count);
-            i = sample_count;
-        }
-        else if (!(flags & HYBRID_FLAG) && !(flags & MONO_DATA) && wpc->block_trigger) {
+        else if (!(flags & HYBRID_FLAG) && !(flags & MONO_DATA)) {
             for (bptr = buffer, i = 0; i < sample_count; ++i) {
                 int32_t left, right, sam_A, sam_B;
 
@@ -1356,10 +1626,10 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
                     noise = code - bptr [-1];
 
                     noise_acc += noise *= noise;
-                    wps->dc.noise_ave = (wps->dc.noise_ave * 0.99) + (noise * 0.01);
+                    noise_ave = (noise_ave * 0.99) + (noise * 0.01);
 
-                    if (wps->dc.noise_ave > wps->dc.noise_max)
-                        wps->dc.noise_max = wps->dc.noise_ave;
+                    if (noise_ave > noise_max)
+                        noise_max = noise_ave;
                 }
             }
 
@@ -1497,28 +1767,15 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
                     noise += (double)(right - bptr [-1]) * (right - bptr [-1]);
 
                     noise_acc += noise /= 2.0;
-                    wps->dc.noise_ave = (wps->dc.noise_ave * 0.99) + (noise * 0.01);
+                    noise_ave = (noise_ave * 0.99) + (noise * 0.01);
 
-                    if (wps->dc.noise_ave > wps->dc.noise_max)
-                        wps->dc.noise_max = wps->dc.noise_ave;
+                    if (noise_ave > noise_max)
+                        noise_max = noise_ave;
                 }
             }
 
         if (m)
-            for (tcount = wps->num_terms, dpp = wps->decorr_passes; tcount--; dpp++)
-                if (dpp->term > 0 && dpp->term <= MAX_TERM) {
-                    int32_t temp_A [MAX_TERM], temp_B [MAX_TERM];
-                    int k;
-
-                    memcpy (temp_A, dpp->samples_A, sizeof (dpp->samples_A));
-                    memcpy (temp_B, dpp->samples_B, sizeof (dpp->samples_B));
-
-                    for (k = 0; k < MAX_TERM; k++) {
-                        dpp->samples_A [k] = temp_A [m];
-                        dpp->samples_B [k] = temp_B [m];
-                        m = (m + 1) & (MAX_TERM - 1);
-                    }
-                }
+            normalize_decorr_samples (wps, m);
 
         if (i != sample_count) {
             ((WavpackHeader *) wps->blockbuff)->block_samples = sample_count = wps->wphdr.block_samples = i;
@@ -1527,31 +1784,16 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
                 ((WavpackHeader *) wps->block2buff)->block_samples = sample_count;
         }
 
-        if (wpc->config.flags & CONFIG_CALC_NOISE)
-            wps->dc.noise_sum += noise_acc;
+        if (wpc->config.flags & CONFIG_CALC_NOISE) {
+            wps->ns.noise_sum += noise_acc;
+            wps->ns.noise_ave = noise_ave;
+            wps->ns.noise_max = noise_max;
+        }
 
         flush_word (wps);
-        data_count = bs_close_write (&wps->wvbits);
 
-        if (data_count) {
-            unsigned char *cptr = wps->blockbuff + ((WavpackHeader *) wps->blockbuff)->ckSize + CHUNK_SIZE_OFFSET;
-
-            if (data_count < 512) {
-                *cptr++ = ID_WV_BITSTREAM;
-                *cptr++ = data_count >> 1;
-                memmove (cptr, cptr + 2, data_count);
-                ((WavpackHeader *) wps->blockbuff)->ckSize += data_count + 2;
-            }
-            else if (data_count != (uint32_t) -1) {
-                *cptr++ = ID_WV_BITSTREAM | ID_LARGE;
-                *cptr++ = data_count >> 1;
-                *cptr++ = data_count >> 9;
-                *cptr++ = data_count >> 17;
-                ((WavpackHeader *) wps->blockbuff)->ckSize += data_count + 4;
-            }
-            else
-                return FALSE;
-        }
+        if (!store_bitstream (wps->blockbuff, bs_close_write (&wps->wvbits), ID_WV_BITSTREAM))
+            return FALSE;
 
 #if AUDIO_CHECKSUM_BYTES
         write_audio_checksum (&wpmd, ID_AUDIO_CHECKSUM, crc);
@@ -1562,25 +1804,8 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
         if (wpc->wvc_flag) {
             data_count = bs_close_write (&wps->wvcbits);
 
-            if (data_count && lossy) {
-                unsigned char *cptr = wps->block2buff + ((WavpackHeader *) wps->block2buff)->ckSize + CHUNK_SIZE_OFFSET;
-
-                if (data_count < 512) {
-                    *cptr++ = ID_WVC_BITSTREAM;
-                    *cptr++ = data_count >> 1;
-                    memmove (cptr, cptr + 2, data_count);
-                    ((WavpackHeader *) wps->block2buff)->ckSize += data_count + 2;
-                }
-                else if (data_count != (uint32_t) -1) {
-                    *cptr++ = ID_WVC_BITSTREAM | ID_LARGE;
-                    *cptr++ = data_count >> 1;
-                    *cptr++ = data_count >> 9;
-                    *cptr++ = data_count >> 17;
-                    ((WavpackHeader *) wps->block2buff)->ckSize += data_count + 4;
-                }
-                else
-                    return FALSE;
-            }
+            if (lossy && !store_bitstream (wps->block2buff, data_count, ID_WVC_BITSTREAM))
+                return FALSE;
 
 #if AUDIO_CHECKSUM_BYTES
             write_audio_checksum (&wpmd, ID_AUDIO_CHECKSUM, crc2);
@@ -1598,29 +1823,191 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
             wps->num_terms = REPACK_SAFE_NUM_TERMS;
             memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
             sample_count = wps->wphdr.block_samples;
+            crc = crc2 = 0xffffffff;
+        }
+        else {
+            if (wps->num_terms != saved_stream.num_terms)
+                restore_num_terms (wps, saved_stream.num_terms);
 
-            if (saved_buffer)
-                memcpy (buffer, saved_buffer, sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
+            break;
+        }
+
+    } while (1);
+
+    wps->sample_index += sample_count;
+    return TRUE;
+}
+
+// Return TRUE if every sample of each channel in the (prepared) block has the same
+// value, which scan_block() has already determined.
+
+static int constant_samples (BlockScan *scan)
+{
+    return !scan->constdata;
+}
+
+// Pack a block in which every sample of each channel has the same value (see
+// constant_samples()) into a WavPack block that contains just that value in an
+// ID_CONSTANT_SAMPLES metadata item (instead of the decorrelation and entropy
+// information and the bitstream), which the decoder expands with a simple fill.
+// This is lossless even in hybrid mode, so a correction block (if any) has no
+// audio data at all. Since every block carries its own decorrelation and entropy
+// state, that is simply reset for the next block (just as execute_mono() and
+// execute_stereo() do for silence).
+
+static int pack_constant_samples (WavpackContext *wpc, int32_t *buffer)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    uint32_t flags = wps->wphdr.flags, sample_count = wps->wphdr.block_samples;
+    WavpackMetadata wpmd;
+#if AUDIO_CHECKSUM_BYTES
+    uint32_t crc = 0xffffffff, i;
+#endif
+
+    wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
+    memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
+    send_pending_metadata (wpc);
+
+    if (flags & INT32_DATA) {
+        write_int32_info (wps, &wpmd);
+        copy_metadata (&wpmd, wps->blockbuff, wps->blockend);
+        free_metadata (&wpmd);
+    }
+
+    send_general_metadata (wpc);
+
+    write_constant_samples (wps, buffer, &wpmd);
+
+    if (!copy_metadata (&wpmd, wps->blockbuff, wps->blockend)) {
+        free_metadata (&wpmd);
+        return FALSE;
+    }
+
+    free_metadata (&wpmd);
+
+#if AUDIO_CHECKSUM_BYTES
+    if (flags & MONO_DATA)
+        for (i = 0; i < sample_count; ++i)
+            crc += (crc << 1) + buffer [0];
+    else
+        for (i = 0; i < sample_count; ++i)
+            crc += (crc << 3) + ((uint32_t)buffer [0] << 1) + buffer [0] + buffer [1];
+
+    write_audio_checksum (&wpmd, ID_AUDIO_CHECKSUM, crc);
+    copy_metadata (&wpmd, wps->blockbuff, wps->blockend);
+    free_metadata (&wpmd);
+#endif
+
+    if (wpc->wvc_flag) {
+        memcpy (wps->block2buff, &wps->wphdr, sizeof (WavpackHeader));
+
+#if AUDIO_CHECKSUM_BYTES
+        write_audio_checksum (&wpmd, ID_AUDIO_CHECKSUM, crc);
+        copy_metadata (&wpmd, wps->block2buff, wps->block2end);
+        free_metadata (&wpmd);
+#endif
+    }
+
+    if ((flags & HYBRID_SHAPE) && !wps->ns.shaping_array) {
+        wps->dc.shaping_acc [0] += wps->dc.shaping_delta [0] * (int32_t) sample_count;
+        wps->dc.shaping_acc [1] += wps->dc.shaping_delta [1] * (int32_t) sample_count;
+    }
+
+    CLEAR (wps->decorr_passes);
+    wps->num_terms = 0;
+    wps->dc.error [0] = wps->dc.error [1] = 0;
+    init_words (wps);
+
+    wps->sample_index += sample_count;
+    return TRUE;
+}
+
+// Decorrelate a lossless block (without block_trigger) in place, once it has been prepared and
+// its decorrelation has been started (if required). In the "extra" modes the decorrelation is
+// chosen here first. In the "high" and "very high" modes, if a residual exceeds a certain
+// threshold the block is decorrelated again with fewer terms (this has only been triggered by
+// pathological audio samples designed to trigger it). The decorrelation metadata for the block
+// is returned in decorr_info (which the caller must free) and the checksum of the samples is
+// the return value.
+
+static uint32_t decorr_lossless_block (WavpackContext *wpc, int32_t *buffer, BlockScan *scan, WavpackMetadata *decorr_info)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream], saved_stream;
+    uint32_t flags = wps->wphdr.flags, sample_count = wps->wphdr.block_samples;
+    uint32_t crc = 0xffffffff, repack_mask, max_magnitude;
+    int32_t *bptr, *eptr, *saved_buffer = NULL;
+    int repack_possible, tcount, m;
+    struct decorr_pass *dpp;
+
+    if (flags & MONO_DATA) {
+        if (scan->crc_valid)
+            crc = scan->crc;
+        else if (AUDIO_CHECKSUM_BYTES)
+            for (bptr = buffer, eptr = buffer + sample_count; bptr < eptr;)
+                crc += (crc << 1) + *bptr++;
+
+        if (wps->num_passes)
+            execute_mono (wpc, buffer, !wps->num_terms, 1);
+    }
+    else {
+        if (scan->crc_valid)
+            crc = scan->crc;
+        else if (AUDIO_CHECKSUM_BYTES)
+            for (bptr = buffer, eptr = buffer + (sample_count * 2); bptr < eptr; bptr += 2)
+                crc += (crc << 3) + ((uint32_t)bptr [0] << 1) + bptr [0] + bptr [1];
 
-            if ((flags & HYBRID_FLAG) || wpc->block_trigger)
-                crc = crc2 = 0xffffffff;
+        if (wps->num_passes) {
+            execute_stereo (wpc, buffer, !wps->num_terms, 1);
+            flags = wps->wphdr.flags;
         }
-        else {
-            // if we actually did repack the block with fewer terms, we detect that here
-            // and clean up so that we return to the original term count...otherwise we just
-            // free the saved_buffer (if allocated) and break out of the loop
-            if (wps->num_terms != saved_stream.num_terms) {
-                int ti;
-
-                for (ti = wps->num_terms; ti < saved_stream.num_terms; ++ti) {
-                    wps->decorr_passes [ti].weight_A = wps->decorr_passes [ti].weight_B = 0;
-                    CLEAR (wps->decorr_passes [ti].samples_A);
-                    CLEAR (wps->decorr_passes [ti].samples_B);
-                }
+    }
 
-                wps->num_terms = saved_stream.num_terms;
+    repack_possible = !wps->num_passes && wps->num_terms > REPACK_SAFE_NUM_TERMS;
+    repack_mask = (flags & MAG_MASK) >> MAG_LSB >= 16 ? 0xF0000000 : 0xFFF00000;
+    saved_stream = *wps;
+
+    if (repack_possible) {
+        saved_buffer = malloc (sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
+        memcpy (saved_buffer, buffer, sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
+    }
+
+    do {
+        max_magnitude = 0;
+        m = 0;
+
+        write_decorr_combined (wps, decorr_info);
+
+        if (!wps->num_passes) {
+            if (flags & MONO_DATA)
+                max_magnitude = DECORR_MONO_BUFFER (buffer, wps->decorr_passes, wps->num_terms, sample_count);
+            else {
+                if (flags & JOINT_STEREO)
+                    for (bptr = buffer, eptr = buffer + (sample_count * 2); bptr < eptr; bptr += 2)
+                        bptr [1] += ((bptr [0] -= bptr [1]) >> 1);
+
+                for (tcount = wps->num_terms, dpp = wps->decorr_passes; tcount-- ; dpp++)
+                    DECORR_STEREO_PASS (dpp, buffer, sample_count);
+
+                if (repack_possible)
+                    max_magnitude = SCAN_MAX_MAGNITUDE (buffer, sample_count * 2);
             }
 
+            m = sample_count & (MAX_TERM - 1);
+        }
+
+        if (m)
+            normalize_decorr_samples (wps, m);
+
+        if (repack_possible && wps->num_terms > REPACK_SAFE_NUM_TERMS && (max_magnitude & repack_mask)) {
+            *wps = saved_stream;
+            wps->num_terms = REPACK_SAFE_NUM_TERMS;
+            free_metadata (decorr_info);
+            memcpy (buffer, saved_buffer, sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
+        }
+        else {
+            if (wps->num_terms != saved_stream.num_terms)
+                restore_num_terms (wps, saved_stream.num_terms);
+
             if (saved_buffer)
                 free (saved_buffer);
 
@@ -1629,10 +2016,166 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
 
     } while (1);
 
+    return crc;
+}
+
+// Entropy code a lossless block that has been decorrelated by decorr_lossless_block() into a
+// completed WavPack block, with the decorrelation metadata from there (which the caller must
+// free) and the checksum. A return of FALSE indicates that the block buffer overflowed.
+
+static int pack_lossless_block (WavpackContext *wpc, int32_t *buffer, uint32_t crc, WavpackMetadata *decorr_info)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    uint32_t flags = wps->wphdr.flags, sample_count = wps->wphdr.block_samples;
+    WavpackMetadata wpmd;
+
+    wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
+    memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
+    send_pending_metadata (wpc);
+
+    if (!sample_count)
+        return TRUE;
+
+    copy_metadata (decorr_info, wps->blockbuff, wps->blockend);
+
+    write_entropy_combined (wps, &wpmd);
+    copy_metadata (&wpmd, wps->blockbuff, wps->blockend);
+    free_metadata (&wpmd);
+
+    if (flags & FLOAT_DATA) {
+        write_float_info (wps, &wpmd);
+        copy_metadata (&wpmd, wps->blockbuff, wps->blockend);
+        free_metadata (&wpmd);
+    }
+
+    if (flags & INT32_DATA) {
+        write_int32_info (wps, &wpmd);
+        copy_metadata (&wpmd, wps->blockbuff, wps->blockend);
+        free_metadata (&wpmd);
+    }
+
+    send_general_metadata (wpc);
+    bs_open_write (&wps->wvbits, wps->blockbuff + ((WavpackHeader *) wps->blockbuff)->ckSize + CHUNK_SIZE_OFFSET + 4, wps->blockend);
+    send_words_lossless (wps, buffer, sample_count);
+    flush_word (wps);
+
+    if (!store_bitstream (wps->blockbuff, bs_close_write (&wps->wvbits), ID_WV_BITSTREAM))
+        return FALSE;
+
+#if AUDIO_CHECKSUM_BYTES
+    write_audio_checksum (&wpmd, ID_AUDIO_CHECKSUM, crc);
+    copy_metadata (&wpmd, wps->blockbuff, wps->blockend);
+    free_metadata (&wpmd);
+#endif
+
     wps->sample_index += sample_count;
     return TRUE;
 }
 
+// The following two functions split the encoding of a lossless integer block (of up to 24 bits,
+// without block_trigger, simulcast or dynamic noise shaping) into two halves. The first does
+// everything that pack_block() does to prepare the samples, choose the decorrelation and
+// decorrelate, and the second does the entropy coding. pack_block() simply calls one after the
+// other, and the pipelined encoder (see pack_pipeline.c) runs them on different threads, with
+// the analysis done on a "shadow" copy of the stream which carries the decorrelation state
+// from block to block while the coding is done on the real stream, which carries the entropy
+// state. So the blocks are the same either way.
+
+void analyze_block (WavpackContext *wpc, int32_t *buffer, BlockAnalysis *ba)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    struct words_data saved_words = wps->w, unset_words;
+    uint32_t sflags = wps->wphdr.flags;
+    BlockScan scan;
+
+    // The entropy state belongs to the coder, but the analysis can restart it (for example
+    // when the joint stereo setting changes). So we set it to a value that it can never
+    // have and, if it's something else when we're done, the coder gets the new value.
+
+    memset (&unset_words, 0xff, sizeof (unset_words));
+    wps->w = unset_words;
+
+    ba->flags = prepare_block (wps, buffer, sflags, AUDIO_CHECKSUM_BYTES, &scan);
+
+    // a constant block is left as is for pack_constant_samples(), which resets the state like this
+
+    if ((ba->constant = scan_int_block (wpc, buffer, ba->flags, &scan))) {
+        CLEAR (wps->decorr_passes);
+        wps->num_terms = 0;
+        wps->dc.error [0] = wps->dc.error [1] = 0;
+        init_words (wps);
+        CLEAR (ba->decorr_info);
+        ba->crc = 0xffffffff;
+    }
+    else {
+        start_decorr (wpc, buffer, ba->flags);
+        ba->crc = decorr_lossless_block (wpc, buffer, &scan, &ba->decorr_info);
+    }
+
+    // finally, store everything the coder needs (including the state of the stream at the
+    // end of the block, so that the real stream can be brought up to date)
+
+    ba->flags = wps->wphdr.flags;
+
+    if ((ba->w_restart = memcmp (&wps->w, &unset_words, sizeof (unset_words))))
+        ba->w = wps->w;
+    else
+        wps->w = saved_words;
+
+    ba->num_terms = wps->num_terms;
+    ba->best_decorr = wps->best_decorr;
+    ba->mask_decorr = wps->mask_decorr;
+    ba->shift = wps->shift;
+    ba->delta_decay = wps->delta_decay;
+    ba->joint_stereo = wps->joint_stereo;
+    ba->false_stereo = wps->false_stereo;
+    ba->int32_sent_bits = wps->int32_sent_bits;
+    ba->int32_zeros = wps->int32_zeros;
+    ba->int32_ones = wps->int32_ones;
+    ba->int32_dups = wps->int32_dups;
+    memcpy (ba->decorr_passes, wps->decorr_passes, sizeof (ba->decorr_passes));
+
+    wps->wphdr.flags = sflags;
+}
+
+// Entropy code a block that has been analyzed (and decorrelated) by analyze_block() into
+// a completed WavPack block. This is called with the context set up exactly as it is for
+// pack_block() and also returns FALSE if the block buffer overflows. The decorrelation
+// metadata is sent from the analysis, but the caller must free it.
+
+int pack_analyzed_block (WavpackContext *wpc, int32_t *buffer, BlockAnalysis *ba)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    uint32_t sflags = wps->wphdr.flags;
+    int result;
+
+    wps->num_terms = ba->num_terms;
+    wps->best_decorr = ba->best_decorr;
+    wps->mask_decorr = ba->mask_decorr;
+    wps->shift = ba->shift;
+    wps->delta_decay = ba->delta_decay;
+    wps->joint_stereo = ba->joint_stereo;
+    wps->false_stereo = ba->false_stereo;
+    wps->int32_sent_bits = ba->int32_sent_bits;
+    wps->int32_zeros = ba->int32_zeros;
+    wps->int32_ones = ba->int32_ones;
+    wps->int32_dups = ba->int32_dups;
+    memcpy (wps->decorr_passes, ba->decorr_passes, sizeof (ba->decorr_passes));
+
+    if (ba->w_restart)
+        wps->w = ba->w;
+
+    wps->wphdr.flags = ba->flags;
+
+    if (ba->constant)
+        result = pack_constant_samples (wpc, buffer);
+    else
+        result = pack_lossless_block (wpc, buffer, ba->crc, &ba->decorr_info);
+
+    wps->wphdr.flags = sflags;
+    return result;
+}
+
 #if !defined(OPT_ASM_X64)
 
 // This is the "C" version of the stereo decorrelation pass function. There
@@ -1832,9 +2375,9 @@ double WavpackStreamGetEncodedNoise (WavpackContext *wpc, double *peak)
     WavpackStream *wps = wpc->streams [wpc->current_stream];
 
     if (peak)
-        *peak = wps->dc.noise_max;
+        *peak = wps->ns.noise_max;
 
-    return wps->dc.noise_sum;
+    return wps->ns.noise_sum;
 }
 
 // Open the specified BitStream using the specified buffer pointers. It is
@@ -49,10 +49,10 @@ void dynamic_noise_shaping (WavpackContext *wpc, int32_t *buffer, int shortening
             }
     }
 
-    if (sample_count > wps->dc.shaping_samples) {
-        sc = sample_count - wps->dc.shaping_samples;
-        swptr = wps->dc.shaping_data + wps->dc.shaping_samples;
-        bptr = buffer + wps->dc.shaping_samples * ((flags & MONO_DATA) ? 1 : 2);
+    if (sample_count > wps->ns.shaping_samples) {
+        sc = sample_count - wps->ns.shaping_samples;
+        swptr = wps->ns.shaping_data + wps->ns.shaping_samples;
+        bptr = buffer + wps->ns.shaping_samples * ((flags & MONO_DATA) ? 1 : 2);
 
         if (flags & MONO_DATA)
             while (sc--) {
@@ -80,7 +80,7 @@ void dynamic_noise_shaping (WavpackContext *wpc, int32_t *buffer, int shortening
                 *swptr++ = (ap->weight_A + ap->weight_B < 512) ? 1024 : 1536 - ap->weight_A - ap->weight_B;
             }
 
-        wps->dc.shaping_samples = sample_count;
+        wps->ns.shaping_samples = sample_count;
     }
 
     if (wpc->wvc_flag) {
@@ -91,7 +91,7 @@ void dynamic_noise_shaping (WavpackContext *wpc, int32_t *buffer, int shortening
         if (max_allowed_error < 128)
             max_allowed_error = 128;
 
-        best_floating_line (wps->dc.shaping_data, sample_count, &initial_y, &final_y, &max_error);
+        best_floating_line (wps->ns.shaping_data, sample_count, &initial_y, &final_y, &max_error);
 
         if (shortening_allowed && max_error > max_allowed_error) {
             int min_samples = 0, max_samples = sample_count, trial_count;
@@ -100,7 +100,7 @@ void dynamic_noise_shaping (WavpackContext *wpc, int32_t *buffer, int shortening
             while (1) {
                 trial_count = (min_samples + max_samples) / 2;
 
-                best_floating_line (wps->dc.shaping_data, trial_count, &trial_initial_y,
+                best_floating_line (wps->ns.shaping_data, trial_count, &trial_initial_y,
                     &trial_final_y, &trial_max_error);
 
                 if (trial_max_error < max_allowed_error) {
@@ -128,7 +128,7 @@ void dynamic_noise_shaping (WavpackContext *wpc, int32_t *buffer, int shortening
         error_line ("%.2f sec, sample count = %5d, max error = %3d, range = %5d, %5d, actual = %5d, %5d",
             (double) wps->sample_index / wpc->config.sample_rate, sample_count, max_error,
             (int) floor (initial_y), (int) floor (final_y),
-            wps->dc.shaping_data [0], wps->dc.shaping_data [sample_count-1]);
+            wps->ns.shaping_data [0], wps->ns.shaping_data [sample_count-1]);
 #endif
         if (sample_count != wps->wphdr.block_samples)
             wps->wphdr.block_samples = sample_count;
@@ -139,13 +139,13 @@ void dynamic_noise_shaping (WavpackContext *wpc, int32_t *buffer, int shortening
             wps->dc.shaping_delta [0] = wps->dc.shaping_delta [1] =
                 (int32_t) floor ((final_y - initial_y) / (sample_count - 1) * 65536.0 + 0.5);
 
-            wps->dc.shaping_array = NULL;
+            wps->ns.shaping_array = NULL;
         }
         else
-            wps->dc.shaping_array = wps->dc.shaping_data;
+            wps->ns.shaping_array = wps->ns.shaping_data;
     }
     else
-        wps->dc.shaping_array = wps->dc.shaping_data;
+        wps->ns.shaping_array = wps->ns.shaping_data;
 }
 
 // Given an array of integer data (in shorts), find the linear function that most closely
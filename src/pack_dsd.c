@@ -213,15 +213,18 @@ static int rle_encode (unsigned char *src, int bcount, unsigned char *destinatio
 
 #endif
 
+// Calculate the probabilities (scaled so that none is over MAX_PROBABILITY, but with no non-zero entry
+// becoming zero) and their running sums from the histogram of a single history bin. Scaled values only
+// increase with the histogram counts, so the divisor is settled using the largest count alone, and then
+// the tables are built in a single pass.
+
 static void calculate_probabilities (int hist [256], unsigned char probs [256], unsigned short prob_sums [256])
 {
-    int divisor, min_value, max_value, sum_values;
-    int min_hits = 0x7fffffff, max_hits = 0, i;
+    int divisor, sum_values = 0, max_hits = 0, i;
+    InvariantDivisor div;
 
-    for (i = 0; i < 256; ++i) {
-        if (hist [i] < min_hits) min_hits = hist [i];
+    for (i = 0; i < 256; ++i)
         if (hist [i] > max_hits) max_hits = hist [i];
-    }
 
     if (max_hits == 0) {
         memset (probs, 0, sizeof (*probs) * 256);
@@ -229,82 +232,49 @@ static void calculate_probabilities (int hist [256], unsigned char probs [256],
         return;
     }
 
-//  fprintf (stderr, "process_histogram(): hits = %d to %d\n", min_hits, max_hits);
-
-    if (max_hits > MAX_PROBABILITY)
-        divisor = ((max_hits << 8) + (MAX_PROBABILITY >> 1)) / MAX_PROBABILITY;
-    else
-        divisor = 0;
-
-    while (1) {
-        min_value = 0x7fffffff; max_value = 0; sum_values = 0;
-
-        for (i = 0; i < 256; ++i) {
-            int value;
-
-            if (hist [i]) {
-                if (divisor) {
-                    if (!(value = ((hist [i] << 8) + (divisor >> 1)) / divisor))
-                        value = 1;
-                }
-                else
-                    value = hist [i];
-
-                if (value < min_value) min_value = value;
-                if (value > max_value) max_value = value;
-            }
-            else
-                value = 0;
+    if (max_hits <= MAX_PROBABILITY) {
+        for (i = 0; i < 256; ++i)
+            prob_sums [i] = sum_values += probs [i] = hist [i];
 
-            prob_sums [i] = sum_values += value;
-            probs [i] = value;
-        }
+        return;
+    }
 
-        if (max_value > MAX_PROBABILITY) {
-            divisor++;
-            continue;
-        }
+    divisor = ((max_hits << 8) + (MAX_PROBABILITY >> 1)) / MAX_PROBABILITY;
 
-#if 0   // this code reduces probability values when they are completely redundant (i.e., common divisor), but
-        // this doesn't really happen often enough to make it worthwhile
+    while (((max_hits << 8) + (divisor >> 1)) / divisor > MAX_PROBABILITY)
+        divisor++;
 
-        if (min_value > 1) {
-            for (i = 0; i < 256; ++i)
-                if (probs [i] % min_value)
-                    break;
+    init_divisor (&div, divisor);
 
-            if (i == 256) {
-                for (i = 0; i < 256; ++i) {
-                    prob_sums [i] /= min_value;
-                    probs [i] /= min_value;
-                }
+    for (i = 0; i < 256; ++i) {
+        int value = 0;
 
-                // fprintf (stderr, "fixed min_value = %d, divisor = %d, probs_sum = %d\n", min_value, divisor, prob_sums [255]);
-            }
-        }
-#endif
+        if (hist [i] && !(value = divide_invariant ((hist [i] << 8) + (divisor >> 1), &div)))
+            value = 1;
 
-        break;
+        prob_sums [i] = sum_values += value;
+        probs [i] = value;
     }
 }
 
 static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samples, unsigned char *destination)
 {
-    uint32_t flags = wps->wphdr.flags, crc = 0xffffffff;
+    uint32_t flags = wps->wphdr.flags;
     unsigned int low = 0, high = 0xffffffff, mult;
     unsigned short (*summed_probabilities) [256];
     unsigned char (*probabilities) [256];
     unsigned char *dp = destination, *ep;
-    int history_bins, bc, p0 = 0, p1 = 0;
+    int history_bins, bc, p0 = 0, p1 = 0, i;
     int total_summed_probabilities = 0;
     int (*histogram) [256];
+    InvariantDivisor *divisors;
     int32_t *bp = buffer;
     char history_bits;
 
     if (!(flags & MONO_DATA))
         num_samples *= 2;
 
-    if (num_samples < 280)
+    if (num_samples < MIN_VALUES_PER_BIN)       // (the decoder enforces this for each history bin)
         return -1;
     else if (num_samples < 560)
         history_bits = 0;
@@ -329,33 +299,54 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
         history_bits = MAX_HISTORY_BITS;
 
     history_bins = 1 << history_bits;
-    histogram = malloc (sizeof (*histogram) * history_bins);
-    memset (histogram, 0, sizeof (*histogram) * history_bins);
     probabilities = malloc (sizeof (*probabilities) * history_bins);
     summed_probabilities = malloc (sizeof (*summed_probabilities) * history_bins);
+    divisors = malloc (sizeof (*divisors) * history_bins);
 
-    bc = num_samples;
+    // The histogram is built in two tables (the second starting at histogram [history_bins]) which are
+    // summed at the end. Consecutive values go to different tables, so runs of identical bytes (very
+    // common in DSD) don't stall on incrementing the same counter twice in a row. For stereo the two
+    // tables simply become one per channel.
 
-    if (flags & MONO_DATA)
-        while (bc--) {
-            crc += (crc << 1) + (*bp & 0xff);
-            histogram [p0] [*bp & 0xff]++;
-            p0 = *bp++ & (history_bins-1);
+    histogram = malloc (sizeof (*histogram) * history_bins * 2);
+    memset (histogram, 0, sizeof (*histogram) * history_bins * 2);
+
+    if (flags & MONO_DATA) {
+        for (bc = num_samples; bc >= 2; bc -= 2, bp += 2) {
+            histogram [p0] [bp [0] & 0xff]++;
+            histogram [history_bins + (bp [0] & (history_bins-1))] [bp [1] & 0xff]++;
+            p0 = bp [1] & (history_bins-1);
         }
-    else
-        while (bc--) {
-            crc += (crc << 1) + (*bp & 0xff);
+
+        if (bc)
             histogram [p0] [*bp & 0xff]++;
-            p0 = p1;
-            p1 = *bp++ & (history_bins-1);
+    }
+    else
+        for (bc = num_samples; bc >= 2; bc -= 2, bp += 2) {
+            histogram [p0] [bp [0] & 0xff]++;
+            histogram [history_bins + p1] [bp [1] & 0xff]++;
+            p0 = bp [0] & (history_bins-1);
+            p1 = bp [1] & (history_bins-1);
         }
 
     for (p0 = 0; p0 < history_bins; p0++) {
+        for (i = 0; i < 256; ++i)
+            histogram [p0] [i] += histogram [history_bins + p0] [i];
+
         calculate_probabilities (histogram [p0], probabilities [p0], summed_probabilities [p0]);
         total_summed_probabilities += summed_probabilities [p0] [255];
     }
 
-    wps->crc = crc;
+#if AUDIO_CHECKSUM_BYTES    // the crc is only needed if we're going to write it
+    {
+        uint32_t crc = 0xffffffff;
+
+        for (bp = buffer, bc = num_samples; bc--;)
+            crc += (crc << 1) + (*bp++ & 0xff);
+
+        wps->crc = crc;
+    }
+#endif
 
     // This code detects the case where the required value lookup tables grow silly big and cuts them back down. This would
     // normally only happen with large blocks or poorly compressible data. The target is to guarantee that the total memory
@@ -382,6 +373,11 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
     }
 
     free (histogram);
+
+    for (p0 = 0; p0 < history_bins; p0++)
+        if (summed_probabilities [p0] [255])
+            init_divisor (divisors + p0, summed_probabilities [p0] [255]);
+
     bp = buffer;
     bc = num_samples;
     *dp++ = 1;
@@ -400,7 +396,7 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
 
     while (dp < ep && bc--) {
 
-        mult = (high - low) / summed_probabilities [p0] [255];
+        mult = divide_invariant (high - low, divisors + p0);
 
         if (!mult) {
             high = low;
@@ -411,7 +407,7 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
                 low <<= 8;
             }
 
-            mult = (high - low) / summed_probabilities [p0] [255];
+            mult = divide_invariant (high - low, divisors + p0);
         }
 
         if (*bp & 0xff)
@@ -443,6 +439,7 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
 
     free (summed_probabilities);
     free (probabilities);
+    free (divisors);
 
     if (dp < ep)
         return (int)(dp - destination);
@@ -452,10 +449,6 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
 
 /*------------------------------------------------------------------------------------------------------------------------*/
 
-#define PTABLE_BITS 8
-#define PTABLE_BINS (1<<PTABLE_BITS)
-#define PTABLE_MASK (PTABLE_BINS-1)
-
 #define INITIAL_TERM (1536/PTABLE_BINS)
 
 #define UP   0x010000fe
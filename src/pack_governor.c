@@ -0,0 +1,237 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// pack_governor.c
+
+// This module implements the speed governor for encoders that must keep up with
+// real time on hosts with varying load. The time taken to encode each block is
+// measured (on the wall clock, because that's what matters for keeping up) and
+// compared to the duration of the audio in the block. When the encoder is using
+// more than the target percentage of real time, it steps down to a faster mode,
+// and when there's enough time to spare for the next slower mode it steps back up.
+//
+// The modes form a ladder of "levels" from fast mode (level 0) up to the mode the
+// encoder was configured with. First the decorrelation tables are stepped through
+// (fast, default, high and very high) and then the extra mode levels (x1 to x6)
+// for the configured table. For example, an encoder configured for -hx2 has the
+// levels fast, default, high, high -x1 and high -x2. Changing level simply resets
+// the decorrelation for the next block; every block is still a normal, independently
+// decodable WavPack block.
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "wavpack_local.h"
+
+// An upward step is only tried after this many blocks at a level (which doubles,
+// up to the maximum, each time an upward step has to be quickly reversed) and only
+// when the current load is less than half the target (because each level can take
+// up to twice as long as the one below it).
+
+#define GOVERNOR_MIN_HOLD   16
+#define GOVERNOR_MAX_HOLD   512
+#define GOVERNOR_UP_RATIO   2
+
+#define LEVEL_FLAGS (CONFIG_FAST_FLAG | CONFIG_HIGH_FLAG | CONFIG_VERY_HIGH_FLAG)
+
+typedef struct {
+    struct { int flags, xmode; } levels [WAVPACK_GOVERNOR_MAX_LEVELS];
+    int64_t block_start;
+    uint32_t load16, up_hold, held;     // load16 is percentage of real time * 16
+    int load_valid, last_step;
+    WavpackGovernorStats stats;
+} SpeedGovernor;
+
+// Return a monotonic time in microseconds (with an arbitrary origin).
+
+static int64_t governor_clock (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+
+    QueryPerformanceCounter (&count);
+    QueryPerformanceFrequency (&frequency);
+    return count.QuadPart / frequency.QuadPart * 1000000 + count.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// Switch the encoder to the specified level. The streams' decorrelation is reset
+// so that it is chosen from scratch (from the new table) with the next block.
+
+static void set_governor_level (WavpackContext *wpc, SpeedGovernor *sg, int level)
+{
+    int i;
+
+    wpc->config.flags = (wpc->config.flags & ~LEVEL_FLAGS) | sg->levels [level].flags;
+    wpc->config.xmode = sg->levels [level].xmode;
+
+    for (i = 0; i < wpc->num_streams; ++i) {
+        WavpackStream *wps = wpc->streams [i];
+
+        set_decorr_specs (wpc, wps);
+        wps->best_decorr = wps->mask_decorr = 0;
+        wps->num_terms = 0;
+    }
+
+    sg->stats.current_level = level;
+    sg->stats.current_flags = sg->levels [level].flags;
+    sg->stats.current_xmode = sg->levels [level].xmode;
+    sg->load_valid = FALSE;
+    sg->held = 0;
+}
+
+// Enable the speed governor for a context opened for writing, with the specified target
+// for the encoding time as a percentage of real time (i.e., 50 means that encoding a
+// second of audio should take no more than half a second), or disable it with a target
+// of zero (which restores the configured mode). The governor starts at the configured
+// mode and never goes above it. This must be called after WavpackStreamPackInit() and
+// is not available for DSD audio, with pipelined encoding or with simulcast. Note that
+// the governor's state is not included in snapshots (the copy created by
+// WavpackStreamCloneEncoder() continues at the current level without a governor). A
+// return of FALSE indicates an error (see error_message).
+
+int WavpackStreamSetSpeedGovernor (WavpackContext *wpc, int target_percent)
+{
+    static const int table_flags [] = { CONFIG_FAST_FLAG, 0, CONFIG_HIGH_FLAG, CONFIG_HIGH_FLAG | CONFIG_VERY_HIGH_FLAG };
+    SpeedGovernor *sg = wpc->speed_governor;
+    int num_tables, i;
+
+    if (!target_percent) {
+        if (sg) {
+            set_governor_level (wpc, sg, sg->stats.max_level);
+            free_speed_governor (wpc);
+        }
+
+        return TRUE;
+    }
+
+    if (wpc->reader || !wpc->num_streams || !wpc->streams [0]->sample_buffer || target_percent < 0) {
+        strcpy (wpc->error_message, "speed governor requires an initialized encoder!");
+        return FALSE;
+    }
+
+    if (wpc->pack_pipeline || wpc->simulcast || (wpc->streams [0]->wphdr.flags & DSD_FLAG)) {
+        strcpy (wpc->error_message, "speed governor not available for DSD, pipelining or simulcast!");
+        return FALSE;
+    }
+
+    if (!sg) {
+        if (!(sg = calloc (1, sizeof (SpeedGovernor)))) {
+            strcpy (wpc->error_message, "can't allocate memory");
+            return FALSE;
+        }
+
+        if (wpc->config.flags & CONFIG_VERY_HIGH_FLAG)
+            num_tables = 4;
+        else if (wpc->config.flags & CONFIG_HIGH_FLAG)
+            num_tables = 3;
+        else if (wpc->config.flags & CONFIG_FAST_FLAG)
+            num_tables = 1;
+        else
+            num_tables = 2;
+
+        for (i = 0; i < num_tables; ++i)
+            sg->levels [i].flags = table_flags [i];
+
+        for (i = 1; i <= wpc->config.xmode; ++i) {
+            sg->levels [num_tables + i - 1].flags = table_flags [num_tables - 1];
+            sg->levels [num_tables + i - 1].xmode = i;
+        }
+
+        sg->stats.max_level = sg->stats.current_level = num_tables + wpc->config.xmode - 1;
+        sg->stats.current_flags = sg->levels [sg->stats.max_level].flags;
+        sg->stats.current_xmode = wpc->config.xmode;
+        sg->up_hold = GOVERNOR_MIN_HOLD;
+        wpc->speed_governor = sg;
+    }
+
+    sg->stats.target_percent = target_percent;
+    return TRUE;
+}
+
+// Get the governor's statistics for the specified context. Returns FALSE if the
+// governor is not enabled.
+
+int WavpackStreamGetGovernorStats (WavpackContext *wpc, WavpackGovernorStats *stats)
+{
+    SpeedGovernor *sg = wpc->speed_governor;
+
+    if (!sg)
+        return FALSE;
+
+    *stats = sg->stats;
+    stats->load_percent = (sg->load16 + 8) >> 4;
+    return TRUE;
+}
+
+// These two functions bracket the encoding of each block (in pack_streams()). The
+// second measures the load and makes any level changes for the next block.
+
+void start_governed_block (WavpackContext *wpc)
+{
+    ((SpeedGovernor *) wpc->speed_governor)->block_start = governor_clock ();
+}
+
+void end_governed_block (WavpackContext *wpc, uint32_t block_samples)
+{
+    SpeedGovernor *sg = wpc->speed_governor;
+    int64_t elapsed = governor_clock () - sg->block_start, block_time;
+    uint32_t target16 = sg->stats.target_percent * 16, load16;
+    int level = sg->stats.current_level;
+
+    if (!block_samples || !wpc->config.sample_rate)
+        return;
+
+    block_time = (int64_t) block_samples * 1000000 / wpc->config.sample_rate;
+    load16 = block_time ? (uint32_t) (elapsed * 1600 / block_time) : 0;
+    sg->load16 = sg->load_valid ? (sg->load16 + load16 + 1) >> 1 : load16;
+    sg->load_valid = TRUE;
+
+    sg->stats.level_blocks [level]++;
+    sg->stats.blocks++;
+    sg->held++;
+
+    // an upward step that has held for a full hold period has worked, so we can be
+    // quicker to try the next one
+
+    if (sg->last_step > 0 && sg->held == sg->up_hold && sg->up_hold > GOVERNOR_MIN_HOLD)
+        sg->up_hold >>= 1;
+
+    if (sg->load16 > target16 && level) {
+        if (sg->last_step > 0 && sg->held < sg->up_hold && sg->up_hold < GOVERNOR_MAX_HOLD)
+            sg->up_hold <<= 1;
+
+        set_governor_level (wpc, sg, level - 1);
+        sg->stats.last_transition = sg->stats.blocks;
+        sg->stats.step_downs++;
+        sg->last_step = -1;
+    }
+    else if (sg->held >= sg->up_hold && sg->load16 * GOVERNOR_UP_RATIO < target16 && level < sg->stats.max_level) {
+        set_governor_level (wpc, sg, level + 1);
+        sg->stats.last_transition = sg->stats.blocks;
+        sg->stats.step_ups++;
+        sg->last_step = 1;
+    }
+}
+
+void free_speed_governor (WavpackContext *wpc)
+{
+    free (wpc->speed_governor);
+    wpc->speed_governor = NULL;
+}
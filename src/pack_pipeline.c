@@ -0,0 +1,387 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// pack_pipeline.c
+
+// This module implements pipelined encoding, where the analysis of each block
+// (choosing and applying the decorrelation, which in the "extra" modes is most
+// of the work) is done on a second thread while the previous block is entropy
+// coded and written on the caller's thread. When a block's samples have all
+// arrived it is handed to the analysis thread, and it is coded and written
+// when the next block has arrived (or the encoder is flushed), so there is
+// exactly one extra block of latency. The blocks are identical to the ones
+// created by sequential encoding.
+//
+// The analysis is done on a "shadow" copy of each stream (which carries the
+// decorrelation state from block to block) and the coding on the real stream
+// (which carries the entropy state). Whenever the pipeline is empty the real
+// streams are completely up to date, and the shadows are refreshed from them
+// when the next block is started.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+#ifdef ENABLE_THREADS
+
+#include <pthread.h>
+
+typedef struct pack_pipeline PackPipeline;
+
+typedef struct {
+    PackPipeline *pp;
+    uint32_t block_samples, max_blocksize, metabytes;
+    WavpackMetadata *metadata;
+    int metacount, state;
+    int32_t **samples;
+    BlockAnalysis *analysis;
+} PipelineBlock;
+
+#define BLOCK_EMPTY     0       // block slot is free
+#define BLOCK_ANALYZING 1       // analysis task has been submitted
+#define BLOCK_ANALYZED  2       // analysis is complete and block is ready to be coded
+
+struct pack_pipeline {
+    WavpackThreadPool *pool;
+    pthread_mutex_t mutex;
+    pthread_cond_t block_analyzed;
+    WavpackContext *shadow;
+    PipelineBlock blocks [2];
+    int next_block;
+};
+
+// Analysis task, run on the pool's thread. The shadow context is only ever
+// touched here (and by the caller's thread when the pipeline is empty).
+
+static void analysis_task (void *arg)
+{
+    PipelineBlock *pb = arg;
+    PackPipeline *pp = pb->pp;
+    WavpackContext *shadow = pp->shadow;
+
+    for (shadow->current_stream = 0; shadow->current_stream < shadow->num_streams; shadow->current_stream++) {
+        WavpackStream *wps = shadow->streams [shadow->current_stream];
+        uint32_t flags = wps->wphdr.flags;
+
+        flags &= ~MAG_MASK;
+        flags += (1U << MAG_LSB) * ((flags & BYTES_STORED) * 8 + 7);
+
+        wps->wphdr.block_samples = pb->block_samples;
+        wps->wphdr.flags = flags;
+        analyze_block (shadow, pb->samples [shadow->current_stream], pb->analysis + shadow->current_stream);
+    }
+
+    pthread_mutex_lock (&pp->mutex);
+    pb->state = BLOCK_ANALYZED;
+    pthread_cond_signal (&pp->block_analyzed);
+    pthread_mutex_unlock (&pp->mutex);
+}
+
+// Wait for the block being analyzed (if any) to be done and return it, or
+// return NULL if the pipeline is empty.
+
+static PipelineBlock *wait_analyzed_block (PackPipeline *pp)
+{
+    PipelineBlock *pb = pp->blocks + (pp->next_block ^ 1);
+
+    pthread_mutex_lock (&pp->mutex);
+
+    while (pb->state == BLOCK_ANALYZING)
+        pthread_cond_wait (&pp->block_analyzed, &pp->mutex);
+
+    pthread_mutex_unlock (&pp->mutex);
+    return pb->state == BLOCK_ANALYZED ? pb : NULL;
+}
+
+// Release the resources held by a block (after it's been coded or discarded).
+
+static void release_block (WavpackContext *wpc, PipelineBlock *pb)
+{
+    int i;
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        free_metadata (&pb->analysis [i].decorr_info);
+
+    for (i = 0; i < pb->metacount; ++i)
+        free_metadata (pb->metadata + i);
+
+    if (pb->metadata)
+        free (pb->metadata);
+
+    pb->metadata = NULL;
+    pb->metacount = 0;
+    pb->state = BLOCK_EMPTY;
+}
+
+// Entropy code and write an analyzed block. The metadata that was pending when
+// the block was started goes into this block (exactly as it would have with
+// sequential encoding) and anything added since then is kept for the next one.
+
+static int pack_analyzed_streams (WavpackContext *wpc, PipelineBlock *pb)
+{
+    WavpackMetadata *metadata = wpc->metadata;
+    uint32_t metabytes = wpc->metabytes;
+    int metacount = wpc->metacount, result = TRUE;
+    unsigned char *outbuff = malloc (pb->max_blocksize);
+
+    wpc->metadata = pb->metadata;
+    wpc->metabytes = pb->metabytes;
+    wpc->metacount = pb->metacount;
+    pb->metadata = NULL;
+    pb->metacount = 0;
+
+    for (wpc->current_stream = 0; wpc->current_stream < wpc->num_streams; wpc->current_stream++) {
+        WavpackStream *wps = wpc->streams [wpc->current_stream];
+        uint32_t flags = wps->wphdr.flags;
+
+        flags &= ~MAG_MASK;
+        flags += (1U << MAG_LSB) * ((flags & BYTES_STORED) * 8 + 7);
+
+        wps->wphdr.block_samples = pb->block_samples;
+        wps->wphdr.flags = flags;
+        wps->blockbuff = outbuff;
+        wps->blockend = outbuff + pb->max_blocksize;
+        wps->block2buff = wps->block2end = NULL;
+
+        if (pack_analyzed_block (wpc, pb->samples [wpc->current_stream], pb->analysis + wpc->current_stream))
+            result = send_stream_blocks (wpc);
+        else {
+            wps->blockbuff = NULL;
+            strcpy (wpc->error_message, "output buffer overflowed!");
+            result = FALSE;
+        }
+
+        if (!result)
+            break;
+    }
+
+    wpc->current_stream = 0;
+    wpc->metadata = metadata;
+    wpc->metabytes = metabytes;
+    wpc->metacount = metacount;
+    release_block (wpc, pb);
+    free (outbuff);
+
+    return result;
+}
+
+// Replacement for the stream loop of pack_streams() when the pipeline is enabled. The samples
+// for the new block are copied from the streams and handed to the analysis thread, and then
+// the previous block (if there is one) is coded and written while that analysis proceeds.
+
+int pack_streams_pipelined (WavpackContext *wpc, uint32_t block_samples, uint32_t max_blocksize)
+{
+    PackPipeline *pp = wpc->pack_pipeline;
+    PipelineBlock *ready = wait_analyzed_block (pp), *pb = pp->blocks + pp->next_block;
+    int i;
+
+    // if the pipeline was empty, the shadow streams are refreshed from the real ones
+    // (otherwise they are already ahead of them, having just analyzed the previous block)
+
+    if (!ready)
+        for (i = 0; i < wpc->num_streams; ++i) {
+            WavpackStream *sps = pp->shadow->streams [i];
+
+            *sps = *wpc->streams [i];
+            sps->blockbuff = sps->block2buff = NULL;
+            sps->sample_buffer = NULL;
+            sps->ns.shaping_data = sps->ns.shaping_array = NULL;
+        }
+
+    for (i = 0; i < wpc->num_streams; ++i) {
+        WavpackStream *wps = wpc->streams [i];
+        int nch = (wps->wphdr.flags & MONO_FLAG) ? 1 : 2;
+
+        memcpy (pb->samples [i], wps->sample_buffer, block_samples * nch * sizeof (int32_t));
+
+        if (wpc->acc_samples != block_samples)
+            memmove (wps->sample_buffer, wps->sample_buffer + block_samples * nch,
+                (wpc->acc_samples - block_samples) * sizeof (int32_t) * nch);
+    }
+
+    pb->block_samples = block_samples;
+    pb->max_blocksize = max_blocksize;
+    pb->metadata = wpc->metadata;
+    pb->metabytes = wpc->metabytes;
+    pb->metacount = wpc->metacount;
+    wpc->metadata = NULL;
+    wpc->metabytes = 0;
+    wpc->metacount = 0;
+
+    wpc->ave_block_samples = (wpc->ave_block_samples * 0x7 + block_samples + 0x4) >> 3;
+    wpc->acc_samples -= block_samples;
+
+    pb->state = BLOCK_ANALYZING;
+    pp->next_block ^= 1;
+    submit_pool_task (pp->pool, analysis_task, pb);
+
+    return ready ? pack_analyzed_streams (wpc, ready) : TRUE;
+}
+
+// Code and write the block in the pipeline (if any), leaving the pipeline empty
+// and the streams up to date. Returns FALSE on an error.
+
+int flush_pack_pipeline (WavpackContext *wpc)
+{
+    PipelineBlock *ready = wait_analyzed_block (wpc->pack_pipeline);
+
+    return ready ? pack_analyzed_streams (wpc, ready) : TRUE;
+}
+
+// Discard the block in the pipeline (if any) without writing it, leaving the
+// streams as they were after the last block written.
+
+void discard_pack_pipeline (WavpackContext *wpc)
+{
+    PipelineBlock *ready = wait_analyzed_block (wpc->pack_pipeline);
+
+    if (ready)
+        release_block (wpc, ready);
+}
+
+void free_pack_pipeline (WavpackContext *wpc)
+{
+    PackPipeline *pp = wpc->pack_pipeline;
+    int i, j;
+
+    discard_pack_pipeline (wpc);
+    detach_thread_pool (pp->pool);
+    WavpackStreamDestroyThreadPool (pp->pool);
+
+    for (i = 0; i < 2; ++i) {
+        if (pp->blocks [i].samples) {
+            for (j = 0; j < wpc->num_streams; ++j)
+                if (pp->blocks [i].samples [j])
+                    free (pp->blocks [i].samples [j]);
+
+            free (pp->blocks [i].samples);
+        }
+
+        if (pp->blocks [i].analysis)
+            free (pp->blocks [i].analysis);
+    }
+
+    if (pp->shadow) {
+        if (pp->shadow->streams) {
+            for (j = 0; j < wpc->num_streams; ++j)
+                if (pp->shadow->streams [j])
+                    free (pp->shadow->streams [j]);
+
+            free (pp->shadow->streams);
+        }
+
+        free (pp->shadow);
+    }
+
+    pthread_cond_destroy (&pp->block_analyzed);
+    pthread_mutex_destroy (&pp->mutex);
+    free (pp);
+
+    wpc->pack_pipeline = NULL;
+}
+
+#endif
+
+// Enable pipelined encoding for a context opened for writing, where the analysis
+// of each block is done on another thread while the previous block is being
+// coded. The blocks created are exactly the same as with sequential encoding, but
+// each block is written one block later (i.e., when the next block's samples have
+// all been sent, or when the encoder is flushed). Pipelining is only supported for
+// lossless encoding of integer audio up to 24 bits (i.e., not hybrid, float or DSD)
+// and is most effective with the "extra" modes. Only a single extra thread is used
+// at this time, so any num_threads of 2 or more is equivalent, and 0 or 1 simply
+// leaves the encoder sequential. This must be called after WavpackStreamPackInit().
+// A return of FALSE indicates an error (see error_message), including configurations
+// that pipelining does not support, but in that case the context can still be used
+// to encode sequentially.
+
+int WavpackStreamSetEncodeThreads (WavpackContext *wpc, int num_threads)
+{
+#ifdef ENABLE_THREADS
+    PackPipeline *pp;
+    int i, j;
+
+    if (num_threads <= 1 || wpc->pack_pipeline)
+        return TRUE;
+
+    if (wpc->reader || !wpc->num_streams || !wpc->streams [0]->sample_buffer) {
+        strcpy (wpc->error_message, "pipelined encoding requires an initialized encoder!");
+        return FALSE;
+    }
+
+    if (wpc->speed_governor || wpc->rate_control) {
+        strcpy (wpc->error_message, "pipelined encoding not available with governor or rate control!");
+        return FALSE;
+    }
+
+    if (wpc->block_trigger || (wpc->config.flags & (CONFIG_HYBRID_FLAG | CONFIG_DYNAMIC_SHAPING)))
+        goto unsupported;
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        if ((wpc->streams [i]->wphdr.flags & (HYBRID_FLAG | FLOAT_DATA | DSD_FLAG)) ||
+            (wpc->streams [i]->wphdr.flags & BYTES_STORED) > 2)
+                goto unsupported;
+
+    if (!(pp = calloc (1, sizeof (PackPipeline))) || !(pp->pool = WavpackStreamCreateThreadPool (1))) {
+        if (pp) free (pp);
+        strcpy (wpc->error_message, "can't create encoding thread!");
+        return FALSE;
+    }
+
+    pthread_mutex_init (&pp->mutex, NULL);
+    pthread_cond_init (&pp->block_analyzed, NULL);
+    attach_thread_pool (pp->pool);
+    wpc->pack_pipeline = pp;
+
+    // the shadow context has just what the analysis needs: the configuration and the streams
+
+    if (!(pp->shadow = calloc (1, sizeof (WavpackContext))) ||
+        !(pp->shadow->streams = calloc (wpc->num_streams, sizeof (WavpackStream *))))
+            goto no_memory;
+
+    pp->shadow->config = wpc->config;
+    pp->shadow->num_streams = wpc->num_streams;
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        if (!(pp->shadow->streams [i] = malloc (sizeof (WavpackStream))))
+            goto no_memory;
+
+    for (i = 0; i < 2; ++i) {
+        PipelineBlock *pb = pp->blocks + i;
+
+        pb->pp = pp;
+
+        if (!(pb->samples = calloc (wpc->num_streams, sizeof (int32_t *))) ||
+            !(pb->analysis = calloc (wpc->num_streams, sizeof (BlockAnalysis))))
+                goto no_memory;
+
+        for (j = 0; j < wpc->num_streams; ++j)
+            if (!(pb->samples [j] = malloc (wpc->block_samples * sizeof (int32_t) *
+                (wpc->streams [j]->wphdr.flags & MONO_FLAG ? 1 : 2))))
+                    goto no_memory;
+    }
+
+    return TRUE;
+
+no_memory:
+    free_pack_pipeline (wpc);
+    strcpy (wpc->error_message, "can't allocate memory");
+    return FALSE;
+
+unsupported:
+    strcpy (wpc->error_message, "pipelined encoding requires lossless PCM up to 24 bits!");
+    return FALSE;
+#else
+    if (num_threads <= 1)
+        return TRUE;
+
+    strcpy (wpc->error_message, "libwavpack-stream not configured for threads!");
+    return FALSE;
+#endif
+}
@@ -0,0 +1,327 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// pack_rate.c
+
+// This module implements closed-loop rate control for hybrid mode, for links with
+// a hard rate cap. The link is modeled as a "leaky bucket" buffer (like the video
+// buffering verifier) which each block is added to when it's created and which
+// drains at the link rate. Before each block, the hybrid bitrate (the stream's
+// "bits" value) is chosen to aim the buffer at half full, using a running estimate
+// of how the actual block sizes compare to the bitrate requested. Then, if a block
+// would still overflow the buffer, the encoder state is restored from a snapshot
+// taken before the block and the block is encoded again at a lower bitrate. So the
+// buffer is never exceeded unless a block will not fit even at the lowest bitrate
+// (which is counted in the statistics). Only the main WavPack blocks are counted;
+// correction blocks (if any) are assumed not to be sent over the link.
+//
+// To make this possible the blocks for each attempt are captured and only sent to
+// the real output once the block is accepted.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "wavpack_local.h"
+
+#define RATE_MIN_BITS       568     // lowest effective bits value (see word_set_bitrate())
+#define RATE_MAX_BITS       (64 << 8)
+#define RATE_MAX_TRIES      4       // attempts per block before accepting an overflow
+
+typedef struct rate_control RateControl;
+
+typedef struct {
+    RateControl *rc;
+    int correction;
+} CaptureTarget;
+
+struct rate_control {
+    uint32_t bytes_per_second, buffer_bytes;
+    int64_t fullness;                   // bytes in buffer * sample_rate (for exact draining)
+    uint32_t efficiency;                // actual block bytes / requested bytes * 256
+    unsigned char *snapshot;
+    uint32_t snapshot_size;
+
+    CaptureTarget targets [2];          // captured blocks for the current attempt
+    unsigned char *captured;
+    uint32_t captured_bytes, captured_size, main_bytes;
+    struct { int32_t offset, bcount; int correction; } *blocks;
+    int num_blocks, max_blocks;
+
+    WavpackRateStats stats;
+};
+
+// Enable rate control for a context opened for writing in hybrid mode, with the link rate
+// in kilobits per second and the size of the receiver's buffer in bytes (which must be at
+// least a few blocks), or disable it with a rate of zero. The configured hybrid bitrate is
+// replaced for each block by the controller. The rate can't be lower than the lowest hybrid
+// bitrate (RATE_MIN_BITS, about 2.2 bits/sample for each channel), because then nearly every
+// block would overflow. Even above that, audio that doesn't compress well at the lowest bitrate
+// can overflow (which is counted in the statistics). This must be called after
+// WavpackStreamPackInit() and is not available with pipelined encoding or simulcast. A return
+// of FALSE indicates an error (see error_message).
+
+int WavpackStreamSetRateControl (WavpackContext *wpc, uint32_t kbps, uint32_t buffer_bytes)
+{
+    RateControl *rc = wpc->rate_control;
+    uint32_t min_kbps;
+
+    if (!kbps) {
+        if (rc)
+            free_rate_control (wpc);
+
+        return TRUE;
+    }
+
+    if (wpc->reader || !wpc->num_streams || !wpc->streams [0]->sample_buffer ||
+        !(wpc->streams [0]->wphdr.flags & HYBRID_FLAG) || !buffer_bytes) {
+            strcpy (wpc->error_message, "rate control requires an initialized hybrid encoder!");
+            return FALSE;
+    }
+
+    if (wpc->pack_pipeline || wpc->simulcast) {
+        strcpy (wpc->error_message, "rate control not available with pipelining or simulcast!");
+        return FALSE;
+    }
+
+    min_kbps = (uint32_t) (((int64_t) RATE_MIN_BITS * wpc->config.num_channels * wpc->config.sample_rate + 255999) / 256000);
+
+    if (kbps < min_kbps) {
+        sprintf (wpc->error_message, "rate cap is below the minimum of %u kbps for this format!", min_kbps);
+        return FALSE;
+    }
+
+    if (!rc) {
+        if (!(rc = calloc (1, sizeof (RateControl)))) {
+            strcpy (wpc->error_message, "can't allocate memory");
+            return FALSE;
+        }
+
+        rc->targets [0].rc = rc->targets [1].rc = rc;
+        rc->targets [1].correction = TRUE;
+        rc->efficiency = 256;
+        wpc->rate_control = rc;
+    }
+
+    rc->bytes_per_second = kbps * 125;
+    rc->stats.buffer_bytes = rc->buffer_bytes = buffer_bytes;
+    return TRUE;
+}
+
+// Get the rate controller's statistics for the specified context. Returns FALSE if
+// rate control is not enabled.
+
+int WavpackStreamGetRateStats (WavpackContext *wpc, WavpackRateStats *stats)
+{
+    RateControl *rc = wpc->rate_control;
+
+    if (!rc)
+        return FALSE;
+
+    *stats = rc->stats;
+    stats->fullness = (uint32_t) ((rc->fullness + wpc->config.sample_rate - 1) / wpc->config.sample_rate);
+    return TRUE;
+}
+
+// Block output function used while an attempt is being made, which just saves the blocks.
+
+static int capture_block (void *id, void *data, int32_t bcount)
+{
+    CaptureTarget *target = id;
+    RateControl *rc = target->rc;
+
+    if (rc->captured_bytes + bcount > rc->captured_size) {
+        uint32_t new_size = (rc->captured_bytes + bcount) * 2;
+        unsigned char *new_captured = realloc (rc->captured, new_size);
+
+        if (!new_captured)
+            return FALSE;
+
+        rc->captured = new_captured;
+        rc->captured_size = new_size;
+    }
+
+    if (rc->num_blocks == rc->max_blocks) {
+        int new_max = rc->max_blocks ? rc->max_blocks * 2 : 8;
+        void *new_blocks = realloc (rc->blocks, new_max * sizeof (rc->blocks [0]));
+
+        if (!new_blocks)
+            return FALSE;
+
+        rc->blocks = new_blocks;
+        rc->max_blocks = new_max;
+    }
+
+    rc->blocks [rc->num_blocks].offset = rc->captured_bytes;
+    rc->blocks [rc->num_blocks].bcount = bcount;
+    rc->blocks [rc->num_blocks++].correction = target->correction;
+    memcpy (rc->captured + rc->captured_bytes, data, bcount);
+    rc->captured_bytes += bcount;
+
+    if (!target->correction)
+        rc->main_bytes += bcount;
+
+    return TRUE;
+}
+
+// Make one attempt at encoding the block at the specified bitrate, capturing the output.
+
+static int encode_attempt (WavpackContext *wpc, uint32_t block_samples, uint32_t bits, int (*encode)(WavpackContext *, uint32_t))
+{
+    RateControl *rc = wpc->rate_control;
+    WavpackBlockOutput blockout = wpc->blockout;
+    void *wv_out = wpc->wv_out, *wvc_out = wpc->wvc_out;
+    int result, i;
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        wpc->streams [i]->bits = bits;
+
+    rc->captured_bytes = rc->main_bytes = 0;
+    rc->num_blocks = 0;
+
+    wpc->blockout = capture_block;
+    wpc->wv_out = rc->targets;
+    wpc->wvc_out = rc->targets + 1;
+    result = encode (wpc, block_samples);
+    wpc->blockout = blockout;
+    wpc->wv_out = wv_out;
+    wpc->wvc_out = wvc_out;
+
+    return result;
+}
+
+// Replacement for the sequential encoder when rate control is enabled, which encodes one
+// block (re-encoding it as required) and then sends it to the real output.
+
+int pack_streams_rate_controlled (WavpackContext *wpc, uint32_t block_samples, int (*encode)(WavpackContext *, uint32_t))
+{
+    RateControl *rc = wpc->rate_control;
+    int64_t sample_rate = wpc->config.sample_rate, room, target, drain;
+    uint32_t acc_samples = wpc->acc_samples, snapshot_bytes, bits, max_bits;
+    int tries, i;
+
+    // first take a snapshot of the encoder so that we can try again if we have to
+
+    snapshot_bytes = WavpackStreamSaveState (wpc, NULL, 0);
+
+    if (snapshot_bytes > rc->snapshot_size) {
+        free (rc->snapshot);
+
+        if (!(rc->snapshot = malloc (snapshot_bytes))) {
+            rc->snapshot_size = 0;
+            strcpy (wpc->error_message, "can't allocate memory");
+            return FALSE;
+        }
+
+        rc->snapshot_size = snapshot_bytes;
+    }
+
+    if (!snapshot_bytes || WavpackStreamSaveState (wpc, rc->snapshot, snapshot_bytes) != snapshot_bytes)
+        return FALSE;
+
+    // aim to leave the buffer half full, spreading the correction over several blocks, and
+    // convert to bits/sample using the measured efficiency (with everything in bytes * sample_rate)
+
+    room = rc->buffer_bytes * sample_rate - rc->fullness;
+    drain = (int64_t) rc->bytes_per_second * block_samples;
+    target = drain + (rc->buffer_bytes * sample_rate / 2 - rc->fullness) / 4;
+
+    if (target > room)
+        target = room;
+
+    if (target < drain / 4)
+        target = drain / 4;
+
+    max_bits = (uint32_t) ((int64_t) rc->bytes_per_second * 2048 * 4 / sample_rate / wpc->config.num_channels);
+    bits = (uint32_t) (target * 2048 * 256 / sample_rate / ((int64_t) block_samples * wpc->config.num_channels * rc->efficiency));
+
+    if (max_bits > RATE_MAX_BITS)
+        max_bits = RATE_MAX_BITS;
+
+    if (bits > max_bits)
+        bits = max_bits;
+
+    if (bits < RATE_MIN_BITS)
+        bits = RATE_MIN_BITS;
+
+    for (tries = 1;; ++tries) {
+        uint32_t new_bits;
+
+        if (!encode_attempt (wpc, block_samples, bits, encode))
+            return FALSE;
+
+        if (rc->main_bytes * sample_rate <= room || bits == RATE_MIN_BITS || tries == RATE_MAX_TRIES)
+            break;
+
+        // the block won't fit, so go back and try again at a (proportionally) lower bitrate
+
+        if (!WavpackStreamRestoreState (wpc, rc->snapshot, snapshot_bytes))
+            return FALSE;
+
+        new_bits = (uint32_t) ((int64_t) bits * (room > 0 ? room : 0) / (rc->main_bytes * sample_rate) * 15 / 16);
+
+        if (new_bits > bits - (bits >> 3))
+            new_bits = bits - (bits >> 3);
+
+        bits = new_bits < RATE_MIN_BITS ? RATE_MIN_BITS : new_bits;
+        rc->stats.retries++;
+    }
+
+    // the block is accepted, so now it goes to the real output
+
+    for (i = 0; i < rc->num_blocks; ++i)
+        if (!wpc->blockout (rc->blocks [i].correction ? wpc->wvc_out : wpc->wv_out,
+            rc->captured + rc->blocks [i].offset, rc->blocks [i].bcount)) {
+                strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
+                return FALSE;
+        }
+
+    // update the buffer model and the efficiency estimate with the samples actually encoded
+
+    block_samples = acc_samples - wpc->acc_samples;
+    drain = (int64_t) rc->bytes_per_second * block_samples;
+
+    if (rc->main_bytes * sample_rate > room)
+        rc->stats.overflows++;
+
+    rc->fullness += rc->main_bytes * sample_rate;
+
+    if (rc->fullness > rc->stats.peak_fullness * sample_rate)
+        rc->stats.peak_fullness = (uint32_t) ((rc->fullness + sample_rate - 1) / sample_rate);
+
+    rc->fullness = rc->fullness > drain ? rc->fullness - drain : 0;
+
+    if (block_samples) {
+        uint32_t requested = (uint32_t) ((int64_t) bits * block_samples * wpc->config.num_channels / 2048);
+        uint32_t efficiency = requested ? (uint32_t) ((int64_t) rc->main_bytes * 256 / requested) : 256;
+
+        if (efficiency < 64)
+            efficiency = 64;
+        else if (efficiency > 1024)
+            efficiency = 1024;
+
+        rc->efficiency = (rc->efficiency * 3 + efficiency + 2) >> 2;
+    }
+
+    rc->stats.blocks++;
+    rc->stats.total_bytes += rc->main_bytes;
+    rc->stats.current_bits = bits;
+    return TRUE;
+}
+
+void free_rate_control (WavpackContext *wpc)
+{
+    RateControl *rc = wpc->rate_control;
+
+    free (rc->snapshot);
+    free (rc->captured);
+    free (rc->blocks);
+    free (rc);
+
+    wpc->rate_control = NULL;
+}
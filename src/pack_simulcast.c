@@ -0,0 +1,374 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// pack_simulcast.c
+
+// This module implements simulcast hybrid encoding, where the same audio is encoded
+// at several bitrates (for example, for adaptive streaming). Each rendition is a normal
+// WavPack encoder with its own context, bitrate and output, but the renditions are
+// attached to a "leading" encoder and samples are only sent to that one. The leader
+// does the per-block analysis (the block length, the dynamic noise shaping profile
+// and the decorrelation search of the extra modes) and records the results, and then
+// the renditions are given the same samples and encode them using the recorded
+// analysis instead of doing their own. So the cost of each extra rendition is mostly
+// just the decorrelation and entropy coding, which can't be shared because in hybrid
+// mode they depend on the quantization noise (and so on the bitrate).
+//
+// Note that because the decorrelation search is done on the leader's noise, the
+// renditions are not quite identical to what separate encoders would produce, but
+// they are completely normal WavPack files. The renditions also end up with exactly
+// the same block boundaries as the leader, which is useful for switching between them.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+typedef struct {
+    short *shaping_data;                // dynamic noise shaping profile (or NULL)
+    int shaping_valid, decorr_valid;
+    int num_terms, best_decorr, mask_decorr;
+    uint32_t joint_flag;                // JOINT_STEREO bit from the header flags
+    char joint_stereo;
+    struct decorr_pass decorr_passes [MAX_NTERMS];
+} SimulcastStream;
+
+typedef struct {
+    uint32_t block_samples;
+    SimulcastStream *streams;
+} SimulcastBlock;
+
+typedef struct {
+    WavpackContext *leader, **renditions;
+    int num_renditions;
+
+    SimulcastBlock *blocks;             // analysis of the blocks encoded by the leader so far
+    int num_blocks, max_blocks;         // during the current call (which the renditions replay)
+    int next_block;                     // the block a rendition is encoding (or will encode next)
+    int feeding;                        // TRUE while the leader is passing samples to the renditions
+} Simulcast;
+
+// Attach an encoder as a simulcast rendition of another one (the leader). Both must be
+// initialized hybrid encoders (i.e., after WavpackStreamPackInit()) with the same audio
+// format, block size and mode, but they can have different bitrates and their own outputs
+// (including correction files). After this, samples are only sent to the leader with
+// WavpackStreamPackSamples() and WavpackStreamFlushSamples(), which pass them on to all
+// its renditions. Everything else (like wrappers, MD5 sums and finally closing) is still
+// done separately for each context. A rendition may be closed before its leader (which
+// detaches it) and the leader may be closed first (which detaches all its renditions).
+// Simulcast is not available with the speed governor or rate control. A return of FALSE
+// indicates an error (see the leader's error_message).
+
+int WavpackStreamAddSimulcast (WavpackContext *wpc, WavpackContext *rendition)
+{
+    Simulcast *sc = wpc->simulcast;
+    WavpackContext **new_renditions;
+    int i;
+
+    if (wpc->reader || rendition->reader || !wpc->num_streams || !wpc->streams [0]->sample_buffer ||
+        !rendition->num_streams || !rendition->streams [0]->sample_buffer ||
+        !(wpc->streams [0]->wphdr.flags & HYBRID_FLAG) || !(rendition->streams [0]->wphdr.flags & HYBRID_FLAG)) {
+            strcpy (wpc->error_message, "simulcast requires initialized hybrid encoders!");
+            return FALSE;
+    }
+
+    if ((sc && sc->leader != wpc) || rendition->simulcast || rendition == wpc) {
+        strcpy (wpc->error_message, "rendition is already part of a simulcast!");
+        return FALSE;
+    }
+
+    if (wpc->speed_governor || wpc->rate_control || rendition->speed_governor || rendition->rate_control) {
+        strcpy (wpc->error_message, "simulcast not available with governor or rate control!");
+        return FALSE;
+    }
+
+    if (rendition->num_streams != wpc->num_streams || rendition->block_samples != wpc->block_samples ||
+        rendition->acc_samples != wpc->acc_samples || rendition->block_trigger || wpc->block_trigger ||
+        rendition->config.num_channels != wpc->config.num_channels ||
+        rendition->config.sample_rate != wpc->config.sample_rate ||
+        rendition->config.bytes_per_sample != wpc->config.bytes_per_sample ||
+        rendition->config.float_norm_exp != wpc->config.float_norm_exp ||
+        rendition->config.xmode != wpc->config.xmode ||
+        ((rendition->config.flags ^ wpc->config.flags) & (CONFIG_FAST_FLAG | CONFIG_HIGH_FLAG |
+        CONFIG_VERY_HIGH_FLAG | CONFIG_EXTRA_MODE | CONFIG_WARM_SEARCH | CONFIG_DYNAMIC_SHAPING |
+        CONFIG_JOINT_OVERRIDE | CONFIG_JOINT_STEREO | CONFIG_CROSS_DECORR))) {
+            strcpy (wpc->error_message, "rendition's format or mode does not match!");
+            return FALSE;
+    }
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        if ((rendition->streams [i]->wphdr.flags ^ wpc->streams [i]->wphdr.flags) & (MONO_FLAG | MAG_MASK)) {
+            strcpy (wpc->error_message, "rendition's format or mode does not match!");
+            return FALSE;
+        }
+
+    if (!sc) {
+        if (!(sc = calloc (1, sizeof (Simulcast)))) {
+            strcpy (wpc->error_message, "can't allocate memory");
+            return FALSE;
+        }
+
+        sc->leader = wpc;
+        wpc->simulcast = sc;
+    }
+
+    new_renditions = realloc (sc->renditions, (sc->num_renditions + 1) * sizeof (*sc->renditions));
+
+    if (!new_renditions) {
+        strcpy (wpc->error_message, "can't allocate memory");
+        return FALSE;
+    }
+
+    sc->renditions = new_renditions;
+    sc->renditions [sc->num_renditions++] = rendition;
+    rendition->simulcast = sc;
+    return TRUE;
+}
+
+// Called by pack_streams() before encoding each block. The leader starts a new analysis
+// record, and a rendition gets the block length from the leader's record.
+
+int start_simulcast_block (WavpackContext *wpc, uint32_t *block_samples)
+{
+    Simulcast *sc = wpc->simulcast;
+    SimulcastBlock *block;
+    int i;
+
+    if (sc->leader == wpc) {
+        if (!sc->num_renditions)
+            return TRUE;
+
+        if (sc->num_blocks == sc->max_blocks) {
+            int new_max = sc->max_blocks ? sc->max_blocks * 2 : 4;
+            SimulcastBlock *new_blocks = realloc (sc->blocks, new_max * sizeof (SimulcastBlock));
+
+            if (!new_blocks) {
+                strcpy (wpc->error_message, "can't allocate memory");
+                return FALSE;
+            }
+
+            memset (new_blocks + sc->max_blocks, 0, (new_max - sc->max_blocks) * sizeof (SimulcastBlock));
+            sc->blocks = new_blocks;
+            sc->max_blocks = new_max;
+        }
+
+        block = sc->blocks + sc->num_blocks++;
+
+        if (!block->streams && !(block->streams = calloc (wpc->num_streams, sizeof (SimulcastStream)))) {
+            sc->num_blocks--;
+            strcpy (wpc->error_message, "can't allocate memory");
+            return FALSE;
+        }
+
+        for (i = 0; i < wpc->num_streams; ++i)
+            block->streams [i].shaping_valid = block->streams [i].decorr_valid = FALSE;
+
+        block->block_samples = *block_samples;
+        return TRUE;
+    }
+
+    if (!sc->feeding || sc->next_block >= sc->num_blocks || sc->blocks [sc->next_block].block_samples > wpc->acc_samples) {
+        strcpy (wpc->error_message, "simulcast rendition out of step with leader!");
+        return FALSE;
+    }
+
+    *block_samples = sc->blocks [sc->next_block].block_samples;
+    return TRUE;
+}
+
+// Called by pack_streams() after encoding each block with the number of samples actually
+// encoded, which can be fewer than requested (because of dynamic noise shaping).
+
+int end_simulcast_block (WavpackContext *wpc, uint32_t block_samples)
+{
+    Simulcast *sc = wpc->simulcast;
+
+    if (sc->leader == wpc) {
+        if (sc->num_renditions)
+            sc->blocks [sc->num_blocks - 1].block_samples = block_samples;
+
+        return TRUE;
+    }
+
+    if (sc->blocks [sc->next_block++].block_samples != block_samples) {
+        strcpy (wpc->error_message, "simulcast rendition out of step with leader!");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static SimulcastStream *simulcast_stream (WavpackContext *wpc)
+{
+    Simulcast *sc = wpc->simulcast;
+
+    if (!sc->num_renditions)
+        return NULL;
+    else if (sc->leader == wpc)
+        return sc->blocks [sc->num_blocks - 1].streams + wpc->current_stream;
+    else
+        return sc->blocks [sc->next_block].streams + wpc->current_stream;
+}
+
+// Replacement for dynamic_noise_shaping() in simulcast encoders. The leader calculates the
+// profile and saves it, and a rendition just copies it (the block length has already been
+// set from the leader, so no shortening is required).
+
+void simulcast_noise_shaping (WavpackContext *wpc, int32_t *buffer, int shortening_allowed)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    SimulcastStream *scs = simulcast_stream (wpc);
+    uint32_t sample_count = wps->wphdr.block_samples;
+
+    if (!scs) {
+        dynamic_noise_shaping (wpc, buffer, shortening_allowed);
+        return;
+    }
+
+    if (((Simulcast *) wpc->simulcast)->leader == wpc) {
+        dynamic_noise_shaping (wpc, buffer, shortening_allowed);
+        sample_count = wps->wphdr.block_samples;
+
+        if (!scs->shaping_data && !(scs->shaping_data = malloc (wpc->block_samples * sizeof (*scs->shaping_data))))
+            return;
+
+        memcpy (scs->shaping_data, wps->ns.shaping_data, sample_count * sizeof (*scs->shaping_data));
+        scs->shaping_valid = TRUE;
+    }
+    else if (scs->shaping_valid) {
+        memcpy (wps->ns.shaping_data, scs->shaping_data, sample_count * sizeof (*scs->shaping_data));
+        wps->ns.shaping_samples = sample_count;
+        dynamic_noise_shaping (wpc, buffer, FALSE);
+    }
+    else
+        dynamic_noise_shaping (wpc, buffer, FALSE);
+}
+
+// Replacement for the calls to execute_mono() and execute_stereo() (without do_samples) in
+// simulcast encoders. The leader does the search and saves the result, and a rendition just
+// copies the result (including the starting decorrelation weights and samples, which are
+// sent in the block).
+
+void simulcast_execute (WavpackContext *wpc, int32_t *buffer, int no_history)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    SimulcastStream *scs = simulcast_stream (wpc);
+
+    if (scs && ((Simulcast *) wpc->simulcast)->leader != wpc && scs->decorr_valid) {
+        memcpy (wps->decorr_passes, scs->decorr_passes, sizeof (wps->decorr_passes));
+        wps->num_terms = scs->num_terms;
+        wps->best_decorr = scs->best_decorr;
+        wps->mask_decorr = scs->mask_decorr;
+        wps->joint_stereo = scs->joint_stereo;
+        wps->wphdr.flags = (wps->wphdr.flags & ~(uint32_t) JOINT_STEREO) | scs->joint_flag;
+        return;
+    }
+
+    if (wps->wphdr.flags & MONO_DATA)
+        execute_mono (wpc, buffer, no_history, 0);
+    else
+        execute_stereo (wpc, buffer, no_history, 0);
+
+    if (scs && ((Simulcast *) wpc->simulcast)->leader == wpc) {
+        memcpy (scs->decorr_passes, wps->decorr_passes, sizeof (scs->decorr_passes));
+        scs->num_terms = wps->num_terms;
+        scs->best_decorr = wps->best_decorr;
+        scs->mask_decorr = wps->mask_decorr;
+        scs->joint_stereo = wps->joint_stereo;
+        scs->joint_flag = wps->wphdr.flags & JOINT_STEREO;
+        scs->decorr_valid = TRUE;
+    }
+}
+
+// Called at the end of WavpackStreamPackSamples() with the samples that were just sent. The
+// leader passes them to its renditions (which replay the blocks it just encoded).
+
+int feed_simulcast (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sample_count)
+{
+    Simulcast *sc = wpc->simulcast;
+    int result = TRUE, i;
+
+    if (sc->leader != wpc || sc->feeding)
+        return TRUE;
+
+    sc->feeding = TRUE;
+
+    for (i = 0; result && i < sc->num_renditions; ++i) {
+        sc->next_block = 0;
+
+        if (!WavpackStreamPackSamples (sc->renditions [i], sample_buffer, sample_count) || sc->next_block != sc->num_blocks) {
+            strcpy (wpc->error_message, "simulcast rendition failed!");
+            result = FALSE;
+        }
+    }
+
+    sc->feeding = FALSE;
+    sc->num_blocks = 0;
+    return result;
+}
+
+// Called from WavpackStreamFlushSamples(), in which case the leader flushes its renditions.
+
+int flush_simulcast (WavpackContext *wpc)
+{
+    Simulcast *sc = wpc->simulcast;
+    int result = TRUE, i;
+
+    if (sc->leader != wpc || sc->feeding)
+        return TRUE;
+
+    sc->feeding = TRUE;
+
+    for (i = 0; result && i < sc->num_renditions; ++i) {
+        sc->next_block = 0;
+
+        if (!WavpackStreamFlushSamples (sc->renditions [i]) || sc->next_block != sc->num_blocks) {
+            strcpy (wpc->error_message, "simulcast rendition failed!");
+            result = FALSE;
+        }
+    }
+
+    sc->feeding = FALSE;
+    sc->num_blocks = 0;
+    return result;
+}
+
+// Detach the specified context from its simulcast. If this is the leader, then all the
+// renditions are detached and the simulcast is freed.
+
+void free_simulcast (WavpackContext *wpc)
+{
+    Simulcast *sc = wpc->simulcast;
+    int i, j;
+
+    if (sc->leader == wpc) {
+        for (i = 0; i < sc->num_renditions; ++i)
+            sc->renditions [i]->simulcast = NULL;
+
+        for (i = 0; i < sc->max_blocks; ++i)
+            if (sc->blocks [i].streams) {
+                for (j = 0; j < wpc->num_streams; ++j)
+                    free (sc->blocks [i].streams [j].shaping_data);
+
+                free (sc->blocks [i].streams);
+            }
+
+        free (sc->renditions);
+        free (sc->blocks);
+        free (sc);
+    }
+    else
+        for (i = 0; i < sc->num_renditions; ++i)
+            if (sc->renditions [i] == wpc) {
+                memmove (sc->renditions + i, sc->renditions + i + 1, (sc->num_renditions - i - 1) * sizeof (*sc->renditions));
+                sc->num_renditions--;
+                break;
+            }
+
+    wpc->simulcast = NULL;
+}
@@ -0,0 +1,437 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// pack_state.c
+
+// This module provides snapshots of the state of an encoding context, which
+// can be used to keep a "hot standby" encoder ready to take over a stream, or
+// to encode audio speculatively and then back up. The snapshot holds the
+// adaptive state that is carried from one block to the next (decorrelation
+// filters, entropy coder medians and bitrate, noise shaping and DSD filters)
+// along with any samples accumulated for the next block and any metadata that
+// is waiting to be written, so that an encoder restored from a snapshot will
+// produce exactly the same blocks as the original. The snapshot is in native
+// format and is only valid for the same build of the library.
+//
+// Note that decoders don't need this because every WavPack block can be decoded
+// without any information from the previous blocks.
+//
+// For completeness, an entire encoding context can also be cloned.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+#define STATE_VERSION 3
+
+typedef struct {
+    char ckID [4];                      // "wpst"
+    uint32_t ckSize;                    // total size of snapshot (including this header)
+    uint16_t version, num_streams;
+    uint32_t stream_size;               // sizeof (WavpackStream) as a build check
+    uint32_t block_samples, acc_samples, ave_block_samples, block_trigger;
+    uint32_t riff_trailer_bytes, metacount;
+    int64_t filelen, file2len;
+    int riff_header_added, riff_header_created, lossy_blocks;
+} StateHeader;
+
+// Copy the specified number of bytes to (store = TRUE) or from the snapshot at the
+// specified index (if they fit in the buffer) and advance the index. The index is
+// advanced regardless so that the total required size is known when we're finished.
+
+static void state_bytes (unsigned char *buffer, uint32_t size, uint32_t *index, void *data, uint32_t bcount, int store)
+{
+    if (buffer && *index <= size && size - *index >= bcount) {
+        if (store)
+            memcpy (buffer + *index, data, bcount);
+        else
+            memcpy (data, buffer + *index, bcount);
+    }
+
+    *index += bcount;
+}
+
+#define STATE_ITEM(item) state_bytes (buffer, size, index, &(item), sizeof (item), store)
+
+// Transfer the state of a single stream to or from the snapshot. This handles only
+// the state that persists between blocks (everything else is recreated for each
+// block). Returns FALSE if the snapshot does not match the stream.
+
+static int stream_state (WavpackContext *wpc, WavpackStream *wps, unsigned char *buffer, uint32_t size, uint32_t *index, int store)
+{
+    int mono = wps->wphdr.flags & MONO_FLAG, dsd = wps->wphdr.flags & DSD_FLAG, num_terms = wps->num_terms;
+    uint32_t sample_bytes = wpc->acc_samples * (mono ? 4 : 8);
+
+    STATE_ITEM (wps->wphdr);
+
+    // when restoring, the snapshot must be of a stream with the same configuration
+
+    if ((wps->wphdr.flags & MONO_FLAG) != mono || (wps->wphdr.flags & DSD_FLAG) != dsd)
+        return FALSE;
+
+    STATE_ITEM (wps->sample_index);
+    STATE_ITEM (wps->block_index);
+    STATE_ITEM (wps->bits);
+    STATE_ITEM (wps->shift);
+    STATE_ITEM (wps->num_decorrs);
+    STATE_ITEM (wps->num_passes);
+    STATE_ITEM (wps->best_decorr);
+    STATE_ITEM (wps->mask_decorr);
+    STATE_ITEM (wps->delta_decay);
+    STATE_ITEM (wps->joint_stereo);
+    STATE_ITEM (wps->false_stereo);
+    STATE_ITEM (wps->w);
+    STATE_ITEM (wps->dc.shaping_acc);
+    STATE_ITEM (wps->dc.shaping_delta);
+    STATE_ITEM (wps->dc.error);
+    STATE_ITEM (wps->ns.noise_sum);
+    STATE_ITEM (wps->ns.noise_ave);
+    STATE_ITEM (wps->ns.noise_max);
+    STATE_ITEM (wps->ns.shaping_samples);
+
+    // with dynamic noise shaping, the profile may already be calculated for some upcoming samples
+
+    if (wps->ns.shaping_data && wps->ns.shaping_samples) {
+        if (wps->ns.shaping_samples > wpc->block_samples)
+            return FALSE;
+
+        state_bytes (buffer, size, index, wps->ns.shaping_data, wps->ns.shaping_samples * sizeof (*wps->ns.shaping_data), store);
+    }
+
+    STATE_ITEM (wps->analysis_pass);
+    STATE_ITEM (num_terms);
+
+    if (num_terms < 0 || num_terms > MAX_NTERMS)
+        return FALSE;
+
+    // only the decorrelation passes in use are stored, the rest are cleared on restore
+
+    if (!store) {
+        CLEAR (wps->decorr_passes);
+        wps->num_terms = num_terms;
+    }
+
+    state_bytes (buffer, size, index, wps->decorr_passes, num_terms * sizeof (struct decorr_pass), store);
+
+    // the DSD probability table is allocated with the first block and then adapts from there
+
+    if (dsd) {
+        int ptable_sent = wps->dsd.ptable != NULL;
+
+        STATE_ITEM (wps->dsd.filters);
+        STATE_ITEM (ptable_sent);
+
+        if (ptable_sent) {
+            if (!wps->dsd.ptable && !(wps->dsd.ptable = malloc (PTABLE_BINS * sizeof (*wps->dsd.ptable))))
+                return FALSE;
+
+            state_bytes (buffer, size, index, wps->dsd.ptable, PTABLE_BINS * sizeof (*wps->dsd.ptable), store);
+        }
+    }
+
+    // finally, the samples accumulated for the next block
+
+    if (sample_bytes) {
+        if (!wps->sample_buffer)
+            return FALSE;
+
+        state_bytes (buffer, size, index, wps->sample_buffer, sample_bytes, store);
+    }
+
+    return TRUE;
+}
+
+// Store a snapshot of the specified encoding context's state into the provided
+// buffer. The return value is the number of bytes required for the snapshot,
+// which is only actually stored if this is not more than buffer_size (so this
+// can be called with a NULL buffer to determine the size). This can be called
+// any time between calls to WavpackStreamPackSamples() (and the other packing
+// functions) once WavpackStreamPackInit() has been called. With pipelined encoding,
+// the block in the pipeline is written first. A return of zero indicates an error
+// (e.g., the context is not an initialized encoder).
+
+uint32_t WavpackStreamSaveState (WavpackContext *wpc, void *buffer, uint32_t buffer_size)
+{
+    uint32_t size = buffer_size, bytes = 0, *index = &bytes;
+    StateHeader header;
+    int store = TRUE, i;
+
+    if (!wpc || wpc->reader || !wpc->num_streams || !wpc->streams [0]->sample_buffer) {
+        if (wpc) strcpy (wpc->error_message, "can only save the state of an initialized encoder!");
+        return 0;
+    }
+
+#ifdef ENABLE_THREADS
+    if (wpc->pack_pipeline && !flush_pack_pipeline (wpc))
+        return 0;
+#endif
+
+    CLEAR (header);                     // so that no padding bytes are left uninitialized
+    memcpy (header.ckID, "wpst", 4);
+    header.version = STATE_VERSION;
+    header.num_streams = wpc->num_streams;
+    header.stream_size = sizeof (WavpackStream);
+    header.block_samples = wpc->block_samples;
+    header.acc_samples = wpc->acc_samples;
+    header.ave_block_samples = wpc->ave_block_samples;
+    header.block_trigger = wpc->block_trigger;
+    header.riff_trailer_bytes = wpc->riff_trailer_bytes;
+    header.metacount = wpc->metacount;
+    header.filelen = wpc->filelen;
+    header.file2len = wpc->file2len;
+    header.riff_header_added = wpc->riff_header_added;
+    header.riff_header_created = wpc->riff_header_created;
+    header.lossy_blocks = wpc->lossy_blocks;
+    STATE_ITEM (header);
+
+    for (i = 0; i < wpc->metacount; ++i) {
+        STATE_ITEM (wpc->metadata [i].byte_length);
+        STATE_ITEM (wpc->metadata [i].id);
+        state_bytes (buffer, size, index, wpc->metadata [i].data, wpc->metadata [i].byte_length, store);
+    }
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        if (!stream_state (wpc, wpc->streams [i], buffer, size, index, store)) {
+            strcpy (wpc->error_message, "can't save encoder state!");
+            return 0;
+        }
+
+    // the size goes into the header last (once we know it), if it fit
+
+    if (buffer && bytes <= size)
+        memcpy ((unsigned char *) buffer + offsetof (StateHeader, ckSize), &bytes, sizeof (bytes));
+
+    return bytes;
+}
+
+// Restore the state of an encoding context from a snapshot created with the function
+// above. The context must have been configured exactly like the one that created the
+// snapshot (same stream configuration, mode and block size) and must have had
+// WavpackStreamPackInit() called, but otherwise can be at any point (it is common to
+// restore into a fresh context that has not yet encoded anything). From here on the
+// context will produce exactly the same blocks as the original would have. Any samples
+// or metadata pending in the context (including a block in the encoding pipeline) are
+// discarded. A return of FALSE indicates that the snapshot is not valid for this context,
+// in which case the state of the context is undefined (it should not be used further).
+
+int WavpackStreamRestoreState (WavpackContext *wpc, void *buffer, uint32_t bcount)
+{
+    uint32_t size = bcount, bytes = 0, *index = &bytes;
+    WavpackMetadata *metadata = NULL;
+    StateHeader header;
+    int store = FALSE, i;
+
+    if (!wpc || wpc->reader || !wpc->num_streams || !wpc->streams [0]->sample_buffer) {
+        if (wpc) strcpy (wpc->error_message, "can only restore the state of an initialized encoder!");
+        return FALSE;
+    }
+
+#ifdef ENABLE_THREADS
+    if (wpc->pack_pipeline)
+        discard_pack_pipeline (wpc);
+#endif
+
+    if (bcount < sizeof (StateHeader))
+        return FALSE;
+
+    STATE_ITEM (header);
+
+    if (strncmp (header.ckID, "wpst", 4) || header.ckSize != bcount || header.version != STATE_VERSION ||
+        header.stream_size != sizeof (WavpackStream) || header.num_streams != wpc->num_streams ||
+        header.block_samples != wpc->block_samples || header.acc_samples > wpc->block_samples) {
+            strcpy (wpc->error_message, "encoder state does not match this context!");
+            return FALSE;
+    }
+
+    // first restore the pending metadata, replacing whatever we have
+
+    if (header.metacount > (bcount - sizeof (StateHeader)) / (sizeof (metadata->byte_length) + sizeof (metadata->id)) ||
+        (header.metacount && !(metadata = calloc (header.metacount, sizeof (WavpackMetadata)))))
+            return FALSE;
+
+    for (i = 0; i < wpc->metacount; ++i)
+        free_metadata (wpc->metadata + i);
+
+    if (wpc->metadata)
+        free (wpc->metadata);
+
+    wpc->metadata = header.metacount ? metadata : NULL;
+    wpc->metacount = 0;
+    wpc->metabytes = 0;
+
+    for (i = 0; i < (int) header.metacount; ++i) {
+        WavpackMetadata *wpmd = wpc->metadata + i;
+
+        STATE_ITEM (wpmd->byte_length);
+        STATE_ITEM (wpmd->id);
+
+        if (bytes > size || wpmd->byte_length > size - bytes || !(wpmd->data = malloc (wpmd->byte_length + 1)))
+            return FALSE;
+
+        state_bytes (buffer, size, index, wpmd->data, wpmd->byte_length, store);
+        wpc->metabytes += wpmd->byte_length;
+        wpc->metacount++;
+    }
+
+    wpc->acc_samples = header.acc_samples;
+    wpc->ave_block_samples = header.ave_block_samples;
+    wpc->block_trigger = header.block_trigger;
+    wpc->riff_trailer_bytes = header.riff_trailer_bytes;
+    wpc->filelen = header.filelen;
+    wpc->file2len = header.file2len;
+    wpc->riff_header_added = header.riff_header_added;
+    wpc->riff_header_created = header.riff_header_created;
+    wpc->lossy_blocks = header.lossy_blocks;
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        if (!stream_state (wpc, wpc->streams [i], buffer, size, index, store) || bytes > size) {
+            strcpy (wpc->error_message, "encoder state does not match this context!");
+            return FALSE;
+        }
+
+    wpc->current_stream = 0;
+    return bytes == size;
+}
+
+// Create a complete copy of the specified encoding context, which will write its blocks
+// to the specified output (which can be the same as the original). The copy is entirely
+// independent of the original and must be closed with WavpackStreamCloseFile(). This is
+// the same as creating and configuring a new context and restoring a snapshot into it,
+// but is quicker and can be done without knowing how the original was configured. With
+// pipelined encoding, the block in the pipeline is written first (and the copy encodes
+// sequentially), and with the speed governor the copy continues at the current level
+// without a governor. Rate control is not copied either. Returns NULL if the context is
+// not an encoder or if we run out of memory.
+
+WavpackContext *WavpackStreamCloneEncoder (WavpackContext *wpc, WavpackBlockOutput blockout, void *wv_id, void *wvc_id)
+{
+    WavpackContext *clone;
+    int i;
+
+    if (!wpc || wpc->reader || !wpc->streams)
+        return NULL;
+
+#ifdef ENABLE_THREADS
+    if (wpc->pack_pipeline && !flush_pack_pipeline (wpc))
+        return NULL;
+#endif
+
+    if (!(clone = malloc (sizeof (WavpackContext))))
+        return NULL;
+
+    // start with a shallow copy and then make copies of everything the original owns
+    // (clearing the pointers first so that we can clean up if something fails)
+
+    *clone = *wpc;
+    clone->blockout = blockout;
+    clone->wv_out = wv_id;
+    clone->wvc_out = wvc_id;
+    clone->metadata = NULL;
+    clone->metacount = 0;
+    clone->wrapper_data = NULL;
+    clone->wrapper_bytes = 0;
+    clone->channel_reordering = NULL;
+    clone->channel_identities = NULL;
+    clone->pack_pipeline = NULL;
+    clone->speed_governor = NULL;
+    clone->rate_control = NULL;
+    clone->simulcast = NULL;
+    clone->transrate = NULL;
+    clone->dsd_fast_tables = NULL;
+    clone->num_dsd_fast_tables = 0;
+    clone->num_streams = 0;
+
+    if (!(clone->streams = calloc (wpc->num_streams, sizeof (wpc->streams [0]))))
+        goto fail;
+
+    for (i = 0; i < wpc->num_streams; ++i) {
+        WavpackStream *wps = wpc->streams [i], *cps = malloc (sizeof (WavpackStream));
+
+        if (!cps)
+            goto fail;
+
+        *cps = *wps;
+        cps->blockbuff = cps->block2buff = NULL;
+        cps->sample_buffer = NULL;
+        cps->ns.shaping_data = cps->ns.shaping_array = NULL;
+        cps->dsd.ptable = NULL;
+        clone->streams [clone->num_streams++] = cps;
+
+        if (wps->sample_buffer) {
+            uint32_t bytes = wpc->block_samples * (wps->wphdr.flags & MONO_FLAG ? 4 : 8);
+
+            if (!(cps->sample_buffer = malloc (bytes)))
+                goto fail;
+
+            memcpy (cps->sample_buffer, wps->sample_buffer, bytes);
+        }
+
+        if (wps->ns.shaping_data) {
+            uint32_t bytes = wpc->block_samples * sizeof (*wps->ns.shaping_data);
+
+            if (!(cps->ns.shaping_data = malloc (bytes)))
+                goto fail;
+
+            memcpy (cps->ns.shaping_data, wps->ns.shaping_data, bytes);
+
+            if (wps->ns.shaping_array == wps->ns.shaping_data)
+                cps->ns.shaping_array = cps->ns.shaping_data;
+        }
+
+        if (wps->dsd.ptable) {
+            if (!(cps->dsd.ptable = malloc (PTABLE_BINS * sizeof (*wps->dsd.ptable))))
+                goto fail;
+
+            memcpy (cps->dsd.ptable, wps->dsd.ptable, PTABLE_BINS * sizeof (*wps->dsd.ptable));
+        }
+    }
+
+    if (wpc->metacount) {
+        if (!(clone->metadata = calloc (wpc->metacount, sizeof (WavpackMetadata))))
+            goto fail;
+
+        for (i = 0; i < wpc->metacount; ++i) {
+            clone->metadata [i] = wpc->metadata [i];
+
+            if (wpc->metadata [i].data) {
+                if (!(clone->metadata [i].data = malloc (wpc->metadata [i].byte_length + 1))) {
+                    clone->metacount = i;
+                    goto fail;
+                }
+
+                memcpy (clone->metadata [i].data, wpc->metadata [i].data, wpc->metadata [i].byte_length);
+            }
+        }
+
+        clone->metacount = wpc->metacount;
+    }
+
+    if (wpc->channel_reordering) {
+        if (!(clone->channel_reordering = malloc (wpc->channel_layout & 0xff)))
+            goto fail;
+
+        memcpy (clone->channel_reordering, wpc->channel_reordering, wpc->channel_layout & 0xff);
+    }
+
+    if (wpc->channel_identities &&
+        !(clone->channel_identities = (unsigned char *) strdup ((char *) wpc->channel_identities)))
+            goto fail;
+
+    return clone;
+
+fail:
+    if (!clone->num_streams) {
+        if (clone->streams)
+            free (clone->streams);
+
+        clone->streams = NULL;
+    }
+
+    return WavpackStreamCloseFile (clone);
+}
@@ -0,0 +1,192 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// pack_transrate.c
+
+// This module implements transrating, which is re-encoding WavPack audio (usually
+// lossless or high-bitrate hybrid) into lower-bitrate hybrid without redoing the
+// analysis. The source is decoded a block at a time and each block is encoded as one
+// block, starting with the decorrelation terms, weights and history that the source
+// block starts with (from its ID_DECORR_COMBINED metadata) instead of doing a search.
+// Only the decorrelation and entropy coding are redone at the new bitrate, which can't
+// be avoided because in hybrid mode these depend on the quantization noise. So this
+// is about as fast as an encode in the same mode without the "extra" modes (at most
+// about 1.15x faster, from skipping the initial search), but for a source that was
+// created with them it gets most of their benefit without the cost of the search.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+typedef struct {
+    int valid, num_terms;
+    uint32_t flags;                     // header flags of the source block
+    int64_t sample_index;               // where the encoder's block must start
+    struct decorr_pass decorr_passes [MAX_NTERMS];
+} TransrateStream;
+
+typedef struct {
+    WavpackStream *scratch;             // used to parse the source blocks
+    TransrateStream *streams;
+    int num_streams;
+} Transrate;
+
+static int alloc_transrate (WavpackContext *wpc)
+{
+    Transrate *tr = calloc (1, sizeof (Transrate));
+
+    if (!tr)
+        return FALSE;
+
+    tr->scratch = calloc (1, sizeof (WavpackStream));
+    tr->streams = calloc (wpc->num_streams, sizeof (TransrateStream));
+
+    if (!tr->scratch || !tr->streams) {
+        free (tr->scratch);
+        free (tr->streams);
+        free (tr);
+        return FALSE;
+    }
+
+    tr->num_streams = wpc->num_streams;
+    wpc->transrate = tr;
+    return TRUE;
+}
+
+// Get the decorrelation that the source's current block starts with for the specified
+// stream. This is only possible when the block has just been completely decoded (so
+// that it's still loaded and corresponds to the samples we were given).
+
+static int read_source_decorr (WavpackContext *source, int stream, uint32_t sample_count, WavpackStream *scratch, TransrateStream *trs)
+{
+    WavpackStream *sps = source->streams [stream];
+    unsigned char *blockptr;
+    WavpackMetadata wpmd;
+    int i;
+
+    if (!sps->blockbuff || !sps->init_done || sps->wphdr.block_samples != sample_count ||
+        sps->sample_index != sps->block_index + sps->wphdr.block_samples || (sps->wphdr.flags & DSD_FLAG))
+            return FALSE;
+
+    scratch->wphdr.flags = sps->wphdr.flags;
+    blockptr = sps->blockbuff + sizeof (WavpackHeader);
+
+    while (read_metadata_buff (&wpmd, sps->blockbuff, &blockptr))
+        if (wpmd.id == ID_DECORR_COMBINED) {
+            if (!read_decorr_combined (scratch, &wpmd))
+                return FALSE;
+
+            // the decoder stores the passes in the order they are undone, which is the
+            // reverse of the order the encoder applies them
+
+            for (i = 0; i < scratch->num_terms; ++i)
+                trs->decorr_passes [i] = scratch->decorr_passes [scratch->num_terms - 1 - i];
+
+            trs->num_terms = scratch->num_terms;
+            trs->flags = sps->wphdr.flags;
+            return TRUE;
+        }
+
+    return FALSE;
+}
+
+// Encode the samples of one block just decoded from the source (a context opened for
+// reading) as one block in the specified encoder (or more, if it's longer than the
+// encoder's block size or dynamic noise shaping shortens it), using the source block's
+// decorrelation. The samples must be exactly the block's samples, which can be done by
+// unpacking the number returned by WavpackStreamGetBlockSamplesLeft(). The encoder's
+// format must match the source's (any differences just mean that the block is encoded
+// normally) and it is flushed after the block, so samples should not be mixed with
+// WavpackStreamPackSamples(). Transrating is only done for hybrid encoders, so with
+// anything else this is just WavpackStreamPackSamples() and WavpackStreamFlushSamples().
+// A return of FALSE indicates an error (see the encoder's error_message).
+
+int WavpackStreamTransrateBlock (WavpackContext *wpc, WavpackContext *source, int32_t *sample_buffer, uint32_t sample_count)
+{
+    Transrate *tr = wpc->transrate;
+    int result, i;
+
+    if (!wpc->num_streams || !wpc->streams [0]->sample_buffer) {
+        strcpy (wpc->error_message, "transrating requires an initialized encoder!");
+        return FALSE;
+    }
+
+    if ((wpc->streams [0]->wphdr.flags & HYBRID_FLAG) && source->reader && source->streams && !wpc->acc_samples) {
+        if (!tr && !alloc_transrate (wpc)) {
+            strcpy (wpc->error_message, "can't allocate memory");
+            return FALSE;
+        }
+
+        tr = wpc->transrate;
+
+        for (i = 0; i < tr->num_streams; ++i)
+            if (i < source->num_streams && read_source_decorr (source, i, sample_count, tr->scratch, tr->streams + i)) {
+                tr->streams [i].sample_index = wpc->streams [i]->sample_index;
+                tr->streams [i].valid = TRUE;
+            }
+    }
+
+    result = WavpackStreamPackSamples (wpc, sample_buffer, sample_count) && WavpackStreamFlushSamples (wpc);
+
+    if (tr)
+        for (i = 0; i < tr->num_streams; ++i)
+            tr->streams [i].valid = FALSE;
+
+    return result;
+}
+
+// Called by pack_block() for hybrid blocks when transrating. If we have the source's
+// decorrelation for the block about to be encoded in the current stream, and it's
+// compatible, it is installed and TRUE is returned (and no search should be done).
+
+int transrate_decorr (WavpackContext *wpc)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    Transrate *tr = wpc->transrate;
+    TransrateStream *trs;
+    struct decorr_pass *dpp;
+    int i;
+
+    if (wpc->current_stream >= tr->num_streams)
+        return FALSE;
+
+    trs = tr->streams + wpc->current_stream;
+
+    if (!trs->valid || trs->sample_index != wps->sample_index || ((trs->flags ^ wps->wphdr.flags) & MONO_DATA))
+        return FALSE;
+
+    memcpy (wps->decorr_passes, trs->decorr_passes, sizeof (wps->decorr_passes));
+    wps->num_terms = trs->num_terms;
+
+    // without cross decorrelation only the -3 negative term is available, but the weights
+    // and history have the same form, so that can simply be substituted
+
+    if (!(wps->wphdr.flags & CROSS_DECORR))
+        for (dpp = wps->decorr_passes, i = 0; i < wps->num_terms; ++i, ++dpp)
+            if (dpp->term < 0)
+                dpp->term = -3;
+
+    if (!(wps->wphdr.flags & MONO_DATA)) {
+        wps->wphdr.flags = (wps->wphdr.flags & ~(uint32_t) JOINT_STEREO) | (trs->flags & JOINT_STEREO);
+        wps->joint_stereo = (trs->flags & JOINT_STEREO) ? 1 : 0;
+    }
+
+    return TRUE;
+}
+
+void free_transrate (WavpackContext *wpc)
+{
+    Transrate *tr = wpc->transrate;
+
+    free (tr->scratch);
+    free (tr->streams);
+    free (tr);
+
+    wpc->transrate = NULL;
+}
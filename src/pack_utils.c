@@ -95,6 +95,11 @@ void WavpackStreamSetFileInformation (WavpackContext *wpc, char *file_extension,
 // o CONFIG_OPTIMIZE_WVC        maximize bybrid compression (-cc option)
 // o CONFIG_CALC_NOISE          calc noise in hybrid mode
 // o CONFIG_EXTRA_MODE          extra processing mode (slow!)
+// o CONFIG_WARM_SEARCH         start extra mode search from the previous block's
+//                               results (much faster for -x3 and up)
+// o CONFIG_LARGE_BLOCKS        use the large-block format, which allows longer
+//                               and larger blocks (and longer default blocks)
+//                               but can't be decoded by older decoders
 // o CONFIG_SKIP_WVX            no wvx stream for floats & large ints
 // o CONFIG_MD5_CHECKSUM        specify if you plan to store MD5 signature
 // o CONFIG_CREATE_EXE          specify if you plan to prepend sfx module
@@ -105,6 +110,7 @@ void WavpackStreamSetFileInformation (WavpackContext *wpc, char *file_extension,
 // config->bitrate              hybrid bitrate in either bits/sample or kbps
 // config->shaping_weight       hybrid noise shaping coefficient override
 // config->block_samples        force samples per WavPack block (0 = use deflt)
+// config->block_bytes          limit bytes per WavPack block (0 = no limit)
 // config->float_norm_exp       select floating-point data (127 for +/-1.0)
 // config->xmode                extra mode processing value override
 
@@ -204,12 +210,14 @@ int WavpackStreamSetConfiguration64 (WavpackContext *wpc, WavpackStreamConfig *c
         return FALSE;
     }
 
-    if (config->block_samples && (config->block_samples < 50 || config->block_samples > 8000)) {
-        strcpy (wpc->error_message, "invalid custom block samples!");
-        return FALSE;
+    if (config->block_samples && (config->block_samples < 50 || config->block_samples >
+        ((config->flags & CONFIG_LARGE_BLOCKS) ? MAX_LARGE_BLOCK_SAMPLES : MAX_STANDARD_BLOCK_SAMPLES))) {
+            strcpy (wpc->error_message, "invalid custom block samples!");
+            return FALSE;
     }
 
-    if (config->block_bytes && (config->block_bytes < 256 || config->block_bytes > 16384)) {
+    if (config->block_bytes && (config->block_bytes < 256 || config->block_bytes >
+        ((config->flags & CONFIG_LARGE_BLOCKS) ? MAX_LARGE_BLOCK_BYTES : MAX_STANDARD_BLOCK_BYTES))) {
         strcpy (wpc->error_message, "invalid custom block bytes!");
         return FALSE;
     }
@@ -242,7 +250,7 @@ int WavpackStreamSetConfiguration64 (WavpackContext *wpc, WavpackStreamConfig *c
         }
 
         // with DSD, very few PCM options work (or make sense), so only allow those that do
-        config->flags &= (CONFIG_HIGH_FLAG | CONFIG_MD5_CHECKSUM | CONFIG_PAIR_UNDEF_CHANS);
+        config->flags &= (CONFIG_HIGH_FLAG | CONFIG_MD5_CHECKSUM | CONFIG_PAIR_UNDEF_CHANS | CONFIG_LARGE_BLOCKS);
         config->float_norm_exp = config->xmode = 0;
 #else
         strcpy (wpc->error_message, "libwavpack not configured for DSD!");
@@ -434,7 +442,7 @@ int WavpackStreamSetConfiguration64 (WavpackContext *wpc, WavpackStreamConfig *c
         if (num_chans && wpc->current_stream == NEW_MAX_STREAMS - 1)
             break;
 
-        memcpy (wps->wphdr.ckID, FOURCC, 4);
+        memcpy (wps->wphdr.ckID, (wpc->config.flags & CONFIG_LARGE_BLOCKS) ? FOURCC_LARGE : FOURCC, 4);
         wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
         wps->wphdr.flags = flags;
         wps->bits = bps;
@@ -535,6 +543,10 @@ int WavpackStreamPackInit (WavpackContext *wpc)
 {
     int sample_rate = wpc->config.sample_rate;
     int divisor = 75;                           // 1/75th second is basic block size
+    int scale = 1;                              // but large blocks are 8x longer
+
+    if (wpc->config.flags & CONFIG_LARGE_BLOCKS)
+        scale = 8;
 
     if (wpc->metabytes > 1000)                  // 1000 bytes still leaves plenty of room for audio
         write_metadata_block (wpc);             //  in this block (otherwise write a special one)
@@ -551,9 +563,9 @@ int WavpackStreamPackInit (WavpackContext *wpc)
             divisor = 100;
     }
 
-    wpc->block_samples = sample_rate / divisor;
+    wpc->block_samples = sample_rate / divisor * scale;
 
-    while (wpc->block_samples > 8000 || (int64_t) wpc->block_samples * wpc->config.num_channels > 25000)
+    while (wpc->block_samples > 8000 * scale || (int64_t) wpc->block_samples * wpc->config.num_channels > 25000 * scale)
         wpc->block_samples /= 2;
 
     while (wpc->block_samples < 256)
@@ -595,6 +607,8 @@ static int pack_streams (WavpackContext *wpc, uint32_t block_samples);
 
 int WavpackStreamPackSamples (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sample_count)
 {
+    int32_t *simulcast_buffer = sample_buffer;
+    uint32_t simulcast_count = sample_count;
     int nch = wpc->config.num_channels;
 
     while (sample_count) {
@@ -705,6 +719,9 @@ int WavpackStreamPackSamples (WavpackContext *wpc, int32_t *sample_buffer, uint3
                 return FALSE;
     }
 
+    if (wpc->simulcast)     // a simulcast leader passes the samples on to its renditions
+        return feed_simulcast (wpc, simulcast_buffer, simulcast_count);
+
     return TRUE;
 }
 
@@ -729,6 +746,14 @@ int WavpackStreamFlushSamples (WavpackContext *wpc)
             return FALSE;
     }
 
+#ifdef ENABLE_THREADS
+    if (wpc->pack_pipeline && !flush_pack_pipeline (wpc))
+        return FALSE;
+#endif
+
+    if (wpc->simulcast && !flush_simulcast (wpc))
+        return FALSE;
+
     if (wpc->metacount)
         write_metadata_block (wpc);
 
@@ -797,11 +822,15 @@ static int block_add_checksum (unsigned char *buffer_start, unsigned char *buffe
 static void block_update_checksum (unsigned char *buffer_start);
 #endif
 
-static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
+// Calculate the size of the block buffers required to pack the specified number of samples
+// (including any pending metadata). If this is larger than the blocks we're allowed to create
+// then the size is limited and (where possible) the block_trigger mechanism is enabled to
+// terminate blocks early when they fill.
+
+static uint32_t block_buffer_size (WavpackContext *wpc, uint32_t block_samples)
 {
-    uint32_t max_blocksize, max_chans = 1, bcount;
-    unsigned char *outbuff, *outend, *out2buff, *out2end;
-    int result = TRUE, i;
+    uint32_t max_blocksize, max_chans = 1, limit;
+    int i;
 
     // for calculating output (block) buffer size, first see if any streams are stereo
 
@@ -825,11 +854,13 @@ static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
     max_blocksize += wpc->metabytes + 1024;     // finally, add metadata & another 1K margin
     max_blocksize += max_blocksize & 1;         // and make sure it's even so we detect overflow
 
-    if (max_blocksize > 16384 || (wpc->config.block_bytes && wpc->config.block_bytes < max_blocksize)) {
+    limit = (wpc->config.flags & CONFIG_LARGE_BLOCKS) ? MAX_LARGE_BLOCK_BYTES : MAX_STANDARD_BLOCK_BYTES;
+
+    if (max_blocksize > limit || (wpc->config.block_bytes && wpc->config.block_bytes < max_blocksize)) {
         if (wpc->config.block_bytes && wpc->config.block_bytes < max_blocksize)
             max_blocksize = wpc->config.block_bytes;
         else
-            max_blocksize = 16384;
+            max_blocksize = limit;
 
         if (wpc->num_streams == 1 && !wpc->config.float_norm_exp && wpc->config.bits_per_sample <= 24 && !wpc->config.xmode) {
             wpc->block_trigger = (wpc->streams [0]->wphdr.flags & MONO_FLAG) ? 24 : 32;
@@ -842,6 +873,56 @@ static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
         }
     }
 
+    return max_blocksize;
+}
+
+static int encode_streams (WavpackContext *wpc, uint32_t block_samples);
+
+static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
+{
+    uint32_t acc_samples = wpc->acc_samples;
+    int result;
+
+#ifdef ENABLE_THREADS
+    if (wpc->pack_pipeline) {
+        uint32_t max_blocksize = block_buffer_size (wpc, block_samples);
+
+        if (!wpc->block_trigger)
+            return pack_streams_pipelined (wpc, block_samples, max_blocksize);
+        else if (!flush_pack_pipeline (wpc))       // the pipeline can't handle block_trigger, so we
+            return FALSE;                           // finish with it here and continue sequentially
+    }
+#endif
+
+    if (wpc->simulcast && !start_simulcast_block (wpc, &block_samples))
+        return FALSE;
+
+    if (wpc->speed_governor)
+        start_governed_block (wpc);
+
+    if (wpc->rate_control)
+        result = pack_streams_rate_controlled (wpc, block_samples, encode_streams);
+    else
+        result = encode_streams (wpc, block_samples);
+
+    if (wpc->speed_governor && result)
+        end_governed_block (wpc, acc_samples - wpc->acc_samples);
+
+    if (wpc->simulcast && result)
+        result = end_simulcast_block (wpc, acc_samples - wpc->acc_samples);
+
+    return result;
+}
+
+// Encode the specified number of samples from each stream into blocks and send them to the
+// output (this is the sequential encoder; see pack_streams() above for the alternatives).
+
+static int encode_streams (WavpackContext *wpc, uint32_t block_samples)
+{
+    uint32_t max_blocksize = block_buffer_size (wpc, block_samples);
+    unsigned char *outbuff, *outend, *out2buff, *out2end;
+    int result = TRUE;
+
     out2buff = (wpc->wvc_flag) ? malloc (max_blocksize) : NULL;
     out2end = out2buff + max_blocksize;
     outbuff = malloc (max_blocksize);
@@ -874,48 +955,18 @@ static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
 #endif
             result = pack_block (wpc, wps->sample_buffer);
 
-#if BLOCK_CHECKSUM_BYTES
-        if (result) {
-            result = block_add_checksum (outbuff, outend, BLOCK_CHECKSUM_BYTES);
-
-            if (result && out2buff)
-                result = block_add_checksum (out2buff, out2end, BLOCK_CHECKSUM_BYTES);
-        }
-#endif
-
-        wps->blockbuff = wps->block2buff = NULL;
-
         if (wps->wphdr.block_samples != block_samples)
             block_samples = wps->wphdr.block_samples;
 
-        if (!result) {
+        if (result)
+            result = send_stream_blocks (wpc);
+        else {
+            wps->blockbuff = wps->block2buff = NULL;
             strcpy (wpc->error_message, "output buffer overflowed!");
-            break;
         }
 
-        bcount = ((WavpackHeader *) outbuff)->ckSize + CHUNK_SIZE_OFFSET;
-        WavpackStreamNativeToLittleEndian ((WavpackHeader *) outbuff, WavpackHeaderFormat);
-        result = wpc->blockout (wpc->wv_out, outbuff, bcount);
-
-        if (!result) {
-            strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
+        if (!result)
             break;
-        }
-
-        wpc->filelen += bcount;
-
-        if (out2buff) {
-            bcount = ((WavpackHeader *) out2buff)->ckSize + CHUNK_SIZE_OFFSET;
-            WavpackStreamNativeToLittleEndian ((WavpackHeader *) out2buff, WavpackHeaderFormat);
-            result = wpc->blockout (wpc->wvc_out, out2buff, bcount);
-
-            if (!result) {
-                strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
-                break;
-            }
-
-            wpc->file2len += bcount;
-        }
 
         if (wpc->acc_samples != block_samples)
             memmove (wps->sample_buffer,
@@ -937,6 +988,58 @@ static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
     return result;
 }
 
+// Send the block (and correction block, if any) just packed for the current stream to the
+// output, adding the block checksums first (if enabled). The block buffers are detached from
+// the stream (but not freed). A return of FALSE indicates an error (see error_message).
+
+int send_stream_blocks (WavpackContext *wpc)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    unsigned char *outbuff = wps->blockbuff, *out2buff = wps->block2buff;
+    int result = TRUE, offset;
+    uint32_t bcount;
+
+#if BLOCK_CHECKSUM_BYTES
+    result = block_add_checksum (outbuff, wps->blockend, BLOCK_CHECKSUM_BYTES);
+
+    if (result && out2buff)
+        result = block_add_checksum (out2buff, wps->block2end, BLOCK_CHECKSUM_BYTES);
+#endif
+
+    wps->blockbuff = wps->block2buff = NULL;
+
+    if (!result) {
+        strcpy (wpc->error_message, "output buffer overflowed!");
+        return FALSE;
+    }
+
+    bcount = ((WavpackHeader *) outbuff)->ckSize + CHUNK_SIZE_OFFSET;
+    offset = store_block_header (outbuff);
+    bcount -= offset;
+
+    if (!wpc->blockout (wpc->wv_out, outbuff + offset, bcount)) {
+        strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
+        return FALSE;
+    }
+
+    wpc->filelen += bcount;
+
+    if (out2buff) {
+        bcount = ((WavpackHeader *) out2buff)->ckSize + CHUNK_SIZE_OFFSET;
+        offset = store_block_header (out2buff);
+        bcount -= offset;
+
+        if (!wpc->blockout (wpc->wvc_out, out2buff + offset, bcount)) {
+            strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
+            return FALSE;
+        }
+
+        wpc->file2len += bcount;
+    }
+
+    return TRUE;
+}
+
 // Given the pointer to the first block written (to either a .wv or .wvc file),
 // update the block with the actual number of samples written. If the wav
 // header was generated by the library, then it is updated also. This should
@@ -951,7 +1054,6 @@ void WavpackStreamUpdateNumSamples (WavpackContext *wpc, void *first_block)
     uint32_t wrapper_size;
     void *loc;
 
-    WavpackStreamLittleEndianToNative (first_block, WavpackHeaderFormat);
     loc = find_metadata (first_block, ID_TOTAL_SAMPLES, &wrapper_size);
 
     if (loc && wrapper_size == 5) {
@@ -968,7 +1070,6 @@ void WavpackStreamUpdateNumSamples (WavpackContext *wpc, void *first_block)
 #if BLOCK_CHECKSUM_BYTES
     block_update_checksum (first_block);
 #endif
-    WavpackStreamNativeToLittleEndian (first_block, WavpackHeaderFormat);
 }
 
 // Note: The following function is no longer required because the wav header
@@ -990,30 +1091,27 @@ void WavpackStreamUpdateNumSamples (WavpackContext *wpc, void *first_block)
 
 void *WavpackStreamGetWrapperLocation (void *first_block, uint32_t *size)
 {
-    void *loc;
-
-    WavpackStreamLittleEndianToNative (first_block, WavpackHeaderFormat);
-    loc = find_metadata (first_block, ID_RIFF_HEADER, size);
+    void *loc = find_metadata (first_block, ID_RIFF_HEADER, size);
 
     if (!loc)
         loc = find_metadata (first_block, ID_ALT_HEADER, size);
 
-    WavpackStreamNativeToLittleEndian (first_block, WavpackHeaderFormat);
-
     return loc;
 }
 
+// Find the specified metadata in a block as it was written (i.e., with the stored header).
+
 static void *find_metadata (void *wavpack_block, int desired_id, uint32_t *size)
 {
-    WavpackHeader *wphdr = wavpack_block;
-    unsigned char *dp, meta_id, c1, c2;
+    unsigned char *dp = wavpack_block, meta_id, c1, c2;
     int32_t bcount, meta_bc;
+    WavpackHeader wphdr;
 
-    if (strncmp (wphdr->ckID, FOURCC, 4))
+    if (!stored_header_size (dp))
         return NULL;
 
-    bcount = wphdr->ckSize - CHUNK_SIZE_REMAINDER;
-    dp = (unsigned char *)(wphdr + 1);
+    dp += read_stored_header (dp, &wphdr);
+    bcount = wphdr.ckSize - CHUNK_SIZE_REMAINDER;
 
     while (bcount >= 2) {
         meta_id = *dp++;
@@ -1159,7 +1257,7 @@ static int write_metadata_block (WavpackContext *wpc)
     WavpackHeader *wphdr;
 
     if (wpc->metacount) {
-        int metacount = wpc->metacount, block_size = sizeof (WavpackHeader);
+        int metacount = wpc->metacount, block_size = sizeof (WavpackHeader), offset;
         WavpackMetadata *wpmdp = wpc->metadata;
 
         while (metacount--) {
@@ -1172,7 +1270,7 @@ static int write_metadata_block (WavpackContext *wpc)
         wphdr = (WavpackHeader *) (block_buff = malloc (block_size + 6));
 
         CLEAR (*wphdr);
-        memcpy (wphdr->ckID, FOURCC, 4);
+        memcpy (wphdr->ckID, (wpc->config.flags & CONFIG_LARGE_BLOCKS) ? FOURCC_LARGE : FOURCC, 4);
         wphdr->ckSize = block_size - CHUNK_SIZE_OFFSET;
         wphdr->block_samples = 0;
 
@@ -1193,9 +1291,9 @@ static int write_metadata_block (WavpackContext *wpc)
 #if BLOCK_CHECKSUM_BYTES
         block_add_checksum ((unsigned char *) block_buff, (unsigned char *) block_buff + (block_size += BLOCK_CHECKSUM_BYTES + 2), BLOCK_CHECKSUM_BYTES);
 #endif
-        WavpackStreamNativeToLittleEndian ((WavpackHeader *) block_buff, WavpackHeaderFormat);
+        offset = store_block_header ((unsigned char *) block_buff);
 
-        if (!wpc->blockout (wpc->wv_out, block_buff, block_size)) {
+        if (!wpc->blockout (wpc->wv_out, block_buff + offset, block_size - offset)) {
             free (block_buff);
             strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
             return FALSE;
@@ -1225,13 +1323,8 @@ void free_metadata (WavpackMetadata *wpmd)
 static int block_add_checksum (unsigned char *buffer_start, unsigned char *buffer_end, int bytes)
 {
     WavpackHeader *wphdr = (WavpackHeader *) buffer_start;
-#ifdef BITSTREAM_SHORTS
-    uint16_t *csptr = (uint16_t*) buffer_start;
-#else
-    unsigned char *csptr = buffer_start;
-#endif
-    int bcount = wphdr->ckSize + CHUNK_SIZE_OFFSET, wcount;
-    uint32_t csum = (uint32_t) -1;
+    int bcount = wphdr->ckSize + CHUNK_SIZE_OFFSET;
+    uint32_t csum;
 
     if (bytes != 2 && bytes != 4)
         return FALSE;
@@ -1241,21 +1334,7 @@ static int block_add_checksum (unsigned char *buffer_start, unsigned char *buffe
 
     wphdr->flags |= HAS_CHECKSUM;
     wphdr->ckSize += 2 + bytes;
-    wcount = bcount >> 1;
-
-#ifdef BITSTREAM_SHORTS
-    while (wcount--)
-        csum = (csum * 3) + *csptr++;
-#else
-    WavpackStreamNativeToLittleEndian ((WavpackHeader *) buffer_start, WavpackHeaderFormat);
-
-    while (wcount--) {
-        csum = (csum * 3) + csptr [0] + (csptr [1] << 8);
-        csptr += 2;
-    }
-
-    WavpackStreamLittleEndianToNative ((WavpackHeader *) buffer_start, WavpackHeaderFormat);
-#endif
+    csum = block_checksum (wphdr, buffer_start + sizeof (WavpackHeader), buffer_start + bcount);
 
     buffer_start += bcount;
     *buffer_start++ = ID_BLOCK_CHECKSUM;
@@ -1276,17 +1355,23 @@ static int block_add_checksum (unsigned char *buffer_start, unsigned char *buffe
     return TRUE;
 }
 
+// (this one is given the block as it was written, with the stored header)
+
 static void block_update_checksum (unsigned char *buffer_start)
 {
-    WavpackHeader *wphdr = (WavpackHeader *) buffer_start;
-    unsigned char *dp, meta_id, c1, c2;
+    unsigned char *data, *dp, meta_id, c1, c2;
     uint32_t bcount, meta_bc;
+    WavpackHeader wphdr;
 
-    if (!(wphdr->flags & HAS_CHECKSUM))
+    if (!stored_header_size (buffer_start))
         return;
 
-    bcount = wphdr->ckSize - CHUNK_SIZE_REMAINDER;
-    dp = (unsigned char *)(wphdr + 1);
+    data = dp = buffer_start + read_stored_header (buffer_start, &wphdr);
+
+    if (!(wphdr.flags & HAS_CHECKSUM))
+        return;
+
+    bcount = wphdr.ckSize - CHUNK_SIZE_REMAINDER;
 
     while (bcount >= 2) {
         meta_id = *dp++;
@@ -1309,30 +1394,12 @@ static void block_update_checksum (unsigned char *buffer_start)
             return;
 
         if ((meta_id & ID_UNIQUE) == ID_BLOCK_CHECKSUM) {
-#ifdef BITSTREAM_SHORTS
-            uint16_t *csptr = (uint16_t*) buffer_start;
-#else
-            unsigned char *csptr = buffer_start;
-#endif
-            int wcount = (int)(dp - 2 - buffer_start) >> 1;
-            uint32_t csum = (uint32_t) -1;
+            uint32_t csum;
 
             if ((meta_id & ID_ODD_SIZE) || meta_bc < 2 || meta_bc > 4)
                 return;
 
-#ifdef BITSTREAM_SHORTS
-            while (wcount--)
-                csum = (csum * 3) + *csptr++;
-#else
-            WavpackStreamNativeToLittleEndian ((WavpackHeader *) buffer_start, WavpackHeaderFormat);
-
-            while (wcount--) {
-                csum = (csum * 3) + csptr [0] + (csptr [1] << 8);
-                csptr += 2;
-            }
-
-            WavpackStreamLittleEndianToNative ((WavpackHeader *) buffer_start, WavpackHeaderFormat);
-#endif
+            csum = block_checksum (&wphdr, data, dp - 2);
 
             if (meta_bc == 4) {
                 *dp++ = csum;
@@ -56,210 +56,140 @@ static const char ones_count_table [] = {
 
 static uint32_t __inline read_code (Bitstream *bs, uint32_t maxcode);
 
-// Read the next word from the bitstream "wvbits" and return the value. This
-// function can be used for hybrid or lossless streams, but since an
-// optimized version is available for lossless this function would normally
-// be used for hybrid only. If a hybrid lossless stream is being read then
-// the "correction" offset is written at the specified pointer. A return value
-// of WORD_EOF indicates that the end of the bitstream was reached (all 1s) or
-// some other error occurred.
+// Read the code used for the length of a run of zeros and for a ones count of LIMIT_ONES
+// or more (a count of 1s, ended by a 0, followed by that many bits less one, which are
+// below an implied most significant 1). Returns FALSE if the end of the bitstream was
+// reached (all 1s).
 
-int32_t FASTCALL get_word (WavpackStream *wps, int chan, int32_t *correction)
+static __inline int read_escape_code (Bitstream *bs, uint32_t *value)
 {
-    struct entropy_data *c = wps->w.c + chan;
-    uint32_t ones_count, low, mid, high;
-    int32_t value;
-    int sign;
-
-    if (!wps->wvbits.ptr)
-        return WORD_EOF;
+    uint32_t mask, result;
+    int cbits;
 
-    if (correction)
-        *correction = 0;
+    for (cbits = 0; cbits < 33 && getbit (bs); ++cbits);
 
-    if (!(wps->w.c [0].median [0] & ~1) && !wps->w.holding_zero && !wps->w.holding_one && !(wps->w.c [1].median [0] & ~1)) {
-        uint32_t mask;
-        int cbits;
+    if (cbits == 33)
+        return FALSE;
 
-        if (wps->w.zeros_acc) {
-            if (--wps->w.zeros_acc) {
-                c->slow_level -= (c->slow_level + SLO) >> SLS;
-                return 0;
-            }
-        }
-        else {
-            for (cbits = 0; cbits < 33 && getbit (&wps->wvbits); ++cbits);
+    if (cbits < 2)
+        result = cbits;
+    else {
+        for (mask = 1, result = 0; --cbits; mask <<= 1)
+            if (getbit (bs))
+                result |= mask;
 
-            if (cbits == 33)
-                return WORD_EOF;
+        result |= mask;
+    }
 
-            if (cbits < 2)
-                wps->w.zeros_acc = cbits;
-            else {
-                for (mask = 1, wps->w.zeros_acc = 0; --cbits; mask <<= 1)
-                    if (getbit (&wps->wvbits))
-                        wps->w.zeros_acc |= mask;
+    *value = result;
+    return TRUE;
+}
 
-                wps->w.zeros_acc |= mask;
-            }
+// Read the unary "ones count" that starts each word (before the holding_one adjustment),
+// using whichever of the optimizations is enabled. Returns FALSE if the end of the
+// bitstream was reached (all 1s).
 
-            if (wps->w.zeros_acc) {
-                c->slow_level -= (c->slow_level + SLO) >> SLS;
-                CLEAR (wps->w.c [0].median);
-                CLEAR (wps->w.c [1].median);
-                return 0;
-            }
-        }
-    }
+static __inline int read_ones_count (Bitstream *bs, uint32_t *value)
+{
+    uint32_t ones_count;
 
-    if (wps->w.holding_zero)
-        ones_count = wps->w.holding_zero = 0;
-    else {
 #ifdef USE_CTZ_OPTIMIZATION
-        while (wps->wvbits.bc < LIMIT_ONES) {
-            if (++(wps->wvbits.ptr) == wps->wvbits.end)
-                wps->wvbits.wrap (&wps->wvbits);
+    while (bs->bc < LIMIT_ONES) {
+        if (++(bs->ptr) == bs->end)
+            bs->wrap (bs);
 
-            wps->wvbits.sr |= *(wps->wvbits.ptr) << wps->wvbits.bc;
-            wps->wvbits.bc += sizeof (*(wps->wvbits.ptr)) * 8;
-        }
+        bs->sr |= *(bs->ptr) << bs->bc;
+        bs->bc += sizeof (*(bs->ptr)) * 8;
+    }
 
 #ifdef _MSC_VER
-        { unsigned long res; _BitScanForward (&res, (unsigned long)~wps->wvbits.sr); ones_count = (uint32_t) res; }
+    { unsigned long res; _BitScanForward (&res, (unsigned long)~bs->sr); ones_count = (uint32_t) res; }
 #else
-        ones_count = __builtin_ctz (~wps->wvbits.sr);
+    ones_count = __builtin_ctz (~bs->sr);
 #endif
 
-        if (ones_count >= LIMIT_ONES) {
-            wps->wvbits.bc -= ones_count;
-            wps->wvbits.sr >>= ones_count;
-
-            for (; ones_count < (LIMIT_ONES + 1) && getbit (&wps->wvbits); ++ones_count);
+    if (ones_count >= LIMIT_ONES) {
+        bs->bc -= ones_count;
+        bs->sr >>= ones_count;
 
-            if (ones_count == (LIMIT_ONES + 1))
-                return WORD_EOF;
-
-            if (ones_count == LIMIT_ONES) {
-                uint32_t mask;
-                int cbits;
-
-                for (cbits = 0; cbits < 33 && getbit (&wps->wvbits); ++cbits);
-
-                if (cbits == 33)
-                    return WORD_EOF;
+        for (; ones_count < (LIMIT_ONES + 1) && getbit (bs); ++ones_count);
 
-                if (cbits < 2)
-                    ones_count = cbits;
-                else {
-                    for (mask = 1, ones_count = 0; --cbits; mask <<= 1)
-                        if (getbit (&wps->wvbits))
-                            ones_count |= mask;
+        if (ones_count == (LIMIT_ONES + 1))
+            return FALSE;
 
-                    ones_count |= mask;
-                }
+        if (ones_count == LIMIT_ONES) {
+            if (!read_escape_code (bs, &ones_count))
+                return FALSE;
 
-                ones_count += LIMIT_ONES;
-            }
-        }
-        else {
-            wps->wvbits.bc -= ones_count + 1;
-            wps->wvbits.sr >>= ones_count + 1;
+            ones_count += LIMIT_ONES;
         }
+    }
+    else {
+        bs->bc -= ones_count + 1;
+        bs->sr >>= ones_count + 1;
+    }
 #elif defined (USE_NEXT8_OPTIMIZATION)
-        int next8;
+    int next8;
 
-        if (wps->wvbits.bc < 8) {
-            if (++(wps->wvbits.ptr) == wps->wvbits.end)
-                wps->wvbits.wrap (&wps->wvbits);
-
-            next8 = (wps->wvbits.sr |= *(wps->wvbits.ptr) << wps->wvbits.bc) & 0xff;
-            wps->wvbits.bc += sizeof (*(wps->wvbits.ptr)) * 8;
-        }
-        else
-            next8 = wps->wvbits.sr & 0xff;
-
-        if (next8 == 0xff) {
-            wps->wvbits.bc -= 8;
-            wps->wvbits.sr >>= 8;
-
-            for (ones_count = 8; ones_count < (LIMIT_ONES + 1) && getbit (&wps->wvbits); ++ones_count);
-
-            if (ones_count == (LIMIT_ONES + 1))
-                return WORD_EOF;
+    if (bs->bc < 8) {
+        if (++(bs->ptr) == bs->end)
+            bs->wrap (bs);
 
-            if (ones_count == LIMIT_ONES) {
-                uint32_t mask;
-                int cbits;
+        next8 = (bs->sr |= *(bs->ptr) << bs->bc) & 0xff;
+        bs->bc += sizeof (*(bs->ptr)) * 8;
+    }
+    else
+        next8 = bs->sr & 0xff;
 
-                for (cbits = 0; cbits < 33 && getbit (&wps->wvbits); ++cbits);
+    if (next8 == 0xff) {
+        bs->bc -= 8;
+        bs->sr >>= 8;
 
-                if (cbits == 33)
-                    return WORD_EOF;
+        for (ones_count = 8; ones_count < (LIMIT_ONES + 1) && getbit (bs); ++ones_count);
 
-                if (cbits < 2)
-                    ones_count = cbits;
-                else {
-                    for (mask = 1, ones_count = 0; --cbits; mask <<= 1)
-                        if (getbit (&wps->wvbits))
-                            ones_count |= mask;
+        if (ones_count == (LIMIT_ONES + 1))
+            return FALSE;
 
-                    ones_count |= mask;
-                }
+        if (ones_count == LIMIT_ONES) {
+            if (!read_escape_code (bs, &ones_count))
+                return FALSE;
 
-                ones_count += LIMIT_ONES;
-            }
-        }
-        else {
-            wps->wvbits.bc -= (ones_count = ones_count_table [next8]) + 1;
-            wps->wvbits.sr >>= ones_count + 1;
+            ones_count += LIMIT_ONES;
         }
+    }
+    else {
+        bs->bc -= (ones_count = ones_count_table [next8]) + 1;
+        bs->sr >>= ones_count + 1;
+    }
 #else
-        for (ones_count = 0; ones_count < (LIMIT_ONES + 1) && getbit (&wps->wvbits); ++ones_count);
-
-        if (ones_count >= LIMIT_ONES) {
-            uint32_t mask;
-            int cbits;
-
-            if (ones_count == (LIMIT_ONES + 1))
-                return WORD_EOF;
-
-            for (cbits = 0; cbits < 33 && getbit (&wps->wvbits); ++cbits);
+    for (ones_count = 0; ones_count < (LIMIT_ONES + 1) && getbit (bs); ++ones_count);
 
-            if (cbits == 33)
-                return WORD_EOF;
+    if (ones_count >= LIMIT_ONES) {
+        if (ones_count == (LIMIT_ONES + 1))
+            return FALSE;
 
-            if (cbits < 2)
-                ones_count = cbits;
-            else {
-                for (mask = 1, ones_count = 0; --cbits; mask <<= 1)
-                    if (getbit (&wps->wvbits))
-                        ones_count |= mask;
+        if (!read_escape_code (bs, &ones_count))
+            return FALSE;
 
-                ones_count |= mask;
-            }
-
-            ones_count += LIMIT_ONES;
-        }
+        ones_count += LIMIT_ONES;
+    }
 #endif
 
-        if (wps->w.holding_one) {
-            wps->w.holding_one = ones_count & 1;
-            ones_count = (ones_count >> 1) + 1;
-        }
-        else {
-            wps->w.holding_one = ones_count & 1;
-            ones_count >>= 1;
-        }
+    *value = ones_count;
+    return TRUE;
+}
 
-        wps->w.holding_zero = ~wps->w.holding_one & 1;
-    }
+// Use the (adjusted) ones count and the medians of the specified channel to determine
+// the range of the value's magnitude, and update the medians. The low end of the range
+// is returned and the high end is stored at "high".
 
-    if ((wps->wphdr.flags & HYBRID_FLAG) && !chan)
-        update_error_limit (wps);
+static __inline uint32_t get_median_range (struct entropy_data *c, uint32_t ones_count, uint32_t *high)
+{
+    uint32_t low;
 
     if (ones_count == 0) {
         low = 0;
-        high = GET_MED (0) - 1;
+        *high = GET_MED (0) - 1;
         DEC_MED0 ();
     }
     else {
@@ -267,7 +197,7 @@ int32_t FASTCALL get_word (WavpackStream *wps, int chan, int32_t *correction)
         INC_MED0 ();
 
         if (ones_count == 1) {
-            high = low + GET_MED (1) - 1;
+            *high = low + GET_MED (1) - 1;
             DEC_MED1 ();
         }
         else {
@@ -275,18 +205,83 @@ int32_t FASTCALL get_word (WavpackStream *wps, int chan, int32_t *correction)
             INC_MED1 ();
 
             if (ones_count == 2) {
-                high = low + GET_MED (2) - 1;
+                *high = low + GET_MED (2) - 1;
                 DEC_MED2 ();
             }
             else {
                 low += (ones_count - 2) * GET_MED (2);
-                high = low + GET_MED (2) - 1;
+                *high = low + GET_MED (2) - 1;
                 INC_MED2 ();
             }
         }
     }
 
-    low &= 0x7fffffff;
+    return low;
+}
+
+// Read the next word from the bitstream "wvbits" and return the value. This
+// function can be used for hybrid or lossless streams, but the decoder uses
+// the batched versions below (get_words_hybrid() and get_words_lossless())
+// which are faster. If a hybrid lossless stream is being read then
+// the "correction" offset is written at the specified pointer. A return value
+// of WORD_EOF indicates that the end of the bitstream was reached (all 1s) or
+// some other error occurred.
+
+int32_t FASTCALL get_word (WavpackStream *wps, int chan, int32_t *correction)
+{
+    struct entropy_data *c = wps->w.c + chan;
+    uint32_t ones_count, low, mid, high;
+    int32_t value;
+    int sign;
+
+    if (!wps->wvbits.ptr)
+        return WORD_EOF;
+
+    if (correction)
+        *correction = 0;
+
+    if (!(wps->w.c [0].median [0] & ~1) && !wps->w.holding_zero && !wps->w.holding_one && !(wps->w.c [1].median [0] & ~1)) {
+        if (wps->w.zeros_acc) {
+            if (--wps->w.zeros_acc) {
+                c->slow_level -= (c->slow_level + SLO) >> SLS;
+                return 0;
+            }
+        }
+        else {
+            if (!read_escape_code (&wps->wvbits, &wps->w.zeros_acc))
+                return WORD_EOF;
+
+            if (wps->w.zeros_acc) {
+                c->slow_level -= (c->slow_level + SLO) >> SLS;
+                CLEAR (wps->w.c [0].median);
+                CLEAR (wps->w.c [1].median);
+                return 0;
+            }
+        }
+    }
+
+    if (wps->w.holding_zero)
+        ones_count = wps->w.holding_zero = 0;
+    else {
+        if (!read_ones_count (&wps->wvbits, &ones_count))
+            return WORD_EOF;
+
+        if (wps->w.holding_one) {
+            wps->w.holding_one = ones_count & 1;
+            ones_count = (ones_count >> 1) + 1;
+        }
+        else {
+            wps->w.holding_one = ones_count & 1;
+            ones_count >>= 1;
+        }
+
+        wps->w.holding_zero = ~wps->w.holding_one & 1;
+    }
+
+    if ((wps->wphdr.flags & HYBRID_FLAG) && !chan)
+        update_error_limit (wps);
+
+    low = get_median_range (c, ones_count, &high) & 0x7fffffff;
     high &= 0x7fffffff;
 
     if (low > high)         // make sure high and low make sense
@@ -330,9 +325,6 @@ int32_t get_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsample
     uint32_t ones_count, low, high;
     Bitstream *bs = &wps->wvbits;
     int32_t csamples;
-#ifdef USE_NEXT8_OPTIMIZATION
-    int32_t next8;
-#endif
 
     if (nsamples && !bs->ptr) {
         memset (buffer, 0, (wps->wphdr.flags & MONO_DATA) ? nsamples * 4 : nsamples * 8);
@@ -360,9 +352,6 @@ int32_t get_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsample
         }
 
         if (wps->w.c [0].median [0] < 2 && !wps->w.holding_one && wps->w.c [1].median [0] < 2) {
-            uint32_t mask;
-            int cbits;
-
             if (wps->w.zeros_acc) {
                 if (--wps->w.zeros_acc) {
                     buffer [csamples] = 0;
@@ -370,21 +359,9 @@ int32_t get_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsample
                 }
             }
             else {
-                for (cbits = 0; cbits < 33 && getbit (bs); ++cbits);
-
-                if (cbits == 33)
+                if (!read_escape_code (bs, &wps->w.zeros_acc))
                     break;
 
-                if (cbits < 2)
-                    wps->w.zeros_acc = cbits;
-                else {
-                    for (mask = 1, wps->w.zeros_acc = 0; --cbits; mask <<= 1)
-                        if (getbit (bs))
-                            wps->w.zeros_acc |= mask;
-
-                    wps->w.zeros_acc |= mask;
-                }
-
                 if (wps->w.zeros_acc) {
                     CLEAR (wps->w.c [0].median);
                     CLEAR (wps->w.c [1].median);
@@ -394,170 +371,150 @@ int32_t get_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsample
             }
         }
 
-#ifdef USE_CTZ_OPTIMIZATION
-        while (bs->bc < LIMIT_ONES) {
-            if (++(bs->ptr) == bs->end)
-                bs->wrap (bs);
+        if (!read_ones_count (bs, &ones_count))
+            break;
 
-            bs->sr |= *(bs->ptr) << bs->bc;
-            bs->bc += sizeof (*(bs->ptr)) * 8;
-        }
+        low = wps->w.holding_one;
+        wps->w.holding_one = ones_count & 1;
+        wps->w.holding_zero = ~ones_count & 1;
+        ones_count = (ones_count >> 1) + low;
 
-#ifdef _MSC_VER
-        { unsigned long res; _BitScanForward (&res, (unsigned long)~wps->wvbits.sr); ones_count = (uint32_t) res; }
-#else
-        ones_count = __builtin_ctz (~wps->wvbits.sr);
-#endif
+        low = get_median_range (c, ones_count, &high);
+        low += read_code (bs, high - low);
+        buffer [csamples] = (getbit (bs)) ? ~low : low;
+    }
+
+    return (wps->wphdr.flags & MONO_DATA) ? csamples : (csamples / 2);
+}
 
-        if (ones_count >= LIMIT_ONES) {
-            bs->bc -= ones_count;
-            bs->sr >>= ones_count;
+// This is a batched version of get_word() for hybrid streams that obtains an
+// entire buffer of either mono or stereo samples. The decoder state that is
+// checked for every word is kept in locals for the whole buffer. If the
+// "corrections" pointer is not NULL, the corresponding correction offsets are
+// written there (zero where there is no correction data, and in that case the
+// correction bitstream is not read). The number of complete samples read is
+// returned, which is less than requested only if an error occurred.
 
-            for (; ones_count < (LIMIT_ONES + 1) && getbit (bs); ++ones_count);
+int32_t get_words_hybrid (WavpackStream *wps, int32_t *buffer, int32_t nsamples, int32_t *corrections)
+{
+    uint32_t flags = wps->wphdr.flags, ones_count, low, mid, high;
+    uint32_t holding_one = wps->w.holding_one, zeros_acc = wps->w.zeros_acc;
+    int holding_zero = wps->w.holding_zero, sign;
+    Bitstream *bs = &wps->wvbits, *cbs = NULL;
+    struct entropy_data *c = wps->w.c;
+    int32_t csamples;
 
-            if (ones_count == (LIMIT_ONES + 1))
-                break;
+    if (!bs->ptr)
+        return 0;
 
-            if (ones_count == LIMIT_ONES) {
-                uint32_t mask;
-                int cbits;
+    if (corrections && bs_is_open (&wps->wvcbits))
+        cbs = &wps->wvcbits;
 
-                for (cbits = 0; cbits < 33 && getbit (bs); ++cbits);
+    if (!(flags & MONO_DATA))
+        nsamples *= 2;
 
-                if (cbits == 33)
-                    break;
+    for (csamples = 0; csamples < nsamples; ++csamples) {
+        if (!(flags & MONO_DATA))
+            c = wps->w.c + (csamples & 1);
 
-                if (cbits < 2)
-                    ones_count = cbits;
-                else {
-                    for (mask = 1, ones_count = 0; --cbits; mask <<= 1)
-                        if (getbit (bs))
-                            ones_count |= mask;
+        if (corrections)
+            corrections [csamples] = 0;
 
-                    ones_count |= mask;
+        if (!(wps->w.c [0].median [0] & ~1) && !holding_zero && !holding_one && !(wps->w.c [1].median [0] & ~1)) {
+            if (zeros_acc) {
+                if (--zeros_acc) {
+                    c->slow_level -= (c->slow_level + SLO) >> SLS;
+                    buffer [csamples] = 0;
+                    continue;
                 }
-
-                ones_count += LIMIT_ONES;
             }
-        }
-        else {
-            bs->bc -= ones_count + 1;
-            bs->sr >>= ones_count + 1;
-        }
-#elif defined (USE_NEXT8_OPTIMIZATION)
-        if (bs->bc < 8) {
-            if (++(bs->ptr) == bs->end)
-                bs->wrap (bs);
+            else {
+                if (!read_escape_code (bs, &zeros_acc))
+                    break;
 
-            next8 = (bs->sr |= *(bs->ptr) << bs->bc) & 0xff;
-            bs->bc += sizeof (*(bs->ptr)) * 8;
+                if (zeros_acc) {
+                    c->slow_level -= (c->slow_level + SLO) >> SLS;
+                    CLEAR (wps->w.c [0].median);
+                    CLEAR (wps->w.c [1].median);
+                    buffer [csamples] = 0;
+                    continue;
+                }
+            }
         }
-        else
-            next8 = bs->sr & 0xff;
-
-        if (next8 == 0xff) {
-            bs->bc -= 8;
-            bs->sr >>= 8;
 
-            for (ones_count = 8; ones_count < (LIMIT_ONES + 1) && getbit (bs); ++ones_count);
-
-            if (ones_count == (LIMIT_ONES + 1))
+        if (holding_zero)
+            ones_count = holding_zero = 0;
+        else {
+            if (!read_ones_count (bs, &ones_count))
                 break;
 
-            if (ones_count == LIMIT_ONES) {
-                uint32_t mask;
-                int cbits;
-
-                for (cbits = 0; cbits < 33 && getbit (bs); ++cbits);
+            low = holding_one;
+            holding_one = ones_count & 1;
+            holding_zero = ~ones_count & 1;
+            ones_count = (ones_count >> 1) + low;
+        }
 
-                if (cbits == 33)
-                    break;
+        if (c == wps->w.c)
+            update_error_limit (wps);
 
-                if (cbits < 2)
-                    ones_count = cbits;
-                else {
-                    for (mask = 1, ones_count = 0; --cbits; mask <<= 1)
-                        if (getbit (bs))
-                            ones_count |= mask;
+        low = get_median_range (c, ones_count, &high) & 0x7fffffff;
+        high &= 0x7fffffff;
 
-                    ones_count |= mask;
-                }
+        if (low > high)         // make sure high and low make sense
+            high = low;
 
-                ones_count += LIMIT_ONES;
-            }
-        }
+        if (!c->error_limit)
+            mid = read_code (bs, high - low) + low;
         else {
-            bs->bc -= (ones_count = ones_count_table [next8]) + 1;
-            bs->sr >>= ones_count + 1;
-        }
-#else
-        for (ones_count = 0; ones_count < (LIMIT_ONES + 1) && getbit (bs); ++ones_count);
+            uint32_t error_limit = c->error_limit, sr = bs->sr;
+            int bc = bs->bc;
 
-        if (ones_count >= LIMIT_ONES) {
-            uint32_t mask;
-            int cbits;
+            // this is the bit-at-a-time search (normally the bulk of the work), so it
+            // has its own copy of the bitstream's shift register and the choice of
+            // halves is made without branches (the bits being essentially random)
 
-            if (ones_count == (LIMIT_ONES + 1))
-                break;
+            mid = (high + low + 1) >> 1;
 
-            for (cbits = 0; cbits < 33 && getbit (bs); ++cbits);
+            while (high - low > error_limit) {
+                if (!bc) {
+                    if (++(bs->ptr) == bs->end)
+                        bs->wrap (bs);
 
-            if (cbits == 33)
-                break;
-
-            if (cbits < 2)
-                ones_count = cbits;
-            else {
-                for (mask = 1, ones_count = 0; --cbits; mask <<= 1)
-                    if (getbit (bs))
-                        ones_count |= mask;
+                    sr = *(bs->ptr);
+                    bc = sizeof (*(bs->ptr)) * 8;
+                }
 
-                ones_count |= mask;
+                low = (sr & 1) ? mid : low;
+                high = (sr & 1) ? high : mid - 1;
+                mid = (high + low + 1) >> 1;
+                sr >>= 1;
+                bc--;
             }
 
-            ones_count += LIMIT_ONES;
+            bs->sr = sr;
+            bs->bc = bc;
         }
-#endif
 
-        low = wps->w.holding_one;
-        wps->w.holding_one = ones_count & 1;
-        wps->w.holding_zero = ~ones_count & 1;
-        ones_count = (ones_count >> 1) + low;
+        sign = getbit (bs);
 
-        if (ones_count == 0) {
-            low = 0;
-            high = GET_MED (0) - 1;
-            DEC_MED0 ();
+        if (cbs && c->error_limit) {
+            int32_t value = read_code (cbs, high - low) + low;
+            corrections [csamples] = sign ? (mid - value) : (value - mid);
         }
-        else {
-            low = GET_MED (0);
-            INC_MED0 ();
-
-            if (ones_count == 1) {
-                high = low + GET_MED (1) - 1;
-                DEC_MED1 ();
-            }
-            else {
-                low += GET_MED (1);
-                INC_MED1 ();
 
-                if (ones_count == 2) {
-                    high = low + GET_MED (2) - 1;
-                    DEC_MED2 ();
-                }
-                else {
-                    low += (ones_count - 2) * GET_MED (2);
-                    high = low + GET_MED (2) - 1;
-                    INC_MED2 ();
-                }
-            }
+        if (flags & HYBRID_BITRATE) {
+            c->slow_level -= (c->slow_level + SLO) >> SLS;
+            c->slow_level += wp_log2 (mid);
         }
 
-        low += read_code (bs, high - low);
-        buffer [csamples] = (getbit (bs)) ? ~low : low;
+        buffer [csamples] = sign ? ~mid : mid;
     }
 
-    return (wps->wphdr.flags & MONO_DATA) ? csamples : (csamples / 2);
+    wps->w.holding_one = holding_one;
+    wps->w.holding_zero = holding_zero;
+    wps->w.zeros_acc = zeros_acc;
+
+    return (flags & MONO_DATA) ? csamples : (csamples / 2);
 }
 
 // Read a single unsigned value from the specified bitstream with a value
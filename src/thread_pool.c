@@ -0,0 +1,347 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// thread_pool.c
+
+// This module provides the worker thread pool used by the parallel features
+// of the library. A pool may be created by the application and attached to
+// any number of contexts, so that a process with many streams does not need
+// a set of threads for every one of them. Each worker has its own task queue,
+// new tasks are distributed among the queues, and a worker that runs out of
+// tasks steals from the back of the other queues. Alternatively, a pool may
+// be created with an executor callback, in which case the tasks are simply
+// handed to the application's own runtime and no threads are created here.
+//
+// A pool must outlive the contexts it is attached to, but destroying it while
+// they are still open is safe: the actual destruction is deferred until the
+// last attached context is closed.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+#ifdef ENABLE_THREADS
+
+#include <pthread.h>
+
+typedef struct pool_task {
+    struct pool_task *next, *prev;
+    WavpackTaskFunction function;
+    void *arg;
+} PoolTask;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    PoolTask *front, *back;
+} TaskQueue;
+
+struct WavpackThreadPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t task_available;
+    int pending_tasks, next_queue, next_index, terminate, num_attached, destroy_requested;
+
+    TaskQueue *queues;
+    pthread_t *workers;
+    int num_workers, concurrency;
+
+    WavpackTaskExecutor executor;
+    void *executor_id;
+};
+
+// Remove a task from the front (oldest) or back (newest) of the specified queue,
+// or return NULL if the queue is empty.
+
+static PoolTask *take_task (TaskQueue *queue, int from_back)
+{
+    PoolTask *task;
+
+    pthread_mutex_lock (&queue->mutex);
+
+    if ((task = from_back ? queue->back : queue->front)) {
+        if (task->prev) task->prev->next = task->next;
+        else queue->front = task->next;
+
+        if (task->next) task->next->prev = task->prev;
+        else queue->back = task->prev;
+    }
+
+    pthread_mutex_unlock (&queue->mutex);
+    return task;
+}
+
+// Worker thread: wait for a task to become available, then take the oldest task from our
+// own queue, or (if that's empty) steal the newest task from another worker's queue. The
+// pending task count is incremented only after a task is queued, so once we have claimed
+// one of the pending tasks we are guaranteed to find a task in one of the queues.
+
+static void *pool_worker (void *arg)
+{
+    WavpackThreadPool *pool = arg;
+    int index, i;
+
+    pthread_mutex_lock (&pool->mutex);
+    index = pool->next_index++;
+
+    while (1) {
+        PoolTask *task;
+
+        while (!pool->pending_tasks && !pool->terminate)
+            pthread_cond_wait (&pool->task_available, &pool->mutex);
+
+        if (!pool->pending_tasks)
+            break;
+
+        pool->pending_tasks--;
+        pthread_mutex_unlock (&pool->mutex);
+
+        while (1) {
+            if ((task = take_task (pool->queues + index, FALSE)))
+                break;
+
+            for (i = 1; i < pool->concurrency; ++i)
+                if ((task = take_task (pool->queues + (index + i) % pool->concurrency, TRUE)))
+                    break;
+
+            if (task)
+                break;
+        }
+
+        task->function (task->arg);
+        free (task);
+        pthread_mutex_lock (&pool->mutex);
+    }
+
+    pthread_mutex_unlock (&pool->mutex);
+    return NULL;
+}
+
+// Release all the resources of a pool (the workers must have been terminated).
+
+static void free_thread_pool (WavpackThreadPool *pool)
+{
+    int i;
+
+    if (pool->queues) {
+        for (i = 0; i < pool->concurrency; ++i) {
+            while (pool->queues [i].front) {
+                PoolTask *task = pool->queues [i].front;
+
+                pool->queues [i].front = task->next;
+                free (task);
+            }
+
+            pthread_mutex_destroy (&pool->queues [i].mutex);
+        }
+
+        free (pool->queues);
+    }
+
+    if (pool->workers)
+        free (pool->workers);
+
+    pthread_cond_destroy (&pool->task_available);
+    pthread_mutex_destroy (&pool->mutex);
+    free (pool);
+}
+
+// Terminate the worker threads and free the pool. Any tasks still queued are
+// run first, so nothing that has been submitted is ever lost.
+
+static void shutdown_thread_pool (WavpackThreadPool *pool)
+{
+    int i;
+
+    pthread_mutex_lock (&pool->mutex);
+    pool->terminate = TRUE;
+    pthread_cond_broadcast (&pool->task_available);
+    pthread_mutex_unlock (&pool->mutex);
+
+    for (i = 0; i < pool->num_workers; ++i)
+        pthread_join (pool->workers [i], NULL);
+
+    free_thread_pool (pool);
+}
+
+#endif
+
+// Create a thread pool with the specified number of worker threads (1 - 256).
+// Returns NULL if the pool could not be created (or if the library was built
+// without thread support).
+
+WavpackThreadPool *WavpackStreamCreateThreadPool (int num_workers)
+{
+#ifdef ENABLE_THREADS
+    WavpackThreadPool *pool;
+    int i;
+
+    if (num_workers < 1 || num_workers > 256 || !(pool = malloc (sizeof (WavpackThreadPool))))
+        return NULL;
+
+    CLEAR (*pool);
+    pthread_mutex_init (&pool->mutex, NULL);
+    pthread_cond_init (&pool->task_available, NULL);
+    pool->queues = calloc (num_workers, sizeof (TaskQueue));
+    pool->workers = malloc (num_workers * sizeof (pthread_t));
+
+    if (!pool->queues || !pool->workers) {
+        free_thread_pool (pool);
+        return NULL;
+    }
+
+    for (i = 0; i < num_workers; ++i)
+        pthread_mutex_init (&pool->queues [i].mutex, NULL);
+
+    pool->concurrency = num_workers;
+
+    for (i = 0; i < num_workers; ++i)
+        if (!pthread_create (&pool->workers [pool->num_workers], NULL, pool_worker, pool))
+            pool->num_workers++;
+
+    // if we couldn't create all the threads, the tasks for the missing workers' queues
+    // will just be stolen, but if we have none at all then the pool is useless
+
+    if (!pool->num_workers) {
+        free_thread_pool (pool);
+        return NULL;
+    }
+
+    return pool;
+#else
+    return NULL;
+#endif
+}
+
+// Create a "pool" that hands all its tasks to the specified executor callback
+// instead of using its own threads. The executor must eventually call each
+// task's function (with its argument) exactly once, on any thread, and must
+// return TRUE if it accepted the task. If it returns FALSE, the task is run
+// immediately on the submitting thread instead. The concurrency parameter is
+// the number of tasks that the executor can usefully run at once, and is used
+// to size buffering (e.g., the number of frames queued for decoding).
+
+WavpackThreadPool *WavpackStreamCreateExecutorPool (WavpackTaskExecutor executor, void *executor_id, int concurrency)
+{
+#ifdef ENABLE_THREADS
+    WavpackThreadPool *pool;
+
+    if (!executor || concurrency < 1 || !(pool = malloc (sizeof (WavpackThreadPool))))
+        return NULL;
+
+    CLEAR (*pool);
+    pthread_mutex_init (&pool->mutex, NULL);
+    pthread_cond_init (&pool->task_available, NULL);
+    pool->executor = executor;
+    pool->executor_id = executor_id;
+    pool->concurrency = concurrency;
+    return pool;
+#else
+    return NULL;
+#endif
+}
+
+// Destroy a pool created with one of the functions above. If contexts are still
+// attached to the pool, this is deferred until the last of them is closed.
+
+void WavpackStreamDestroyThreadPool (WavpackThreadPool *pool)
+{
+#ifdef ENABLE_THREADS
+    int num_attached;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock (&pool->mutex);
+    pool->destroy_requested = TRUE;
+    num_attached = pool->num_attached;
+    pthread_mutex_unlock (&pool->mutex);
+
+    if (!num_attached)
+        shutdown_thread_pool (pool);
+#endif
+}
+
+#ifdef ENABLE_THREADS
+
+// Return the number of tasks that the pool can usefully run at once.
+
+int thread_pool_concurrency (WavpackThreadPool *pool)
+{
+    return pool->concurrency;
+}
+
+// Register or unregister a context using the pool. Unregistering the last context
+// from a pool that the application has asked to destroy completes the destruction.
+
+void attach_thread_pool (WavpackThreadPool *pool)
+{
+    pthread_mutex_lock (&pool->mutex);
+    pool->num_attached++;
+    pthread_mutex_unlock (&pool->mutex);
+}
+
+void detach_thread_pool (WavpackThreadPool *pool)
+{
+    int destroy;
+
+    pthread_mutex_lock (&pool->mutex);
+    destroy = !--pool->num_attached && pool->destroy_requested;
+    pthread_mutex_unlock (&pool->mutex);
+
+    if (destroy)
+        shutdown_thread_pool (pool);
+}
+
+// Submit a task to be run by the pool. Tasks are distributed to the worker queues
+// in turn (from where they may be stolen by idle workers). If the task cannot be
+// queued (no memory, or rejected by the executor) it is run immediately, so the
+// caller can always count on each task being run exactly once.
+
+void submit_pool_task (WavpackThreadPool *pool, WavpackTaskFunction function, void *arg)
+{
+    TaskQueue *queue;
+    PoolTask *task;
+
+    if (pool->executor) {
+        if (!pool->executor (pool->executor_id, function, arg))
+            function (arg);
+
+        return;
+    }
+
+    if (!(task = malloc (sizeof (PoolTask)))) {
+        function (arg);
+        return;
+    }
+
+    task->function = function;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock (&pool->mutex);
+    queue = pool->queues + pool->next_queue;
+    pool->next_queue = (pool->next_queue + 1) % pool->concurrency;
+    pthread_mutex_unlock (&pool->mutex);
+
+    pthread_mutex_lock (&queue->mutex);
+
+    if ((task->prev = queue->back))
+        queue->back->next = task;
+    else
+        queue->front = task;
+
+    queue->back = task;
+    pthread_mutex_unlock (&queue->mutex);
+
+    pthread_mutex_lock (&pool->mutex);
+    pool->pending_tasks++;
+    pthread_cond_signal (&pool->task_available);
+    pthread_mutex_unlock (&pool->mutex);
+}
+
+#endif
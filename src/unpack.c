@@ -49,6 +49,16 @@ extern void DECORR_MONO_PASS_CONT (struct decorr_pass *dpp, int32_t *buffer, int
 
 #define LOSSY_MUTE
 
+// In hybrid lossless mode the words (and corrections) are read in chunks of this
+// many samples before being decorrelated and corrected sample by sample.
+
+#define WORD_CHUNK 256
+
+// The literal bits of extended integer data are read from the wvx stream for
+// as many samples at once as will fit in this many bits.
+
+#define MAX_GETBITS 24
+
 ///////////////////////////// executable code ////////////////////////////////
 
 // This monster actually unpacks the WavPack bitstream(s) into the specified
@@ -70,13 +80,19 @@ extern void DECORR_MONO_PASS_CONT (struct decorr_pass *dpp, int32_t *buffer, int
 static void decorr_stereo_pass (struct decorr_pass *dpp, int32_t *buffer, int32_t sample_count);
 static void decorr_mono_pass (struct decorr_pass *dpp, int32_t *buffer, int32_t sample_count);
 static void fixup_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_count);
+static void restore_int32_lsbs (int32_t *values, uint32_t num_values, int zeros, int ones, int dups);
+static uint32_t read_mono_words (WavpackStream *wps, int32_t *buffer, uint32_t sample_count);
+static uint32_t check_mono_samples (int32_t *buffer, uint32_t sample_count, int32_t mute_limit, uint32_t *crc);
+static int32_t finish_unpack (WavpackContext *wpc, int32_t *buffer, uint32_t sample_count, uint32_t i, uint32_t crc, int m);
+static int32_t unpack_constant_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_count);
 
 int32_t unpack_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_count)
 {
     WavpackStream *wps = wpc->streams [wpc->current_stream];
     uint32_t flags = wps->wphdr.flags, crc = wps->crc, i;
     int32_t mute_limit = (1L << ((flags & MAG_MASK) >> MAG_LSB)) + 2;
-    int32_t correction [2], read_word, *bptr;
+    int32_t correction [2], corrections [WORD_CHUNK * 2], read_word, *bptr, *cptr = corrections;
+    uint32_t words = 0, words_read = 0, words_left = 0;
     struct decorr_pass *dpp;
     int tcount, m = 0;
 
@@ -99,27 +115,16 @@ int32_t unpack_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_co
         return sample_count;
     }
 
+    if (wps->constant_block)
+        return unpack_constant_samples (wpc, buffer, sample_count);
+
     if ((flags & HYBRID_FLAG) && !wps->block2buff)
         mute_limit = (mute_limit * 2) + 128;
 
     //////////////// handle lossless or hybrid lossy mono data /////////////////
 
     if (!wps->block2buff && (flags & MONO_DATA)) {
-        int32_t *eptr = buffer + sample_count;
-
-        if (flags & HYBRID_FLAG) {
-            i = sample_count;
-
-            for (bptr = buffer; bptr < eptr;)
-                if ((*bptr++ = get_word (wps, 0, NULL)) == WORD_EOF) {
-                    i = (uint32_t)(bptr - buffer);
-                    break;
-                }
-        }
-        else
-            i = get_words_lossless (wps, buffer, sample_count);
-
-        if (i != sample_count)
+        if ((i = read_mono_words (wps, buffer, sample_count)) != sample_count)
             goto get_word_eof;
 
 #ifdef DECORR_MONO_PASS_CONT
@@ -141,21 +146,12 @@ int32_t unpack_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_co
 #endif
 
 #ifndef LOSSY_MUTE
-        if (!(flags & HYBRID_FLAG))
-#endif
-        for (bptr = buffer; bptr < eptr; ++bptr) {
-            if (labs (bptr [0]) > mute_limit) {
-                i = (uint32_t)(bptr - buffer);
-                break;
-            }
-
-            crc = crc * 3 + bptr [0];
-        }
-#ifndef LOSSY_MUTE
-        else
-            for (bptr = buffer; bptr < eptr; ++bptr)
+        if (flags & HYBRID_FLAG)
+            for (bptr = buffer, i = sample_count; bptr < buffer + sample_count; ++bptr)
                 crc = crc * 3 + bptr [0];
+        else
 #endif
+        i = check_mono_samples (buffer, sample_count, mute_limit, &crc);
     }
 
     /////////////// handle lossless or hybrid lossy stereo data ///////////////
@@ -163,16 +159,8 @@ int32_t unpack_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_co
     else if (!wps->block2buff && !(flags & MONO_DATA)) {
         int32_t *eptr = buffer + (sample_count * 2);
 
-        if (flags & HYBRID_FLAG) {
-            i = sample_count;
-
-            for (bptr = buffer; bptr < eptr; bptr += 2)
-                if ((bptr [0] = get_word (wps, 0, NULL)) == WORD_EOF ||
-                    (bptr [1] = get_word (wps, 1, NULL)) == WORD_EOF) {
-                        i = (uint32_t)(bptr - buffer) / 2;
-                        break;
-                }
-        }
+        if (flags & HYBRID_FLAG)
+            i = get_words_hybrid (wps, buffer, sample_count, NULL);
         else
             i = get_words_lossless (wps, buffer, sample_count);
 
@@ -226,8 +214,21 @@ int32_t unpack_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_co
     else if ((flags & HYBRID_FLAG) && (flags & MONO_DATA))
         for (bptr = buffer, i = 0; i < sample_count; ++i) {
 
-            if ((read_word = get_word (wps, 0, correction)) == WORD_EOF)
-                break;
+            if (!words_left) {
+                if (words_read < words)         // last read was short, so we're done
+                    break;
+
+                words = (sample_count - i < WORD_CHUNK) ? sample_count - i : WORD_CHUNK;
+
+                if (!(words_left = words_read = get_words_hybrid (wps, bptr, words, corrections)))
+                    break;
+
+                cptr = corrections;
+            }
+
+            read_word = bptr [0];
+            correction [0] = *cptr++;
+            words_left--;
 
             for (tcount = wps->num_terms, dpp = wps->decorr_passes; tcount--; dpp++) {
                 int32_t sam, temp;
@@ -287,10 +288,24 @@ int32_t unpack_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_co
             int32_t left, right, left2, right2;
             int32_t left_c = 0, right_c = 0;
 
-            if ((left = get_word (wps, 0, correction)) == WORD_EOF ||
-                (right = get_word (wps, 1, correction + 1)) == WORD_EOF)
+            if (!words_left) {
+                if (words_read < words)         // last read was short, so we're done
+                    break;
+
+                words = (sample_count - i < WORD_CHUNK) ? sample_count - i : WORD_CHUNK;
+
+                if (!(words_left = words_read = get_words_hybrid (wps, bptr, words, corrections)))
                     break;
 
+                cptr = corrections;
+            }
+
+            left = bptr [0];
+            right = bptr [1];
+            correction [0] = *cptr++;
+            correction [1] = *cptr++;
+            words_left--;
+
             if (flags & CROSS_DECORR) {
                 left_c = left + correction [0];
                 right_c = right + correction [1];
@@ -456,6 +471,102 @@ int32_t unpack_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_co
         i = 0;  /* this line can't execute, but suppresses compiler warning */
 
 get_word_eof:
+    return finish_unpack (wpc, buffer, sample_count, i, crc, m);
+}
+
+// Read the entropy-coded residuals for a block of mono samples (lossless or lossy
+// hybrid, but not hybrid lossless) into the specified buffer, returning the number
+// of samples read (which is less than requested if we run out of data).
+
+static uint32_t read_mono_words (WavpackStream *wps, int32_t *buffer, uint32_t sample_count)
+{
+    if (wps->wphdr.flags & HYBRID_FLAG)
+        return get_words_hybrid (wps, buffer, sample_count, NULL);
+    else
+        return get_words_lossless (wps, buffer, sample_count);
+}
+
+// Check decoded mono samples against the mute limit and accumulate their crc,
+// returning the number of samples that passed (i.e., all of them unless one
+// appears to be corrupt).
+
+static uint32_t check_mono_samples (int32_t *buffer, uint32_t sample_count, int32_t mute_limit, uint32_t *crc)
+{
+    int32_t *bptr, *eptr = buffer + sample_count;
+    uint32_t crc_value = *crc;
+
+    for (bptr = buffer; bptr < eptr; ++bptr) {
+        if (labs (bptr [0]) > mute_limit)
+            break;
+
+        crc_value = crc_value * 3 + bptr [0];
+    }
+
+    *crc = crc_value;
+    return (uint32_t)(bptr - buffer);
+}
+
+// Unpack samples from a constant block (ID_CONSTANT_SAMPLES), which is just a
+// matter of filling the buffer with the block's value (converted to its final
+// form by fixup_samples()). The crc only has to be calculated if the block has
+// an audio checksum to check it against.
+
+static int32_t unpack_constant_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_count)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    uint32_t flags = wps->wphdr.flags, crc = wps->crc, i;
+    int32_t values [2], *bptr, *eptr;
+
+    values [0] = wps->constant_values [0];
+    values [1] = wps->constant_values [1];
+
+    if (wps->crc_wv_bytes) {
+        if (flags & MONO_DATA)
+            for (i = 0; i < sample_count; ++i)
+                crc += (crc << 1) + values [0];
+        else
+            for (i = 0; i < sample_count; ++i)
+                crc += (crc << 3) + ((uint32_t) values [0] << 1) + values [0] + values [1];
+
+        wps->crc = crc;
+    }
+
+    fixup_samples (wpc, values, 1);
+
+    if (flags & MONO_DATA)
+        values [1] = values [0];
+
+    if (flags & MONO_FLAG) {
+        if (!values [0])
+            memset (buffer, 0, sample_count * 4);
+        else
+            for (bptr = buffer, eptr = buffer + sample_count; bptr < eptr;)
+                *bptr++ = values [0];
+    }
+    else if (!values [0] && !values [1])
+        memset (buffer, 0, sample_count * 8);
+    else
+        for (bptr = buffer, eptr = buffer + sample_count * 2; bptr < eptr; bptr += 2) {
+            bptr [0] = values [0];
+            bptr [1] = values [1];
+        }
+
+    wps->sample_index += sample_count;
+    return sample_count;
+}
+
+// This is the common final step of unpacking. If fewer samples than requested
+// were successfully decoded, the output is muted (and will stay muted until the
+// next block). Otherwise the decorrelation history is normalized (if needed) and
+// the samples are converted to their final form.
+
+static int32_t finish_unpack (WavpackContext *wpc, int32_t *buffer, uint32_t sample_count, uint32_t i, uint32_t crc, int m)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    uint32_t flags = wps->wphdr.flags;
+    struct decorr_pass *dpp;
+    int tcount;
+
     if (i != sample_count) {
         memset (buffer, 0, sample_count * (flags & MONO_FLAG ? 4 : 8));
         wps->mute_error = TRUE;
@@ -504,6 +615,185 @@ get_word_eof:
     return i;
 }
 
+// Batch version of unpack_samples() for many independent streams of mono data
+// (lossless or lossy hybrid, but not hybrid lossless). Every context must have
+// a mono block loaded and initialized with at least the specified number of
+// samples remaining (see WavpackStreamUnpackSamplesBatch()), and each buffer
+// receives exactly what unpack_samples() would have returned. The entropy
+// decoding is done stream by stream, but the decorrelation passes (which can't
+// be vectorized within a stream because every sample depends on the previous
+// ones) are done in lockstep on groups of streams with the same decorrelation
+// terms, with the samples and filter state interleaved so that each SIMD lane
+// handles one stream.
+
+#define BATCH_LANES 8
+
+// branch-free equivalent of update_weight() so that the lane loops can vectorize
+
+#define update_weight_batch(weight, delta, source, result) \
+    { int32_t s = (int32_t) (source ^ result) >> 31; weight += ((delta ^ s) - s) & -((source != 0) & (result != 0)); }
+
+static int same_decorr_terms (WavpackStream *wps1, WavpackStream *wps2);
+static void decorr_mono_batch (WavpackContext **wpcs, int32_t **buffers, int *group, int num_lanes, int32_t *soa, uint32_t sample_count);
+
+void unpack_mono_batch (WavpackContext **wpcs, int32_t **buffers, int num_contexts, uint32_t sample_count)
+{
+    int32_t *soa = malloc ((MAX_TERM + sample_count) * BATCH_LANES * sizeof (int32_t));
+    uint32_t *words_read = malloc (num_contexts * sizeof (uint32_t));
+    char *grouped = calloc (num_contexts, 1);
+    int group [BATCH_LANES], num_lanes, i, j;
+
+    if (!soa || !words_read || !grouped) {
+        for (i = 0; i < num_contexts; ++i) {
+            wpcs [i]->current_stream = 0;
+            unpack_samples (wpcs [i], buffers [i], sample_count);
+        }
+    }
+    else {
+        for (i = 0; i < num_contexts; ++i)
+            words_read [i] = read_mono_words (wpcs [i]->streams [0], buffers [i], sample_count);
+
+        for (i = 0; i < num_contexts; ++i)
+            if (!grouped [i] && words_read [i] == sample_count) {
+                WavpackStream *wps = wpcs [i]->streams [0];
+
+                for (group [0] = i, num_lanes = 1, j = i + 1; j < num_contexts && num_lanes < BATCH_LANES; ++j)
+                    if (!grouped [j] && words_read [j] == sample_count && same_decorr_terms (wps, wpcs [j]->streams [0])) {
+                        group [num_lanes++] = j;
+                        grouped [j] = TRUE;
+                    }
+
+                decorr_mono_batch (wpcs, buffers, group, num_lanes, soa, sample_count);
+            }
+
+        for (i = 0; i < num_contexts; ++i) {
+            WavpackStream *wps = wpcs [i]->streams [0];
+            uint32_t flags = wps->wphdr.flags, crc = wps->crc, count = words_read [i];
+            int32_t mute_limit = (1L << ((flags & MAG_MASK) >> MAG_LSB)) + 2;
+
+            if (flags & HYBRID_FLAG)
+                mute_limit = (mute_limit * 2) + 128;
+
+            if (count == sample_count) {
+#ifndef LOSSY_MUTE
+                if (flags & HYBRID_FLAG)
+                    for (j = 0; j < sample_count; ++j)
+                        crc = crc * 3 + buffers [i] [j];
+                else
+#endif
+                count = check_mono_samples (buffers [i], sample_count, mute_limit, &crc);
+            }
+
+            wpcs [i]->current_stream = 0;
+            finish_unpack (wpcs [i], buffers [i], sample_count, count, crc, 0);
+        }
+    }
+
+    if (soa) free (soa);
+    if (words_read) free (words_read);
+    if (grouped) free (grouped);
+}
+
+// Return TRUE if the two streams have the same sequence of decorrelation terms
+// (the weights and deltas may differ).
+
+static int same_decorr_terms (WavpackStream *wps1, WavpackStream *wps2)
+{
+    int i;
+
+    if (wps1->num_terms != wps2->num_terms)
+        return FALSE;
+
+    for (i = 0; i < wps1->num_terms; ++i)
+        if (wps1->decorr_passes [i].term != wps2->decorr_passes [i].term)
+            return FALSE;
+
+    return TRUE;
+}
+
+// Perform the mono decorrelation passes on a group of streams in lockstep. The
+// samples are interleaved into the "soa" buffer so that each row holds one sample
+// from each stream, with MAX_TERM rows of history in front. Unused lanes are left
+// zeroed (with zero weights) so that the inner loops can always handle all lanes.
+// The results (and the filter state) are identical to decorr_mono_pass().
+
+static void decorr_mono_batch (WavpackContext **wpcs, int32_t **buffers, int *group, int num_lanes, int32_t *soa, uint32_t sample_count)
+{
+    int32_t weight [BATCH_LANES], delta [BATCH_LANES], *rows = soa + MAX_TERM * BATCH_LANES, *row;
+    WavpackStream *wps = wpcs [group [0]]->streams [0];
+    int tcount, lane, k;
+    uint32_t i;
+
+    memset (soa, 0, (MAX_TERM + sample_count) * BATCH_LANES * sizeof (int32_t));
+
+    for (lane = 0; lane < num_lanes; ++lane)
+        for (i = 0; i < sample_count; ++i)
+            rows [i * BATCH_LANES + lane] = buffers [group [lane]] [i];
+
+    for (tcount = 0; tcount < wps->num_terms; ++tcount) {
+        int term = wps->decorr_passes [tcount].term, history = term > MAX_TERM ? 2 : term;
+
+        // load the filter state for this pass (terms 17 & 18 keep the newest sample first)
+
+        for (lane = 0; lane < BATCH_LANES; ++lane) {
+            struct decorr_pass *dpp = lane < num_lanes ? wpcs [group [lane]]->streams [0]->decorr_passes + tcount : NULL;
+
+            weight [lane] = dpp ? dpp->weight_A : 0;
+            delta [lane] = dpp ? dpp->delta : 0;
+
+            for (k = 0; k < history; ++k)
+                rows [(k - history) * BATCH_LANES + lane] = !dpp ? 0 :
+                    dpp->samples_A [term > MAX_TERM ? history - 1 - k : k];
+        }
+
+        if (term == 17)
+            for (row = rows, i = 0; i < sample_count; ++i, row += BATCH_LANES)
+                for (lane = 0; lane < BATCH_LANES; ++lane) {
+                    int32_t sam = 2 * row [lane - BATCH_LANES] - row [lane - BATCH_LANES * 2], input = row [lane];
+
+                    row [lane] = apply_weight_f (weight [lane], sam) + input;
+                    update_weight_batch (weight [lane], delta [lane], sam, input);
+                }
+        else if (term == 18)
+            for (row = rows, i = 0; i < sample_count; ++i, row += BATCH_LANES)
+                for (lane = 0; lane < BATCH_LANES; ++lane) {
+                    int32_t sam = (3 * row [lane - BATCH_LANES] - row [lane - BATCH_LANES * 2]) >> 1, input = row [lane];
+
+                    row [lane] = apply_weight_f (weight [lane], sam) + input;
+                    update_weight_batch (weight [lane], delta [lane], sam, input);
+                }
+        else
+            for (row = rows, i = 0; i < sample_count; ++i, row += BATCH_LANES) {
+                int32_t sams [BATCH_LANES];     // copied so the compiler need not worry about overlap
+
+                memcpy (sams, row - BATCH_LANES * term, sizeof (sams));
+
+                for (lane = 0; lane < BATCH_LANES; ++lane) {
+                    int32_t sam = sams [lane], input = row [lane];
+
+                    row [lane] = apply_weight_f (weight [lane], sam) + input;
+                    update_weight_batch (weight [lane], delta [lane], sam, input);
+                }
+            }
+
+        // store the filter state back (normalized, just like decorr_mono_pass() leaves it)
+
+        for (lane = 0; lane < num_lanes; ++lane) {
+            struct decorr_pass *dpp = wpcs [group [lane]]->streams [0]->decorr_passes + tcount;
+
+            dpp->weight_A = weight [lane];
+
+            for (k = 0; k < history; ++k)
+                dpp->samples_A [term > MAX_TERM ? history - 1 - k : k] =
+                    rows [((int32_t) sample_count + k - history) * BATCH_LANES + lane];
+        }
+    }
+
+    for (lane = 0; lane < num_lanes; ++lane)
+        for (i = 0; i < sample_count; ++i)
+            buffers [group [lane]] [i] = rows [i * BATCH_LANES + lane];
+}
+
 // General function to perform mono decorrelation pass on specified buffer
 // (although since this is the reverse function it might technically be called
 // "correlation" instead). This version handles all sample resolutions and
@@ -704,26 +994,28 @@ static void fixup_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample
         int32_t *dptr = buffer;
 
         if (bs_is_open (&wps->wvxbits)) {
-            uint32_t crc = wps->crc_x;
-
-            while (count--) {
-//              if (sent_bits) {
-                    getbits (&data, sent_bits, &wps->wvxbits);
-                    *dptr = ((uint32_t) *dptr << sent_bits) | (data & mask);
-//              }
+            if (sent_bits) {
+                uint32_t per_read = sent_bits < MAX_GETBITS ? MAX_GETBITS / sent_bits : 1, remaining, values, i;
 
-                if (zeros)
-                    *(uint32_t*)dptr <<= zeros;
-                else if (ones)
-                    *dptr = ((uint32_t)(*dptr + 1) << ones) - 1;
-                else if (dups)
-                    *dptr = ((uint32_t)(*dptr + (*dptr & 1)) << dups) - (*dptr & 1);
+                for (remaining = count; remaining; remaining -= values, dptr += values) {
+                    values = per_read < remaining ? per_read : remaining;
+                    getbits (&data, values * sent_bits, &wps->wvxbits);
 
-                crc = crc * 9 + (*dptr & 0xffff) * 3 + ((*dptr >> 16) & 0xffff);
-                dptr++;
+                    for (i = 0; i < values; ++i, data >>= sent_bits)
+                        dptr [i] = ((uint32_t) dptr [i] << sent_bits) | (data & mask);
+                }
             }
 
-            wps->crc_x = crc;
+            restore_int32_lsbs (buffer, count, zeros, ones, dups);
+
+            if (wps->crc_wvx_bytes) {
+                uint32_t crc = wps->crc_x;
+
+                for (dptr = buffer; count--; dptr++)
+                    crc = crc * 9 + (*dptr & 0xffff) * 3 + ((*dptr >> 16) & 0xffff);
+
+                wps->crc_x = crc;
+            }
         }
         else if (!sent_bits && (zeros + ones + dups)) {
             while (lossy_flag && (flags & BYTES_STORED) == 3 && shift < 8) {
@@ -739,16 +1031,7 @@ static void fixup_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample
                 shift++;
             }
 
-            while (count--) {
-                if (zeros)
-                    *(uint32_t*)dptr <<= zeros;
-                else if (ones)
-                    *dptr = ((uint32_t)(*dptr + 1) << ones) - 1;
-                else if (dups)
-                    *dptr = ((uint32_t)(*dptr + (*dptr & 1)) << dups) - (*dptr & 1);
-
-                dptr++;
-            }
+            restore_int32_lsbs (buffer, count, zeros, ones, dups);
         }
         else
             shift += zeros + sent_bits + ones + dups;
@@ -802,6 +1085,25 @@ static void fixup_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample
     }
 }
 
+// Restore the redundant LSBs that were removed from extended integer data by
+// scan_int32_data() on the encode side. Only one of "zeros", "ones" or "dups"
+// is used, so each case gets its own simple loop that can be vectorized.
+
+static void restore_int32_lsbs (int32_t *values, uint32_t num_values, int zeros, int ones, int dups)
+{
+    uint32_t i;
+
+    if (zeros)
+        for (i = 0; i < num_values; ++i)
+            values [i] = (uint32_t) values [i] << zeros;
+    else if (ones)
+        for (i = 0; i < num_values; ++i)
+            values [i] = ((uint32_t)(values [i] + 1) << ones) - 1;
+    else if (dups)
+        for (i = 0; i < num_values; ++i)
+            values [i] = ((uint32_t)(values [i] + (values [i] & 1)) << dups) - (values [i] & 1);
+}
+
 // This function checks the crc value(s) for an unpacked block, returning the
 // number of actual crc errors detected for the block. The block must be
 // completely unpacked before this test is valid. For losslessly unpacked
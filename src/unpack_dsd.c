@@ -22,7 +22,7 @@
 
 // This function initializes the main range-encoded data for DSD audio samples
 
-static int init_dsd_block_fast (WavpackStream *wps, WavpackMetadata *wpmd);
+static int init_dsd_block_fast (WavpackContext *wpc, WavpackMetadata *wpmd);
 static int init_dsd_block_high (WavpackStream *wps, WavpackMetadata *wpmd);
 static int decode_fast (WavpackStream *wps, int32_t *output, int sample_count);
 static int decode_high (WavpackStream *wps, int32_t *output, int sample_count);
@@ -53,7 +53,7 @@ int init_dsd_block (WavpackContext *wpc, WavpackMetadata *wpmd)
     }
 
     if (wps->dsd.mode == 1)
-        return init_dsd_block_fast (wps, wpmd);
+        return init_dsd_block_fast (wpc, wpmd);
     else if (wps->dsd.mode == 3)
         return init_dsd_block_high (wps, wpmd);
     else
@@ -129,10 +129,36 @@ int32_t unpack_dsd_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sampl
 // #define DSD_BYTE_READY(low,high) (!(((low) ^ (high)) >> 24))
 #define DSD_BYTE_READY(low,high) (!(((low) ^ (high)) & 0xff000000))
 
-static int init_dsd_block_fast (WavpackStream *wps, WavpackMetadata *wpmd)
+// Return the DSD "fast" mode decoding tables for the current stream, which are kept by the
+// context and reused for every block (allocated here on first use). Returns NULL if no memory.
+
+static DSDFastTables *get_fast_tables (WavpackContext *wpc)
+{
+    int si = wpc->current_stream;
+
+    if (si >= wpc->num_dsd_fast_tables) {
+        DSDFastTables **new_tables = realloc (wpc->dsd_fast_tables, (si + 1) * sizeof (*new_tables));
+
+        if (!new_tables)
+            return NULL;
+
+        memset (new_tables + wpc->num_dsd_fast_tables, 0, (si + 1 - wpc->num_dsd_fast_tables) * sizeof (*new_tables));
+        wpc->dsd_fast_tables = new_tables;
+        wpc->num_dsd_fast_tables = si + 1;
+    }
+
+    if (!wpc->dsd_fast_tables [si])
+        wpc->dsd_fast_tables [si] = malloc (sizeof (DSDFastTables));
+
+    return wpc->dsd_fast_tables [si];
+}
+
+static int init_dsd_block_fast (WavpackContext *wpc, WavpackMetadata *wpmd)
 {
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
     unsigned char history_bits, max_probability, *lb_ptr;
     int total_summed_probabilities = 0, bi, i;
+    DSDFastTables *tables;
 
     if (wps->dsd.byteptr == wps->dsd.endptr)
         return FALSE;
@@ -142,20 +168,29 @@ static int init_dsd_block_fast (WavpackStream *wps, WavpackMetadata *wpmd)
     if (wps->dsd.byteptr == wps->dsd.endptr || history_bits > MAX_HISTORY_BITS)
         return FALSE;
 
+    // Building the tables takes the same time regardless of the number of samples, so
+    // a damaged or malicious header with a tiny sample count could make this very
+    // expensive per sample. The encoder only uses as many history bins as the block has
+    // samples to fill, so we can enforce that and keep the work proportional to the block.
+
+    if (wps->wphdr.block_samples * (wps->wphdr.flags & MONO_DATA ? 1 : 2) < (uint32_t) MIN_VALUES_PER_BIN << history_bits)
+        return FALSE;
+
     wps->dsd.history_bins = 1 << history_bits;
 
     free_dsd_tables (wps);
-    lb_ptr = wps->dsd.lookup_buffer = (unsigned char *)malloc (wps->dsd.history_bins * MAX_BYTES_PER_BIN);
-    wps->dsd.value_lookup = (unsigned char **)malloc (sizeof (*wps->dsd.value_lookup) * wps->dsd.history_bins);
-    memset (wps->dsd.value_lookup, 0, sizeof (*wps->dsd.value_lookup) * wps->dsd.history_bins);
-    wps->dsd.summed_probabilities = (uint16_t (*)[256])malloc (sizeof (*wps->dsd.summed_probabilities) * wps->dsd.history_bins);
-    wps->dsd.probabilities = (unsigned char (*)[256])malloc (sizeof (*wps->dsd.probabilities) * wps->dsd.history_bins);
+
+    if (!(tables = wps->dsd.fast_tables = get_fast_tables (wpc)))
+        return FALSE;
+
+    lb_ptr = tables->lookup_buffer;
+    memset (tables->value_lookup, 0, sizeof (*tables->value_lookup) * wps->dsd.history_bins);
 
     max_probability = *wps->dsd.byteptr++;
 
     if (max_probability < 0xff) {
-        unsigned char *outptr = (unsigned char *) wps->dsd.probabilities;
-        unsigned char *outend = outptr + sizeof (*wps->dsd.probabilities) * wps->dsd.history_bins;
+        unsigned char *outptr = (unsigned char *) tables->probabilities;
+        unsigned char *outend = outptr + sizeof (*tables->probabilities) * wps->dsd.history_bins;
 
         while (outptr < outend && wps->dsd.byteptr < wps->dsd.endptr) {
             int code = *wps->dsd.byteptr++;
@@ -175,9 +210,9 @@ static int init_dsd_block_fast (WavpackStream *wps, WavpackMetadata *wpmd)
         if (outptr < outend || (wps->dsd.byteptr < wps->dsd.endptr && *wps->dsd.byteptr++))
             return FALSE;
     }
-    else if (wps->dsd.endptr - wps->dsd.byteptr > (int) sizeof (*wps->dsd.probabilities) * wps->dsd.history_bins) {
-        memcpy (wps->dsd.probabilities, wps->dsd.byteptr, sizeof (*wps->dsd.probabilities) * wps->dsd.history_bins);
-        wps->dsd.byteptr += sizeof (*wps->dsd.probabilities) * wps->dsd.history_bins;
+    else if (wps->dsd.endptr - wps->dsd.byteptr > (int) sizeof (*tables->probabilities) * wps->dsd.history_bins) {
+        memcpy (tables->probabilities, wps->dsd.byteptr, sizeof (*tables->probabilities) * wps->dsd.history_bins);
+        wps->dsd.byteptr += sizeof (*tables->probabilities) * wps->dsd.history_bins;
     }
     else
         return FALSE;
@@ -186,19 +221,18 @@ static int init_dsd_block_fast (WavpackStream *wps, WavpackMetadata *wpmd)
         int32_t sum_values;
 
         for (sum_values = i = 0; i < 256; ++i)
-            wps->dsd.summed_probabilities [bi] [i] = sum_values += wps->dsd.probabilities [bi] [i];
+            tables->summed_probabilities [bi] [i] = sum_values += tables->probabilities [bi] [i];
 
         if (sum_values) {
             if ((total_summed_probabilities += sum_values) > wps->dsd.history_bins * MAX_BYTES_PER_BIN)
                 return FALSE;
 
-            wps->dsd.value_lookup [bi] = lb_ptr;
+            init_divisor (tables->divisors + bi, sum_values);
+            tables->value_lookup [bi] = lb_ptr;
 
             for (i = 0; i < 256; i++) {
-                int c = wps->dsd.probabilities [bi] [i];
-
-                while (c--)
-                    *lb_ptr++ = i;
+                memset (lb_ptr, i, tables->probabilities [bi] [i]);
+                lb_ptr += tables->probabilities [bi] [i];
             }
         }
     }
@@ -216,68 +250,107 @@ static int init_dsd_block_fast (WavpackStream *wps, WavpackMetadata *wpmd)
     return TRUE;
 }
 
-static int decode_fast (WavpackStream *wps, int32_t *output, int sample_count)
-{
-    int total_samples = sample_count;
-
-    if (!(wps->wphdr.flags & MONO_DATA))
-        total_samples *= 2;
-
-    while (total_samples--) {
-        unsigned int mult, index, code, i;
-
-        if (!wps->dsd.summed_probabilities [wps->dsd.p0] [255])
-            return 0;
-
-        mult = (wps->dsd.high - wps->dsd.low) / wps->dsd.summed_probabilities [wps->dsd.p0] [255];
-
-        if (!mult) {
-            if (wps->dsd.endptr - wps->dsd.byteptr >= 4)
-                for (i = 4; i--;)
-                    wps->dsd.value = (wps->dsd.value << 8) | *wps->dsd.byteptr++;
+// Decode one value from the "fast" mode range coder using the specified history bin. If the
+// coder is out of range (or the data is corrupt) we bail out of decode_fast() with an error.
+// Renormalization shifts in all the settled high bytes at once (zero to four of them, which
+// avoids a hard-to-predict branch) as long as at least 4 bytes remain, otherwise we fall back
+// to going one byte at a time.
+
+#define DECODE_FAST_VALUE(bin,code) {                                               \
+    uint32_t sum = tables->summed_probabilities [bin] [255], mult, index;           \
+                                                                                    \
+    if (!sum)                                                                       \
+        goto done;                                                                  \
+                                                                                    \
+    if (!(mult = divide_invariant (high - low, tables->divisors + (bin)))) {        \
+        if (endptr - byteptr >= 4) {                                                \
+            value = ((uint32_t) byteptr [0] << 24) | ((uint32_t) byteptr [1] << 16) |   \
+                ((uint32_t) byteptr [2] << 8) | byteptr [3];                        \
+            byteptr += 4;                                                           \
+        }                                                                           \
+                                                                                    \
+        low = 0;                                                                    \
+        high = 0xffffffff;                                                          \
+        mult = divide_invariant (high, tables->divisors + (bin));                   \
+    }                                                                               \
+                                                                                    \
+    if ((index = (value - low) / mult) >= sum)                                      \
+        goto done;                                                                  \
+                                                                                    \
+    if ((code = tables->value_lookup [bin] [index]))                                \
+        low += tables->summed_probabilities [bin] [code-1] * mult;                  \
+                                                                                    \
+    high = low + tables->probabilities [bin] [code] * mult - 1;                     \
+    crc += (crc << 1) + code;                                                       \
+                                                                                    \
+    if (endptr - byteptr >= 4) {                                                    \
+        int shift = (32 - count_bits (high ^ low)) & ~7;                            \
+        uint64_t next = ((uint32_t) byteptr [0] << 24) | ((uint32_t) byteptr [1] << 16) |   \
+            ((uint32_t) byteptr [2] << 8) | byteptr [3];                            \
+                                                                                    \
+        value = (uint32_t) (((uint64_t) value << shift) | (next >> (32 - shift)));  \
+        high = (uint32_t) (((uint64_t) high << shift) | ((1ULL << shift) - 1));     \
+        low = (uint32_t) ((uint64_t) low << shift);                                 \
+        byteptr += shift >> 3;                                                      \
+    }                                                                               \
+    else                                                                            \
+        while (DSD_BYTE_READY (high, low) && byteptr < endptr) {                    \
+            value = (value << 8) | *byteptr++;                                      \
+            high = (high << 8) | 0xff;                                              \
+            low <<= 8;                                                              \
+        }                                                                           \
+}
 
-            wps->dsd.low = 0;
-            wps->dsd.high = 0xffffffff;
-            mult = wps->dsd.high / wps->dsd.summed_probabilities [wps->dsd.p0] [255];
+// Decode the specified number of samples from a DSD "fast" mode block. The range coder state
+// is kept in locals (which the output cannot alias) and stored back when we're done. Stereo
+// is decoded in pairs because each channel uses its own history bin (both channels share the
+// single range coder, so the values themselves must still be decoded in order).
 
-            if (!mult)
-                return 0;
+static int decode_fast (WavpackStream *wps, int32_t *output, int sample_count)
+{
+    unsigned char *byteptr = wps->dsd.byteptr, *endptr = wps->dsd.endptr;
+    uint32_t low = wps->dsd.low, high = wps->dsd.high, value = wps->dsd.value, crc = wps->crc;
+    DSDFastTables *tables = wps->dsd.fast_tables;
+    int p0 = wps->dsd.p0, p1 = wps->dsd.p1, mask = wps->dsd.history_bins - 1;
+    int samples_left = sample_count;
+
+    if (wps->wphdr.flags & MONO_DATA)
+        while (samples_left) {
+            unsigned int code;
+
+            DECODE_FAST_VALUE (p0, code);
+            *output++ = code;
+            p0 = code & mask;
+            samples_left--;
         }
-
-        index = (wps->dsd.value - wps->dsd.low) / mult;
-
-        if (index >= wps->dsd.summed_probabilities [wps->dsd.p0] [255])
-            return 0;
-
-        if ((*output++ = code = wps->dsd.value_lookup [wps->dsd.p0] [index]))
-            wps->dsd.low += wps->dsd.summed_probabilities [wps->dsd.p0] [code-1] * mult;
-
-        wps->dsd.high = wps->dsd.low + wps->dsd.probabilities [wps->dsd.p0] [code] * mult - 1;
-        wps->crc += (wps->crc << 1) + code;
-
-        if (wps->wphdr.flags & MONO_DATA)
-            wps->dsd.p0 = code & (wps->dsd.history_bins-1);
-        else {
-            wps->dsd.p0 = wps->dsd.p1;
-            wps->dsd.p1 = code & (wps->dsd.history_bins-1);
+    else
+        while (samples_left) {
+            unsigned int left, right;
+
+            DECODE_FAST_VALUE (p0, left);
+            DECODE_FAST_VALUE (p1, right);
+            output [0] = left;
+            output [1] = right;
+            output += 2;
+            p0 = left & mask;
+            p1 = right & mask;
+            samples_left--;
         }
 
-        while (DSD_BYTE_READY (wps->dsd.high, wps->dsd.low) && wps->dsd.byteptr < wps->dsd.endptr) {
-            wps->dsd.value = (wps->dsd.value << 8) | *wps->dsd.byteptr++;
-            wps->dsd.high = (wps->dsd.high << 8) | 0xff;
-            wps->dsd.low <<= 8;
-        }
-    }
+done:
+    wps->dsd.byteptr = byteptr;
+    wps->dsd.low = low;
+    wps->dsd.high = high;
+    wps->dsd.value = value;
+    wps->dsd.p0 = p0;
+    wps->dsd.p1 = p1;
+    wps->crc = crc;
 
-    return sample_count;
+    return samples_left ? 0 : sample_count;
 }
 
 /*------------------------------------------------------------------------------------------------------------------------*/
 
-#define PTABLE_BITS 8
-#define PTABLE_BINS (1<<PTABLE_BITS)
-#define PTABLE_MASK (PTABLE_BINS-1)
-
 #define UP   0x010000fe
 #define DOWN 0x00010000
 #define DECAY 8
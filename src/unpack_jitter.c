@@ -0,0 +1,455 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// unpack_jitter.c
+
+// This module provides a jitter buffer and playout scheduler for applications
+// receiving WavPack frames over a network (e.g., one frame per packet). The
+// application hands each frame to WavpackStreamJitterPutFrame() as it arrives,
+// along with its media timestamp and arrival time, and frames may arrive out
+// of order or more than once. Then, at regular intervals, the application calls
+// WavpackStreamJitterGetPeriod() to get the next fixed-size period of audio to
+// play. The frames are decoded just in time with the raw decoder and missing
+// audio is replaced with silence. The playout delay adapts to the measured
+// interarrival jitter (estimated as in RFC 3550) by inserting periods of
+// silence when there is not enough data buffered (a "stall") and dropping
+// periods of audio when there is too much (a "skip").
+//
+// All times (timestamps, arrival times, and delays) are expressed in samples
+// at the stream's sample rate, and arrival times and playout times must come
+// from the same clock. Correction data is not supported in this mode.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+typedef struct jitter_frame {
+    struct jitter_frame *next;
+    unsigned char *data;
+    int32_t bytes, *samples;
+    int64_t timestamp;
+    uint32_t num_samples;
+} JitterFrame;
+
+typedef struct {
+    JitterFrame *frames;            // held frames, sorted by timestamp
+    uint32_t period_samples, min_delay, max_delay, jitter16;
+    int64_t play_index, first_arrival, base_transit, last_transit;
+    int started, format_known, transit_known;
+    WavpackJitterStats stats;
+} JitterBuffer;
+
+// As with the push decoder, the context needs a reader for the functions that query
+// the input directly, but all the data here arrives from the application.
+
+static int32_t jitter_read_bytes (void *id, void *data, int32_t bcount) { return 0; }
+static int32_t jitter_write_bytes (void *id, void *data, int32_t bcount) { return 0; }
+static int64_t jitter_get_pos (void *id) { return 0; }
+static int jitter_set_pos_abs (void *id, int64_t pos) { return -1; }
+static int jitter_set_pos_rel (void *id, int64_t delta, int mode) { return -1; }
+static int jitter_push_back_byte (void *id, int c) { return -1; }
+static int64_t jitter_get_length (void *id) { return 0; }
+static int jitter_can_seek (void *id) { return 0; }
+
+static WavpackReader64 jitter_reader = {
+    jitter_read_bytes, jitter_write_bytes, jitter_get_pos, jitter_set_pos_abs, jitter_set_pos_rel,
+    jitter_push_back_byte, jitter_get_length, jitter_can_seek, NULL, NULL
+};
+
+// Open a context for jitter-buffered decoding. The flags and norm_offset parameters
+// are the same as for WavpackStreamOpenFileInputEx64(), except that OPEN_WVC is
+// ignored. Each call to WavpackStreamJitterGetPeriod() will return period_samples
+// samples, and the target playout delay (above the smallest network transit time
+// observed) is kept between min_delay and max_delay. As with the push decoder, the
+// format information is not available until the first frame has been received.
+
+WavpackContext *WavpackStreamOpenJitterBuffer (char *error, int flags, int norm_offset,
+    uint32_t period_samples, uint32_t min_delay, uint32_t max_delay)
+{
+    WavpackContext *wpc;
+    JitterBuffer *jb;
+
+    if (!period_samples || min_delay > max_delay) {
+        if (error) strcpy (error, "invalid jitter buffer parameters!");
+        return NULL;
+    }
+
+    wpc = malloc (sizeof (WavpackContext));
+
+    if (!wpc) {
+        if (error) strcpy (error, "can't allocate memory");
+        return NULL;
+    }
+
+    CLEAR (*wpc);
+    wpc->reader = &jitter_reader;
+    wpc->total_samples = -1;
+    wpc->norm_offset = norm_offset;
+    wpc->max_streams = OLD_MAX_STREAMS;     // use this until overwritten with actual number
+    wpc->open_flags = flags & ~OPEN_WVC;
+
+    wpc->streams = malloc ((wpc->num_streams = 1) * sizeof (wpc->streams [0]));
+    wpc->jitter_buffer = jb = malloc (sizeof (JitterBuffer));
+
+    if (!wpc->streams || !jb) {
+        if (error) strcpy (error, "can't allocate memory");
+        return WavpackStreamCloseFile (wpc);
+    }
+
+    CLEAR (*jb);
+    jb->period_samples = period_samples;
+    jb->min_delay = min_delay;
+    jb->max_delay = max_delay;
+    jb->stats.target_delay = min_delay;
+    wpc->streams [0] = malloc (sizeof (WavpackStream));
+
+    if (!wpc->streams [0]) {
+        if (error) strcpy (error, "can't allocate memory");
+        return WavpackStreamCloseFile (wpc);
+    }
+
+    CLEAR (*wpc->streams [0]);
+    return wpc;
+}
+
+// Remove the specified frame from the list and free it.
+
+static void discard_frame (JitterBuffer *jb, JitterFrame **link)
+{
+    JitterFrame *jf = *link;
+
+    *link = jf->next;
+    if (jf->samples) free (jf->samples);
+    free (jf->data);
+    free (jf);
+}
+
+// Decode the specified frame (if it hasn't been already) using the raw decoder.
+// The first frame decoded provides the format information for the context. If
+// the frame cannot be decoded (or its format does not match the first frame)
+// then FALSE is returned and the caller should discard it.
+
+static int decode_jitter_frame (WavpackContext *wpc, JitterFrame *jf)
+{
+    int num_channels, open_flags = wpc->open_flags & (OPEN_2CH_MAX | OPEN_NORMALIZE | OPEN_DSD_NATIVE | OPEN_DSD_AS_PCM);
+    JitterBuffer *jb = wpc->jitter_buffer;
+    WavpackContext *raw_wpc;
+    char error [80];
+
+    if (jf->samples)
+        return TRUE;
+
+    // DSD decimation has history that spans frames, so that is done on the main context
+
+    if (open_flags & OPEN_DSD_AS_PCM)
+        open_flags = (open_flags & ~OPEN_DSD_AS_PCM) | OPEN_DSD_NATIVE;
+
+    raw_wpc = WavpackStreamOpenRawDecoder (jf->data, jf->bytes, NULL, 0, 0, error, open_flags, wpc->norm_offset);
+
+    if (!raw_wpc) {
+        strcpy (wpc->error_message, error);
+        return FALSE;
+    }
+
+    if (!jb->format_known) {
+        WavpackStream *wps = wpc->streams [0];
+
+        wpc->config = raw_wpc->config;
+        wpc->reduced_channels = raw_wpc->reduced_channels;
+        wpc->max_streams = raw_wpc->max_streams;
+        wpc->version_five = raw_wpc->version_five;
+        memcpy (&wps->wphdr, &raw_wpc->streams [0]->wphdr, sizeof (WavpackHeader));
+
+        if ((wps->wphdr.flags & DSD_FLAG) && (wpc->open_flags & OPEN_DSD_AS_PCM) && !(wpc->open_flags & OPEN_DSD_NATIVE)) {
+#ifdef ENABLE_DSD
+            wpc->decimation_context = decimate_dsd_init (wpc->reduced_channels ?
+                wpc->reduced_channels : wpc->config.num_channels);
+#endif
+            wpc->config.bytes_per_sample = 3;
+            wpc->config.bits_per_sample = 24;
+        }
+
+        jb->format_known = TRUE;
+    }
+
+    num_channels = wpc->reduced_channels ? wpc->reduced_channels : wpc->config.num_channels;
+
+    if ((raw_wpc->reduced_channels ? raw_wpc->reduced_channels : raw_wpc->config.num_channels) == num_channels)
+        jf->samples = malloc (jf->num_samples * num_channels * sizeof (int32_t));
+
+    if (jf->samples && WavpackStreamUnpackSamples (raw_wpc, jf->samples, jf->num_samples) == jf->num_samples && !raw_wpc->crc_errors) {
+        if (raw_wpc->lossy_blocks)
+            wpc->lossy_blocks = TRUE;
+    }
+    else if (jf->samples) {
+        free (jf->samples);
+        jf->samples = NULL;
+    }
+
+    WavpackStreamCloseFile (raw_wpc);
+    return jf->samples != NULL;
+}
+
+// Add the specified frame to the jitter buffer. The data must be exactly one
+// complete WavPack frame (i.e., from an INITIAL_BLOCK to a FINAL_BLOCK) and is
+// copied, so the caller's buffer may be reused immediately. The timestamp is
+// the index of the frame's first sample in the stream and the arrival time is
+// the time the frame was received. A return of TRUE indicates that the frame
+// was accepted; FALSE means that it was discarded because it was late, a
+// duplicate, damaged, or because its samples overlap those of a frame already
+// held with a different timestamp (which is also tracked in the statistics).
+// In the last case the frame that arrived first is kept, since there is no
+// way to tell which one is right.
+
+int WavpackStreamJitterPutFrame (WavpackContext *wpc, void *data, int32_t bcount, int64_t timestamp, int64_t arrival_time)
+{
+    JitterBuffer *jb = wpc->jitter_buffer;
+    unsigned char *bp = data;
+    JitterFrame *jf, *prev = NULL, **link;
+    WavpackHeader wphdr;
+    int64_t transit;
+    int header_bytes;
+
+    if (!jb)
+        return FALSE;
+
+    jb->stats.frames_received++;
+
+    if (bcount < STANDARD_HEADER_SIZE || !(header_bytes = stored_header_size (bp)) || bcount < header_bytes) {
+        jb->stats.frames_damaged++;
+        wpc->crc_errors++;
+        return FALSE;
+    }
+
+    read_stored_header (bp, &wphdr);
+
+    if (!wphdr.block_samples || !(wphdr.flags & INITIAL_BLOCK) ||
+        wphdr.ckSize + CHUNK_SIZE_OFFSET - (sizeof (WavpackHeader) - header_bytes) > (uint32_t) bcount) {
+        jb->stats.frames_damaged++;
+        wpc->crc_errors++;
+        return FALSE;
+    }
+
+    // frames that end before the current playout position are too late to use
+
+    if (jb->started && timestamp + wphdr.block_samples <= jb->play_index) {
+        jb->stats.frames_late++;
+        return FALSE;
+    }
+
+    for (link = &jb->frames; *link && (*link)->timestamp < timestamp; link = &(*link)->next)
+        prev = *link;
+
+    if (*link && (*link)->timestamp == timestamp) {
+        jb->stats.frames_duplicate++;
+        return FALSE;
+    }
+
+    // the list is sorted and never holds overlapping frames, so only the neighbors need checking
+
+    if ((prev && prev->timestamp + prev->num_samples > timestamp) ||
+        (*link && timestamp + wphdr.block_samples > (*link)->timestamp)) {
+            jb->stats.frames_overlapping++;
+            return FALSE;
+    }
+
+    // update the transit time and jitter estimates (jitter is kept scaled by 16 as in RFC 3550)
+
+    transit = arrival_time - timestamp;
+
+    if (jb->transit_known) {
+        int64_t delta = transit - jb->last_transit;
+
+        if (delta < 0)
+            delta = -delta;
+
+        jb->jitter16 += (uint32_t) (delta > 0x7fffff ? 0x7fffff : delta) - ((jb->jitter16 + 8) >> 4);
+
+        if (transit < jb->base_transit)
+            jb->base_transit = transit;
+    }
+    else {
+        jb->base_transit = transit;
+        jb->first_arrival = arrival_time;
+        jb->transit_known = TRUE;
+    }
+
+    jb->last_transit = transit;
+    jb->stats.jitter = jb->jitter16 >> 4;
+    jb->stats.target_delay = jb->period_samples + jb->stats.jitter * 3;
+
+    if (jb->stats.target_delay < jb->min_delay)
+        jb->stats.target_delay = jb->min_delay;
+    else if (jb->stats.target_delay > jb->max_delay)
+        jb->stats.target_delay = jb->max_delay;
+
+    // insert the frame into the list (in timestamp order)
+
+    jf = malloc (sizeof (JitterFrame));
+
+    if (!jf || !(jf->data = malloc (bcount))) {
+        strcpy (wpc->error_message, "can't allocate memory");
+        if (jf) free (jf);
+        return FALSE;
+    }
+
+    memcpy (jf->data, data, jf->bytes = bcount);
+    jf->timestamp = timestamp;
+    jf->num_samples = wphdr.block_samples;
+    jf->samples = NULL;
+    jf->next = *link;
+    *link = jf;
+
+    // if we don't know the format yet, get it from this frame now
+
+    if (!jb->format_known && !decode_jitter_frame (wpc, jf)) {
+        discard_frame (jb, link);
+        jb->stats.frames_damaged++;
+        wpc->crc_errors++;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Return the next period of audio to play, starting at the specified time. The
+// buffer must have room for period_samples samples (of all channels) and will
+// always be completely filled, with silence for any missing audio. The return
+// value is the number of samples of actual audio in the period, which is zero
+// before playout starts, during stalls, and when nothing is available at all.
+// Until the format is known (i.e., WavpackStreamGetNumChannels() returns zero)
+// the buffer is not written. After each call, WavpackStreamGetSampleIndex64()
+// returns the stream position just past the period returned (which therefore
+// covers the period_samples samples before that when audio was returned).
+
+uint32_t WavpackStreamJitterGetPeriod (WavpackContext *wpc, int32_t *buffer, int64_t now)
+{
+    JitterBuffer *jb = wpc->jitter_buffer;
+    uint32_t samples_returned = 0;
+    int64_t delay, end_index;
+    int num_channels;
+    JitterFrame *jf;
+
+    if (!jb)
+        return 0;
+
+    num_channels = wpc->reduced_channels ? wpc->reduced_channels : wpc->config.num_channels;
+    jb->stats.periods++;
+
+    if (jb->format_known)
+        memset (buffer, 0, jb->period_samples * num_channels * sizeof (int32_t));
+
+    // playout starts when the first frame received has been held for the target delay
+
+    if (!jb->started) {
+        if (!jb->frames || now - jb->first_arrival < jb->stats.target_delay)
+            return 0;
+
+        jb->play_index = jb->frames->timestamp;
+        jb->started = TRUE;
+    }
+
+    // the current delay is how far we are playing behind the fastest transit seen
+
+    delay = now - jb->play_index - jb->base_transit;
+    jb->stats.current_delay = (int32_t) (delay > 0x7fffffff ? 0x7fffffff : delay < -0x7fffffff ? -0x7fffffff : delay);
+
+    // if there is nothing available to start the period, and we have not reached the
+    // target delay, then stall (which increases the delay by one period)
+
+    if ((!jb->frames || jb->frames->timestamp > jb->play_index) && delay < (int64_t) jb->stats.target_delay) {
+        jb->stats.stalls++;
+        jb->stats.underruns++;
+        return 0;
+    }
+
+    // if we are at least a period beyond the target delay (or beyond the maximum) then
+    // drop a period of audio to bring the delay back down
+
+    if (delay >= (int64_t) jb->stats.target_delay + jb->period_samples || delay > (int64_t) jb->max_delay + jb->period_samples) {
+        jb->play_index += jb->period_samples;
+        jb->stats.skips++;
+    }
+
+    end_index = jb->play_index + jb->period_samples;
+
+    // discard frames that are completely before the playout position, then decode
+    // and copy the audio from the frames overlapping this period
+
+    while (jb->frames && jb->frames->timestamp + jb->frames->num_samples <= jb->play_index)
+        discard_frame (jb, &jb->frames);
+
+    for (jf = jb->frames; jf && jf->timestamp < end_index;) {
+        int64_t first = jf->timestamp > jb->play_index ? jf->timestamp : jb->play_index;
+        int64_t last = jf->timestamp + jf->num_samples < end_index ? jf->timestamp + jf->num_samples : end_index;
+
+        if (!decode_jitter_frame (wpc, jf)) {
+            JitterFrame **link;
+
+            for (link = &jb->frames; *link != jf; link = &(*link)->next);
+            jf = jf->next;
+            discard_frame (jb, link);
+            jb->stats.frames_damaged++;
+            wpc->crc_errors++;
+            continue;
+        }
+
+        if (!wpc->decimation_context || first == jb->play_index + samples_returned) {
+            memcpy (buffer + (first - jb->play_index) * num_channels, jf->samples + (first - jf->timestamp) * num_channels,
+                (size_t) (last - first) * num_channels * sizeof (int32_t));
+
+            samples_returned += (uint32_t) (last - first);
+        }
+
+        jf = jf->next;
+    }
+
+#ifdef ENABLE_DSD
+    if (wpc->decimation_context)
+        decimate_dsd_run (wpc->decimation_context, buffer, samples_returned);
+#endif
+
+    if (samples_returned < jb->period_samples)
+        jb->stats.underruns++;
+
+    wpc->streams [0]->sample_index = jb->play_index = end_index;
+
+    while (jb->frames && jb->frames->timestamp + jb->frames->num_samples <= jb->play_index)
+        discard_frame (jb, &jb->frames);
+
+    return samples_returned;
+}
+
+// Get the current jitter buffer statistics.
+
+int WavpackStreamGetJitterStats (WavpackContext *wpc, WavpackJitterStats *stats)
+{
+    JitterBuffer *jb = wpc->jitter_buffer;
+
+    if (!jb)
+        return FALSE;
+
+    memcpy (stats, &jb->stats, sizeof (WavpackJitterStats));
+    return TRUE;
+}
+
+// Free all resources used by a jitter buffer (called from WavpackStreamCloseFile()).
+
+void free_jitter_buffer (WavpackContext *wpc)
+{
+    JitterBuffer *jb = wpc->jitter_buffer;
+
+    if (jb) {
+        while (jb->frames)
+            discard_frame (jb, &jb->frames);
+
+        free (jb);
+        wpc->jitter_buffer = NULL;
+    }
+}
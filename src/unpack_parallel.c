@@ -0,0 +1,541 @@
+////////////////////////////////////////////////////////////////////////////
+//                       **** WAVPACK-STREAM ****                         //
+//                      Streaming Audio Compressor                        //
+//                Copyright (c) 1998 - 2020 David Bryant.                 //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// unpack_parallel.c
+
+// This module provides frame-parallel decoding of WavPack streams. Because
+// every WavPack block carries its complete decoder state (in the
+// ID_DECORR_COMBINED and ID_ENTROPY_COMBINED metadata), the frames of a
+// stream can be decoded independently of each other. Here the application's
+// thread scans the stream with read_next_header() and queues complete frames
+// (with their matching correction blocks) into a fixed-size window, the tasks
+// of decoding them (using private raw decoder contexts) are submitted to a
+// thread pool (either private or shared with other contexts), and the
+// decoded audio is returned to WavpackStreamUnpackSamples() strictly in
+// stream order. Memory use is bounded by the number of frames in the window.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+#ifdef ENABLE_THREADS
+
+#include <pthread.h>
+
+#define FRAME_EMPTY     0       // slot is available for the next frame
+#define FRAME_QUEUED    1       // frame has been submitted to the pool for decoding
+#define FRAME_DONE      2       // frame is decoded and waiting to be returned
+
+typedef struct {
+    struct parallel_decoder *pd;
+    unsigned char *wv_data, *wvc_data;
+    uint32_t wv_bytes, wvc_bytes, num_samples, samples_returned;
+    int32_t *samples;
+    int state, num_blocks, mute, crc_errors, lossy_blocks;
+} ParallelFrame;
+
+typedef struct parallel_decoder {
+    pthread_mutex_t mutex;
+    pthread_cond_t frame_done;
+    WavpackThreadPool *pool;
+    int own_pool;
+
+    ParallelFrame *frames;
+    int num_frames, head, count, stream_done;
+
+    unsigned char *held_block, *held_block2;
+    int num_channels, open_flags, norm_offset;
+    int32_t mute_value;
+} ParallelDecoder;
+
+// Decode a single queued frame into its own sample buffer. This is called from the
+// pool's threads and touches nothing but the frame itself (and the read-only fields
+// of the parallel decoder) so no locking is required. Frames that cannot be decoded
+// (or that decode to the wrong number of channels or samples) are muted and flagged.
+
+static void decode_frame (ParallelDecoder *pd, ParallelFrame *frame)
+{
+    WavpackContext *raw_wpc = NULL;
+    char error [80];
+
+    frame->samples = malloc (frame->num_samples * pd->num_channels * sizeof (int32_t));
+
+    if (frame->samples && !frame->mute)
+        raw_wpc = WavpackStreamOpenRawDecoder (frame->wv_data, frame->wv_bytes, frame->wvc_data, frame->wvc_bytes,
+            0, error, pd->open_flags, pd->norm_offset);
+
+    if (raw_wpc && (raw_wpc->reduced_channels ? raw_wpc->reduced_channels : raw_wpc->config.num_channels) == pd->num_channels &&
+        WavpackStreamUnpackSamples (raw_wpc, frame->samples, frame->num_samples) == frame->num_samples) {
+            frame->crc_errors += raw_wpc->crc_errors;
+            frame->lossy_blocks = raw_wpc->lossy_blocks;
+    }
+    else
+        frame->mute = TRUE;
+
+    if (raw_wpc)
+        WavpackStreamCloseFile (raw_wpc);
+
+    if (frame->mute)
+        frame->crc_errors++;
+
+    free (frame->wv_data);
+    frame->wv_data = NULL;
+
+    if (frame->wvc_data) {
+        free (frame->wvc_data);
+        frame->wvc_data = NULL;
+    }
+}
+
+// Pool task: decode the specified frame and signal that it's ready to be returned.
+
+static void decode_task (void *arg)
+{
+    ParallelFrame *frame = arg;
+    ParallelDecoder *pd = frame->pd;
+
+    decode_frame (pd, frame);
+    pthread_mutex_lock (&pd->mutex);
+    frame->state = FRAME_DONE;
+    pthread_cond_broadcast (&pd->frame_done);
+    pthread_mutex_unlock (&pd->mutex);
+}
+
+// Append a complete block (in the internal form) to the specified frame buffer,
+// converting the header back to the form it was stored in.
+
+static int append_block (unsigned char **data, uint32_t *bytes, unsigned char *block)
+{
+    WavpackHeader header = * (WavpackHeader *) block;
+    uint32_t data_bytes = header.ckSize - CHUNK_SIZE_REMAINDER;
+    int header_bytes = sizeof (WavpackHeader) - store_block_header ((unsigned char *) &header);
+    unsigned char *new_data = realloc (*data, *bytes + header_bytes + data_bytes);
+
+    if (!new_data)
+        return FALSE;
+
+    memcpy (new_data + *bytes, (unsigned char *) (&header + 1) - header_bytes, header_bytes);
+    memcpy (new_data + *bytes + header_bytes, block + sizeof (WavpackHeader), data_bytes);
+    *data = new_data;
+    *bytes += header_bytes + data_bytes;
+    return TRUE;
+}
+
+// Read the next complete frame (one or more blocks, from an INITIAL_BLOCK through a
+// FINAL_BLOCK) from the stream into the specified frame, along with the matching
+// correction blocks if we're in hybrid lossless mode. Blocks that fail verification
+// are rendered harmless exactly like the sequential decoder does, and blocks that
+// contain no audio are processed here (on the main context) so that any metadata
+// they carry (like the MD5 sum or the RIFF trailer) is picked up. Returns TRUE if
+// a frame with audio was read, or FALSE at the end of the stream.
+
+static int read_frame (WavpackContext *wpc, ParallelDecoder *pd, ParallelFrame *frame)
+{
+    WavpackStream *wps = wpc->streams [0];
+
+    while (1) {
+        unsigned char *blockbuff, *block2buff = NULL;
+        WavpackHeader wphdr;
+
+        if (pd->held_block) {
+            blockbuff = pd->held_block;
+            block2buff = pd->held_block2;
+            pd->held_block = pd->held_block2 = NULL;
+            memcpy (&wphdr, blockbuff, sizeof (WavpackHeader));
+        }
+        else {
+            int64_t nexthdrpos;
+            int64_t bcount;
+
+            if (wpc->wrapper_bytes >= MAX_WRAPPER_BYTES)
+                break;
+
+            nexthdrpos = wpc->reader->get_pos (wpc->wv_in);
+            bcount = read_next_header (wpc->reader, wpc->wv_in, &wphdr, wpc->resync_limit, wpc->open_flags);
+
+            if (bcount == -1)
+                break;
+
+            wpc->filepos = nexthdrpos + bcount;
+            blockbuff = malloc (wphdr.ckSize + CHUNK_SIZE_OFFSET);
+
+            if (!blockbuff)
+                break;
+
+            memcpy (blockbuff, &wphdr, sizeof (WavpackHeader));
+
+            if (wpc->reader->read_bytes (wpc->wv_in, blockbuff + sizeof (WavpackHeader), wphdr.ckSize - CHUNK_SIZE_REMAINDER) !=
+                wphdr.ckSize - CHUNK_SIZE_REMAINDER) {
+                    strcpy (wpc->error_message, "can't read all of last block!");
+                    free (blockbuff);
+                    break;
+            }
+
+            // render corrupt blocks harmless
+            if (!verify_block_buff (blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
+                wphdr.ckSize = CHUNK_SIZE_REMAINDER;
+                wphdr.block_samples = 0;
+                memcpy (blockbuff, &wphdr, sizeof (WavpackHeader));
+            }
+        }
+
+        // blocks with no audio are processed immediately on the main context (if we're in the
+        // middle of a frame, this was a corrupt block and we will have to mute the frame)
+
+        if (!wphdr.block_samples) {
+            if (frame->num_blocks)
+                frame->mute = TRUE;
+            else {
+                free_streams (wpc);
+                memcpy (&wps->wphdr, &wphdr, sizeof (WavpackHeader));
+                wps->blockbuff = blockbuff;
+                wps->init_done = FALSE;
+
+                if (!unpack_init (wpc))
+                    wpc->crc_errors++;
+
+                wps = wpc->streams [0];     // might have been reallocated (compact mode)
+                wps->init_done = TRUE;
+                free_streams (wpc);
+                continue;
+            }
+
+            free (blockbuff);
+            continue;
+        }
+
+        // we must start a frame with an initial block, and if we get an initial block in the middle
+        // of a frame, the previous frame was incomplete (so hold this block for the next frame)
+
+        if (!(wphdr.flags & INITIAL_BLOCK) && !frame->num_blocks) {
+            if (block2buff) free (block2buff);
+            free (blockbuff);
+            continue;
+        }
+
+        if ((wphdr.flags & INITIAL_BLOCK) && frame->num_blocks) {
+            pd->held_block = blockbuff;
+            pd->held_block2 = block2buff;
+            frame->mute = TRUE;
+            return TRUE;
+        }
+
+        // if we're in hybrid lossless mode (and don't already have it) read the matching wvc block
+
+        if (wpc->wvc_flag && !block2buff) {
+            memcpy (&wps->wphdr, &wphdr, sizeof (WavpackHeader));
+            read_wvc_block (wpc);
+            block2buff = wps->block2buff;
+            wps->block2buff = NULL;
+        }
+
+        if (!append_block (&frame->wv_data, &frame->wv_bytes, blockbuff))
+            frame->mute = TRUE;
+
+        if (block2buff && !append_block (&frame->wvc_data, &frame->wvc_bytes, block2buff))
+            frame->mute = TRUE;
+
+        if (!frame->num_blocks++)
+            frame->num_samples = wphdr.block_samples;
+        else if (wphdr.block_samples != frame->num_samples)
+            frame->mute = TRUE;
+
+        if (block2buff) free (block2buff);
+        free (blockbuff);
+
+        if ((wphdr.flags & FINAL_BLOCK) || frame->num_blocks == wpc->max_streams)
+            return TRUE;
+    }
+
+    // we have reached the end of the stream, so return any incomplete frame (muted)
+
+    if (frame->num_blocks) {
+        strcpy (wpc->error_message, "can't read all of last block!");
+        frame->mute = TRUE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Fill any empty slots in the window with frames read from the stream and
+// submit them to the pool for decoding.
+
+static void fill_window (WavpackContext *wpc, ParallelDecoder *pd)
+{
+    while (!pd->stream_done && pd->count < pd->num_frames) {
+        ParallelFrame *frame = pd->frames + (pd->head + pd->count) % pd->num_frames;
+
+        CLEAR (*frame);
+        frame->pd = pd;
+
+        if (!read_frame (wpc, pd, frame)) {
+            pd->stream_done = TRUE;
+            break;
+        }
+
+        pthread_mutex_lock (&pd->mutex);
+        frame->state = FRAME_QUEUED;
+        pd->count++;
+        pthread_mutex_unlock (&pd->mutex);
+
+        submit_pool_task (pd->pool, decode_task, frame);
+    }
+}
+
+// This is the parallel version of WavpackStreamUnpackSamples() and is called
+// from there when parallel decoding has been enabled for the context. The
+// semantics are identical to the sequential version.
+
+uint32_t unpack_samples_parallel (WavpackContext *wpc, int32_t *buffer, uint32_t samples)
+{
+    ParallelDecoder *pd = wpc->parallel_decoder;
+    WavpackStream *wps = wpc->streams [0];
+    uint32_t samples_unpacked = 0;
+    int32_t *bptr = buffer;
+
+    while (samples) {
+        uint32_t samples_to_copy;
+        ParallelFrame *frame;
+
+        fill_window (wpc, pd);
+
+        if (!pd->count)
+            break;
+
+        frame = pd->frames + pd->head;
+        pthread_mutex_lock (&pd->mutex);
+
+        while (frame->state != FRAME_DONE)
+            pthread_cond_wait (&pd->frame_done, &pd->mutex);
+
+        pthread_mutex_unlock (&pd->mutex);
+
+        if (!frame->samples_returned) {
+            wpc->crc_errors += frame->crc_errors;
+
+            if (frame->lossy_blocks)
+                wpc->lossy_blocks = TRUE;
+        }
+
+        samples_to_copy = frame->num_samples - frame->samples_returned;
+
+        if (samples_to_copy > samples)
+            samples_to_copy = samples;
+
+        if (frame->mute || !frame->samples) {
+            uint32_t samples_to_mute = samples_to_copy * pd->num_channels;
+            int32_t *mptr = bptr;
+
+            while (samples_to_mute--)
+                *mptr++ = pd->mute_value;
+        }
+        else
+            memcpy (bptr, frame->samples + frame->samples_returned * pd->num_channels,
+                samples_to_copy * pd->num_channels * sizeof (int32_t));
+
+        bptr += samples_to_copy * pd->num_channels;
+        frame->samples_returned += samples_to_copy;
+        samples_unpacked += samples_to_copy;
+        wps->sample_index += samples_to_copy;
+        samples -= samples_to_copy;
+
+        if (frame->samples_returned == frame->num_samples) {
+            if (frame->samples) {
+                free (frame->samples);
+                frame->samples = NULL;
+            }
+
+            pthread_mutex_lock (&pd->mutex);
+            frame->state = FRAME_EMPTY;
+            pd->head = (pd->head + 1) % pd->num_frames;
+            pd->count--;
+            pthread_mutex_unlock (&pd->mutex);
+
+            if (wpc->total_samples != -1 && wps->sample_index == wpc->total_samples)
+                break;
+        }
+    }
+
+#ifdef ENABLE_DSD
+    if (wpc->decimation_context)
+        decimate_dsd_run (wpc->decimation_context, buffer, samples_unpacked);
+#endif
+
+    return samples_unpacked;
+}
+
+// Wait for any frames still being decoded (tasks can't be withdrawn from the pool),
+// detach from the pool, and free all resources used by the parallel decoder.
+
+void free_parallel_decoder (WavpackContext *wpc)
+{
+    ParallelDecoder *pd = wpc->parallel_decoder;
+    int i;
+
+    if (!pd)
+        return;
+
+    pthread_mutex_lock (&pd->mutex);
+
+    for (i = 0; i < pd->num_frames; ++i)
+        while (pd->frames [i].state == FRAME_QUEUED)
+            pthread_cond_wait (&pd->frame_done, &pd->mutex);
+
+    pthread_mutex_unlock (&pd->mutex);
+    detach_thread_pool (pd->pool);
+
+    if (pd->own_pool)
+        WavpackStreamDestroyThreadPool (pd->pool);
+
+    for (i = 0; i < pd->num_frames; ++i) {
+        if (pd->frames [i].wv_data) free (pd->frames [i].wv_data);
+        if (pd->frames [i].wvc_data) free (pd->frames [i].wvc_data);
+        if (pd->frames [i].samples) free (pd->frames [i].samples);
+    }
+
+    if (pd->held_block) free (pd->held_block);
+    if (pd->held_block2) free (pd->held_block2);
+
+    pthread_cond_destroy (&pd->frame_done);
+    pthread_mutex_destroy (&pd->mutex);
+    free (pd->frames);
+    free (pd);
+
+    wpc->parallel_decoder = NULL;
+}
+
+// Start parallel decoding on the context using the specified pool, which is
+// owned by the decoder (and destroyed with it) if own_pool is set.
+
+static int start_parallel_decoder (WavpackContext *wpc, WavpackThreadPool *pool, int own_pool, int max_frames)
+{
+    WavpackStream *wps = wpc->streams ? wpc->streams [0] : NULL;
+    ParallelDecoder *pd;
+
+    if (!wps || !wpc->reader || wpc->parallel_decoder || wpc->push_decoder || wpc->jitter_buffer) {
+        strcpy (wpc->error_message, "parallel decoding requires a newly opened input!");
+        return FALSE;
+    }
+
+    if (wpc->num_streams > 1 || wps->sample_index) {
+        strcpy (wpc->error_message, "parallel decoding must be enabled before unpacking!");
+        return FALSE;
+    }
+
+    if (max_frames <= 0)
+        max_frames = thread_pool_concurrency (pool) * 2;
+
+    pd = malloc (sizeof (ParallelDecoder));
+
+    if (!pd) {
+        strcpy (wpc->error_message, "can't allocate memory");
+        return FALSE;
+    }
+
+    CLEAR (*pd);
+    pd->frames = calloc (max_frames, sizeof (ParallelFrame));
+
+    if (!pd->frames) {
+        free (pd);
+        strcpy (wpc->error_message, "can't allocate memory");
+        return FALSE;
+    }
+
+    pd->num_frames = max_frames;
+    pd->num_channels = wpc->reduced_channels ? wpc->reduced_channels : wpc->config.num_channels;
+    pd->open_flags = wpc->open_flags & (OPEN_2CH_MAX | OPEN_NORMALIZE | OPEN_DSD_NATIVE | OPEN_DSD_AS_PCM);
+    pd->norm_offset = wpc->norm_offset;
+    pd->mute_value = (wps->wphdr.flags & DSD_FLAG) ? 0x55 : 0;
+
+    // DSD decimation has history that spans frames, so that is done here (not in the workers)
+
+    if (wpc->decimation_context)
+        pd->open_flags = (pd->open_flags & ~OPEN_DSD_AS_PCM) | OPEN_DSD_NATIVE;
+
+    // the first audio block was read when the stream was opened, so that starts the first frame
+
+    if (wps->blockbuff && wps->wphdr.block_samples) {
+        pd->held_block = wps->blockbuff;
+        pd->held_block2 = wps->block2buff;
+        wps->blockbuff = wps->block2buff = NULL;
+    }
+
+    free_streams (wpc);
+    pthread_mutex_init (&pd->mutex, NULL);
+    pthread_cond_init (&pd->frame_done, NULL);
+    attach_thread_pool (pd->pool = pool);
+    pd->own_pool = own_pool;
+    wpc->parallel_decoder = pd;
+    return TRUE;
+}
+
+#endif
+
+// Enable frame-parallel decoding for a context opened for reading. The specified
+// number of worker threads will decode frames concurrently while the application
+// continues to call WavpackStreamUnpackSamples() normally (and, for undamaged
+// streams, receives exactly the same audio as with sequential decoding; damaged
+// frames are always muted in their entirety). The number of frames
+// that may be buffered (read but not yet returned to the caller) is specified
+// with max_frames (0 = twice the number of threads), and this bounds the memory
+// used. This must be called after opening the stream and before unpacking any
+// samples. A return of FALSE indicates an error (see error_message), and a
+// num_threads of 0 or 1 simply leaves the context in sequential mode. The
+// threads are private to this context; to share threads among contexts use
+// WavpackStreamAttachThreadPool() instead.
+
+int WavpackStreamSetDecodeThreads (WavpackContext *wpc, int num_threads, int max_frames)
+{
+#ifdef ENABLE_THREADS
+    WavpackThreadPool *pool;
+
+    if (num_threads <= 1)
+        return TRUE;
+
+    if (!(pool = WavpackStreamCreateThreadPool (num_threads))) {
+        strcpy (wpc->error_message, "can't create decoding threads!");
+        return FALSE;
+    }
+
+    if (!start_parallel_decoder (wpc, pool, TRUE, max_frames)) {
+        WavpackStreamDestroyThreadPool (pool);
+        return FALSE;
+    }
+
+    return TRUE;
+#else
+    if (num_threads <= 1)
+        return TRUE;
+
+    strcpy (wpc->error_message, "libwavpack-stream not configured for threads!");
+    return FALSE;
+#endif
+}
+
+// Enable frame-parallel decoding (exactly as above) using a thread pool that
+// may be shared with any number of other contexts. The max_frames parameter
+// defaults to twice the pool's concurrency. The pool should not be destroyed
+// until the context is closed (although if WavpackStreamDestroyThreadPool()
+// is called early, the destruction is simply deferred until then).
+
+int WavpackStreamAttachThreadPool (WavpackContext *wpc, WavpackThreadPool *pool, int max_frames)
+{
+#ifdef ENABLE_THREADS
+    if (!pool) {
+        strcpy (wpc->error_message, "invalid thread pool!");
+        return FALSE;
+    }
+
+    return start_parallel_decoder (wpc, pool, FALSE, max_frames);
+#else
+    strcpy (wpc->error_message, "libwavpack-stream not configured for threads!");
+    return FALSE;
+#endif
+}
@@ -20,6 +20,109 @@
 
 ///////////////////////////// executable code ////////////////////////////////
 
+// Free the current streams and read the next block from the file into the first
+// stream (including the matching correction block, if any), rendering corrupt
+// blocks harmless. Blocks without audio are processed completely here. Returns
+// FALSE if no block could be read (generally meaning the end of the file).
+
+static int read_next_block (WavpackContext *wpc)
+{
+    WavpackStream *wps = wpc->streams [0];
+    int64_t nexthdrpos, bcount;
+
+    if (wpc->wrapper_bytes >= MAX_WRAPPER_BYTES)
+        return FALSE;
+
+    free_streams (wpc);
+    nexthdrpos = wpc->reader->get_pos (wpc->wv_in);
+    bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr, wpc->resync_limit, wpc->open_flags);
+
+    if (bcount == -1)
+        return FALSE;
+
+    wpc->filepos = nexthdrpos + bcount;
+
+    // allocate the memory for the entire raw block and read it in
+
+    wps->blockbuff = malloc (wps->wphdr.ckSize + CHUNK_SIZE_OFFSET);
+
+    if (!wps->blockbuff)
+        return FALSE;
+
+    memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
+
+    if (wpc->reader->read_bytes (wpc->wv_in, wps->blockbuff + sizeof (WavpackHeader), wps->wphdr.ckSize - CHUNK_SIZE_REMAINDER) !=
+        wps->wphdr.ckSize - CHUNK_SIZE_REMAINDER) {
+            strcpy (wpc->error_message, "can't read all of last block!");
+            wps->wphdr.block_samples = 0;
+            wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
+            return FALSE;
+    }
+
+    // render corrupt blocks harmless
+    if (!verify_block_buff (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
+        wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
+        wps->wphdr.block_samples = 0;
+        memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
+    }
+
+    // potentially adjusting block_index must be done AFTER verifying block
+
+    wps->block_index = wps->sample_index;
+    memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
+    wps->init_done = FALSE;     // we have not yet called unpack_init() for this block
+
+    // if this block has audio, and we're in hybrid lossless mode, read the matching wvc block
+
+    if (wps->wphdr.block_samples && wpc->wvc_flag)
+        read_wvc_block (wpc);
+
+    // if the block does NOT have any audio, call unpack_init() to process non-audio stuff
+
+    if (!wps->wphdr.block_samples) {
+        if (!wps->init_done && !unpack_init (wpc))
+            wpc->crc_errors++;
+
+        wpc->streams [0]->init_done = TRUE;
+    }
+
+    return TRUE;
+}
+
+// Called when we have just finished a block to check for a calculated crc error. If
+// there is one, the samples from the block (just before bptr) are muted, and we back
+// up the streams a little if possible in case we passed a header.
+
+static void check_block_crc (WavpackContext *wpc, int32_t *bptr, uint32_t samples_to_unpack)
+{
+    WavpackStream *wps = wpc->streams [0];
+
+    if (check_crc_error (wpc)) {
+        int32_t *zptr = bptr, zvalue = (wps->wphdr.flags & DSD_FLAG) ? 0x55 : 0;
+        uint32_t samples_to_zero = wps->wphdr.block_samples;
+
+        if (samples_to_zero > samples_to_unpack)
+            samples_to_zero = samples_to_unpack;
+
+        samples_to_zero *= (wpc->reduced_channels ? wpc->reduced_channels : wpc->config.num_channels);
+
+        while (samples_to_zero--)
+            *--zptr = zvalue;
+
+        if (wps->blockbuff && wpc->reader->can_seek (wpc->wv_in)) {
+            int32_t rseek = ((WavpackHeader *) wps->blockbuff)->ckSize / 3;
+            wpc->reader->set_pos_rel (wpc->wv_in, (rseek > 16384) ? -16384 : -rseek, SEEK_CUR);
+        }
+
+        if (wpc->wvc_flag && wps->block2buff && wpc->reader->can_seek (wpc->wvc_in)) {
+            int32_t rseek = ((WavpackHeader *) wps->block2buff)->ckSize / 3;
+            wpc->reader->set_pos_rel (wpc->wvc_in, (rseek > 16384) ? -16384 : -rseek, SEEK_CUR);
+        }
+
+        wpc->crc_errors++;
+    }
+}
+
 // Unpack the specified number of samples from the current file position.
 // Note that "samples" here refers to "complete" samples, which would be
 // 2 longs for stereo files or even more for multichannel files, so the
@@ -38,11 +141,19 @@ uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint3
 {
     WavpackStream *wps = wpc->streams ? wpc->streams [wpc->current_stream = 0] : NULL;
     int num_channels = wpc->config.num_channels, file_done = FALSE;
-    uint32_t bcount, samples_unpacked = 0, samples_to_unpack;
+    uint32_t samples_unpacked = 0, samples_to_unpack;
     int32_t *bptr = buffer;
 
     memset (buffer, 0, num_channels * samples * sizeof (int32_t));
 
+    if (wpc->push_decoder)
+        return unpack_samples_pushed (wpc, buffer, samples);
+
+#ifdef ENABLE_THREADS
+    if (wpc->parallel_decoder)
+        return unpack_samples_parallel (wpc, buffer, samples);
+#endif
+
     while (samples) {
 
         // if the current block has no audio, or it's not the first block of a multichannel
@@ -50,67 +161,10 @@ uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint3
         // to free up the streams and read the next block
 
         if (!wps->wphdr.block_samples || !(wps->wphdr.flags & INITIAL_BLOCK) ||
-            wps->sample_index >= wps->block_index + wps->wphdr.block_samples) {
-
-                int64_t nexthdrpos;
-
-                if (wpc->wrapper_bytes >= MAX_WRAPPER_BYTES)
-                    break;
-
-                free_streams (wpc);
-                nexthdrpos = wpc->reader->get_pos (wpc->wv_in);
-                bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr);
-
-                if (bcount == (uint32_t) -1)
-                    break;
-
-                wpc->filepos = nexthdrpos + bcount;
-
-                // allocate the memory for the entire raw block and read it in
-
-                wps->blockbuff = malloc (wps->wphdr.ckSize + CHUNK_SIZE_OFFSET);
-
-                if (!wps->blockbuff)
+            wps->sample_index >= wps->block_index + wps->wphdr.block_samples)
+                if (!read_next_block (wpc))
                     break;
 
-                memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
-
-                if (wpc->reader->read_bytes (wpc->wv_in, wps->blockbuff + sizeof (WavpackHeader), wps->wphdr.ckSize - CHUNK_SIZE_REMAINDER) !=
-                    wps->wphdr.ckSize - CHUNK_SIZE_REMAINDER) {
-                        strcpy (wpc->error_message, "can't read all of last block!");
-                        wps->wphdr.block_samples = 0;
-                        wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
-                        break;
-                }
-
-                // render corrupt blocks harmless
-                if (!WavpackStreamVerifySingleBlock (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
-                    wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
-                    wps->wphdr.block_samples = 0;
-                    memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
-                }
-
-                // potentially adjusting block_index must be done AFTER verifying block
-
-                wps->block_index = wps->sample_index;
-                memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
-                wps->init_done = FALSE;     // we have not yet called unpack_init() for this block
-
-                // if this block has audio, and we're in hybrid lossless mode, read the matching wvc block
-
-                if (wps->wphdr.block_samples && wpc->wvc_flag)
-                    read_wvc_block (wpc);
-
-                // if the block does NOT have any audio, call unpack_init() to process non-audio stuff
-
-                if (!wps->wphdr.block_samples) {
-                    if (!wps->init_done && !unpack_init (wpc))
-                        wpc->crc_errors++;
-
-                    wps->init_done = TRUE;
-                }
-        }
-
         // if the current block has no audio, or it's not the first block of a multichannel
         // sequence, or the sample we're on is past the last sample in this block...we need
         // to loop back and read the next block
@@ -130,6 +184,7 @@ uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint3
         if (!wps->init_done && !unpack_init (wpc))
             wpc->crc_errors++;
 
+        wps = wpc->streams [0];     // might have been reallocated (compact mode)
         wps->init_done = TRUE;
 
         // if this block is not the final block of a multichannel sequence (and we're not truncating
@@ -158,15 +213,12 @@ uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint3
                     if (!wpc->streams)
                         break;
 
-                    wps = wpc->streams [wpc->num_streams++] = malloc (sizeof (WavpackStream));
+                    wps = wpc->streams [wpc->num_streams++] = alloc_stream (wpc);
 
                     if (!wps)
                         break;
 
-                    CLEAR (*wps);
-                    bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr);
-
-                    if (bcount == (uint32_t) -1) {
+                    if (read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr, wpc->resync_limit, wpc->open_flags) == -1) {
                         wpc->streams [0]->wphdr.block_samples = 0;
                         wpc->streams [0]->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
                         file_done = TRUE;
@@ -189,7 +241,7 @@ uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint3
                     }
 
                     // render corrupt blocks harmless
-                    if (!WavpackStreamVerifySingleBlock (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
+                    if (!verify_block_buff (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
                         wps->wphdr.ckSize = CHUNK_SIZE_REMAINDER;
                         wps->wphdr.block_samples = 0;
                         memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
@@ -210,6 +262,7 @@ uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint3
                     if (!unpack_init (wpc))
                         wpc->crc_errors++;
 
+                    wps = wpc->streams [wpc->current_stream];
                     wps->init_done = TRUE;
                 }
                 else
@@ -326,40 +379,262 @@ uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint3
         // (and back up the streams a little if possible in case we passed a header)
 
         if (wps->sample_index == wps->block_index + wps->wphdr.block_samples) {
-            if (check_crc_error (wpc)) {
-                int32_t *zptr = bptr, zvalue = (wps->wphdr.flags & DSD_FLAG) ? 0x55 : 0;
-                uint32_t samples_to_zero = wps->wphdr.block_samples;
+            check_block_crc (wpc, bptr, samples_to_unpack);
 
-                if (samples_to_zero > samples_to_unpack)
-                    samples_to_zero = samples_to_unpack;
+            // compact contexts don't hold on to raw blocks once they are completely decoded
 
-                samples_to_zero *= (wpc->reduced_channels ? wpc->reduced_channels : num_channels);
+            if (wpc->open_flags & OPEN_COMPACT)
+                free_streams (wpc);
+        }
 
-                while (samples_to_zero--)
-                    *--zptr = zvalue;
+        if (wpc->total_samples != -1 && wps->sample_index == wpc->total_samples)
+            break;
+    }
 
-                if (wps->blockbuff && wpc->reader->can_seek (wpc->wv_in)) {
-                    int32_t rseek = ((WavpackHeader *) wps->blockbuff)->ckSize / 3;
-                    wpc->reader->set_pos_rel (wpc->wv_in, (rseek > 16384) ? -16384 : -rseek, SEEK_CUR);
-                }
+#ifdef ENABLE_DSD
+    if (wpc->decimation_context)
+        decimate_dsd_run (wpc->decimation_context, buffer, samples_unpacked);
+#endif
+
+    return samples_unpacked;
+}
+
+// Unpack the specified number of samples from a DSD file opened with OPEN_DSD_NATIVE, but
+// return them as packed bytes instead of one DSD byte in each 32-bit word, which is 1/4 of
+// the memory traffic for the application (and what it usually needs to store or send anyway).
+// The DSD_BYTES_* flags in "format" specify the layout:
+//
+//  0                   = bytes interleaved by channel, MSB first (as in DSDIFF files)
+//  DSD_BYTES_LSB_FIRST = bits reversed in each byte, LSB first (as in DSF files)
+//  DSD_BYTES_IN_BLOCKS = all the bytes of each channel together (the DSF block layout), so
+//                        channel n starts at buffer + n * samples and any samples at the end
+//                        that could not be unpacked are set to zero (as in DSF files)
+//  DSD_BYTES_DOP       = DoP ("DSD over PCM") 24-bit little-endian words interleaved by
+//                        channel, each with the marker byte (alternating 0x05 and 0xFA)
+//                        on top of two DSD bytes; samples must be even and this cannot be
+//                        combined with the other flags (if the file ends on an odd sample,
+//                        the last word is padded with DSD silence and counted as a pair)
+//
+// So the buffer must hold samples * num_channels bytes (3/2 that for DoP), where num_channels
+// is WavpackStreamGetReducedChannels(). The samples are unpacked in small chunks with
+// WavpackStreamUnpackSamples() (so everything works the same, including error muting and
+// parallel decoding) and the 32-bit values stay in cache. The number of samples actually
+// unpacked is returned, which is zero at the end of the file, or if the context is not
+// returning native DSD or the format is not valid.
+
+#define DSD_BYTES_CHUNK 1024   // samples unpacked at a time to the temporary buffer
+
+static const unsigned char bit_reverse_table [] = {
+    0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+    0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+    0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+    0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+    0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+    0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+    0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+    0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+    0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+    0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+    0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+    0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+    0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+    0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+    0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+    0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff
+};
+
+uint32_t WavpackStreamUnpackDSDBytes (WavpackContext *wpc, unsigned char *buffer, uint32_t samples, int format)
+{
+    int num_channels = WavpackStreamGetReducedChannels (wpc), chan;
+    uint32_t samples_unpacked = 0, chunk_samples;
+    int32_t *temp_buffer;
+
+    if (!(wpc->config.qmode & QMODE_DSD_AUDIO) || wpc->decimation_context || (format & ~(DSD_BYTES_LSB_FIRST | DSD_BYTES_IN_BLOCKS | DSD_BYTES_DOP)) ||
+        ((format & DSD_BYTES_DOP) && ((format & ~DSD_BYTES_DOP) || (samples & 1))))
+            return 0;
+
+    chunk_samples = samples < DSD_BYTES_CHUNK ? samples : DSD_BYTES_CHUNK;
+
+    if (!samples || !(temp_buffer = malloc (chunk_samples * num_channels * sizeof (int32_t))))
+        return 0;
 
-                if (wpc->wvc_flag && wps->block2buff && wpc->reader->can_seek (wpc->wvc_in)) {
-                    int32_t rseek = ((WavpackHeader *) wps->block2buff)->ckSize / 3;
-                    wpc->reader->set_pos_rel (wpc->wvc_in, (rseek > 16384) ? -16384 : -rseek, SEEK_CUR);
+    while (samples_unpacked < samples) {
+        uint32_t samples_to_unpack = samples - samples_unpacked, count, i;
+        int32_t *sptr = temp_buffer;
+
+        if (samples_to_unpack > chunk_samples)
+            samples_to_unpack = chunk_samples;
+
+        if (!(count = WavpackStreamUnpackSamples (wpc, temp_buffer, samples_to_unpack)))
+            break;
+
+        if (format & DSD_BYTES_DOP) {
+            unsigned char *dptr = buffer + (samples_unpacked / 2) * num_channels * 3;
+
+            // if the stream ends on an odd sample, pad the last pair with DSD silence
+
+            if (count & 1)
+                for (chan = 0; chan < num_channels; ++chan)
+                    temp_buffer [count * num_channels + chan] = 0x69;
+
+            for (i = 0; i < count; i += 2, sptr += num_channels * 2) {
+                unsigned char marker = wpc->dop_marker ? 0xfa : 0x05;
+
+                for (chan = 0; chan < num_channels; ++chan) {
+                    *dptr++ = (unsigned char) sptr [chan + num_channels];
+                    *dptr++ = (unsigned char) sptr [chan];
+                    *dptr++ = marker;
                 }
 
-                wpc->crc_errors++;
+                wpc->dop_marker = !wpc->dop_marker;
             }
+
+            count = (count + 1) & ~1;
         }
+        else if (format & DSD_BYTES_IN_BLOCKS) {
+            for (chan = 0; chan < num_channels; ++chan) {
+                unsigned char *dptr = buffer + (size_t) chan * samples + samples_unpacked;
 
-        if (wpc->total_samples != -1 && wps->sample_index == wpc->total_samples)
+                sptr = temp_buffer + chan;
+
+                if (format & DSD_BYTES_LSB_FIRST)
+                    for (i = 0; i < count; ++i, sptr += num_channels)
+                        *dptr++ = bit_reverse_table [*sptr & 0xff];
+                else
+                    for (i = 0; i < count; ++i, sptr += num_channels)
+                        *dptr++ = (unsigned char) *sptr;
+            }
+        }
+        else {
+            unsigned char *dptr = buffer + (size_t) samples_unpacked * num_channels;
+            uint32_t bcount = count * num_channels;
+
+            if (format & DSD_BYTES_LSB_FIRST)
+                for (i = 0; i < bcount; ++i)
+                    dptr [i] = bit_reverse_table [sptr [i] & 0xff];
+            else
+                for (i = 0; i < bcount; ++i)
+                    dptr [i] = (unsigned char) sptr [i];
+        }
+
+        samples_unpacked += count;
+
+        if (count < samples_to_unpack)
             break;
     }
 
-#ifdef ENABLE_DSD
-    if (wpc->decimation_context)
-        decimate_dsd_run (wpc->decimation_context, buffer, samples_unpacked);
-#endif
+    if ((format & DSD_BYTES_IN_BLOCKS) && samples_unpacked < samples)
+        for (chan = 0; chan < num_channels; ++chan)
+            memset (buffer + (size_t) chan * samples + samples_unpacked, 0, samples - samples_unpacked);
 
+    free (temp_buffer);
     return samples_unpacked;
 }
+
+// Return the number of samples remaining in the block currently being decoded, first
+// reading the next block (with audio) if the current one has been finished. So this is
+// zero only at the end of the file (or on an error). Unpacking exactly this many samples
+// with WavpackStreamUnpackSamples() finishes the block but leaves it loaded, which lets
+// the caller decode block by block (see WavpackStreamTransrateBlock()). This is not
+// available with the push, parallel or jitter-buffered decoders.
+
+uint32_t WavpackStreamGetBlockSamplesLeft (WavpackContext *wpc)
+{
+    WavpackStream *wps = wpc->streams ? wpc->streams [wpc->current_stream = 0] : NULL;
+
+    if (!wps || !wpc->reader || wpc->push_decoder || wpc->parallel_decoder || wpc->jitter_buffer)
+        return 0;
+
+    if (wpc->total_samples != -1 && wps->sample_index >= wpc->total_samples)
+        return 0;
+
+    while (!wps->wphdr.block_samples || !(wps->wphdr.flags & INITIAL_BLOCK) ||
+        wps->sample_index >= wps->block_index + wps->wphdr.block_samples)
+            if (!read_next_block (wpc))
+                return 0;
+
+    return (uint32_t) (wps->block_index + wps->wphdr.block_samples - wps->sample_index);
+}
+
+// Determine whether the specified context can be unpacked on the batch path, which
+// requires that the next samples come from a block of mono audio (lossless or lossy
+// hybrid, but not a constant block) with at least the requested number of samples
+// remaining. Just like WavpackStreamUnpackSamples(), we read past any blocks without
+// audio first, and the decoder is initialized for the block if it hasn't been already.
+
+static int batch_ready (WavpackContext *wpc, uint32_t samples)
+{
+    WavpackStream *wps = wpc->streams ? wpc->streams [wpc->current_stream = 0] : NULL;
+    uint32_t flags;
+
+    if (!wps || !wpc->reader || !samples || wpc->push_decoder || wpc->parallel_decoder || wpc->jitter_buffer)
+        return FALSE;
+
+    while (!wps->wphdr.block_samples || !(wps->wphdr.flags & INITIAL_BLOCK) ||
+        wps->sample_index >= wps->block_index + wps->wphdr.block_samples)
+            if (!read_next_block (wpc))
+                return FALSE;
+
+    flags = wps->wphdr.flags;
+
+    if (!(flags & MONO_DATA) || !(flags & FINAL_BLOCK) || (flags & DSD_FLAG) || wps->block2buff ||
+        (!(flags & MONO_FLAG) && (wpc->config.num_channels == 1 || wpc->reduced_channels == 1)) ||
+        wps->block_index > wps->sample_index || wps->block_index + wps->wphdr.block_samples - wps->sample_index < samples)
+            return FALSE;
+
+    if (!wps->init_done && !unpack_init (wpc))
+        wpc->crc_errors++;
+
+    wps = wpc->streams [0];     // might have been reallocated (compact mode)
+    wps->init_done = TRUE;
+    return !wps->mute_error && !wps->constant_block;
+}
+
+// Unpack the same number of samples from each context in a batch, with exactly
+// the same results as calling WavpackStreamUnpackSamples() on each in turn (the
+// number of samples unpacked from each context is returned in samples_unpacked).
+// This is intended for applications handling many streams of mono audio (e.g.,
+// voice channels). Contexts that are positioned in a mono block with at least
+// the requested number of samples remaining (which will always be the case if
+// samples are requested in units of the block size) are decoded together, with
+// the decorrelation done in lockstep across the streams, and the others are
+// simply decoded individually. Returns the number of contexts decoded together.
+
+int WavpackStreamUnpackSamplesBatch (WavpackContext **wpcs, int32_t **buffers, uint32_t *samples_unpacked, int num_contexts, uint32_t samples)
+{
+    WavpackContext **batch_wpcs = malloc (num_contexts * sizeof (*batch_wpcs));
+    int32_t **batch_buffers = malloc (num_contexts * sizeof (*batch_buffers));
+    int num_batched = 0, i;
+
+    for (i = 0; i < num_contexts; ++i)
+        if (batch_wpcs && batch_buffers && batch_ready (wpcs [i], samples)) {
+            memset (buffers [i], 0, wpcs [i]->config.num_channels * samples * sizeof (int32_t));
+            batch_wpcs [num_batched] = wpcs [i];
+            batch_buffers [num_batched++] = buffers [i];
+            samples_unpacked [i] = samples;
+        }
+        else
+            samples_unpacked [i] = WavpackStreamUnpackSamples (wpcs [i], buffers [i], samples);
+
+    if (num_batched) {
+        unpack_mono_batch (batch_wpcs, batch_buffers, num_batched, samples);
+
+        for (i = 0; i < num_batched; ++i) {
+            WavpackStream *wps = batch_wpcs [i]->streams [0];
+
+            int num_channels = batch_wpcs [i]->reduced_channels ? batch_wpcs [i]->reduced_channels : batch_wpcs [i]->config.num_channels;
+
+            if (wps->sample_index == wps->block_index + wps->wphdr.block_samples) {
+                check_block_crc (batch_wpcs [i], batch_buffers [i] + samples * num_channels, samples);
+
+                if (batch_wpcs [i]->open_flags & OPEN_COMPACT)
+                    free_streams (batch_wpcs [i]);
+            }
+        }
+    }
+
+    if (batch_wpcs) free (batch_wpcs);
+    if (batch_buffers) free (batch_buffers);
+
+    return num_batched;
+}
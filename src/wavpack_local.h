@@ -28,6 +28,7 @@
 #endif
 
 #include <sys/types.h>
+#include <stddef.h>
 
 // Checksums for the encoded block and/or the audio data may be added, and these checksums
 // may be 2 or 4 bytes wide. They are automatically verified on decode. These do occupy
@@ -83,20 +84,40 @@ typedef int32_t f32;
 // Note that this is the ONLY structure that is included in wavpack-stream
 // data, and is stored little-endian. It is the preamble to every block in both
 // main and correction streams.
+//
+// Blocks are stored with one of two forms of this header. The standard form has
+// 16-bit ckSize and block_samples fields (so it's only 12 bytes) and blocks with
+// it are limited to 16K bytes and 8K samples. The large-block form (which must be
+// requested with CONFIG_LARGE_BLOCKS) is exactly this structure and is identified
+// by a different ckID, so older decoders simply skip these blocks. Internally,
+// blocks always start with this structure (in native endian) regardless of how
+// they are stored, and the conversion is done only when blocks are read or written.
 
 typedef struct {
     char ckID [4];
-    uint16_t ckSize;
-    uint16_t block_samples;
+    uint32_t ckSize;
+    uint32_t block_samples;
     uint32_t flags;
 } WavpackHeader;
 
-#define WavpackHeaderFormat "4SSL"
+#define WavpackHeaderFormat "4LLL"
 
 #define FOURCC "wpsb"
-#define CHUNK_SIZE_OFFSET 6
+#define FOURCC_LARGE "wpsl"
+#define CHUNK_SIZE_OFFSET 8
 #define CHUNK_SIZE_REMAINDER (sizeof (WavpackHeader) - CHUNK_SIZE_OFFSET)
 
+#define STANDARD_HEADER_SIZE 12                 // stored size of standard header
+#define STANDARD_CKSIZE_ADJUST 2                // internal ckSize - standard ckSize
+#define MAX_STANDARD_BLOCK_BYTES 16384
+#define MAX_STANDARD_BLOCK_SAMPLES 8000
+#define MAX_LARGE_BLOCK_BYTES 0x1000000
+#define MAX_LARGE_BLOCK_SAMPLES 0x100000
+
+#define is_large_block(hdr) ((hdr)->ckID [3] == FOURCC_LARGE [3])
+#define stored_header_bytes(hdr) (is_large_block (hdr) ? (int) sizeof (WavpackHeader) : STANDARD_HEADER_SIZE)
+#define valid_fourcc(id) (!strncmp ((id), FOURCC, 4) || !strncmp ((id), FOURCC_LARGE, 4))
+
 // or-values for "flags"
 
 #define BYTES_STORED    3       // 1-4 bytes/sample
@@ -165,6 +186,7 @@ typedef struct {
 #define ID_WVX_BITSTREAM        0xc
 #define ID_CHANNEL_INFO         0xd
 #define ID_DSD_BLOCK            0xe
+#define ID_CONSTANT_SAMPLES     0xf
 
 #define ID_DECORR_COMBINED      0x10
 #define ID_ENTROPY_COMBINED     0x11
@@ -226,6 +248,8 @@ typedef struct bs {
 } Bitstream;
 
 #define MAX_WRAPPER_BYTES 16777216
+#define DEFAULT_RESYNC_LIMIT 10240          // bytes of garbage skipped looking for a block
+#define RESYNC_CHUNK_SIZE 4096              // read size when skipping garbage (if seekable)
 #define NEW_MAX_STREAMS 4096
 #define OLD_MAX_STREAMS 8
 #define MAX_NTERMS 16
@@ -235,9 +259,15 @@ typedef struct bs {
 
 #define MAX_HISTORY_BITS    5       // maximum number of history bits in DSD "fast" mode
                                     // note that 5 history bits requires 32 history bins
+#define MAX_HISTORY_BINS    (1 << MAX_HISTORY_BITS)
 #define MAX_BYTES_PER_BIN   1280    // maximum bytes for the value lookup array (per bin)
                                     //  such that the total storage per bin = 2K (also
                                     //  counting probabilities and summed_probabilities)
+#define MIN_VALUES_PER_BIN  280     // minimum values in a block for each history bin
+
+#define PTABLE_BITS 8                   // probability table used in DSD "high" mode
+#define PTABLE_BINS (1<<PTABLE_BITS)
+#define PTABLE_MASK (PTABLE_BINS-1)
 
 // Note that this structure is directly accessed in assembly files, so modify with care
 
@@ -268,6 +298,34 @@ typedef struct {
     unsigned int byte;
 } DSDfilters;
 
+// The DSD "fast" mode range coder divides by the same few values (the probability sums of
+// each history bin) over and over, so these are replaced with a multiply and shifts using
+// the method of Granlund & Montgomery ("Division by Invariant Integers using Multiplication"),
+// which gives exactly the same result as the division for any 32-bit dividend.
+
+typedef struct {
+    uint32_t multiplier;
+    int shift1, shift2;
+} InvariantDivisor;
+
+static __inline uint32_t divide_invariant (uint32_t value, const InvariantDivisor *div)
+{
+    uint32_t t = (uint32_t)(((uint64_t) value * div->multiplier) >> 32);
+
+    return (t + ((value - t) >> div->shift1)) >> div->shift2;
+}
+
+// Tables for decoding DSD "fast" mode blocks. These are rebuilt for every block but are
+// fairly large, so they are owned by the context (one set for each stream index) and are
+// reused from block to block rather than being allocated with each stream.
+
+typedef struct {
+    unsigned char probabilities [MAX_HISTORY_BINS] [256], *value_lookup [MAX_HISTORY_BINS];
+    uint16_t summed_probabilities [MAX_HISTORY_BINS] [256];
+    InvariantDivisor divisors [MAX_HISTORY_BINS];
+    unsigned char lookup_buffer [MAX_HISTORY_BINS * MAX_BYTES_PER_BIN];
+} DSDFastTables;
+
 typedef struct {
     WavpackHeader wphdr;
     struct words_data w;
@@ -277,30 +335,39 @@ typedef struct {
     int32_t *sample_buffer;
 
     int64_t sample_index, block_index;
-    int bits, num_terms, shift;
-    char mute_error, joint_stereo, false_stereo, init_done, wvc_skip, crc_wv_bytes, crc_wvx_bytes;
-    int num_decorrs, num_passes, best_decorr, mask_decorr;
+    int bits, num_terms, max_terms, shift;
+    char mute_error, joint_stereo, false_stereo, init_done, wvc_skip, crc_wv_bytes, crc_wvx_bytes, constant_block;
     uint32_t crc, crc_x, crc_wv, crc_wvx;
+    int32_t constant_values [2];        // samples of a constant block (ID_CONSTANT_SAMPLES)
     Bitstream wvbits, wvcbits, wvxbits;
-    float delta_decay;
 
     unsigned char int32_sent_bits, int32_zeros, int32_ones, int32_dups;
     unsigned char float_flags, float_shift, float_max_exp, float_norm_exp;
 
     struct {
         int32_t shaping_acc [2], shaping_delta [2], error [2];
-        double noise_sum, noise_ave, noise_max;
-        int16_t *shaping_data, *shaping_array;
-        int32_t shaping_samples;
     } dc;
 
-    struct decorr_pass decorr_passes [MAX_NTERMS], analysis_pass;
+    // In a compact decoding context (OPEN_COMPACT) each stream is allocated only up
+    // to the decorrelation passes actually used (max_terms), so everything from here
+    // on down must be for encoding or DSD only (see COMPACT_STREAM_BYTES).
+
+    struct decorr_pass decorr_passes [MAX_NTERMS];
+    struct decorr_pass analysis_pass;
     const WavpackDecorrSpec *decorr_specs;
+    int num_decorrs, num_passes, best_decorr, mask_decorr;
+    float delta_decay;
 
     struct {
-        unsigned char *byteptr, *endptr, (*probabilities) [256], *lookup_buffer, **value_lookup, mode, ready;
+        double noise_sum, noise_ave, noise_max;
+        int16_t *shaping_data, *shaping_array;
+        int32_t shaping_samples;
+    } ns;                               // noise measurement and dynamic noise shaping
+
+    struct {
+        unsigned char *byteptr, *endptr, mode, ready;
         int history_bins, p0, p1;
-        uint16_t (*summed_probabilities) [256];
+        DSDFastTables *fast_tables;
         uint32_t low, high, value;
         DSDfilters filters [2];
         int32_t *ptable;
@@ -308,6 +375,25 @@ typedef struct {
 
 } WavpackStream;
 
+#define COMPACT_STREAM_BYTES(terms) (offsetof (WavpackStream, decorr_passes) + (terms) * sizeof (struct decorr_pass))
+
+// The results of analyzing one stream of a block for pipelined encoding (see analyze_block()
+// in pack.c). This is everything the entropy coder needs (including a restarted entropy state
+// if w_restart is set) plus the stream's decorrelation state at the end of the block.
+
+typedef struct {
+    uint32_t flags, crc;
+    WavpackMetadata decorr_info;
+    int w_restart, constant;
+    struct words_data w;
+
+    int num_terms, best_decorr, mask_decorr, shift;
+    float delta_decay;
+    char joint_stereo, false_stereo;
+    unsigned char int32_sent_bits, int32_zeros, int32_ones, int32_dups;
+    struct decorr_pass decorr_passes [MAX_NTERMS];
+} BlockAnalysis;
+
 // flags for float_flags:
 
 #define FLOAT_SHIFT_ONES 1      // bits left-shifted into float = '1'
@@ -336,7 +422,7 @@ struct WavpackContext {
     void *wv_in, *wvc_in;
 
     int64_t filelen, file2len, filepos, file2pos, total_samples, initial_index;
-    uint32_t crc_errors, first_flags;
+    uint32_t crc_errors, first_flags, resync_limit;
     int wvc_flag, open_flags, norm_offset, reduced_channels, lossy_blocks, version_five;
     uint32_t block_samples, ave_block_samples, acc_samples, riff_trailer_bytes, block_trigger;
     int riff_header_added, riff_header_created;
@@ -349,9 +435,12 @@ struct WavpackContext {
     unsigned char file_format, *channel_reordering, *channel_identities;
     uint32_t channel_layout, dsd_multiplier;
     void *decimation_context;
+    DSDFastTables **dsd_fast_tables;
+    int num_dsd_fast_tables, dop_marker;
     char file_extension [8];
 
     void (*close_callback)(void *wpc);
+    void *parallel_decoder, *push_decoder, *jitter_buffer, *pack_pipeline, *speed_governor, *rate_control, *simulcast, *transrate;
     char error_message [80];
 };
 
@@ -411,16 +500,21 @@ struct WavpackContext {
     }
 
 void pack_init (WavpackContext *wpc);
+void set_decorr_specs (WavpackContext *wpc, WavpackStream *wps);
 int pack_block (WavpackContext *wpc, int32_t *buffer);
+void analyze_block (WavpackContext *wpc, int32_t *buffer, BlockAnalysis *ba);
+int pack_analyzed_block (WavpackContext *wpc, int32_t *buffer, BlockAnalysis *ba);
 void write_audio_checksum (WavpackMetadata *wpmd, unsigned char id, uint32_t checksum);
 void send_general_metadata (WavpackContext *wpc);
 void free_metadata (WavpackMetadata *wpmd);
 int copy_metadata (WavpackMetadata *wpmd, unsigned char *buffer_start, unsigned char *buffer_end);
 double WavpackGetEncodedNoise (WavpackContext *wpc, double *peak);
 int unpack_init (WavpackContext *wpc);
+int read_metadata_buff (WavpackMetadata *wpmd, unsigned char *blockbuff, unsigned char **buffptr);
 int read_decorr_combined (WavpackStream *wps, WavpackMetadata *wpmd);
 int read_shaping_info (WavpackStream *wps, WavpackMetadata *wpmd);
 int32_t unpack_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_count);
+void unpack_mono_batch (WavpackContext **wpcs, int32_t **buffers, int num_contexts, uint32_t sample_count);
 int check_crc_error (WavpackContext *wpc);
 int scan_float_data (WavpackStream *wps, f32 *values, int32_t num_values);
 void send_float_data (WavpackStream *wps, f32 *values, int32_t num_values);
@@ -572,6 +666,7 @@ int32_t FASTCALL send_word (WavpackStream *wps, int32_t value, int chan);
 void send_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsamples);
 int32_t FASTCALL get_word (WavpackStream *wps, int chan, int32_t *correction);
 int32_t get_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsamples);
+int32_t get_words_hybrid (WavpackStream *wps, int32_t *buffer, int32_t nsamples, int32_t *corrections);
 void flush_word (WavpackStream *wps);
 int32_t nosend_word (WavpackStream *wps, int32_t value, int chan);
 void scan_word (WavpackStream *wps, int32_t *samples, uint32_t num_samples, int dir);
@@ -613,7 +708,7 @@ int restore_weight_nybble (signed char weight);
 void WavpackStreamFloatNormalize (int32_t *values, int32_t num_values, int delta_exp);
 
 /////////////////////////// high-level unpacking API and support ////////////////////////////
-// modules: open_utils.c, unpack_utils.c, unpack_seek.c, unpack_floats.c
+// modules: open_utils.c, open_push.c, unpack_utils.c, unpack_seek.c, unpack_floats.c, unpack_parallel.c, unpack_jitter.c
 
 WavpackContext *WavpackStreamOpenFileInputEx64 (WavpackReader64 *reader, void *wv_id, void *wvc_id, char *error, int flags, int norm_offset);
 WavpackContext *WavpackStreamOpenFileInputEx (WavpackReader *reader, void *wv_id, void *wvc_id, char *error, int flags, int norm_offset);
@@ -633,22 +728,52 @@ WavpackContext *WavpackStreamOpenFileInput (const char *infilename, char *error,
 #define OPEN_ALT_TYPES  0x400   // application is aware of alternate file types & qmode
                                 // (just affects retrieving wrappers & MD5 checksums)
 #define OPEN_NO_CHECKSUM 0x800  // don't verify block checksums before decoding
+#define OPEN_COMPACT    0x1000  // minimize memory used by decoding context (PCM only)
+#define OPEN_NO_SKIP_LIMIT 0x2000   // no limit on garbage skipped to find the next block
+#define OPEN_VERIFY_RESYNC 0x4000   // verify block found after skipping (seekable input only;
+                                    // this is ignored for non-seekable input, which is also
+                                    // scanned for headers more slowly, without read-ahead)
 
 int WavpackStreamGetMode (WavpackContext *wpc);
 
 int WavpackStreamGetQualifyMode (WavpackContext *wpc);
 int WavpackStreamGetVersion (WavpackContext *wpc);
 uint32_t WavpackStreamUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint32_t samples);
+uint32_t WavpackStreamGetBlockSamplesLeft (WavpackContext *wpc);
+int WavpackStreamUnpackSamplesBatch (WavpackContext **wpcs, int32_t **buffers, uint32_t *samples_unpacked, int num_contexts, uint32_t samples);
+uint32_t WavpackStreamUnpackDSDBytes (WavpackContext *wpc, unsigned char *buffer, uint32_t samples, int format);
 int WavpackStreamSeekSample (WavpackContext *wpc, uint32_t sample);
 int WavpackStreamSeekSample64 (WavpackContext *wpc, int64_t sample);
 int WavpackStreamGetMD5Sum (WavpackContext *wpc, unsigned char data [16]);
+void WavpackStreamSetResyncLimit (WavpackContext *wpc, uint32_t max_bytes);
 
 int WavpackStreamVerifySingleBlock (unsigned char *buffer, int verify_checksum);
-uint32_t read_next_header (WavpackReader64 *reader, void *id, WavpackHeader *wphdr);
+int verify_block_buff (unsigned char *blockbuff, int verify_checksum);
+int verify_stored_block (unsigned char *buffer, int verify_checksum);
+int64_t read_next_header (WavpackReader64 *reader, void *id, WavpackHeader *wphdr, uint32_t max_skip, int open_flags);
 int read_wvc_block (WavpackContext *wpc);
+WavpackStream *alloc_stream (WavpackContext *wpc);
+
+int WavpackStreamSetDecodeThreads (WavpackContext *wpc, int num_threads, int max_frames);
+int WavpackStreamAttachThreadPool (WavpackContext *wpc, WavpackThreadPool *pool, int max_frames);
+uint32_t unpack_samples_parallel (WavpackContext *wpc, int32_t *buffer, uint32_t samples);
+void free_parallel_decoder (WavpackContext *wpc);
+
+WavpackContext *WavpackStreamOpenPushDecoder (char *error, int flags, int norm_offset);
+int WavpackStreamPushData (WavpackContext *wpc, void *data, int32_t bcount);
+uint32_t unpack_samples_pushed (WavpackContext *wpc, int32_t *buffer, uint32_t samples);
+void free_push_decoder (WavpackContext *wpc);
+
+WavpackContext *WavpackStreamOpenJitterBuffer (char *error, int flags, int norm_offset,
+    uint32_t period_samples, uint32_t min_delay, uint32_t max_delay);
+int WavpackStreamJitterPutFrame (WavpackContext *wpc, void *data, int32_t bcount, int64_t timestamp, int64_t arrival_time);
+uint32_t WavpackStreamJitterGetPeriod (WavpackContext *wpc, int32_t *buffer, int64_t now);
+int WavpackStreamGetJitterStats (WavpackContext *wpc, WavpackJitterStats *stats);
+void free_jitter_buffer (WavpackContext *wpc);
 
 /////////////////////////// high-level packing API and support ////////////////////////////
-// modules: pack_utils.c, pack_floats.c
+// modules: pack_utils.c, pack_floats.c, pack_state.c, pack_pipeline.c, pack_governor.c, pack_rate.c, pack_simulcast.c,
+//          pack_transrate.c
 
 WavpackContext *WavpackStreamOpenFileOutput (WavpackBlockOutput blockout, void *wv_id, void *wvc_id);
 int WavpackStreamSetConfiguration (WavpackContext *wpc, WavpackStreamConfig *config, uint32_t total_samples);
@@ -662,6 +787,52 @@ void WavpackSeekTrailingWrapper (WavpackContext *wpc);
 void WavpackStreamUpdateNumSamples (WavpackContext *wpc, void *first_block);
 void *WavpackStreamGetWrapperLocation (void *first_block, uint32_t *size);
 
+uint32_t WavpackStreamSaveState (WavpackContext *wpc, void *buffer, uint32_t buffer_size);
+int WavpackStreamRestoreState (WavpackContext *wpc, void *buffer, uint32_t bcount);
+WavpackContext *WavpackStreamCloneEncoder (WavpackContext *wpc, WavpackBlockOutput blockout, void *wv_id, void *wvc_id);
+
+int send_stream_blocks (WavpackContext *wpc);
+int WavpackStreamSetEncodeThreads (WavpackContext *wpc, int num_threads);
+int pack_streams_pipelined (WavpackContext *wpc, uint32_t block_samples, uint32_t max_blocksize);
+int flush_pack_pipeline (WavpackContext *wpc);
+void discard_pack_pipeline (WavpackContext *wpc);
+void free_pack_pipeline (WavpackContext *wpc);
+
+int WavpackStreamSetSpeedGovernor (WavpackContext *wpc, int target_percent);
+int WavpackStreamGetGovernorStats (WavpackContext *wpc, WavpackGovernorStats *stats);
+void start_governed_block (WavpackContext *wpc);
+void end_governed_block (WavpackContext *wpc, uint32_t block_samples);
+void free_speed_governor (WavpackContext *wpc);
+
+int WavpackStreamSetRateControl (WavpackContext *wpc, uint32_t kbps, uint32_t buffer_bytes);
+int WavpackStreamGetRateStats (WavpackContext *wpc, WavpackRateStats *stats);
+int pack_streams_rate_controlled (WavpackContext *wpc, uint32_t block_samples, int (*encode)(WavpackContext *, uint32_t));
+void free_rate_control (WavpackContext *wpc);
+
+int WavpackStreamAddSimulcast (WavpackContext *wpc, WavpackContext *rendition);
+int start_simulcast_block (WavpackContext *wpc, uint32_t *block_samples);
+int end_simulcast_block (WavpackContext *wpc, uint32_t block_samples);
+void simulcast_noise_shaping (WavpackContext *wpc, int32_t *buffer, int shortening_allowed);
+void simulcast_execute (WavpackContext *wpc, int32_t *buffer, int no_history);
+int feed_simulcast (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sample_count);
+int flush_simulcast (WavpackContext *wpc);
+void free_simulcast (WavpackContext *wpc);
+
+int WavpackStreamTransrateBlock (WavpackContext *wpc, WavpackContext *source, int32_t *sample_buffer, uint32_t sample_count);
+int transrate_decorr (WavpackContext *wpc);
+void free_transrate (WavpackContext *wpc);
+
+//////////////////////////////////// thread pools /////////////////////////////////////
+// module: thread_pool.c
+
+WavpackThreadPool *WavpackStreamCreateThreadPool (int num_workers);
+WavpackThreadPool *WavpackStreamCreateExecutorPool (WavpackTaskExecutor executor, void *executor_id, int concurrency);
+void WavpackStreamDestroyThreadPool (WavpackThreadPool *pool);
+int thread_pool_concurrency (WavpackThreadPool *pool);
+void attach_thread_pool (WavpackThreadPool *pool);
+void detach_thread_pool (WavpackThreadPool *pool);
+void submit_pool_task (WavpackThreadPool *pool, WavpackTaskFunction function, void *arg);
+
 /////////////////////////////////// common utilities ////////////////////////////////////
 // module: common_utils.c
 
@@ -691,14 +862,22 @@ int64_t WavpackStreamGetFileSize64 (WavpackContext *wpc);
 double WavpackStreamGetRatio (WavpackContext *wpc);
 double WavpackStreamGetAverageBitrate (WavpackContext *wpc, int count_wvc);
 double WavpackStreamGetInstantBitrate (WavpackContext *wpc);
+int64_t WavpackStreamGetMemoryUsage (WavpackContext *wpc);
 WavpackContext *WavpackStreamCloseFile (WavpackContext *wpc);
 void WavpackStreamLittleEndianToNative (void *data, char *format);
 void WavpackStreamNativeToLittleEndian (void *data, char *format);
 void WavpackStreamBigEndianToNative (void *data, char *format);
 void WavpackStreamNativeToBigEndian (void *data, char *format);
 
+int stored_header_size (const unsigned char *sp);
+int read_stored_header (const unsigned char *sp, WavpackHeader *wphdr);
+int store_block_header (unsigned char *blockbuff);
+uint32_t block_checksum (WavpackHeader *wphdr, unsigned char *data, unsigned char *endptr);
+
 void install_close_callback (WavpackContext *wpc, void cb_func (void *wpc));
 void free_dsd_tables (WavpackStream *wps);
+void free_dsd_fast_tables (WavpackContext *wpc);
+void init_divisor (InvariantDivisor *div, uint32_t divisor);
 void free_streams (WavpackContext *wpc);
 
 #endif